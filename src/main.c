@@ -2,17 +2,21 @@
 #include <gst/gst.h>
 #include <stdlib.h>
 #include "mati-application.h"
+#include "mati-writer.h"
 
 int
 main (int argc, char *argv[])
 {
     g_autoptr (MatiApplication) application = NULL;
+    gint64 start_time = g_get_monotonic_time ();
     gint exit_status;
 
     // Init gstreamer
     gst_init (&argc, &argv);
+    /* splitmuxsink creates a writer per segment by factory name */
+    gst_element_register (NULL, "matiwriter", GST_RANK_NONE, MATI_TYPE_WRITER);
 
-    application = mati_application_new (argc, argv);
+    application = mati_application_new (argc, argv, start_time);
     if (application == NULL)
         return EXIT_FAILURE;
     
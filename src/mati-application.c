@@ -3,15 +3,33 @@
 #include "mati-options.h"
 
 #include "mati-detector.h"
+#include "mati-http-server.h"
+#include "mati-recording.h"
+#include "mati-retention.h"
+#include "mati-writer.h"
 #include <gst/gst.h>
 
+#define DBUS_NAME_PREFIX "com.froura.mati.app"
+#define DBUS_OBJECT_PATH "/com/froura/mati/app"
+
 struct _MatiApplication
 {
     GApplication parent_instance;
 
-    MatiDetector *detector;
-    MatiCommunicator *communicator;
+    /* One detector per camera that could be built, communicators and
+     * camera ids share the index */
+    GPtrArray *detectors;
+    GPtrArray *communicators;
+    GPtrArray *camera_ids; // owned by the options
     MatiOptions *options;
+
+    /* Shared by every detector, outlives them */
+    MatiRetention *retention;
+    MatiHttpServer *http_server;
+
+    gint64 start_time; // monotonic, startup timings are relative to it
+
+    guint dbus_owner_id;
 };
 
 G_DEFINE_TYPE (MatiApplication, mati_application, G_TYPE_APPLICATION);
@@ -20,9 +38,13 @@ G_DEFINE_TYPE (MatiApplication, mati_application, G_TYPE_APPLICATION);
 static void
 mati_application_init (MatiApplication *self)
 {
-    self->detector = NULL;
-    self->communicator = NULL;
+    self->detectors = g_ptr_array_new_with_free_func (g_object_unref);
+    self->communicators = g_ptr_array_new_with_free_func (g_object_unref);
+    self->camera_ids = g_ptr_array_new ();
     self->options = NULL;
+    self->retention = NULL;
+    self->http_server = NULL;
+    self->dbus_owner_id = 0;
 }
 
 static void
@@ -30,36 +52,181 @@ mati_application_finalize (GObject *object)
 {
     MatiApplication *self = MATI_APPLICATION (object);
 
-    g_clear_object (&self->communicator);
-    g_clear_object (&self->detector);
+    if (self->dbus_owner_id != 0)
+        g_bus_unown_name (self->dbus_owner_id);
+
+    g_clear_pointer (&self->detectors, g_ptr_array_unref);
+    g_clear_pointer (&self->communicators, g_ptr_array_unref);
+    g_clear_pointer (&self->camera_ids, g_ptr_array_unref);
+    g_clear_pointer (&self->retention, mati_retention_free);
+    g_clear_pointer (&self->http_server, mati_http_server_free);
+    g_clear_object (&self->options);
 
     G_OBJECT_CLASS (mati_application_parent_class)->finalize (object);
 }
 
+static char *
+mati_application_get_object_path (MatiApplication *self,
+                                  const char      *mati_id)
+{
+    g_autofree char *escaped_id = NULL;
+
+    if (mati_options_is_single_camera (self->options))
+        return g_strdup (DBUS_OBJECT_PATH);
+
+    escaped_id = g_dbus_escape_object_path (mati_id);
+    return g_strconcat (DBUS_OBJECT_PATH, "/", escaped_id, NULL);
+}
+
+static void
+on_name_lost (GDBusConnection *connection, const char *name, gpointer user_data)
+{
+    if (connection)
+        g_critical ("Couldn't acquire DBus name %s", name);
+    else
+        g_critical ("Failed to connect to bus: %s", name);
+}
+
+static void
+on_name_acquired (GDBusConnection *connection, const char *name, gpointer user_data)
+{
+    g_message ("acquired DBus name %s", name);
+}
+
+static void
+on_connection_acquired (GDBusConnection *connection, const char *name, gpointer user_data)
+{
+    MatiApplication *self = MATI_APPLICATION (user_data);
+
+    for (guint i = 0; i < self->communicators->len; i++)
+    {
+        MatiCommunicator *communicator = g_ptr_array_index (self->communicators, i);
+        const char *mati_id = g_ptr_array_index (self->camera_ids, i);
+        g_autofree char *object_path = mati_application_get_object_path (self, mati_id);
+        g_autoptr (GError) error = NULL;
+
+        if (!mati_communicator_export (communicator, connection, object_path, &error))
+            g_critical ("Failed to export mati %s to dbus: %s", mati_id, error->message);
+    }
+}
+
+static void
+mati_application_own_bus_name (MatiApplication *self)
+{
+    g_autofree char *dbus_name = NULL;
+
+    if (mati_options_get_bus_name (self->options) != NULL)
+        dbus_name = g_strdup (mati_options_get_bus_name (self->options));
+    else if (mati_options_is_single_camera (self->options))
+        dbus_name = g_strdup_printf ("%s_%s", DBUS_NAME_PREFIX, mati_options_get_camera_id (self->options, 0));
+    else
+        dbus_name = g_strdup (DBUS_NAME_PREFIX);
+
+    self->dbus_owner_id = g_bus_own_name (G_BUS_TYPE_SESSION, dbus_name, 0, on_connection_acquired, on_name_acquired, on_name_lost, self, NULL);
+}
+
 static void
 mati_application_activate (GApplication *app)
 {
     MatiApplication *self = MATI_APPLICATION (app);
 
-    self->communicator = mati_communicator_new (mati_options_get_id (self->options), self);
+    mati_writer_set_ram_budget (mati_options_get_ram_budget (self->options));
+    self->retention = mati_retention_new (MATI_RECORDING_DIR,
+                                          mati_options_get_quota_bytes (self->options),
+                                          mati_options_get_camera_quota_bytes (self->options),
+                                          mati_options_get_max_age (self->options));
+    if (mati_options_get_http_port (self->options) != 0)
+        self->http_server = mati_http_server_new (mati_options_get_http_address (self->options),
+                                                  mati_options_get_http_port (self->options));
 
-    self->detector = mati_detector_new (self->communicator,
-                                        mati_options_get_id (self->options),
-                                        mati_options_get_turnserver (self->options));
-    if (self->detector == NULL)
-        return;
-    
-    if (!mati_detector_build (self->detector, mati_options_get_uri (self->options)))
+    for (guint i = 0; i < mati_options_get_n_cameras (self->options); i++)
     {
-        g_critical ("Could not build detector pipeline!");
+        const char *mati_id = mati_options_get_camera_id (self->options, i);
+        g_autoptr (MatiCommunicator) communicator = NULL;
+        g_autoptr (MatiDetector) detector = NULL;
+
+        /* A camera that fails is left out, the others still run */
+        communicator = mati_communicator_new (mati_id, self);
+        detector = mati_detector_new (communicator,
+                                      mati_options_get_camera_id (self->options, i),
+                                      mati_options_get_turnserver (self->options));
+        if (detector == NULL)
+        {
+            g_critical ("Could not create detector for %s!", mati_id);
+            continue;
+        }
+
+        mati_detector_set_recording_options (detector,
+                                             mati_options_get_preroll_time (self->options),
+                                             mati_options_get_preroll_bytes (self->options),
+                                             mati_options_get_postroll_time (self->options));
+        mati_detector_set_segment_options (detector,
+                                           mati_options_get_recording_format (self->options),
+                                           mati_options_get_segment_time (self->options),
+                                           mati_options_get_segment_bytes (self->options));
+        mati_detector_set_writer_options (detector,
+                                          mati_options_get_direct_io (self->options),
+                                          mati_options_get_sync_writes (self->options),
+                                          mati_options_get_ram_budget (self->options) > 0);
+        mati_detector_set_retention (detector, self->retention);
+        mati_detector_set_export_options (detector, mati_options_get_export_dir (self->options));
+        mati_detector_set_http_server (detector, self->http_server);
+        mati_detector_set_analysis_options (detector,
+                                            mati_options_get_analysis_width (self->options),
+                                            mati_options_get_analysis_fps (self->options));
+        mati_detector_set_thumbnail_options (detector, mati_options_get_thumbnail_width (self->options));
+        mati_detector_set_frame_ring_options (detector,
+                                              mati_options_get_frame_ring_width (self->options),
+                                              mati_options_get_frame_ring_fps (self->options),
+                                              mati_options_get_frame_ring_format (self->options));
+        mati_detector_set_startup_options (detector,
+                                           self->start_time,
+                                           mati_options_get_fast_start (self->options),
+                                           mati_options_get_rtsp_transport (self->options));
+        mati_detector_set_live_options (detector,
+                                        mati_options_get_live_mode (self->options),
+                                        mati_options_get_passthrough_profiles (self->options));
+        mati_detector_set_decoder_options (detector,
+                                           mati_options_get_decode_idle_mode (self->options),
+                                           mati_options_get_decode_gate_threshold (self->options));
+        mati_detector_set_diagnostics_options (detector, mati_options_get_stats_interval (self->options));
+        mati_detector_set_thread_options (detector,
+                                          mati_options_get_decoder_threads (self->options),
+                                          mati_options_get_thread_rules (self->options));
+
+        if (!mati_detector_build (detector, mati_options_get_camera_uri (self->options, i)))
+        {
+            g_critical ("Could not build detector pipeline for %s!", mati_id);
+            continue;
+        }
+
+        g_ptr_array_add (self->communicators, g_steal_pointer (&communicator));
+        g_ptr_array_add (self->detectors, g_steal_pointer (&detector));
+        g_ptr_array_add (self->camera_ids, (gpointer) mati_id);
+    }
+
+    if (self->detectors->len == 0)
+    {
+        g_critical ("No camera could be started!");
         return;
     }
 
-    mati_detector_start (self->detector);
+    mati_application_own_bus_name (self);
+    mati_retention_start (self->retention);
+    if (self->http_server != NULL)
+    {
+        g_autoptr (GError) error = NULL;
+
+        if (!mati_http_server_start (self->http_server, &error))
+            g_critical ("Couldn't start http server: %s", error->message);
+    }
+
+    for (guint i = 0; i < self->detectors->len; i++)
+        mati_detector_start (g_ptr_array_index (self->detectors, i));
 
     g_application_hold (app);
 
-    g_message ("Mati is running");
+    g_message ("Mati is running %u camera(s)", self->detectors->len);
 }
 
 static void
@@ -82,22 +249,39 @@ mati_application_class_init (MatiApplicationClass *klass)
     gapplication_class->shutdown = mati_application_shutdown;
 }
 
+static MatiDetector *
+mati_application_get_detector (MatiApplication *self,
+                               const char      *mati_id)
+{
+    for (guint i = 0; i < self->detectors->len; i++)
+    {
+        if (g_str_equal (g_ptr_array_index (self->camera_ids, i), mati_id))
+            return g_ptr_array_index (self->detectors, i);
+    }
+    return NULL;
+}
+
 const char *
-mati_application_get_diagnostics (MatiApplication *self)
+mati_application_get_diagnostics (MatiApplication *self,
+                                  const char      *mati_id)
 {
-    g_autoptr (JsonNode) diagnostics = mati_detector_get_diagnostics (self->detector);
+    MatiDetector *detector = mati_application_get_detector (self, mati_id);
+
+    if (detector == NULL)
+        return g_strdup ("{}");
 
-    return json_to_string (diagnostics, FALSE);
+    return mati_detector_get_diagnostics (detector);
 }
 
 MatiApplication *
-mati_application_new (int argc, char *argv[])
+mati_application_new (int argc, char *argv[], gint64 start_time)
 {
     g_autoptr (MatiApplication) self = NULL;
     g_autoptr (GError) error = NULL;
 
     self = g_object_new (MATI_TYPE_APPLICATION, "application-id", NULL, "flags", G_APPLICATION_NON_UNIQUE, NULL);
 
+    self->start_time = start_time;
     self->options = mati_options_new();
     if (!mati_options_read (self->options, &argc, &argv, &error))
     {
@@ -9,8 +9,9 @@ G_BEGIN_DECLS
 
 G_DECLARE_FINAL_TYPE (MatiApplication, mati_application, MATI, APPLICATION, GApplication);
 
-const char* mati_application_get_diagnostics (MatiApplication *self);
+const char* mati_application_get_diagnostics (MatiApplication *self,
+                                              const char      *mati_id);
 
-MatiApplication* mati_application_new (int argc, char* argv[]);
+MatiApplication* mati_application_new (int argc, char* argv[], gint64 start_time);
 
 G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,234 @@
+#include "mati-branch.h"
+
+/* A queue in front of one consumer of a tee. The queue itself is unbounded
+ * and never blocks, a probe on its sink pad enforces the limits instead and
+ * drops what doesn't fit. A tee only pushes as fast as its slowest branch,
+ * so a stalled consumer now loses its own frames instead of holding back
+ * everybody else on the same tee.
+ *
+ * Encoded branches drop up to the next keyframe, a decoder or muxer can't
+ * do anything with the delta frames following a gap. The first buffer after
+ * a gap is marked DISCONT. A lossless branch is given a budget large enough
+ * that it only drops when its consumer is stuck for good, and warns when
+ * that happens.
+ *
+ * The fill level is counted by probes on both pads of the queue instead of
+ * asking the queue for it, and every counter is atomic, so a buffer costs
+ * neither a property lookup nor a lock. */
+struct _MatiBranch
+{
+    gchar *name;
+    MatiBranchPolicy policy;
+    guint max_buffers; // 0 is unlimited
+    guint max_bytes;   // 0 is unlimited
+
+    GstElement *queue;
+
+    /* Only touched by the streaming thread feeding the queue */
+    gboolean dropping;
+    gboolean discont;
+
+    /* Atomic, the level is written by the streaming threads on both sides
+     * of the queue */
+    guint level_buffers;
+    guint level_bytes;
+    guint64 passed;
+    guint64 dropped;
+    guint64 dropped_bytes;
+    guint overruns;
+    guint high_water_buffers;
+    guint high_water_bytes;
+};
+
+static gboolean
+mati_branch_is_full (MatiBranch *self,
+                     guint       level_buffers,
+                     guint       level_bytes,
+                     gsize       size)
+{
+    return (self->max_buffers > 0 && level_buffers >= self->max_buffers)
+           || (self->max_bytes > 0 && level_bytes + size > self->max_bytes);
+}
+
+static void
+update_high_water (guint *high_water,
+                   guint  level)
+{
+    guint current = __atomic_load_n (high_water, __ATOMIC_RELAXED);
+
+    while (level > current
+           && !__atomic_compare_exchange_n (high_water, &current, level, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static GstPadProbeReturn
+branch_probe_cb (GstPad          *pad,
+                 GstPadProbeInfo *info,
+                 gpointer         user_data)
+{
+    MatiBranch *self = user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    gsize size = gst_buffer_get_size (buffer);
+    gboolean keyframe = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    guint level_buffers = __atomic_load_n (&self->level_buffers, __ATOMIC_RELAXED);
+    guint level_bytes = __atomic_load_n (&self->level_bytes, __ATOMIC_RELAXED);
+    gboolean full, drop, overrun;
+
+    full = mati_branch_is_full (self, level_buffers, level_bytes, size);
+
+    /* Leaky branches resume on any buffer that fits, the others on the
+     * next keyframe that fits */
+    overrun = full && !self->dropping;
+    if (self->policy == MATI_BRANCH_LEAKY || !self->dropping)
+        drop = full;
+    else
+        drop = full || !keyframe;
+    self->dropping = drop;
+
+    if (overrun && self->policy == MATI_BRANCH_LOSSLESS)
+        g_warning ("%s branch exceeded its budget of %u bytes, dropping up to the next keyframe",
+                   self->name, self->max_bytes);
+    else if (overrun)
+        GST_DEBUG ("%s branch full at %u buffers, %u bytes, dropping", self->name, level_buffers, level_bytes);
+
+    if (overrun)
+        __atomic_fetch_add (&self->overruns, 1, __ATOMIC_RELAXED);
+
+    if (drop)
+    {
+        __atomic_fetch_add (&self->dropped, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add (&self->dropped_bytes, size, __ATOMIC_RELAXED);
+        self->discont = TRUE;
+        return GST_PAD_PROBE_DROP;
+    }
+
+    __atomic_fetch_add (&self->passed, 1, __ATOMIC_RELAXED);
+    update_high_water (&self->high_water_buffers, __atomic_add_fetch (&self->level_buffers, 1, __ATOMIC_RELAXED));
+    update_high_water (&self->high_water_bytes, __atomic_add_fetch (&self->level_bytes, size, __ATOMIC_RELAXED));
+
+    if (self->discont)
+    {
+        buffer = gst_buffer_make_writable (buffer);
+        GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
+        GST_PAD_PROBE_INFO_DATA (info) = buffer;
+        self->discont = FALSE;
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+/* A buffer leaving the queue */
+static GstPadProbeReturn
+branch_src_probe_cb (GstPad          *pad,
+                     GstPadProbeInfo *info,
+                     gpointer         user_data)
+{
+    MatiBranch *self = user_data;
+
+    __atomic_fetch_sub (&self->level_bytes, gst_buffer_get_size (GST_PAD_PROBE_INFO_BUFFER (info)), __ATOMIC_RELAXED);
+    __atomic_fetch_sub (&self->level_buffers, 1, __ATOMIC_RELAXED);
+    return GST_PAD_PROBE_OK;
+}
+
+/* A flush empties the queue without pushing anything out */
+static GstPadProbeReturn
+branch_flush_probe_cb (GstPad          *pad,
+                       GstPadProbeInfo *info,
+                       gpointer         user_data)
+{
+    MatiBranch *self = user_data;
+
+    if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_FLUSH_STOP)
+    {
+        __atomic_store_n (&self->level_buffers, 0, __ATOMIC_RELAXED);
+        __atomic_store_n (&self->level_bytes, 0, __ATOMIC_RELAXED);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+MatiBranch *
+mati_branch_new (const char       *name,
+                 MatiBranchPolicy  policy,
+                 guint             max_buffers,
+                 guint             max_bytes)
+{
+    MatiBranch *self = g_new0 (MatiBranch, 1);
+    g_autofree gchar *queue_name = g_strconcat (name, "-branch", NULL);
+    g_autoptr (GstPad) sink_pad = NULL;
+    g_autoptr (GstPad) src_pad = NULL;
+
+    self->name = g_strdup (name);
+    self->policy = policy;
+    self->max_buffers = max_buffers;
+    self->max_bytes = max_bytes;
+
+    self->queue = gst_element_factory_make ("queue", queue_name);
+    g_return_val_if_fail (GST_IS_ELEMENT (self->queue), self);
+    gst_object_ref_sink (self->queue);
+    g_object_set (self->queue,
+                  "max-size-time", (guint64) 0,
+                  "max-size-buffers", 0,
+                  "max-size-bytes", 0,
+                  NULL);
+
+    sink_pad = gst_element_get_static_pad (self->queue, "sink");
+    gst_pad_add_probe (sink_pad, GST_PAD_PROBE_TYPE_BUFFER, branch_probe_cb, self, NULL);
+    gst_pad_add_probe (sink_pad, GST_PAD_PROBE_TYPE_EVENT_FLUSH, branch_flush_probe_cb, self, NULL);
+    src_pad = gst_element_get_static_pad (self->queue, "src");
+    gst_pad_add_probe (src_pad, GST_PAD_PROBE_TYPE_BUFFER, branch_src_probe_cb, self, NULL);
+
+    return self;
+}
+
+void
+mati_branch_free (MatiBranch *self)
+{
+    gst_clear_object (&self->queue);
+    g_free (self->name);
+    g_free (self);
+}
+
+/* Owned by the branch, the caller adds it to its bin and links the
+ * consumer behind it */
+GstElement *
+mati_branch_get_queue (MatiBranch *self)
+{
+    return self->queue;
+}
+
+const char *
+mati_branch_get_name (MatiBranch *self)
+{
+    return self->name;
+}
+
+void
+mati_branch_get_stats (MatiBranch      *self,
+                       MatiBranchStats *stats)
+{
+    stats->policy = self->policy;
+    stats->passed = __atomic_load_n (&self->passed, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n (&self->dropped, __ATOMIC_RELAXED);
+    stats->dropped_bytes = __atomic_load_n (&self->dropped_bytes, __ATOMIC_RELAXED);
+    stats->overruns = __atomic_load_n (&self->overruns, __ATOMIC_RELAXED);
+    stats->level_buffers = __atomic_load_n (&self->level_buffers, __ATOMIC_RELAXED);
+    stats->level_bytes = __atomic_load_n (&self->level_bytes, __ATOMIC_RELAXED);
+    stats->high_water_buffers = __atomic_load_n (&self->high_water_buffers, __ATOMIC_RELAXED);
+    stats->high_water_bytes = __atomic_load_n (&self->high_water_bytes, __ATOMIC_RELAXED);
+}
+
+const char *
+mati_branch_policy_to_string (MatiBranchPolicy policy)
+{
+    switch (policy)
+    {
+        case MATI_BRANCH_LEAKY:
+            return "leaky";
+        case MATI_BRANCH_KEYFRAME:
+            return "keyframe";
+        case MATI_BRANCH_LOSSLESS:
+            return "lossless";
+        default:
+            return "unknown";
+    }
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <glib.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+    MATI_BRANCH_LEAKY,      // drops single buffers while full, for raw video
+    MATI_BRANCH_KEYFRAME,   // drops up to the next keyframe once full, for encoded video
+    MATI_BRANCH_LOSSLESS,   // drops nothing until its memory budget runs out
+} MatiBranchPolicy;
+
+typedef struct _MatiBranch MatiBranch;
+
+typedef struct
+{
+    MatiBranchPolicy policy;
+    guint64 passed;
+    guint64 dropped;            // buffers dropped to keep the tee moving
+    guint64 dropped_bytes;
+    guint overruns;             // times the branch was full and started dropping
+    guint level_buffers;
+    guint level_bytes;
+    guint high_water_buffers;
+    guint high_water_bytes;
+} MatiBranchStats;
+
+MatiBranch *mati_branch_new (const char       *name,
+                             MatiBranchPolicy  policy,
+                             guint             max_buffers,
+                             guint             max_bytes);
+
+void mati_branch_free (MatiBranch *self);
+
+GstElement *mati_branch_get_queue (MatiBranch *self);
+
+const char *mati_branch_get_name (MatiBranch *self);
+
+void mati_branch_get_stats (MatiBranch      *self,
+                            MatiBranchStats *stats);
+
+const char *mati_branch_policy_to_string (MatiBranchPolicy policy);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MatiBranch, mati_branch_free)
+
+G_END_DECLS
\ No newline at end of file
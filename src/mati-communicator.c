@@ -4,8 +4,8 @@ struct _MatiCommunicator
 {
    MatiDbusSkeleton parent_instance;
 
-   guint dbus_owner_id;
    MatiApplication *app;
+   char *mati_id;
 };
 
 G_DEFINE_TYPE (MatiCommunicator, mati_communicator, MATI_DBUS_TYPE__SKELETON);
@@ -31,15 +31,42 @@ mati_communicator_emit_peer_id (MatiCommunicator *self,
     mati_dbus__emit_peer_id (MATI_DBUS_ (self), peer_id);
 }
 
+void
+mati_communicator_emit_export_progress (MatiCommunicator *self,
+                                        guint             job,
+                                        gdouble           progress)
+{
+    mati_dbus__emit_export_progress (MATI_DBUS_ (self), job, progress);
+}
+
+void
+mati_communicator_emit_export_finished (MatiCommunicator *self,
+                                        guint             job,
+                                        gboolean          success,
+                                        const char       *message)
+{
+    mati_dbus__emit_export_finished (MATI_DBUS_ (self), job, success, message);
+}
+
+/* Safe from any thread, the skeleton batches changes into one
+ * PropertiesChanged emitted from the main context */
+void
+mati_communicator_set_stats (MatiCommunicator *self,
+                             GVariant         *stats)
+{
+    mati_dbus__set_stats (MATI_DBUS_ (self), stats);
+}
+
 static gboolean
 handle_get_diagnostics (MatiDbus              *obj,
                         GDBusMethodInvocation *invoc,
                         gpointer               user_data)
 {
     MatiCommunicator *self = MATI_COMMUNICATOR (user_data);
-    g_autofree const char *diag_str = mati_application_get_diagnostics (self->app);
+    g_autofree const char *diag_str = mati_application_get_diagnostics (self->app, self->mati_id);
 
     mati_dbus__complete_get_diagnostics (obj, invoc, diag_str);
+    return TRUE;
 }
 
 static void
@@ -47,7 +74,9 @@ mati_communicator_finalize (GObject *object)
 {
     MatiCommunicator *self = MATI_COMMUNICATOR (object);
 
-    g_bus_unown_name (self->dbus_owner_id);
+    if (g_dbus_interface_skeleton_get_connection (G_DBUS_INTERFACE_SKELETON (self)) != NULL)
+        g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (self));
+    g_free (self->mati_id);
 
     G_OBJECT_CLASS (mati_communicator_parent_class)->finalize (object);
 }
@@ -55,8 +84,8 @@ mati_communicator_finalize (GObject *object)
 static void
 mati_communicator_init (MatiCommunicator *self)
 {
-    self->dbus_owner_id = 0;
     self->app = NULL;
+    self->mati_id = NULL;
 }
 
 static void
@@ -68,31 +97,17 @@ mati_communicator_class_init (MatiCommunicatorClass *klass)
     // object_class->constructed = mati_communicator_constructed;
 }
 
-static void
-on_name_lost (GDBusConnection *connection, const char *name, gpointer user_data)
+gboolean
+mati_communicator_export (MatiCommunicator  *self,
+                          GDBusConnection   *connection,
+                          const char        *object_path,
+                          GError           **error)
 {
-    if (connection)
-        g_critical ("Couldn't acquire DBus name %s", name);
-    else
-        g_critical ("Failed to connect to bus: %s", name);
-}
-
-static void
-on_name_acquired (GDBusConnection *connection, const char *name, gpointer user_data)
-{
-    g_message ("acquired DBus name %s", name);
-}
-
-static void
-on_connection_acquired (GDBusConnection *connection, const char *name, gpointer user_data)
-{
-    MatiCommunicator *self = MATI_COMMUNICATOR (user_data);
-    g_autoptr (GError) error = NULL;
+    if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (self), connection, object_path, error))
+        return FALSE;
 
-    if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (self), connection, "/com/froura/mati/app", &error))
-        g_critical ("Failed to export mati to dbus: %s", error->message);
-
-    g_signal_connect_object (MATI_DBUS_ (self), "handle-get-diagnostics", G_CALLBACK (handle_get_diagnostics), self, 0);
+    g_message ("exported %s on %s", self->mati_id, object_path);
+    return TRUE;
 }
 
 MatiCommunicator *
@@ -100,13 +115,12 @@ mati_communicator_new (const char      *mati_id,
                        MatiApplication *app)
 {
     MatiCommunicator *self;
-    g_autofree char *dbus_name = NULL;
 
     self = g_object_new (MATI_TYPE_COMMUNICATOR, NULL);
 
-    dbus_name = g_strdup_printf ("com.froura.mati.app_%s", mati_id);
-    self->dbus_owner_id = g_bus_own_name (G_BUS_TYPE_SESSION, dbus_name, 0, on_connection_acquired, on_name_acquired, on_name_lost, self, NULL);
     self->app = app;
+    self->mati_id = g_strdup (mati_id);
+    g_signal_connect_object (MATI_DBUS_ (self), "handle-get-diagnostics", G_CALLBACK (handle_get_diagnostics), self, 0);
 
     return self;
 }
\ No newline at end of file
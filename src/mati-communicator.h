@@ -31,6 +31,27 @@ void
 mati_communicator_emit_peer_id (MatiCommunicator *self,
                                 char             *peer_id);
 
+void
+mati_communicator_emit_export_progress (MatiCommunicator *self,
+                                        guint             job,
+                                        gdouble           progress);
+
+void
+mati_communicator_emit_export_finished (MatiCommunicator *self,
+                                        guint             job,
+                                        gboolean          success,
+                                        const char       *message);
+
+void
+mati_communicator_set_stats (MatiCommunicator *self,
+                             GVariant         *stats);
+
+gboolean
+mati_communicator_export (MatiCommunicator  *self,
+                          GDBusConnection   *connection,
+                          const char        *object_path,
+                          GError           **error);
+
 MatiCommunicator *
 mati_communicator_new (const char      *mati_id,
                        MatiApplication *app);
@@ -0,0 +1,310 @@
+#include "mati-decode-gate.h"
+
+#define WARMUP_FRAMES 50
+#define BASELINE_WEIGHT (1.0 / 256)
+#define RECENT_WEIGHT (1.0 / 4)
+#define QUIET_TIME (10 * G_TIME_SPAN_SECOND)
+
+#define NAL_SLICE 1
+#define NAL_SLICE_IDR 5
+
+/* Decides which frames reach the decoder. The gate is open, decoding every
+ * frame, while the detector reports motion, while someone watches the live
+ * view or while the encoded stream looks active. Activity is estimated from the size of encoded delta
+ * frames without decoding anything: a fast average over the last frames
+ * divided by a slow average taken while nothing happens. Once both have
+ * been quiet for a while the gate closes and the idle mode decides what
+ * still gets decoded.
+ *
+ * Dropping only non-reference frames never breaks decoding, so that mode
+ * can switch back to full rate on any frame. Keyframe-only decoding opens
+ * and closes on keyframes, so switching back takes at most one GOP. */
+struct _MatiDecodeGate
+{
+    MatiDecodeIdleMode idle_mode;
+    gdouble threshold;
+
+    /* Only touched by the streaming thread */
+    gdouble baseline;
+    gdouble recent;
+    guint warmup;
+    gint64 last_active;
+    guint nal_length_size; // 0 for byte-stream
+
+    /* Read and written from any thread */
+    gint in_motion;
+    gint watched;
+    gint open;
+    gint activity_permille;
+    gint switches_to_full;
+    gint switches_to_idle;
+
+    /* Counted per frame for the lifetime of the camera, atomically */
+    guint64 passed;
+    guint64 dropped;
+};
+
+MatiDecodeGate *
+mati_decode_gate_new (MatiDecodeIdleMode idle_mode,
+                      gdouble            activity_threshold)
+{
+    MatiDecodeGate *self = g_new0 (MatiDecodeGate, 1);
+
+    self->idle_mode = idle_mode;
+    self->threshold = activity_threshold;
+    self->open = TRUE;
+    self->activity_permille = 1000;
+    self->last_active = g_get_monotonic_time ();
+
+    return self;
+}
+
+void
+mati_decode_gate_free (MatiDecodeGate *self)
+{
+    g_free (self);
+}
+
+static void
+mati_decode_gate_update_activity (MatiDecodeGate *self,
+                                  gsize           size)
+{
+    gdouble activity;
+
+    if (self->warmup < WARMUP_FRAMES)
+    {
+        self->warmup++;
+        self->baseline += (size - self->baseline) / self->warmup;
+        self->recent = self->baseline;
+        self->last_active = g_get_monotonic_time ();
+        return;
+    }
+
+    self->recent += RECENT_WEIGHT * (size - self->recent);
+    activity = self->baseline > 0 ? self->recent / self->baseline : 1;
+
+    if (activity >= self->threshold)
+        self->last_active = g_get_monotonic_time ();
+    else
+        self->baseline += BASELINE_WEIGHT * (size - self->baseline);
+
+    g_atomic_int_set (&self->activity_permille, (gint) MIN (activity * 1000, G_MAXINT));
+}
+
+static gboolean
+mati_decode_gate_is_quiet (MatiDecodeGate *self)
+{
+    /* Without an activity threshold only the detector state counts */
+    if (self->threshold <= 0)
+        return TRUE;
+
+    return g_get_monotonic_time () - self->last_active > QUIET_TIME;
+}
+
+static void
+mati_decode_gate_parse_caps (MatiDecodeGate *self,
+                             GstCaps        *caps)
+{
+    GstStructure *structure = gst_caps_get_structure (caps, 0);
+    const char *stream_format = gst_structure_get_string (structure, "stream-format");
+    const GValue *codec_data = gst_structure_get_value (structure, "codec_data");
+
+    self->nal_length_size = 0;
+    if (stream_format != NULL && g_str_has_prefix (stream_format, "avc") && codec_data != NULL)
+    {
+        GstMapInfo map;
+        GstBuffer *buffer = gst_value_get_buffer (codec_data);
+
+        self->nal_length_size = 4;
+        if (gst_buffer_map (buffer, &map, GST_MAP_READ))
+        {
+            if (map.size > 4)
+                self->nal_length_size = (map.data[4] & 0x03) + 1;
+            gst_buffer_unmap (buffer, &map);
+        }
+    }
+}
+
+/* Looks at nal_ref_idc of the first slice in the access unit. Anything
+ * that can't be parsed counts as a reference frame so it gets decoded. */
+static gboolean
+mati_decode_gate_is_reference (MatiDecodeGate *self,
+                               GstBuffer      *buffer)
+{
+    GstMapInfo map;
+    gboolean reference = TRUE;
+    gsize pos = 0;
+
+    if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
+        return TRUE;
+
+    while (pos < map.size)
+    {
+        gsize nal_start;
+        guint8 nal_type;
+
+        if (self->nal_length_size > 0)
+        {
+            gsize nal_size = 0;
+
+            if (pos + self->nal_length_size >= map.size)
+                break;
+            for (guint i = 0; i < self->nal_length_size; i++)
+                nal_size = (nal_size << 8) | map.data[pos + i];
+            nal_start = pos + self->nal_length_size;
+            pos = nal_start + nal_size;
+        }
+        else
+        {
+            while (pos + 3 < map.size && !(map.data[pos] == 0 && map.data[pos + 1] == 0 && map.data[pos + 2] == 1))
+                pos++;
+            if (pos + 3 >= map.size)
+                break;
+            nal_start = pos + 3;
+            pos = nal_start;
+        }
+
+        if (nal_start >= map.size)
+            break;
+
+        nal_type = map.data[nal_start] & 0x1f;
+        if (nal_type == NAL_SLICE || nal_type == NAL_SLICE_IDR)
+        {
+            reference = (map.data[nal_start] & 0x60) != 0;
+            break;
+        }
+    }
+
+    gst_buffer_unmap (buffer, &map);
+    return reference;
+}
+
+static GstPadProbeReturn
+decode_gate_probe_cb (GstPad          *pad,
+                      GstPadProbeInfo *info,
+                      gpointer         user_data)
+{
+    MatiDecodeGate *self = user_data;
+    GstBuffer *buffer;
+    gboolean keyframe, open, want_open;
+
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM)
+    {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+
+        if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS)
+        {
+            GstCaps *caps;
+
+            gst_event_parse_caps (event, &caps);
+            mati_decode_gate_parse_caps (self, caps);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    keyframe = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    if (!keyframe && self->threshold > 0)
+        mati_decode_gate_update_activity (self, gst_buffer_get_size (buffer));
+
+    open = g_atomic_int_get (&self->open);
+    want_open = g_atomic_int_get (&self->in_motion) || g_atomic_int_get (&self->watched)
+                || !mati_decode_gate_is_quiet (self);
+
+    if (open != want_open && (keyframe || (want_open && self->idle_mode == MATI_DECODE_IDLE_REFERENCE)))
+    {
+        open = want_open;
+        g_atomic_int_set (&self->open, open);
+        g_atomic_int_inc (open ? &self->switches_to_full : &self->switches_to_idle);
+        GST_INFO ("decoding %s, activity %.2f", open ? "every frame" : mati_decode_idle_mode_to_string (self->idle_mode),
+                  g_atomic_int_get (&self->activity_permille) / 1000.0);
+    }
+
+    if (open || keyframe
+        || (self->idle_mode == MATI_DECODE_IDLE_REFERENCE && mati_decode_gate_is_reference (self, buffer)))
+    {
+        __atomic_fetch_add (&self->passed, 1, __ATOMIC_RELAXED);
+        return GST_PAD_PROBE_OK;
+    }
+
+    __atomic_fetch_add (&self->dropped, 1, __ATOMIC_RELAXED);
+    return GST_PAD_PROBE_DROP;
+}
+
+gulong
+mati_decode_gate_add_probe (MatiDecodeGate *self,
+                            GstPad         *pad)
+{
+    if (self->idle_mode == MATI_DECODE_IDLE_FULL)
+        return 0;
+
+    return gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+                              decode_gate_probe_cb, self, NULL);
+}
+
+/* Motion keeps the gate open, the switch happens on the next frame that
+ * allows it */
+void
+mati_decode_gate_set_motion (MatiDecodeGate *self,
+                             gboolean        in_motion)
+{
+    g_atomic_int_set (&self->in_motion, in_motion);
+}
+
+/* Live view wants every frame, same as motion */
+void
+mati_decode_gate_set_watched (MatiDecodeGate *self,
+                              gboolean        watched)
+{
+    g_atomic_int_set (&self->watched, watched);
+}
+
+gboolean
+mati_decode_gate_is_open (MatiDecodeGate *self)
+{
+    return g_atomic_int_get (&self->open);
+}
+
+void
+mati_decode_gate_get_stats (MatiDecodeGate      *self,
+                            MatiDecodeGateStats *stats)
+{
+    stats->open = g_atomic_int_get (&self->open);
+    stats->activity = g_atomic_int_get (&self->activity_permille) / 1000.0;
+    stats->passed = __atomic_load_n (&self->passed, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n (&self->dropped, __ATOMIC_RELAXED);
+    stats->switches_to_full = g_atomic_int_get (&self->switches_to_full);
+    stats->switches_to_idle = g_atomic_int_get (&self->switches_to_idle);
+}
+
+const char *
+mati_decode_idle_mode_to_string (MatiDecodeIdleMode idle_mode)
+{
+    switch (idle_mode)
+    {
+        case MATI_DECODE_IDLE_FULL:
+            return "full";
+        case MATI_DECODE_IDLE_REFERENCE:
+            return "reference";
+        case MATI_DECODE_IDLE_KEYFRAMES:
+            return "keyframes";
+        default:
+            return "unknown";
+    }
+}
+
+gboolean
+mati_decode_idle_mode_from_string (const char         *string,
+                                   MatiDecodeIdleMode *idle_mode)
+{
+    for (MatiDecodeIdleMode mode = MATI_DECODE_IDLE_FULL; mode <= MATI_DECODE_IDLE_KEYFRAMES; mode++)
+    {
+        if (g_strcmp0 (string, mati_decode_idle_mode_to_string (mode)) == 0)
+        {
+            *idle_mode = mode;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
\ No newline at end of file
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <glib.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+    MATI_DECODE_IDLE_FULL,        // decode every frame, also while idle
+    MATI_DECODE_IDLE_REFERENCE,   // drop non-reference frames while idle
+    MATI_DECODE_IDLE_KEYFRAMES,   // decode only keyframes while idle
+} MatiDecodeIdleMode;
+
+typedef struct _MatiDecodeGate MatiDecodeGate;
+
+typedef struct
+{
+    gboolean open;
+    gdouble activity;    // recent encoded frame size relative to the idle baseline
+    guint64 passed;      // frames sent to the decoder
+    guint64 dropped;     // frames held back while idle
+    guint switches_to_full;
+    guint switches_to_idle;
+} MatiDecodeGateStats;
+
+MatiDecodeGate *mati_decode_gate_new (MatiDecodeIdleMode idle_mode,
+                                      gdouble            activity_threshold);
+
+void mati_decode_gate_free (MatiDecodeGate *self);
+
+gulong mati_decode_gate_add_probe (MatiDecodeGate *self,
+                                   GstPad         *pad);
+
+void mati_decode_gate_set_motion (MatiDecodeGate *self,
+                                  gboolean        in_motion);
+
+void mati_decode_gate_set_watched (MatiDecodeGate *self,
+                                   gboolean        watched);
+
+gboolean mati_decode_gate_is_open (MatiDecodeGate *self);
+
+void mati_decode_gate_get_stats (MatiDecodeGate      *self,
+                                 MatiDecodeGateStats *stats);
+
+const char *mati_decode_idle_mode_to_string (MatiDecodeIdleMode idle_mode);
+
+gboolean mati_decode_idle_mode_from_string (const char         *string,
+                                            MatiDecodeIdleMode *idle_mode);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MatiDecodeGate, mati_decode_gate_free)
+
+G_END_DECLS
\ No newline at end of file
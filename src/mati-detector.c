@@ -1,5 +1,18 @@
 #include "mati-detector.h"
+#include "mati-branch.h"
+#include "mati-export.h"
+#include "mati-frame-ring.h"
+#include "mati-index.h"
+#include "mati-motion.h"
+#include "mati-preroll.h"
+#include "mati-stats.h"
+#include "mati-thread-policy.h"
+#include "mati-thumbnailer.h"
+#include "mati-writer.h"
+#include <errno.h>
+#include <gio/gunixfdlist.h>
 #include <gst/video/video.h>
+#include <string.h>
 
 #define TCP_BIN_SUBNAME "tcpbin_"
 #define TCP_BIN_SUBNAME_LENGTH 7
@@ -8,12 +21,41 @@
 #define ENCODER_ELEMENT_NAME "encoder"
 #define RTSPSRC_NAME "rtspsource"
 #define WEBRTCSINK_NAME "webrtcsink"
+#define LIVE_ENCODER_NAME "liveencoder"
 #define FILESINK_NAME "filesink"
-#define RECORDING_BUFFER_NAME "recording-buffer"
+#define PREROLL_NAME "preroll"
+#define MOTION_NAME "motion"
 #define DECODE_FRAME_TIMEOUT 10000
+#define FRAME_WATCHDOG_INTERVAL 1
+#define RECONNECT_MIN_DELAY 1 // seconds, doubled on every failed attempt
+#define RECONNECT_MAX_DELAY 60
+#define FAST_START_LATENCY 200 // ms of jitterbuffer until steady state
+#define STEADY_LATENCY 2000    // ms, what rtspsrc defaults to
+#define STEADY_STATE_DELAY 10  // seconds after the first decoded frame
+#define CACHE_DIR "/var/cache/mati/"
 #define PAUSED 3
 #define PLAYING 4
-#define RECORDING_BUFFER ((guint64)10 * 1000000000) // 10 seconds in nanoseconds
+#define DEFAULT_PREROLL_TIME ((guint64)10 * GST_SECOND)
+#define DEFAULT_PREROLL_BYTES ((guint64)64 * 1024 * 1024)
+#define DEFAULT_POSTROLL_TIME ((guint64)10 * GST_SECOND)
+#define MAX_RECORDING_ROLL_TIME ((guint64)60 * 60 * 1000) // ms, pre- and post-roll ConfigureRecording accepts
+#define RECORDING_QUEUE_BYTES (32 * 1024 * 1024)
+#define DECODER_QUEUE_BUFFERS 30 // a second of frames at most, motion shouldn't lag more
+#define RAW_QUEUE_BUFFERS 2
+#define ENCODED_QUEUE_BYTES (4 * 1024 * 1024)
+#define SINGLE_QUEUE_BUFFERS 1 // thumbnails and shared frames, anything older is stale
+#define FRAGMENT_DURATION 1000 // ms, what is lost at most on a crash
+#define FINALIZE_TIMEOUT 30
+#define DEFAULT_ANALYSIS_WIDTH 640
+#define DEFAULT_ANALYSIS_FPS 5
+#define DEFAULT_THUMBNAIL_WIDTH 320
+#define DEFAULT_DECODE_IDLE_MODE MATI_DECODE_IDLE_KEYFRAMES
+#define DEFAULT_DECODE_GATE_THRESHOLD 1.5
+#define DEFAULT_DECODER_THREADS 2
+#define DEFAULT_STATS_INTERVAL 5
+#define DEFAULT_LIVE_MODE MATI_LIVE_PER_CONSUMER
+#define DEFAULT_PASSTHROUGH_PROFILES "constrained-baseline"
+#define STREAMER_DETACH_DELAY 30
 #define THUMBNAIL_REFRESH_INTERVAL ((guint64)10 * 1000000000) // 10 seconds in nanoseconds
 
 GST_DEBUG_CATEGORY_STATIC (mati_detector_debug);
@@ -28,23 +70,149 @@ struct _MatiDetector
 
     GstElement *pipeline;
 
+    /* Bus handling and every timeout of this detector run on its own thread
+     * so one busy camera can't stall the others. */
+    GMainContext *context;
+    GMainLoop *loop;
+    GThread *thread;
+    GSource *bus_source;
+
     GstElement *tee;
-    GstElement *file_sink_bin;
 
+    /* Bin of the active recording and the bins still finalizing, only
+     * touched on the detector thread */
+    MatiRecordingState recording_state;
+    GstElement *file_sink_bin;
+    GstPad *recording_tee_pad;
+    GList *finalizing_bins;
+    guint finalize_watchdog;
+    guint recordings_started;
+    guint recordings_finalized;
+
+    /* The source, the only part rebuilt when the camera is lost. Only
+     * touched on the detector thread. */
+    gchar *uri;
+    GstElement *common_bin;
     GstElement *queue_connect;
-    GstElement *mux_queue;
-    GstElement *mux;
+    guint reconnect_timeout;
+    guint reconnect_delay;
+    gboolean reconnecting;
+    gint64 reconnect_began;
+    guint reconnect_attempts;
+    guint reconnects;
+    gdouble last_reconnect_time; // ms from losing the camera to its next frame
+
+    /* Fast start and how long startup took, monotonic times in
+     * microseconds, 0 until reached. Every time is set once, from
+     * whichever thread reaches it. */
+    gboolean fast_start;
+    gchar *rtsp_transport;
+    gboolean steady_latency;
+    gchar *cached_caps;       // as last written to the cache
+    gboolean caps_from_cache;
+    gint64 process_start;
+    gint64 build_time;
+    gint64 sdp_time;
+    gint64 connected_time;
+    gint64 first_buffer_time;
+    gint64 first_keyframe_time;
+    gint64 first_frame_time;
     GstElement *motion;
 
+    GstElement *preroll;
     GstElement *recording_tee;
 
-    GstElement *decoder_tee;
+    /* Recording in the past and after motion stopped, in nanoseconds */
+    guint64 preroll_time;
+    guint64 preroll_bytes;
+    guint64 postroll_time;
+
+    /* Container and when a recording continues in a new file, 0 never */
+    MatiRecordingFormat format;
+    guint64 segment_time;
+    guint64 segment_bytes;
+
+    /* File the active recording writes to, set from the streaming thread
+     * when a new segment starts */
+    GMutex recording_lock;
+    gchar *recording_location;
+    guint recording_segments;
+    GstElement *writer;
+    gint64 recording_start_time; // wall-clock of the pre-roll, for the first file
+    gint64 motion_began;         // wall-clock, 0 without motion
+
+    /* Passed on to every MatiWriter */
+    gboolean direct_io;
+    gboolean sync_writes;
+    gboolean ram_staging;
+
+    /* Owned by the application, told about every new file */
+    MatiRetention *retention;
+
+    /* Owned by the application, serves http_stream when set */
+    MatiHttpServer *http_server;
+    GstElement *http_stream;
+
+    /* Size and rate of the frames motion analysis runs on */
+    gint analysis_width;
+    gint analysis_fps;
 
-    gint64 last_frame_buffer;
-    gdouble framerate;
-    guint frame_timeout;
+    GstElement *decoder_tee;
 
-    gulong block_pad_id;
+    /* Keyframes of the encoded stream turned into JPEGs of this width */
+    GstElement *thumbnailer;
+    guint thumbnail_width;
+
+    /* Decoded frames shared with local consumers, only built with a rate */
+    GstElement *frame_ring;
+    guint frame_ring_width;
+    gint frame_ring_rate;
+    gchar *frame_ring_format;
+
+    /* Live view is only linked to the decoder while someone watches, the
+     * consumer count is updated from webrtcsink threads */
+    GstElement *streamer_bin;
+    GstElement *streamer_source; // decoder_tee, or tee for passthrough
+    GstElement *live_encoder;
+    MatiLiveMode live_mode;
+    gchar *input_profile;
+    gchar **passthrough_profiles;
+    GstCaps *input_caps;         // newest camera caps for the detector thread
+    GMutex caps_lock;
+    gboolean streamer_replacing;
+    GstPad *streamer_tee_pad;
+    gint n_consumers;
+    guint streamer_detach_timeout;
+    guint streamer_attaches;
+
+    /* Encoded input and decoded output, updated lock-free per frame */
+    MatiStats *input_stats;
+    MatiStats *decoder_stats;
+
+    /* Holds frames back from the decoder while there is no motion and the
+     * scene is quiet */
+    MatiDecodeGate *decode_gate;
+    MatiDecodeIdleMode decode_idle_mode;
+    gdouble decode_gate_threshold;
+
+    /* Queues in front of every consumer of the tees, a slow consumer drops
+     * its own frames instead of blocking the others */
+    GPtrArray *branches;
+
+    /* Names streaming threads and sets their affinity and priority */
+    MatiThreadPolicy *thread_policy;
+    guint decoder_threads;
+
+    /* Diagnostics are collected on the detector thread every stats_interval
+     * seconds, DBus callers only ever get the last snapshot */
+    guint stats_interval;
+    guint stats_timeout;
+    GMutex diagnostics_lock;
+    gchar *diagnostics;
+
+    guint frame_watchdog;
+    gint64 watchdog_start_time;
+    gboolean frame_timeout_reached;
 
     char *peer_id;
 
@@ -54,8 +222,17 @@ struct _MatiDetector
     guint motion_stopped_timeout;
 
     guint thumbnail_timeout;
+
+    guint export_jobs;
+    gchar *export_dir; // clips are only ever written in here
 };
 
+typedef struct
+{
+    GstElement *bin;
+    gint64 deadline;
+} MatiFinalizingBin;
+
 G_DEFINE_TYPE (MatiDetector, mati_detector, G_TYPE_OBJECT);
 
 enum MatiDetectorSignals
@@ -72,18 +249,160 @@ static guint signals[LAST];
 GstStateChangeReturn mati_detector_stop (MatiDetector *self);
 
 static GstElement* build_filesink (MatiDetector *self);
-// static gboolean decode_frame_timeout (MatiDetector *self);
+static void mati_detector_mark_motion (MatiDetector *self, gboolean in_motion);
+static gboolean decode_frame_watchdog (MatiDetector *self);
+static void mati_detector_schedule_reconnect (MatiDetector *self, const char *reason);
+static gboolean mati_detector_refresh_diagnostics (gpointer user_data);
+
+static guint
+mati_detector_timeout_add (MatiDetector *self,
+                           guint         interval,
+                           GSourceFunc   function)
+{
+    g_autoptr (GSource) source = g_timeout_source_new (interval);
+
+    g_source_set_callback (source, function, self, NULL);
+    return g_source_attach (source, self->context);
+}
+
+static guint
+mati_detector_timeout_add_seconds (MatiDetector *self,
+                                   guint         interval,
+                                   GSourceFunc   function)
+{
+    g_autoptr (GSource) source = g_timeout_source_new_seconds (interval);
+
+    g_source_set_callback (source, function, self, NULL);
+    return g_source_attach (source, self->context);
+}
+
+static guint
+mati_detector_idle_add (MatiDetector *self,
+                        GSourceFunc   function)
+{
+    g_autoptr (GSource) source = g_idle_source_new ();
+
+    g_source_set_callback (source, function, self, NULL);
+    return g_source_attach (source, self->context);
+}
+
+static void
+mati_detector_source_remove (MatiDetector *self,
+                             guint         source_id)
+{
+    GSource *source = g_main_context_find_source_by_id (self->context, source_id);
+
+    if (source != NULL)
+        g_source_destroy (source);
+}
+
+static gpointer
+mati_detector_thread_func (gpointer user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+
+    g_main_context_push_thread_default (self->context);
+    g_main_loop_run (self->loop);
+    g_main_context_pop_thread_default (self->context);
+
+    return NULL;
+}
 
 static void
 mati_detector_init (MatiDetector *self)
 {
+    self->context = g_main_context_new ();
+    self->loop = g_main_loop_new (self->context, FALSE);
+    self->thread = NULL;
+    self->bus_source = NULL;
     self->is_in_motion = FALSE;
+    self->recording_state = MATI_RECORDING_IDLE;
     self->file_sink_bin = NULL;
-    self->framerate = 0;
-    self->last_frame_buffer = 0;
+    self->recording_tee_pad = NULL;
+    self->finalizing_bins = NULL;
+    self->finalize_watchdog = 0;
+    self->recordings_started = 0;
+    self->recordings_finalized = 0;
+    self->input_stats = mati_stats_new ();
+    self->decoder_stats = mati_stats_new ();
+    self->decode_gate = NULL;
+    self->branches = g_ptr_array_new_with_free_func ((GDestroyNotify) mati_branch_free);
+    self->thread_policy = NULL;
+    self->decoder_threads = DEFAULT_DECODER_THREADS;
+    self->stats_interval = DEFAULT_STATS_INTERVAL;
+    self->stats_timeout = 0;
+    g_mutex_init (&self->diagnostics_lock);
+    self->diagnostics = g_strdup ("{}");
+    self->streamer_bin = NULL;
+    self->streamer_tee_pad = NULL;
+    self->streamer_source = NULL;
+    self->live_encoder = NULL;
+    self->input_profile = NULL;
+    self->streamer_replacing = FALSE;
+    self->live_mode = DEFAULT_LIVE_MODE;
+    self->passthrough_profiles = g_strsplit (DEFAULT_PASSTHROUGH_PROFILES, ",", -1);
+    self->n_consumers = 0;
+    self->streamer_detach_timeout = 0;
+    self->streamer_attaches = 0;
+    self->decode_idle_mode = DEFAULT_DECODE_IDLE_MODE;
+    self->decode_gate_threshold = DEFAULT_DECODE_GATE_THRESHOLD;
+    self->frame_watchdog = 0;
+    self->watchdog_start_time = 0;
+    self->frame_timeout_reached = FALSE;
     self->motion_stopped_timeout = 0;
     self->thumbnail_timeout = 0;
-    // self->frame_timeout = g_timeout_add (DECODE_FRAME_TIMEOUT, decode_frame_timeout, self);
+    self->export_jobs = 0;
+    self->export_dir = g_strdup (MATI_EXPORT_DIR);
+    self->preroll = NULL;
+    self->preroll_time = DEFAULT_PREROLL_TIME;
+    self->preroll_bytes = DEFAULT_PREROLL_BYTES;
+    self->postroll_time = DEFAULT_POSTROLL_TIME;
+    self->format = MATI_RECORDING_MATROSKA;
+    self->segment_time = 0;
+    self->segment_bytes = 0;
+    g_mutex_init (&self->recording_lock);
+    self->recording_location = NULL;
+    self->recording_start_time = 0;
+    self->motion_began = 0;
+    self->recording_segments = 0;
+    self->writer = NULL;
+    self->direct_io = FALSE;
+    self->sync_writes = FALSE;
+    self->ram_staging = FALSE;
+    self->retention = NULL;
+    self->http_server = NULL;
+    self->http_stream = NULL;
+    self->analysis_width = DEFAULT_ANALYSIS_WIDTH;
+    self->analysis_fps = DEFAULT_ANALYSIS_FPS;
+    self->thumbnailer = NULL;
+    self->thumbnail_width = DEFAULT_THUMBNAIL_WIDTH;
+    self->frame_ring = NULL;
+    self->frame_ring_width = 0;
+    self->frame_ring_rate = 0;
+    self->frame_ring_format = NULL;
+    self->uri = NULL;
+    self->common_bin = NULL;
+    self->reconnect_timeout = 0;
+    self->reconnect_delay = RECONNECT_MIN_DELAY;
+    self->reconnecting = FALSE;
+    self->reconnect_began = 0;
+    self->reconnect_attempts = 0;
+    self->reconnects = 0;
+    self->last_reconnect_time = 0;
+    self->fast_start = FALSE;
+    self->rtsp_transport = NULL;
+    self->steady_latency = FALSE;
+    self->cached_caps = NULL;
+    self->caps_from_cache = FALSE;
+    self->input_caps = NULL;
+    g_mutex_init (&self->caps_lock);
+    self->process_start = g_get_monotonic_time ();
+    self->build_time = 0;
+    self->sdp_time = 0;
+    self->connected_time = 0;
+    self->first_buffer_time = 0;
+    self->first_keyframe_time = 0;
+    self->first_frame_time = 0;
 }
 
 static void
@@ -93,6 +412,18 @@ mati_detector_finalize (GObject *object)
 
     g_return_if_fail (GST_IS_ELEMENT (self->pipeline));
 
+    if (self->thread != NULL)
+    {
+        g_main_loop_quit (self->loop);
+        g_thread_join (self->thread);
+        self->thread = NULL;
+    }
+    if (self->bus_source != NULL)
+    {
+        g_source_destroy (self->bus_source);
+        g_clear_pointer (&self->bus_source, g_source_unref);
+    }
+
     if (mati_detector_stop (self) != GST_STATE_CHANGE_SUCCESS)
     {
         g_critical ("Couldn't stop the pipeline, exiting...");
@@ -104,7 +435,33 @@ mati_detector_finalize (GObject *object)
         gst_clear_object (&self->pipeline);
     }
 
+    gst_clear_object (&self->streamer_tee_pad);
+    gst_clear_object (&self->recording_tee_pad);
+    for (GList *l = self->finalizing_bins; l != NULL; l = l->next)
+        gst_object_unref (((MatiFinalizingBin *) l->data)->bin);
+    g_list_free_full (self->finalizing_bins, g_free);
+    g_free (self->input_profile);
+    g_strfreev (self->passthrough_profiles);
+    g_free (self->frame_ring_format);
+    g_free (self->uri);
+    g_free (self->export_dir);
+    g_free (self->rtsp_transport);
+    g_free (self->cached_caps);
+    gst_clear_caps (&self->input_caps);
+    g_mutex_clear (&self->caps_lock);
+    g_free (self->recording_location);
+    gst_clear_object (&self->writer);
+    g_mutex_clear (&self->recording_lock);
     g_free (self->peer_id);
+    g_clear_pointer (&self->input_stats, mati_stats_free);
+    g_clear_pointer (&self->decoder_stats, mati_stats_free);
+    g_clear_pointer (&self->decode_gate, mati_decode_gate_free);
+    g_clear_pointer (&self->branches, g_ptr_array_unref);
+    g_clear_pointer (&self->thread_policy, mati_thread_policy_free);
+    g_mutex_clear (&self->diagnostics_lock);
+    g_free (self->diagnostics);
+    g_clear_pointer (&self->loop, g_main_loop_unref);
+    g_clear_pointer (&self->context, g_main_context_unref);
 
     G_OBJECT_CLASS (mati_detector_parent_class)->finalize (object);
 }
@@ -123,123 +480,228 @@ mati_detector_class_init (MatiDetectorClass *klass)
 }
 
 static void
-mati_detector_setup_filesink_pipeline (MatiDetector *self)
+mati_detector_set_recording_state (MatiDetector       *self,
+                                   MatiRecordingState  state)
 {
-    g_message ("Setting up filesink pipeline");
+    g_message ("recording %s -> %s", mati_recording_state_to_string (self->recording_state),
+               mati_recording_state_to_string (state));
+    self->recording_state = state;
+}
 
-    self->file_sink_bin = build_filesink (self);
-    gst_bin_add (GST_BIN (self->pipeline), self->file_sink_bin);
-    if (!gst_element_link (self->recording_tee, self->file_sink_bin))
-        g_critical ("Couldn't link filesink pipeline!");
+static gboolean
+mati_detector_recording_started (gpointer user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
 
-    gst_element_sync_state_with_parent (self->file_sink_bin);
+    if (self->recording_state == MATI_RECORDING_STARTING)
+        mati_detector_set_recording_state (self, MATI_RECORDING_RECORDING);
+
+    return G_SOURCE_REMOVE;
 }
 
-static gboolean
-sync_state_change (GstElement *element,
-                   GstState    state,
-                   char       *element_name)
+static GstPadProbeReturn
+first_recording_buffer_probe_cb (GstPad          *pad,
+                                 GstPadProbeInfo *info,
+                                 gpointer         user_data)
 {
-    switch (gst_element_set_state (element, state))
+    MatiDetector *self = MATI_DETECTOR (user_data);
+
+    mati_detector_idle_add (self, mati_detector_recording_started);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+/* Motion while draining continues the same recording, otherwise a new bin
+ * is linked to recording_tee and the pre-roll flushed into it. */
+static void
+mati_detector_start_recording (MatiDetector *self)
+{
+    g_autoptr (GstPad) sink_pad = NULL;
+    GstClockTime preroll_duration;
+    guint64 preroll_bytes;
+    guint preroll_keyframes;
+
+    switch (self->recording_state)
     {
-        case GST_STATE_CHANGE_SUCCESS:
-        {
-            GST_INFO ("%s state succesfully changed to playing!", element_name);
-            return TRUE;
-        }
-        case GST_STATE_CHANGE_ASYNC:
-        {
-            GST_INFO ("The state change of %s will happen asynchronously, waiting for state change.", element_name);
-            GstState current_state, pending;
-            GstStateChangeReturn res = gst_element_get_state (element, &current_state, &pending, GST_CLOCK_TIME_NONE);
-            if (res == GST_STATE_CHANGE_SUCCESS && state == current_state)
-            {
-                g_message ("state change successful!");
-                return TRUE;
-            }
-            return FALSE;
-        }
-        case GST_STATE_CHANGE_FAILURE:
-        {
-            GST_INFO ("Failed to change state of %s!!", element_name);
-            return FALSE;
-        }
-        case GST_STATE_CHANGE_NO_PREROLL:
+        case MATI_RECORDING_STARTING:
+        case MATI_RECORDING_RECORDING:
+            return;
+        case MATI_RECORDING_DRAINING:
         {
-            GST_INFO ("State change of %s succeeded, but element cannot produce data while paused", element_name);
-            return FALSE;
+            mati_detector_source_remove (self, self->motion_stopped_timeout);
+            self->motion_stopped_timeout = 0;
+            mati_detector_set_recording_state (self, MATI_RECORDING_RECORDING);
+            return;
         }
         default:
-            return FALSE;
+            break;
     }
+
+    /* Makes room in the background, the recording doesn't wait for it */
+    if (self->retention != NULL)
+        mati_retention_prune (self->retention);
+
+    mati_preroll_get_stats (MATI_PREROLL (self->preroll), &preroll_bytes, &preroll_duration, &preroll_keyframes);
+    g_mutex_lock (&self->recording_lock);
+    self->recording_start_time = g_get_real_time () - preroll_duration / GST_USECOND;
+    g_mutex_unlock (&self->recording_lock);
+
+    self->file_sink_bin = build_filesink (self);
+    /* Lets us see the EOS of this bin in on_pipeline_message() */
+    g_object_set (self->file_sink_bin, "message-forward", TRUE, NULL);
+    gst_bin_add (GST_BIN (self->pipeline), self->file_sink_bin);
+
+    self->recording_tee_pad = gst_element_request_pad_simple (self->recording_tee, "src_%u");
+    sink_pad = gst_element_get_static_pad (self->file_sink_bin, "videosink");
+    if (GST_PAD_LINK_FAILED (gst_pad_link (self->recording_tee_pad, sink_pad)))
+        g_critical ("Couldn't link filesink pipeline!");
+    gst_pad_add_probe (sink_pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+                       first_recording_buffer_probe_cb, self, NULL);
+
+    gst_element_sync_state_with_parent (self->file_sink_bin);
+    mati_detector_set_recording_state (self, MATI_RECORDING_STARTING);
+    mati_preroll_start (MATI_PREROLL (self->preroll));
 }
 
 static gboolean
-async_destroy_filesink (gpointer user_data)
+release_tee_pad (gpointer user_data)
+{
+    GstPad *pad = GST_PAD (user_data);
+    g_autoptr (GstElement) tee = gst_pad_get_parent_element (pad);
+
+    if (tee != NULL)
+        gst_element_release_request_pad (tee, pad);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Nothing is in flight on the tee pad, the EOS is the last thing the bin
+ * gets. Releasing the pad has to wait for the detector thread. */
+static GstPadProbeReturn
+on_recording_pad_idle (GstPad          *pad,
+                       GstPadProbeInfo *info,
+                       gpointer         user_data)
 {
     MatiDetector *self = MATI_DETECTOR (user_data);
-    sync_state_change (self->file_sink_bin, GST_STATE_NULL, "filesink bin");
-    gst_element_unlink (self->recording_tee, self->file_sink_bin);
-    if (!gst_bin_remove (GST_BIN (self->pipeline), self->file_sink_bin))
+    g_autoptr (GstPad) peer = gst_pad_get_peer (pad);
+    g_autoptr (GSource) source = g_idle_source_new ();
+
+    if (peer != NULL)
+    {
+        gst_pad_unlink (pad, peer);
+        gst_pad_send_event (peer, gst_event_new_eos ());
+    }
+
+    g_source_set_callback (source, release_tee_pad, gst_object_ref (pad), gst_object_unref);
+    g_source_attach (source, self->context);
+
+    return GST_PAD_PROBE_REMOVE;
+}
+
+static void
+remove_recording_bin_async (GstElement *bin,
+                            gpointer    user_data)
+{
+    g_autoptr (GstObject) parent = gst_object_get_parent (GST_OBJECT (bin));
+
+    gst_element_set_state (bin, GST_STATE_NULL);
+    if (parent != NULL && !gst_bin_remove (GST_BIN (parent), bin))
         g_critical ("Couldn't remove filesink bin from pipeline!");
-    self->file_sink_bin = NULL;
-    return FALSE;
 }
 
+/* Shutting a bin down waits for its streaming threads, which is never done
+ * on the detector thread */
 static void
-on_mux_queue_blocked (GstPad          *pad,
-                      GstPadProbeInfo *info,
-                      gpointer         user_data)
+mati_detector_remove_recording_bin (MatiDetector *self,
+                                    GstElement   *bin,
+                                    gboolean      timed_out)
+{
+    GList *link = NULL;
+
+    for (GList *l = self->finalizing_bins; l != NULL; l = l->next)
+    {
+        if (((MatiFinalizingBin *) l->data)->bin == bin)
+            link = l;
+    }
+    if (link == NULL)
+        return;
+
+    if (timed_out)
+        g_warning ("recording %s didn't finalize in time, removing it", GST_OBJECT_NAME (bin));
+    else
+        g_message ("recording %s %s", GST_OBJECT_NAME (bin), mati_recording_state_to_string (MATI_RECORDING_FINALIZED));
+
+    gst_element_call_async (bin, remove_recording_bin_async, NULL, NULL);
+    self->recordings_finalized++;
+
+    gst_object_unref (bin);
+    g_free (link->data);
+    self->finalizing_bins = g_list_delete_link (self->finalizing_bins, link);
+}
+
+static gboolean
+recording_finalize_watchdog (gpointer user_data)
 {
     MatiDetector *self = MATI_DETECTOR (user_data);
+    gint64 now = g_get_monotonic_time ();
+    GList *l = self->finalizing_bins;
 
-    if (gst_pad_is_blocked (pad))
-    {
-        g_autoptr (GstIterator) pad_iter = gst_element_iterate_sink_pads (self->mux);
-        GValue item = G_VALUE_INIT;
-        gboolean done = FALSE;
-        while (!done) {
-            switch (gst_iterator_next (pad_iter, &item)) {
-            case GST_ITERATOR_OK:
-                GstPad *sink_pad = g_value_get_object (&item);
-                GstEvent *eos_event = gst_event_new_eos ();
-                gst_pad_send_event (sink_pad, eos_event);
-                g_value_reset (&item);
-                break;
-            case GST_ITERATOR_RESYNC:
-                g_warning ("iterator resync");
-                gst_iterator_resync (pad_iter);
-                break;
-            case GST_ITERATOR_ERROR:
-                g_warning ("iterator error");
-                done = TRUE;
-                break;
-            case GST_ITERATOR_DONE:
-                done = TRUE;
-                break;
-            }
-        }
-        g_value_unset (&item);
-        g_idle_add (async_destroy_filesink, self);
+    while (l != NULL)
+    {
+        MatiFinalizingBin *finalizing = l->data;
 
-        return TRUE;
+        l = l->next;
+        if (now > finalizing->deadline)
+            mati_detector_remove_recording_bin (self, finalizing->bin, TRUE);
     }
+
+    if (self->finalizing_bins != NULL)
+        return G_SOURCE_CONTINUE;
+
+    self->finalize_watchdog = 0;
+    return G_SOURCE_REMOVE;
 }
 
+/* Post-roll is over, hands the bin over to be finalized and goes back to
+ * idle right away */
 static gboolean
-mati_detector_destroy_filesink_pipeline (gpointer user_data)
+mati_detector_finish_recording (gpointer user_data)
 {
     MatiDetector *self = MATI_DETECTOR (user_data);
+    MatiFinalizingBin *finalizing;
+    GstPad *tee_pad;
 
-    g_autoptr (GstPad) pad = gst_element_get_static_pad (self->mux_queue, "src");
-    self->block_pad_id = gst_pad_add_probe (pad,
-                                            GST_PAD_PROBE_TYPE_BLOCK_DOWNSTREAM,
-                                            on_mux_queue_blocked,
-                                            self, NULL);
     self->motion_stopped_timeout = 0;
+    if (self->recording_state != MATI_RECORDING_DRAINING)
+        return G_SOURCE_REMOVE;
+
+    /* Stop passing the live stream, the pre-roll keeps filling up */
+    mati_preroll_stop (MATI_PREROLL (self->preroll));
+
+    finalizing = g_new0 (MatiFinalizingBin, 1);
+    finalizing->bin = gst_object_ref (g_steal_pointer (&self->file_sink_bin));
+    finalizing->deadline = g_get_monotonic_time () + FINALIZE_TIMEOUT * G_TIME_SPAN_SECOND;
+    self->finalizing_bins = g_list_prepend (self->finalizing_bins, finalizing);
+    if (self->finalize_watchdog == 0)
+        self->finalize_watchdog = mati_detector_timeout_add_seconds (self, 1, recording_finalize_watchdog);
+
+    tee_pad = g_steal_pointer (&self->recording_tee_pad);
+    gst_pad_add_probe (tee_pad, GST_PAD_PROBE_TYPE_IDLE, on_recording_pad_idle, self, NULL);
+    gst_object_unref (tee_pad);
+
+    mati_detector_set_recording_state (self, MATI_RECORDING_IDLE);
     return G_SOURCE_REMOVE;
 }
 
+static void
+mati_detector_stop_recording (MatiDetector *self)
+{
+    if (self->recording_state != MATI_RECORDING_STARTING && self->recording_state != MATI_RECORDING_RECORDING)
+        return;
+
+    mati_detector_set_recording_state (self, MATI_RECORDING_DRAINING);
+    self->motion_stopped_timeout = mati_detector_timeout_add_seconds (self, self->postroll_time / GST_SECOND, mati_detector_finish_recording);
+}
+
 static gboolean
 on_pipeline_message (GstBus *bus, GstMessage *message, gpointer user_data)
 {
@@ -261,6 +723,10 @@ on_pipeline_message (GstBus *bus, GstMessage *message, gpointer user_data)
 
             gst_message_parse_error (message, &err, NULL);
             g_signal_emit (self, signals[PIPELINE_ERROR], 0, message->src, err->message);
+            /* Losing the camera is fixed by a new source, the rest of the
+             * pipeline keeps running */
+            if (self->common_bin != NULL && gst_object_has_as_ancestor (GST_MESSAGE_SRC (message), GST_OBJECT (self->common_bin)))
+                mati_detector_schedule_reconnect (self, err->message);
             break;
         }
         case GST_MESSAGE_STATE_CHANGED:
@@ -295,39 +761,44 @@ on_pipeline_message (GstBus *bus, GstMessage *message, gpointer user_data)
         }
         case GST_MESSAGE_ELEMENT:
         {
-            if ((GObject *) GST_MESSAGE_SRC (message) == (GObject *) self->motion)
+            const GstStructure *structure = gst_message_get_structure (message);
+
+            if ((GObject *) GST_MESSAGE_SRC (message) == (GObject *) self->motion
+                && gst_structure_has_name (structure, "motion"))
             {
+                gboolean motion_begin = gst_structure_has_field (structure, "motion_begin");
+
+                if (motion_begin == self->is_in_motion)
+                    break;
+
                 g_message ("motion %s!", self->is_in_motion ? "stopped" : "started");
-                self->is_in_motion = !self->is_in_motion;
+                self->is_in_motion = motion_begin;
+                mati_detector_mark_motion (self, motion_begin);
 
                 mati_communicator_emit_motion_event (self->communicator, self->is_in_motion);
+                mati_decode_gate_set_motion (self->decode_gate, self->is_in_motion);
 
                 if (self->is_in_motion)
-                {
-                    if (self->motion_stopped_timeout != 0)
-                    {
-                        g_message ("Removing motion stopped timeout");
-                        g_source_remove (self->motion_stopped_timeout);
-                        self->motion_stopped_timeout = 0;
-                    }
-                    else
-                    {
-                        g_message ("setting new filesink");
-                    mati_detector_setup_filesink_pipeline (self);
-                    }
-                }
+                    mati_detector_start_recording (self);
                 else
-                {
-                    if (self->motion_stopped_timeout != 0)
-                    {
-                        g_message ("Removing previous motion stopped timeout");
-                        g_source_remove (self->motion_stopped_timeout);
-                        self->motion_stopped_timeout = 0;
-                    }
-                    g_message ("setting new motion stopped timeout");
-                    self->motion_stopped_timeout = g_timeout_add_seconds (RECORDING_BUFFER / 1000000000, (GSourceFunc) mati_detector_destroy_filesink_pipeline, self);
-                }
+                    mati_detector_stop_recording (self);
+            }
+            else if (gst_structure_has_name (structure, "GstBinForwarded"))
+            {
+                g_autoptr (GstMessage) forwarded = NULL;
+
+                gst_structure_get (structure, "message", GST_TYPE_MESSAGE, &forwarded, NULL);
+                if (forwarded != NULL && GST_MESSAGE_TYPE (forwarded) == GST_MESSAGE_EOS)
+                    mati_detector_remove_recording_bin (self, GST_ELEMENT (GST_MESSAGE_SRC (message)), FALSE);
             }
+            break;
+        }
+        case GST_MESSAGE_LATENCY:
+        {
+            /* Posted when the jitterbuffer latency changes, e.g. once a fast
+             * start reached its steady latency */
+            gst_bin_recalculate_latency (GST_BIN (self->pipeline));
+            break;
         }
         default:
             break;
@@ -335,145 +806,758 @@ on_pipeline_message (GstBus *bus, GstMessage *message, gpointer user_data)
     return TRUE;
 }
 
-MatiDetector *
-mati_detector_new (MatiCommunicator *communicator,
-                   char             *source_id,
-                   char             *turnserver)
+void
+mati_detector_set_recording_options (MatiDetector *self,
+                                     guint64       preroll_time,
+                                     guint64       preroll_bytes,
+                                     guint64       postroll_time)
 {
-    g_autoptr (MatiDetector) self = g_object_new (MATI_TYPE_DETECTOR, NULL);
-    g_autoptr (GstBus) pipeline_bus = NULL;
+    g_return_if_fail (MATI_IS_DETECTOR (self));
 
-    self->source_id = source_id;
-    self->turnserver = turnserver;
-    self->pipeline = gst_pipeline_new ("mati");
-    if (self->pipeline == NULL)
-        return NULL;
-    
-    pipeline_bus = gst_element_get_bus (self->pipeline);
-    gst_bus_add_watch (pipeline_bus, on_pipeline_message, self);
+    self->preroll_time = preroll_time;
+    self->preroll_bytes = preroll_bytes;
+    self->postroll_time = MAX (postroll_time, GST_SECOND);
 
-    self->communicator = communicator;
-    self->peer_id = g_strdup ("no peer id yet");
+    if (self->preroll != NULL)
+        g_object_set (self->preroll,
+                      "preroll-time", self->preroll_time,
+                      "max-bytes", self->preroll_bytes,
+                      NULL);
 
-    return g_steal_pointer (&self);
+    g_message ("recording pre-roll %" GST_TIME_FORMAT " (max %" G_GUINT64_FORMAT " bytes), post-roll %" GST_TIME_FORMAT,
+               GST_TIME_ARGS (self->preroll_time), self->preroll_bytes, GST_TIME_ARGS (self->postroll_time));
 }
 
+/* Takes effect on the next recording */
 void
-mati_detector_start (MatiDetector *self)
+mati_detector_set_segment_options (MatiDetector        *self,
+                                   MatiRecordingFormat  format,
+                                   guint64              segment_time,
+                                   guint64              segment_bytes)
 {
-    g_message ("emiting state %d", MATI_STATE_PENDING);
-    mati_communicator_emit_state_changed (self->communicator, MATI_STATE_PENDING);
-    gboolean change_success = FALSE;
-
     g_return_if_fail (MATI_IS_DETECTOR (self));
-    g_return_if_fail (GST_IS_ELEMENT (self->pipeline));
 
-    GST_INFO ("Setting pipeline to playing state...");
-
-    switch (gst_element_set_state (self->pipeline, GST_STATE_PLAYING))
-    {
-        case GST_STATE_CHANGE_SUCCESS:
-        {
-            mati_communicator_emit_state_changed (self->communicator, MATI_STATE_PLAYING);
-            GST_INFO ("Pipeline state succesfully changed to playing!");
-            change_success = TRUE;
-            break;
-        }
-        case GST_STATE_CHANGE_ASYNC:
-        {
-            GST_INFO ("The state change will happen asynchronously");
-            change_success = TRUE;
-            break;
-        }
-        case GST_STATE_CHANGE_FAILURE:
-        {
-            GST_INFO ("Failed to change state to playing!!");
-            break;
-        }
-        case GST_STATE_CHANGE_NO_PREROLL:
-        {
-            GST_INFO ("State change succeeded, but element cannot produce data while paused");
-            break;
-        }
-        default:
-            break;
-    }
-    if (change_success)
-        g_signal_emit (self, signals[MATI_PENDING], 0);
+    self->format = format;
+    self->segment_time = segment_time;
+    self->segment_bytes = segment_bytes;
 }
 
-GstStateChangeReturn
-mati_detector_stop (MatiDetector *self)
+/* Takes effect on the next recording */
+void
+mati_detector_set_writer_options (MatiDetector *self,
+                                  gboolean      direct_io,
+                                  gboolean      sync_writes,
+                                  gboolean      ram_staging)
 {
-    g_autoptr (GstBus) bus = NULL;
-    GstMessage *message = NULL;
-    GstStateChangeReturn ret = GST_STATE_CHANGE_SUCCESS;
-
-    g_message ("Stopping the pipeline...");
-    g_return_val_if_fail (GST_IS_BIN (self->pipeline), GST_STATE_CHANGE_FAILURE);
-
-    bus = gst_element_get_bus (GST_ELEMENT_CAST (self->pipeline));
-    g_return_val_if_fail (GST_IS_BUS (bus), GST_STATE_CHANGE_FAILURE);
-
-    message = gst_message_new_warning (GST_OBJECT (self->pipeline), NULL, "pipeline interrupted");
-    gst_bus_post (bus, message);
+    g_return_if_fail (MATI_IS_DETECTOR (self));
 
-    g_message ("Setting pipeline to NULL...");
+    self->direct_io = direct_io;
+    self->sync_writes = sync_writes;
+    self->ram_staging = ram_staging;
+}
 
-    ret = gst_element_set_state (GST_ELEMENT (self->pipeline), GST_STATE_NULL);
+/* Has to outlive the detector */
+void
+mati_detector_set_retention (MatiDetector  *self,
+                             MatiRetention *retention)
+{
+    g_return_if_fail (MATI_IS_DETECTOR (self));
 
-    if (ret == GST_STATE_CHANGE_FAILURE)
-    {
-        g_critical ("Failed to set pipeline to NULL!");
-    }
-    else if (ret == GST_STATE_CHANGE_ASYNC)
-    {
-        g_message ("Waiting for pipeline to become NULL...");
-        ret = gst_element_get_state (GST_ELEMENT_CAST (self->pipeline), NULL, NULL, GST_SECOND);
-        if (ret == GST_STATE_CHANGE_FAILURE)
-        {
-            g_critical ("Failed to set pipeline to NULL!");
-        }
-        else if (ret == GST_STATE_CHANGE_ASYNC)
-        {
-            g_critical ("Failed to set pipeline to NULL within timeout!");
-        }
-    }
-    return ret;
+    self->retention = retention;
 }
 
-static gboolean
-dump_dot (MatiDetector *self)
+void
+mati_detector_set_export_options (MatiDetector *self,
+                                  const gchar  *export_dir)
 {
-    g_message ("dumping dot");
-    GST_DEBUG_BIN_TO_DOT_FILE (GST_BIN (self->pipeline), GST_DEBUG_GRAPH_SHOW_ALL, "pipeline");
-    return TRUE;
+    g_return_if_fail (MATI_IS_DETECTOR (self));
+
+    g_free (self->export_dir);
+    self->export_dir = g_strdup (export_dir);
+}
+
+/* Only takes effect on the next mati_detector_build() */
+void
+mati_detector_set_http_server (MatiDetector   *self,
+                               MatiHttpServer *http_server)
+{
+    g_return_if_fail (MATI_IS_DETECTOR (self));
+
+    self->http_server = http_server;
+}
+
+/* Only takes effect on the next mati_detector_build() */
+void
+mati_detector_set_analysis_options (MatiDetector *self,
+                                    gint          analysis_width,
+                                    gint          analysis_fps)
+{
+    g_return_if_fail (MATI_IS_DETECTOR (self));
+    g_return_if_fail (analysis_width > 0 && analysis_fps > 0);
+
+    self->analysis_width = analysis_width;
+    self->analysis_fps = analysis_fps;
+}
+
+/* Only takes effect on the next mati_detector_build() */
+void
+mati_detector_set_thumbnail_options (MatiDetector *self,
+                                     guint         thumbnail_width)
+{
+    g_return_if_fail (MATI_IS_DETECTOR (self));
+    g_return_if_fail (thumbnail_width > 0);
+
+    self->thumbnail_width = thumbnail_width;
+}
+
+/* Only takes effect on the next mati_detector_build(). A max_rate of 0
+ * leaves the frame ring out, a width of 0 keeps the decoded size. */
+void
+mati_detector_set_frame_ring_options (MatiDetector *self,
+                                      guint         width,
+                                      gint          max_rate,
+                                      const gchar  *format)
+{
+    g_return_if_fail (MATI_IS_DETECTOR (self));
+
+    self->frame_ring_width = width;
+    self->frame_ring_rate = max_rate;
+    g_free (self->frame_ring_format);
+    self->frame_ring_format = g_strdup (format);
+}
+
+/* Only takes effect on the next mati_detector_build(). Startup timings
+ * are measured from process_start, a NULL transport lets rtspsrc try UDP
+ * before TCP. */
+void
+mati_detector_set_startup_options (MatiDetector *self,
+                                   gint64        process_start,
+                                   gboolean      fast_start,
+                                   const gchar  *rtsp_transport)
+{
+    g_return_if_fail (MATI_IS_DETECTOR (self));
+
+    self->process_start = process_start;
+    self->fast_start = fast_start;
+    g_free (self->rtsp_transport);
+    self->rtsp_transport = g_strdup (rtsp_transport);
+}
+
+/* Only takes effect on the next mati_detector_build(). NULL profiles keep
+ * the default ones. */
+void
+mati_detector_set_live_options (MatiDetector  *self,
+                                MatiLiveMode   live_mode,
+                                gchar        **passthrough_profiles)
+{
+    g_return_if_fail (MATI_IS_DETECTOR (self));
+
+    self->live_mode = live_mode;
+    if (passthrough_profiles != NULL)
+    {
+        g_strfreev (self->passthrough_profiles);
+        self->passthrough_profiles = g_strdupv (passthrough_profiles);
+    }
+}
+
+/* Only takes effect on the next mati_detector_build(). A threshold of 0
+ * only leaves the idle mode on motion. */
+void
+mati_detector_set_decoder_options (MatiDetector       *self,
+                                   MatiDecodeIdleMode  idle_mode,
+                                   gdouble             decode_gate_threshold)
+{
+    g_return_if_fail (MATI_IS_DETECTOR (self));
+
+    self->decode_idle_mode = idle_mode;
+    self->decode_gate_threshold = decode_gate_threshold;
+}
+
+/* Rules were validated with the options */
+void
+mati_detector_set_thread_options (MatiDetector  *self,
+                                  guint          decoder_threads,
+                                  gchar        **thread_rules)
+{
+    g_return_if_fail (MATI_IS_DETECTOR (self));
+
+    self->decoder_threads = decoder_threads;
+    for (guint i = 0; thread_rules != NULL && thread_rules[i] != NULL; i++)
+    {
+        g_autoptr (GError) error = NULL;
+
+        if (!mati_thread_policy_set_rule (self->thread_policy, thread_rules[i], &error))
+            g_critical ("Ignoring thread rule: %s", error->message);
+    }
+}
+
+void
+mati_detector_set_diagnostics_options (MatiDetector *self,
+                                       guint         stats_interval)
+{
+    g_return_if_fail (MATI_IS_DETECTOR (self));
+
+    self->stats_interval = stats_interval;
+}
+
+typedef struct
+{
+    MatiDetector *detector;
+    MatiDbus *obj;
+    GDBusMethodInvocation *invoc;
+    guint64 preroll_time;
+    guint64 preroll_bytes;
+    guint64 postroll_time;
+} MatiRecordingConfig;
+
+static void
+mati_recording_config_free (MatiRecordingConfig *config)
+{
+    g_object_unref (config->obj);
+    g_clear_object (&config->invoc);
+    g_free (config);
+}
+
+/* Runs on the detector thread, like everything else that touches the
+ * recording state, and only answers once the change is in effect */
+static gboolean
+mati_detector_apply_recording_config (gpointer user_data)
+{
+    MatiRecordingConfig *config = user_data;
+
+    mati_detector_set_recording_options (config->detector,
+                                         config->preroll_time,
+                                         config->preroll_bytes,
+                                         config->postroll_time);
+    mati_dbus__complete_configure_recording (config->obj, g_steal_pointer (&config->invoc));
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+handle_configure_recording (MatiDbus              *obj,
+                            GDBusMethodInvocation *invoc,
+                            guint64                preroll_time,
+                            guint64                preroll_bytes,
+                            guint64                postroll_time,
+                            gpointer               user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    MatiRecordingConfig *config;
+
+    /* Milliseconds are turned into nanoseconds, the pre-roll queue takes
+     * twice the bytes as a guint */
+    if (preroll_time > MAX_RECORDING_ROLL_TIME || postroll_time > MAX_RECORDING_ROLL_TIME
+        || preroll_bytes > G_MAXUINT / 2)
+    {
+        g_dbus_method_invocation_return_error (invoc, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                               "Pre- and post-roll take at most %" G_GUINT64_FORMAT " ms, the pre-roll at most %u bytes",
+                                               MAX_RECORDING_ROLL_TIME, G_MAXUINT / 2);
+        return TRUE;
+    }
+
+    config = g_new0 (MatiRecordingConfig, 1);
+    config->detector = self;
+    config->obj = g_object_ref (obj);
+    config->invoc = invoc; // completing it gives up the reference
+    config->preroll_time = preroll_time * GST_MSECOND;
+    config->preroll_bytes = preroll_bytes;
+    config->postroll_time = postroll_time * GST_MSECOND;
+    g_main_context_invoke_full (self->context, G_PRIORITY_DEFAULT, mati_detector_apply_recording_config,
+                                config, (GDestroyNotify) mati_recording_config_free);
+    return TRUE;
+}
+
+typedef struct
+{
+    gint64 from;
+    gint64 to;
+    GPtrArray *locations; // oldest first
+} MatiRangeQuery;
+
+static void
+mati_range_query_free (MatiRangeQuery *query)
+{
+    g_ptr_array_unref (query->locations);
+    g_free (query);
+}
+
+/* Runs on a GTask thread, mapping one index per recording must not hold
+ * up the D-Bus API of every camera */
+static void
+lookup_range_thread (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+    MatiRangeQuery *query = task_data;
+    GVariantBuilder recordings, motion;
+
+    g_variant_builder_init (&recordings, G_VARIANT_TYPE ("a(sxxxt)"));
+    g_variant_builder_init (&motion, G_VARIANT_TYPE ("a(xx)"));
+
+    for (guint i = 0; i < query->locations->len; i++)
+    {
+        const char *location = g_ptr_array_index (query->locations, i);
+        MatiIndexLookup lookup;
+        gboolean after_range;
+
+        if (!mati_index_lookup (location, query->from, &lookup))
+            continue;
+
+        after_range = lookup.start > query->to;
+        if (!after_range)
+        {
+            g_variant_builder_add (&recordings, "(sxxxt)", location, lookup.start, lookup.end,
+                                   lookup.seek_time, lookup.seek_offset);
+            for (guint j = 0; j < lookup.motion->len; j++)
+            {
+                MatiIndexInterval *interval = &g_array_index (lookup.motion, MatiIndexInterval, j);
+
+                if (interval->start <= query->to && interval->end >= query->from)
+                    g_variant_builder_add (&motion, "(xx)", interval->start, interval->end);
+            }
+        }
+        g_array_unref (lookup.motion);
+
+        /* Oldest first, every later recording starts after this one */
+        if (after_range)
+            break;
+    }
+
+    g_task_return_pointer (task,
+                           g_variant_ref_sink (g_variant_new ("(@a(sxxxt)@a(xx))",
+                                                              g_variant_builder_end (&recordings),
+                                                              g_variant_builder_end (&motion))),
+                           (GDestroyNotify) g_variant_unref);
+}
+
+static void
+lookup_range_done (GObject      *source_object,
+                   GAsyncResult *result,
+                   gpointer      user_data)
+{
+    GDBusMethodInvocation *invoc = user_data;
+    g_autoptr (GVariant) ranges = g_task_propagate_pointer (G_TASK (result), NULL);
+    g_autoptr (GVariant) recordings = g_variant_get_child_value (ranges, 0);
+    g_autoptr (GVariant) motion = g_variant_get_child_value (ranges, 1);
+
+    mati_dbus__complete_lookup_range (MATI_DBUS (source_object), invoc, recordings, motion);
+}
+
+/* Recordings overlapping from..to, wall-clock in microseconds, with the
+ * keyframe to seek to for from, answered from the sidecar indexes */
+static gboolean
+handle_lookup_range (MatiDbus              *obj,
+                     GDBusMethodInvocation *invoc,
+                     gint64                 from,
+                     gint64                 to,
+                     gpointer               user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    MatiRangeQuery *query = g_new0 (MatiRangeQuery, 1);
+    g_autoptr (GTask) task = g_task_new (obj, NULL, lookup_range_done, invoc);
+
+    query->from = from;
+    query->to = to;
+    if (self->retention != NULL)
+        query->locations = mati_retention_list_files (self->retention, self->source_id, from / G_USEC_PER_SEC);
+    else
+        query->locations = g_ptr_array_new_with_free_func (g_free);
+
+    g_task_set_task_data (task, query, (GDestroyNotify) mati_range_query_free);
+    g_task_run_in_thread (task, lookup_range_thread);
+    return TRUE;
+}
+
+/* The cached thumbnail in a sealed memfd, nothing is read from disk */
+static gboolean
+handle_get_thumbnail (MatiDbus              *obj,
+                      GDBusMethodInvocation *invoc,
+                      GUnixFDList           *fd_list,
+                      gpointer               user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    g_autoptr (GUnixFDList) out_fd_list = NULL;
+    g_autoptr (GError) error = NULL;
+    gint fd;
+
+    if (self->thumbnailer == NULL)
+    {
+        g_dbus_method_invocation_return_error (invoc, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "No thumbnail yet");
+        return TRUE;
+    }
+
+    fd = mati_thumbnailer_get_fd (MATI_THUMBNAILER (self->thumbnailer), &error);
+    if (fd < 0)
+    {
+        g_dbus_method_invocation_return_error (invoc, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "%s", error->message);
+        return TRUE;
+    }
+
+    out_fd_list = g_unix_fd_list_new_from_array (&fd, 1);
+    mati_dbus__complete_get_thumbnail (obj, invoc, out_fd_list, g_variant_new_handle (0));
+    return TRUE;
+}
+
+/* A read-only memfd of the shared frame ring, see mati-frame-ring.h */
+static gboolean
+handle_get_frame_ring (MatiDbus              *obj,
+                       GDBusMethodInvocation *invoc,
+                       GUnixFDList           *fd_list,
+                       gpointer               user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    g_autoptr (GUnixFDList) out_fd_list = NULL;
+    g_autoptr (GError) error = NULL;
+    gint fd;
+
+    if (self->frame_ring == NULL)
+    {
+        g_dbus_method_invocation_return_error (invoc, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+                                               "Frame ring is disabled");
+        return TRUE;
+    }
+
+    fd = mati_frame_ring_get_fd (MATI_FRAME_RING (self->frame_ring), &error);
+    if (fd < 0)
+    {
+        g_dbus_method_invocation_return_error (invoc, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "%s", error->message);
+        return TRUE;
+    }
+
+    out_fd_list = g_unix_fd_list_new_from_array (&fd, 1);
+    mati_dbus__complete_get_frame_ring (obj, invoc, out_fd_list, g_variant_new_handle (0));
+    return TRUE;
+}
+
+static void
+export_progress_cb (guint    job,
+                    gdouble  progress,
+                    gpointer user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+
+    mati_communicator_emit_export_progress (self->communicator, job, progress);
+}
+
+static void
+export_finished_cb (guint       job,
+                    gboolean    success,
+                    const char *message,
+                    gpointer    user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+
+    mati_communicator_emit_export_finished (self->communicator, job, success, message);
+}
+
+/* A plain file name, the export directory is the only place clips go */
+static gboolean
+is_export_name (const char *name)
+{
+    return name[0] != '\0' && name[0] != '.' && strchr (name, '/') == NULL
+           && (g_str_has_suffix (name, ".mp4") || g_str_has_suffix (name, ".mkv"));
+}
+
+/* Hands the recordings overlapping the range and a copy of the pre-roll to
+ * an export running on its own thread */
+static gboolean
+handle_export_clip (MatiDbus              *obj,
+                    GDBusMethodInvocation *invoc,
+                    gint64                 from,
+                    gint64                 to,
+                    const char            *location,
+                    gpointer               user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    g_autoptr (GPtrArray) locations = NULL;
+    g_autoptr (GstClock) clock = NULL;
+    g_autofree gchar *path = NULL;
+    MatiExport *export;
+    guint job;
+
+    if (to <= from || !is_export_name (location))
+    {
+        g_dbus_method_invocation_return_error (invoc, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                               "Needs a range and a .mp4 or .mkv file name without directories");
+        return TRUE;
+    }
+
+    /* The export creates the file exclusively and without following
+     * symlinks, this only answers early */
+    path = g_build_filename (self->export_dir, location, NULL);
+    if (g_file_test (path, G_FILE_TEST_EXISTS | G_FILE_TEST_IS_SYMLINK))
+    {
+        g_dbus_method_invocation_return_error (invoc, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                               "%s already exists", location);
+        return TRUE;
+    }
+
+    job = ++self->export_jobs;
+    export = mati_export_new (job, from, to, path);
+
+    if (self->retention != NULL)
+        locations = mati_retention_list_files (self->retention, self->source_id, from / G_USEC_PER_SEC);
+    /* Their indexes are only read on the export thread */
+    for (guint i = 0; locations != NULL && i < locations->len; i++)
+        mati_export_add_recording (export, g_ptr_array_index (locations, i));
+
+    /* Pre-roll timestamps are running time of the pipeline */
+    clock = gst_element_get_clock (self->pipeline);
+    if (clock != NULL && self->preroll != NULL)
+    {
+        GstClockTime running_time = gst_clock_get_time (clock) - gst_element_get_base_time (self->pipeline);
+        GstCaps *caps = NULL;
+        GstBufferList *buffers = mati_preroll_snapshot (MATI_PREROLL (self->preroll), &caps);
+
+        if (caps != NULL)
+            mati_export_add_preroll (export, buffers, caps, g_get_real_time () - running_time / GST_USECOND);
+        else
+            gst_buffer_list_unref (buffers);
+    }
+
+    g_message ("exporting job %u to %s", job, path);
+    mati_export_run (export, export_progress_cb, export_finished_cb, g_object_ref (self), g_object_unref);
+
+    mati_dbus__complete_export_clip (obj, invoc, job);
+    return TRUE;
+}
+
+MatiDetector *
+mati_detector_new (MatiCommunicator *communicator,
+                   char             *source_id,
+                   char             *turnserver)
+{
+    g_autoptr (MatiDetector) self = g_object_new (MATI_TYPE_DETECTOR, NULL);
+    g_autoptr (GstBus) pipeline_bus = NULL;
+    g_autofree char *name = g_strconcat ("mati-", source_id, NULL);
+
+    self->source_id = source_id;
+    self->turnserver = turnserver;
+    self->pipeline = gst_pipeline_new (name);
+    if (self->pipeline == NULL)
+        return NULL;
+    
+    pipeline_bus = gst_element_get_bus (self->pipeline);
+    self->thread_policy = mati_thread_policy_new (source_id);
+    mati_thread_policy_add_branch (self->thread_policy, "commonbin", MATI_THREAD_INPUT, "in");
+    mati_thread_policy_add_branch (self->thread_policy, "decoder", MATI_THREAD_DECODE, "dec");
+    mati_thread_policy_add_branch (self->thread_policy, "analysis", MATI_THREAD_ANALYSIS, "ana");
+    mati_thread_policy_add_branch (self->thread_policy, "streamer", MATI_THREAD_ENCODE, "live");
+    mati_thread_policy_add_branch (self->thread_policy, "thumbnailer", MATI_THREAD_ENCODE, "thumb");
+    mati_thread_policy_add_branch (self->thread_policy, "httpstream", MATI_THREAD_ENCODE, "http");
+    mati_thread_policy_add_branch (self->thread_policy, "framering", MATI_THREAD_ENCODE, "ring");
+    mati_thread_policy_add_branch (self->thread_policy, "recording", MATI_THREAD_IO, "rec");
+    mati_thread_policy_add_branch (self->thread_policy, "filesinkbin", MATI_THREAD_IO, "file");
+    mati_thread_policy_attach (self->thread_policy, pipeline_bus);
+    self->bus_source = gst_bus_create_watch (pipeline_bus);
+    g_source_set_callback (self->bus_source, (GSourceFunc) on_pipeline_message, self, NULL);
+    g_source_attach (self->bus_source, self->context);
+
+    self->thread = g_thread_new (name, mati_detector_thread_func, self);
+
+    self->communicator = communicator;
+    self->peer_id = g_strdup ("no peer id yet");
+    g_signal_connect_object (communicator, "handle-configure-recording", G_CALLBACK (handle_configure_recording), self, 0);
+    g_signal_connect_object (communicator, "handle-lookup-range", G_CALLBACK (handle_lookup_range), self, 0);
+    g_signal_connect_object (communicator, "handle-export-clip", G_CALLBACK (handle_export_clip), self, 0);
+    g_signal_connect_object (communicator, "handle-get-thumbnail", G_CALLBACK (handle_get_thumbnail), self, 0);
+    g_signal_connect_object (communicator, "handle-get-frame-ring", G_CALLBACK (handle_get_frame_ring), self, 0);
+
+    return g_steal_pointer (&self);
+}
+
+void
+mati_detector_start (MatiDetector *self)
+{
+    g_message ("emiting state %d", MATI_STATE_PENDING);
+    mati_communicator_emit_state_changed (self->communicator, MATI_STATE_PENDING);
+    gboolean change_success = FALSE;
+
+    g_return_if_fail (MATI_IS_DETECTOR (self));
+    g_return_if_fail (GST_IS_ELEMENT (self->pipeline));
+
+    GST_INFO ("Setting pipeline to playing state...");
+
+    switch (gst_element_set_state (self->pipeline, GST_STATE_PLAYING))
+    {
+        case GST_STATE_CHANGE_SUCCESS:
+        {
+            mati_communicator_emit_state_changed (self->communicator, MATI_STATE_PLAYING);
+            GST_INFO ("Pipeline state succesfully changed to playing!");
+            change_success = TRUE;
+            break;
+        }
+        case GST_STATE_CHANGE_ASYNC:
+        {
+            GST_INFO ("The state change will happen asynchronously");
+            change_success = TRUE;
+            break;
+        }
+        case GST_STATE_CHANGE_FAILURE:
+        {
+            GST_INFO ("Failed to change state to playing!!");
+            break;
+        }
+        case GST_STATE_CHANGE_NO_PREROLL:
+        {
+            GST_INFO ("State change succeeded, but element cannot produce data while paused");
+            break;
+        }
+        default:
+            break;
+    }
+    if (change_success)
+    {
+        if (self->frame_watchdog == 0)
+        {
+            self->watchdog_start_time = g_get_monotonic_time ();
+            self->frame_watchdog = mati_detector_timeout_add_seconds (self, FRAME_WATCHDOG_INTERVAL, (GSourceFunc) decode_frame_watchdog);
+        }
+        if (self->stats_timeout == 0)
+        {
+            mati_detector_idle_add (self, mati_detector_refresh_diagnostics);
+            self->stats_timeout = mati_detector_timeout_add_seconds (self, self->stats_interval, mati_detector_refresh_diagnostics);
+        }
+        g_signal_emit (self, signals[MATI_PENDING], 0);
+    }
+}
+
+GstStateChangeReturn
+mati_detector_stop (MatiDetector *self)
+{
+    g_autoptr (GstBus) bus = NULL;
+    GstMessage *message = NULL;
+    GstStateChangeReturn ret = GST_STATE_CHANGE_SUCCESS;
+
+    g_message ("Stopping the pipeline...");
+    g_return_val_if_fail (GST_IS_BIN (self->pipeline), GST_STATE_CHANGE_FAILURE);
+
+    bus = gst_element_get_bus (GST_ELEMENT_CAST (self->pipeline));
+    g_return_val_if_fail (GST_IS_BUS (bus), GST_STATE_CHANGE_FAILURE);
+
+    message = gst_message_new_warning (GST_OBJECT (self->pipeline), NULL, "pipeline interrupted");
+    gst_bus_post (bus, message);
+
+    g_message ("Setting pipeline to NULL...");
+
+    ret = gst_element_set_state (GST_ELEMENT (self->pipeline), GST_STATE_NULL);
+
+    if (ret == GST_STATE_CHANGE_FAILURE)
+    {
+        g_critical ("Failed to set pipeline to NULL!");
+    }
+    else if (ret == GST_STATE_CHANGE_ASYNC)
+    {
+        g_message ("Waiting for pipeline to become NULL...");
+        ret = gst_element_get_state (GST_ELEMENT_CAST (self->pipeline), NULL, NULL, GST_SECOND);
+        if (ret == GST_STATE_CHANGE_FAILURE)
+        {
+            g_critical ("Failed to set pipeline to NULL!");
+        }
+        else if (ret == GST_STATE_CHANGE_ASYNC)
+        {
+            g_critical ("Failed to set pipeline to NULL within timeout!");
+        }
+    }
+    return ret;
 }
 
 static gboolean
-decode_frame_timeout (MatiDetector *self)
+dump_dot (MatiDetector *self)
 {
-    g_critical ("Frame timeout reached!");
-    mati_communicator_emit_state_changed (self->communicator, MATI_STATE_STOPPED);
-    return FALSE;
+    g_message ("dumping dot");
+    GST_DEBUG_BIN_TO_DOT_FILE (GST_BIN (self->pipeline), GST_DEBUG_GRAPH_SHOW_ALL, "pipeline");
+    return TRUE;
 }
 
-static GstPadProbeReturn
-decode_frame_probe_cb (GstPad          *pad,
-                       GstPadProbeInfo *info,
-                       gpointer         user_data)
+/* The short fast start jitterbuffer has done its job once frames flow, the
+ * default one rides out network hiccups better. rtpbin hands the new
+ * latency on to its jitterbuffers, the latency message they post makes
+ * on_pipeline_message() redistribute it. */
+static void
+mati_detector_set_steady_latency (MatiDetector *self)
 {
-    MatiDetector *self = MATI_DETECTOR (user_data);
+    g_autoptr (GstElement) rtspsrc = gst_bin_get_by_name (GST_BIN (self->pipeline), RTSPSRC_NAME);
+    g_autoptr (GstElement) manager = NULL;
 
-    gint64 previous_frame_buffer = self->last_frame_buffer;
-    self->last_frame_buffer = g_get_monotonic_time ();
-    self->framerate = 1 / ((double) (self->last_frame_buffer - previous_frame_buffer) / 1000000);
+    self->steady_latency = TRUE;
+    if (rtspsrc == NULL)
+        return;
 
-    if (self->frame_timeout > 0)
-    g_source_remove (self->frame_timeout);
-    self->frame_timeout = g_timeout_add (DECODE_FRAME_TIMEOUT, decode_frame_timeout, self);
+    g_object_set (rtspsrc, "latency", STEADY_LATENCY, NULL);
+    manager = gst_bin_get_by_name (GST_BIN (rtspsrc), "manager");
+    if (manager != NULL)
+        g_object_set (manager, "latency", STEADY_LATENCY, NULL);
+    g_message ("camera %s reached steady state, latency is now %u ms", self->source_id, STEADY_LATENCY);
+}
 
-    return GST_PAD_PROBE_OK;
+/* Startup times are stamped on streaming threads and read on the detector
+ * thread, only the first stamp counts */
+static void
+startup_time_stamp (gint64 *time)
+{
+    gint64 unset = 0;
+
+    __atomic_compare_exchange_n (time, &unset, g_get_monotonic_time (), FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static gint64
+startup_time_get (gint64 *time)
+{
+    return __atomic_load_n (time, __ATOMIC_RELAXED);
+}
+
+/* Runs on the detector thread, replaces rearming a timeout for every frame */
+static gboolean
+decode_frame_watchdog (MatiDetector *self)
+{
+    MatiStatsSnapshot snapshot;
+    gint64 last_frame_time, first_frame_time;
+
+    /* With the decode gate closed only some frames get decoded, so watch
+     * the encoded input instead */
+    if (self->decode_gate != NULL && !mati_decode_gate_is_open (self->decode_gate))
+        mati_stats_snapshot (self->input_stats, &snapshot);
+    else
+        mati_stats_snapshot (self->decoder_stats, &snapshot);
+    /* The start time moves with every reconnect attempt, each gets the
+     * full timeout */
+    last_frame_time = MAX (snapshot.last_frame_time, self->watchdog_start_time);
+
+    if (g_get_monotonic_time () - last_frame_time > DECODE_FRAME_TIMEOUT * G_TIME_SPAN_MILLISECOND)
+    {
+        if (!self->frame_timeout_reached)
+        {
+            g_critical ("Frame timeout reached!");
+            mati_communicator_emit_state_changed (self->communicator, MATI_STATE_STOPPED);
+            self->frame_timeout_reached = TRUE;
+        }
+        mati_detector_schedule_reconnect (self, "frame timeout");
+    }
+    else if (self->frame_timeout_reached)
+    {
+        g_message ("Frames are being decoded again");
+        self->frame_timeout_reached = FALSE;
+    }
+
+    mati_stats_snapshot (self->input_stats, &snapshot);
+    first_frame_time = startup_time_get (&self->first_frame_time);
+    if (self->fast_start && !self->steady_latency && first_frame_time != 0
+        && g_get_monotonic_time () - first_frame_time > STEADY_STATE_DELAY * G_TIME_SPAN_SECOND)
+        mati_detector_set_steady_latency (self);
+
+    if (self->reconnecting && snapshot.last_frame_time > self->watchdog_start_time)
+    {
+        self->last_reconnect_time = (g_get_monotonic_time () - self->reconnect_began) / 1000.0;
+        self->reconnecting = FALSE;
+        self->reconnect_delay = RECONNECT_MIN_DELAY;
+        self->reconnects++;
+        g_message ("camera %s is back after %.0f ms", self->source_id, self->last_reconnect_time);
+        mati_communicator_emit_state_changed (self->communicator, MATI_STATE_PLAYING);
+    }
+
+    return G_SOURCE_CONTINUE;
 }
 
 static void
@@ -486,6 +1570,8 @@ pad_added_handler (GstElement *src, GstPad *new_pad, MatiDetector *self)
     const gchar *new_pad_type = NULL;
 
     g_message ("Received new pad '%s' from '%s':\n", GST_PAD_NAME (new_pad), GST_ELEMENT_NAME (src));
+    if (self->connected_time == 0)
+        self->connected_time = g_get_monotonic_time ();
 
     new_pad_caps = gst_pad_get_current_caps (new_pad);
     new_pad_struct = gst_caps_get_structure (new_pad_caps, 0);
@@ -524,6 +1610,100 @@ peer_id_handler (GstElement   *signaller,
     self->peer_id = g_strdup (peer_id);
 }
 
+static void
+mati_detector_attach_streamer (MatiDetector *self)
+{
+    g_autoptr (GstPad) sink_pad = NULL;
+
+    if (self->streamer_tee_pad != NULL)
+        return;
+
+    self->streamer_tee_pad = gst_element_request_pad_simple (self->streamer_source, "src_%u");
+    sink_pad = gst_element_get_static_pad (self->streamer_bin, "videosink");
+    if (GST_PAD_LINK_FAILED (gst_pad_link (self->streamer_tee_pad, sink_pad)))
+    {
+        g_critical ("Couldn't link decoder pipeline to streamer bin!");
+        gst_element_release_request_pad (self->streamer_source, self->streamer_tee_pad);
+        gst_clear_object (&self->streamer_tee_pad);
+        return;
+    }
+
+    self->streamer_attaches++;
+    GST_INFO ("streamer attached");
+}
+
+static gboolean
+async_release_streamer_pad (gpointer user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+
+    gst_element_release_request_pad (self->streamer_source, self->streamer_tee_pad);
+    gst_clear_object (&self->streamer_tee_pad);
+    GST_INFO ("streamer detached");
+
+    /* Someone may have connected while the pad was being released */
+    if (g_atomic_int_get (&self->n_consumers) > 0)
+        mati_detector_attach_streamer (self);
+
+    return G_SOURCE_REMOVE;
+}
+
+static GstPadProbeReturn
+on_streamer_pad_idle (GstPad          *pad,
+                      GstPadProbeInfo *info,
+                      gpointer         user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    g_autoptr (GstPad) peer = gst_pad_get_peer (pad);
+
+    if (peer != NULL)
+        gst_pad_unlink (pad, peer);
+
+    mati_detector_idle_add (self, async_release_streamer_pad);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+static gboolean
+mati_detector_detach_streamer (gpointer user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+
+    self->streamer_detach_timeout = 0;
+    if (g_atomic_int_get (&self->n_consumers) == 0 && self->streamer_tee_pad != NULL)
+        gst_pad_add_probe (self->streamer_tee_pad, GST_PAD_PROBE_TYPE_IDLE, on_streamer_pad_idle, self, NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Runs on the detector thread. Attaching happens right away, detaching only
+ * after STREAMER_DETACH_DELAY without consumers so a reload doesn't cost a
+ * new attach. */
+static gboolean
+mati_detector_update_streamer (gpointer user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    gboolean watched = g_atomic_int_get (&self->n_consumers) > 0;
+
+    /* Passthrough viewers don't need anything decoded */
+    mati_decode_gate_set_watched (self->decode_gate, watched && self->streamer_source == self->decoder_tee);
+
+    if (watched)
+    {
+        if (self->streamer_detach_timeout != 0)
+        {
+            mati_detector_source_remove (self, self->streamer_detach_timeout);
+            self->streamer_detach_timeout = 0;
+        }
+        mati_detector_attach_streamer (self);
+    }
+    else if (self->streamer_tee_pad != NULL && self->streamer_detach_timeout == 0)
+    {
+        self->streamer_detach_timeout = mati_detector_timeout_add_seconds (self, STREAMER_DETACH_DELAY, mati_detector_detach_streamer);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
 static void
 consumer_added_handler (GstElement *consumer_id, char *webrtcbin, GstElement *arg1, MatiDetector *self)
 {
@@ -531,6 +1711,19 @@ consumer_added_handler (GstElement *consumer_id, char *webrtcbin, GstElement *ar
     char *ts;
     g_object_get (arg1, "turn-server", &ts, NULL);
     g_signal_emit_by_name (arg1, "add-turn-server", self->turnserver, &ret);
+
+    g_atomic_int_inc (&self->n_consumers);
+    mati_detector_idle_add (self, mati_detector_update_streamer);
+}
+
+static void
+consumer_removed_handler (GstElement   *webrtcsink,
+                          char         *peer_id,
+                          GstElement   *webrtcbin,
+                          MatiDetector *self)
+{
+    if (g_atomic_int_dec_and_test (&self->n_consumers))
+        mati_detector_idle_add (self, mati_detector_update_streamer);
 }
 
 static gboolean
@@ -550,76 +1743,351 @@ encoder_setup (GstElement * consumer_id,
             NULL);
     }
 
-    return TRUE;
+    return TRUE;
+}
+
+/* Returns the queue the consumer of a new branch is linked behind */
+static GstElement*
+mati_detector_add_branch (MatiDetector     *self,
+                          const char       *name,
+                          MatiBranchPolicy  policy,
+                          guint             max_buffers,
+                          guint             max_bytes)
+{
+    MatiBranch *branch = mati_branch_new (name, policy, max_buffers, max_bytes);
+
+    g_ptr_array_add (self->branches, branch);
+    return mati_branch_get_queue (branch);
+}
+
+static GstElement*
+build_streamer (MatiDetector *self,
+                gboolean      shared_encoder)
+{
+    GstElement *bin, *streamer_queue, *webrtcsink, *videoscale, *capsfilter;
+    GstPad *video_sink_pad;
+    GstCaps *scale_caps;
+
+    /* webrtcsink stalls with its slowest peer, that must not reach the
+     * tee it hangs off */
+    if (self->streamer_source == self->tee)
+        streamer_queue = mati_detector_add_branch (self, "streamer", MATI_BRANCH_KEYFRAME, 0, ENCODED_QUEUE_BYTES);
+    else
+        streamer_queue = mati_detector_add_branch (self, "streamer", MATI_BRANCH_LEAKY, RAW_QUEUE_BUFFERS, 0);
+
+    webrtcsink = gst_element_factory_make ("webrtcsink", NULL);
+    g_return_val_if_fail (GST_IS_ELEMENT (webrtcsink), FALSE);
+    GObject *signaller;
+    GstValueArray *turnservers;
+    GValue turnserver_array = G_VALUE_INIT;
+    GValue deserialized_turnserver = G_VALUE_INIT;;
+    char *uri;
+    g_object_get (webrtcsink, "signaller", &signaller, "turn-servers", &turnservers, NULL);
+    g_object_get (signaller, "uri", &uri, NULL);
+    g_object_set (signaller, "uri", "ws://synthima-service:8443", NULL);
+    g_object_get (signaller, "uri", &uri, NULL);
+    g_signal_connect (signaller, "peer-id-ready", G_CALLBACK (peer_id_handler), self);
+    g_signal_connect(webrtcsink, "consumer-added", G_CALLBACK (consumer_added_handler), self);
+    g_signal_connect (webrtcsink, "consumer-removed", G_CALLBACK (consumer_removed_handler), self);
+    g_signal_connect(webrtcsink, "encoder-setup", G_CALLBACK(encoder_setup), NULL);
+    g_value_init (&turnserver_array, GST_TYPE_ARRAY);
+    g_value_init (&deserialized_turnserver, G_TYPE_STRING);
+    gboolean ret = gst_value_deserialize (&deserialized_turnserver, self->turnserver);
+    gst_value_array_append_value (&turnserver_array, &deserialized_turnserver);
+    g_object_set_property(G_OBJECT(webrtcsink), "turn-servers", &turnserver_array);
+    gst_element_set_name (webrtcsink, WEBRTCSINK_NAME);
+    g_object_set(webrtcsink, "audio-caps", NULL, NULL);
+
+    bin = gst_bin_new ("streamerbin");
+    gst_bin_add_many (GST_BIN (bin), streamer_queue, webrtcsink, NULL);
+
+    /* With encoded input webrtcsink doesn't run an encoder per session */
+    if (shared_encoder)
+    {
+        self->live_encoder = mati_live_encoder_new (LIVE_ENCODER_NAME);
+        gst_bin_add (GST_BIN (bin), self->live_encoder);
+        if (!gst_element_link_many (streamer_queue, self->live_encoder, webrtcsink, NULL))
+            g_critical ("Failed to link streamer elements!");
+    }
+    else if (!gst_element_link_many (streamer_queue, webrtcsink, NULL))
+    {
+        g_critical ("Failed to link streamer elements!");
+    }
+
+    video_sink_pad = gst_ghost_pad_new ("videosink", gst_element_get_static_pad (streamer_queue, "sink"));
+    if (!gst_element_add_pad (bin, video_sink_pad))
+        g_critical ("Failed to set videosink pad in streamer bin!");
+
+    return bin;
+}
+
+/* Profiles passed through to browsers. Only constrained baseline is
+ * mandatory in WebRTC, a peer that doesn't offer the camera profile gets
+ * no session at all, so main and high are only passed through when
+ * configured for viewers known to decode them. */
+static gboolean
+is_browser_profile (MatiDetector *self,
+                    const gchar  *profile)
+{
+    return profile != NULL && g_strv_contains ((const gchar * const *) self->passthrough_profiles, profile);
+}
+
+/* Runs on the detector thread once the camera profile is known. Streams
+ * browsers can't play fall back to the shared encoder. */
+static gboolean
+mati_detector_setup_passthrough (gpointer user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    gboolean passthrough = is_browser_profile (self, self->input_profile);
+
+    if (passthrough)
+    {
+        g_message ("live view passes through the %s stream", self->input_profile);
+        self->streamer_source = self->tee;
+    }
+    else
+    {
+        g_message ("browsers can't play H.264 profile %s, live view gets transcoded",
+                   self->input_profile ? self->input_profile : "unknown");
+        self->streamer_source = self->decoder_tee;
+    }
+
+    self->streamer_bin = build_streamer (self, !passthrough);
+    gst_bin_add (GST_BIN (self->pipeline), self->streamer_bin);
+    gst_element_sync_state_with_parent (self->streamer_bin);
+
+    mati_detector_attach_streamer (self);
+    return mati_detector_update_streamer (self);
+}
+
+/* Runs on the detector thread once nothing flows into the old streamer
+ * any more, its viewers have to connect again */
+static gboolean
+mati_detector_replace_streamer (gpointer user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    GstElement *streamer_bin = g_steal_pointer (&self->streamer_bin);
+
+    if (self->streamer_tee_pad != NULL)
+    {
+        gst_element_release_request_pad (self->streamer_source, self->streamer_tee_pad);
+        gst_clear_object (&self->streamer_tee_pad);
+    }
+    gst_element_set_state (streamer_bin, GST_STATE_NULL);
+    gst_bin_remove (GST_BIN (self->pipeline), streamer_bin);
+    self->live_encoder = NULL;
+    g_atomic_int_set (&self->n_consumers, 0);
+
+    for (guint i = 0; i < self->branches->len; i++)
+    {
+        if (g_str_equal (mati_branch_get_name (g_ptr_array_index (self->branches, i)), "streamer"))
+        {
+            g_ptr_array_remove_index (self->branches, i);
+            break;
+        }
+    }
+
+    self->streamer_replacing = FALSE;
+    return mati_detector_setup_passthrough (self);
+}
+
+static GstPadProbeReturn
+on_streamer_replace_idle (GstPad          *pad,
+                          GstPadProbeInfo *info,
+                          gpointer         user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    g_autoptr (GstPad) peer = gst_pad_get_peer (pad);
+
+    if (peer != NULL)
+        gst_pad_unlink (pad, peer);
+
+    mati_detector_idle_add (self, mati_detector_replace_streamer);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+/* Runs on the detector thread. A fast start guessed the profile from the
+ * last run and a reconnect may bring a reconfigured camera, the streamer
+ * is rebuilt when passing the stream through no longer fits. */
+static void
+mati_detector_set_input_profile (MatiDetector *self,
+                                 const gchar  *profile)
+{
+    gboolean passthrough = is_browser_profile (self, profile);
+
+    g_free (self->input_profile);
+    self->input_profile = g_strdup (profile);
+
+    if (self->streamer_bin == NULL)
+    {
+        mati_detector_setup_passthrough (self);
+        return;
+    }
+    if (self->streamer_replacing || passthrough == (self->streamer_source == self->tee))
+        return;
+
+    g_message ("camera %s switched to H.264 profile %s, rebuilding the live view",
+               self->source_id, profile ? profile : "unknown");
+    self->streamer_replacing = TRUE;
+    if (self->streamer_detach_timeout != 0)
+    {
+        mati_detector_source_remove (self, self->streamer_detach_timeout);
+        self->streamer_detach_timeout = 0;
+    }
+    if (self->streamer_tee_pad != NULL)
+        gst_pad_add_probe (self->streamer_tee_pad, GST_PAD_PROBE_TYPE_IDLE, on_streamer_replace_idle, self, NULL);
+    else
+        mati_detector_replace_streamer (self);
+}
+
+/* Recordings are named after the local time they start at, later segments
+ * of the same recording get their index appended */
+static gchar *
+mati_detector_get_recording_file_name (MatiDetector *self,
+                                       guint         segment)
+{
+    g_autoptr (GTimeZone) time_zone = g_time_zone_new_local ();
+    g_autoptr (GDateTime) date_time = g_date_time_new_now (time_zone);
+    g_autofree char *date_time_str = g_date_time_format (date_time, "%H-%M-%S---%d-%m-%Y");
+    g_autofree char *segment_str = segment > 0 ? g_strdup_printf ("-%03u", segment) : g_strdup ("");
+
+    return g_strconcat (MATI_RECORDING_DIR, self->source_id, "/", date_time_str, segment_str, ".",
+                        mati_recording_format_get_extension (self->format), NULL);
+}
+
+static void
+mati_detector_set_recording_location (MatiDetector *self,
+                                      const gchar  *location,
+                                      guint         segments)
+{
+    g_mutex_lock (&self->recording_lock);
+    g_free (self->recording_location);
+    self->recording_location = g_strdup (location);
+    self->recording_segments = segments;
+    g_mutex_unlock (&self->recording_lock);
+
+    if (self->retention != NULL)
+        mati_retention_add_file (self->retention, self->source_id, location);
+}
+
+static void
+mati_detector_set_writer (MatiDetector *self,
+                          GstElement   *writer)
+{
+    gint64 motion_began;
+
+    g_mutex_lock (&self->recording_lock);
+    gst_object_replace ((GstObject **) &self->writer, GST_OBJECT (writer));
+    motion_began = self->motion_began;
+    g_mutex_unlock (&self->recording_lock);
+
+    /* A file started during motion carries on its interval */
+    if (writer != NULL && motion_began != 0)
+        mati_writer_mark_motion (MATI_WRITER (writer), TRUE, motion_began);
+}
+
+/* Only the first file of a recording starts with the pre-roll, later
+ * segments start when they are opened */
+static gint64
+mati_detector_take_recording_start_time (MatiDetector *self)
+{
+    gint64 start_time;
+
+    g_mutex_lock (&self->recording_lock);
+    start_time = self->recording_start_time;
+    self->recording_start_time = 0;
+    g_mutex_unlock (&self->recording_lock);
+
+    return start_time;
 }
 
-static GstElement*
-build_streamer (MatiDetector *self)
+static void
+sink_added_handler (GstElement   *splitmuxsink,
+                    GstElement   *sink,
+                    MatiDetector *self)
 {
-    GstElement *bin, *streamer_queue, *webrtcsink, *videoscale, *capsfilter;
-    GstPad *video_sink_pad;
-    GstCaps *scale_caps;
+    g_object_set (sink,
+                  "index", TRUE,
+                  "start-time", mati_detector_take_recording_start_time (self),
+                  NULL);
+    mati_detector_set_writer (self, sink);
+}
 
-    streamer_queue = gst_element_factory_make ("queue", NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (streamer_queue), FALSE);
+/* Motion intervals go into the index of the file being written */
+static void
+mati_detector_mark_motion (MatiDetector *self,
+                           gboolean      in_motion)
+{
+    g_autoptr (GstElement) writer = NULL;
+    gint64 now = g_get_real_time ();
 
-    webrtcsink = gst_element_factory_make ("webrtcsink", NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (webrtcsink), FALSE);
-    GObject *signaller;
-    GstValueArray *turnservers;
-    GValue turnserver_array = G_VALUE_INIT;
-    GValue deserialized_turnserver = G_VALUE_INIT;;
-    char *uri;
-    g_object_get (webrtcsink, "signaller", &signaller, "turn-servers", &turnservers, NULL);
-    g_object_get (signaller, "uri", &uri, NULL);
-    g_object_set (signaller, "uri", "ws://synthima-service:8443", NULL);
-    g_object_get (signaller, "uri", &uri, NULL);
-    g_signal_connect (signaller, "peer-id-ready", G_CALLBACK (peer_id_handler), self);
-    g_signal_connect(webrtcsink, "consumer-added", G_CALLBACK (consumer_added_handler), self);
-    g_signal_connect(webrtcsink, "encoder-setup", G_CALLBACK(encoder_setup), NULL);
-    g_value_init (&turnserver_array, GST_TYPE_ARRAY);
-    g_value_init (&deserialized_turnserver, G_TYPE_STRING);
-    gboolean ret = gst_value_deserialize (&deserialized_turnserver, self->turnserver);
-    gst_value_array_append_value (&turnserver_array, &deserialized_turnserver);
-    g_object_set_property(G_OBJECT(webrtcsink), "turn-servers", &turnserver_array);
-    gst_element_set_name (webrtcsink, WEBRTCSINK_NAME);
-    g_object_set(webrtcsink, "audio-caps", NULL, NULL);
+    g_mutex_lock (&self->recording_lock);
+    self->motion_began = in_motion ? now : 0;
+    if (self->writer != NULL)
+        writer = gst_object_ref (self->writer);
+    g_mutex_unlock (&self->recording_lock);
 
-    bin = gst_bin_new ("streamerbin");
-    gst_bin_add_many (GST_BIN (bin), streamer_queue, webrtcsink, NULL);
-    if (!gst_element_link_many (streamer_queue, webrtcsink, NULL))
-        g_critical ("Failed to link streamer elements!");
+    if (writer != NULL)
+        mati_writer_mark_motion (MATI_WRITER (writer), in_motion, now);
+}
 
-    video_sink_pad = gst_ghost_pad_new ("videosink", gst_element_get_static_pad (streamer_queue, "sink"));
-    if (!gst_element_add_pad (bin, video_sink_pad))
-        g_critical ("Failed to set videosink pad in streamer bin!");
+static gchar *
+format_location_handler (GstElement   *splitmuxsink,
+                         guint         fragment_id,
+                         MatiDetector *self)
+{
+    gchar *file_name = mati_detector_get_recording_file_name (self, fragment_id);
 
-    return bin;
+    g_message ("saving segment %u to %s", fragment_id, file_name);
+    mati_detector_set_recording_location (self, file_name, fragment_id + 1);
+    return file_name;
 }
 
-static GstPadProbeReturn
-iframe_probe_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data)
+/* Fragmented MP4 and segmented recordings go through splitmuxsink. A
+ * fragmented file is readable up to its last fragment and has nothing to
+ * rewrite at the end, and async-finalize closes a segment while the next
+ * one already gets written. */
+static GstElement*
+build_segment_muxer (MatiDetector *self)
 {
-    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
-    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+    GstElement *splitmuxsink;
+    GstStructure *muxer_properties, *sink_properties;
 
-    if (buffer) {
-        if (!(gst_buffer_get_flags (buffer) & GST_BUFFER_FLAG_DELTA_UNIT) && gst_buffer_get_flags (buffer) != 0) {
-            g_message ("I-frame detected, starting recording");
-            return GST_PAD_PROBE_REMOVE;
-        } else {
-            return GST_PAD_PROBE_DROP;
-        }
-    }
+    splitmuxsink = gst_element_factory_make ("splitmuxsink", NULL);
+    g_return_val_if_fail (GST_IS_ELEMENT (splitmuxsink), NULL);
 
-    if (event) {
-        if (GST_EVENT_TYPE (event) == GST_EVENT_EOS) {
-            g_message ("EOS event received, stopping probe");
-            return GST_PAD_PROBE_REMOVE;
-        }
-    }
+    if (self->format == MATI_RECORDING_FMP4)
+        muxer_properties = gst_structure_new ("properties",
+                                              "fragment-duration", G_TYPE_UINT, FRAGMENT_DURATION,
+                                              "streamable", G_TYPE_BOOLEAN, TRUE,
+                                              NULL);
+    else
+        muxer_properties = gst_structure_new ("properties",
+                                              "offset-to-zero", G_TYPE_BOOLEAN, TRUE,
+                                              NULL);
+    sink_properties = gst_structure_new ("properties",
+                                         "direct", G_TYPE_BOOLEAN, self->direct_io,
+                                         "sync", G_TYPE_BOOLEAN, self->sync_writes,
+                                         "ram-staging", G_TYPE_BOOLEAN, self->ram_staging,
+                                         NULL);
+
+    g_object_set (splitmuxsink,
+                  "muxer-factory", self->format == MATI_RECORDING_FMP4 ? "mp4mux" : "matroskamux",
+                  "muxer-properties", muxer_properties,
+                  "sink-factory", "matiwriter",
+                  "sink-properties", sink_properties,
+                  "async-finalize", TRUE,
+                  "max-size-time", self->segment_time,
+                  "max-size-bytes", self->segment_bytes,
+                  "send-keyframe-requests", FALSE, // camera keyframes can't be forced
+                  NULL);
+    g_signal_connect (splitmuxsink, "format-location", G_CALLBACK (format_location_handler), self);
+    g_signal_connect (splitmuxsink, "sink-added", G_CALLBACK (sink_added_handler), self);
 
-    return GST_PAD_PROBE_OK;
+    gst_structure_free (muxer_properties);
+    gst_structure_free (sink_properties);
+
+    return splitmuxsink;
 }
 
 static GstElement*
@@ -627,43 +2095,55 @@ build_filesink (MatiDetector *self)
 {
     GstElement *bin, *queue_detector, *mux_detector, *writer_detector;
     GstPad *video_sink_pad;
-    g_autoptr (GTimeZone) time_zone = NULL;
-    g_autoptr (GDateTime) date_time = NULL;
-    g_autofree char *date_time_str = NULL;
     g_autofree char *file_name = NULL;
+    g_autofree char *bin_name = g_strdup_printf ("filesinkbin%u", self->recordings_started++);
 
+    /* Takes the whole pre-roll burst without blocking the recording branch */
     queue_detector = gst_element_factory_make ("queue", NULL);
     g_return_val_if_fail (GST_IS_ELEMENT (queue_detector), FALSE);
-    self->mux_queue = queue_detector;
-
-    mux_detector = gst_element_factory_make ("matroskamux", NULL);
-    g_object_set (G_OBJECT (mux_detector), "offset-to-zero", TRUE, NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (mux_detector), FALSE);
-    self->mux = mux_detector;
-
-    writer_detector = gst_element_factory_make ("filesink", NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (writer_detector), FALSE);
-    time_zone = g_time_zone_new_local ();
-    date_time = g_date_time_new_now (time_zone);
-    date_time_str =  g_date_time_format (date_time, "%H-%M-%S---%d-%m-%Y");
-    file_name = g_strconcat ("/etc/videos/", self->source_id, "/", date_time_str, ".mp4", NULL);
-    g_message ("saving to %s", file_name);
-    g_object_set (G_OBJECT (writer_detector),
-                  "location", file_name,
-                  "sync", TRUE,
+    g_object_set (queue_detector,
+                  "max-size-time", (guint64) 0,
+                  "max-size-buffers", 0,
+                  "max-size-bytes", (guint) MIN (self->preroll_bytes * 2, G_MAXUINT),
                   NULL);
-    gst_element_set_name (writer_detector, FILESINK_NAME);
 
-    /* Add probe that drops frames until a keyframe is received to ensure we
-     * only have a useful, fully readable recording. */
-    GstPad *mux_queue_src_pad = gst_element_get_static_pad (self->mux_queue, "src");
-    gst_pad_add_probe (mux_queue_src_pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, iframe_probe_cb, self, NULL);
-    gst_object_unref (mux_queue_src_pad);
+    /* Earlier recordings may still be finalizing next to this one */
+    bin = gst_bin_new (bin_name);
+
+    if (self->format != MATI_RECORDING_MATROSKA || self->segment_time > 0 || self->segment_bytes > 0)
+    {
+        mux_detector = build_segment_muxer (self);
+        g_return_val_if_fail (GST_IS_ELEMENT (mux_detector), FALSE);
+
+        gst_bin_add_many (GST_BIN (bin), queue_detector, mux_detector, NULL);
+        if (!gst_element_link (queue_detector, mux_detector))
+            g_critical ("Failed to link filesink elements!");
+    }
+    else
+    {
+        mux_detector = gst_element_factory_make ("matroskamux", NULL);
+        g_object_set (G_OBJECT (mux_detector), "offset-to-zero", TRUE, NULL);
+        g_return_val_if_fail (GST_IS_ELEMENT (mux_detector), FALSE);
+
+        writer_detector = mati_writer_new (FILESINK_NAME);
+        g_return_val_if_fail (GST_IS_ELEMENT (writer_detector), FALSE);
+        file_name = mati_detector_get_recording_file_name (self, 0);
+        g_message ("saving to %s", file_name);
+        g_object_set (G_OBJECT (writer_detector),
+                      "location", file_name,
+                      "direct", self->direct_io,
+                      "sync", self->sync_writes,
+                      "ram-staging", self->ram_staging,
+                      "index", TRUE,
+                      "start-time", mati_detector_take_recording_start_time (self),
+                      NULL);
+        mati_detector_set_recording_location (self, file_name, 1);
+        mati_detector_set_writer (self, writer_detector);
 
-    bin = gst_bin_new ("filesinkbin");
-    gst_bin_add_many (GST_BIN (bin), queue_detector, mux_detector, writer_detector, NULL);
-    if (!gst_element_link_many (queue_detector, mux_detector, writer_detector, NULL))
-        g_critical ("Failed to link filesink elements!");
+        gst_bin_add_many (GST_BIN (bin), queue_detector, mux_detector, writer_detector, NULL);
+        if (!gst_element_link_many (queue_detector, mux_detector, writer_detector, NULL))
+            g_critical ("Failed to link filesink elements!");
+    }
 
     video_sink_pad = gst_ghost_pad_new ("videosink", gst_element_get_static_pad (queue_detector, "sink"));
     if (!gst_element_add_pad (bin, video_sink_pad))
@@ -678,73 +2158,214 @@ build_decoder (MatiDetector *self)
     GstElement *decoder;
     decoder = gst_element_factory_make ("avdec_h264", NULL);
     g_return_val_if_fail (GST_IS_ELEMENT (decoder), FALSE);
-    gst_pad_add_probe(gst_element_get_static_pad (decoder, "src"),
-                      GST_PAD_PROBE_TYPE_BUFFER,
-                      decode_frame_probe_cb,
-                      self,
-                      NULL);
+    /* libav starts a thread per core otherwise, for every camera */
+    g_object_set (decoder, "max-threads", self->decoder_threads, NULL);
+    g_autoptr (GstPad) decoder_src_pad = gst_element_get_static_pad (decoder, "src");
+
+    mati_stats_add_probe (self->decoder_stats, decoder_src_pad);
     return decoder;
 }
 
+/* Fed from the encoded tee, so thumbnails neither wait for the decode gate
+ * nor cost a full-resolution decode */
 static GstElement*
-build_thumbnailsink (MatiDetector *self)
+build_thumbnailer (MatiDetector *self)
 {
-    GstElement *bin, *queue_fakesink, *videoconvert, *motioncells, *videorate, *capsfilter, *jpegenc, *multifilesink;
-    GstPad *video_sink_pad;
-    g_autofree char *file_name = NULL;
-
-    queue_fakesink = gst_element_factory_make ("queue", NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (queue_fakesink), FALSE);
+    g_autofree char *file_name = g_strconcat ("/etc/thumbnails/", self->source_id, ".jpg", NULL);
+    GstElement *thumbnailer = mati_thumbnailer_new ("thumbnailer");
 
-    jpegenc = gst_element_factory_make ("jpegenc", NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (jpegenc), FALSE);
-
-    multifilesink = gst_element_factory_make ("multifilesink", NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (multifilesink), FALSE);
-    file_name = g_strconcat ("/etc/thumbnails/", self->source_id, ".jpg", NULL);
-    g_object_set (G_OBJECT (multifilesink),
+    g_object_set (thumbnailer,
                   "location", file_name,
-                  "post-messages", TRUE,
-                  "next-file", 0, // every buffer is a new image
-                  "sync", FALSE,
+                  "width", self->thumbnail_width,
+                  "interval", THUMBNAIL_REFRESH_INTERVAL,
                   NULL);
+    return thumbnailer;
+}
 
-    videoconvert = gst_element_factory_make ("videoconvert", NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (videoconvert), FALSE);
+/* Motion analysis runs on its own branch. Frames are dropped down to
+ * analysis_fps and scaled down to analysis_width, after which MatiMotion
+ * works directly on their luma plane. */
+static GstElement*
+build_analysis (MatiDetector *self)
+{
+    GstElement *bin, *queue_analysis, *videorate, *videoscale, *capsfilter, *videoconvert, *motion, *fakesink;
+    GstPad *video_sink_pad;
 
-    motioncells = gst_element_factory_make ("motioncells", NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (motioncells), FALSE);
-    g_object_set (G_OBJECT (motioncells), "display", FALSE, NULL);
-    self->motion = motioncells;
+    queue_analysis = mati_detector_add_branch (self, "analysis", MATI_BRANCH_LEAKY, RAW_QUEUE_BUFFERS, 0);
 
     videorate = gst_element_factory_make ("videorate", NULL);
     g_return_val_if_fail (GST_IS_ELEMENT (videorate), FALSE);
     g_object_set (G_OBJECT (videorate),
-                  "max-rate", 1,
+                  "max-rate", self->analysis_fps,
                   "drop-only", TRUE,
-                  "skip-to-first", TRUE,
                   NULL);
 
+    videoscale = gst_element_factory_make ("videoscale", NULL);
+    g_return_val_if_fail (GST_IS_ELEMENT (videoscale), FALSE);
+    g_object_set (G_OBJECT (videoscale), "method", 0, NULL); // nearest neighbour
+
     capsfilter = gst_element_factory_make ("capsfilter", NULL);
     g_return_val_if_fail (GST_IS_ELEMENT (capsfilter), FALSE);
     GstCaps *caps = gst_caps_new_simple ("video/x-raw",
-                                        "framerate", GST_TYPE_FRACTION, 1, 10,
+                                        "width", G_TYPE_INT, self->analysis_width,
                                         NULL);
     g_object_set (G_OBJECT (capsfilter), "caps", caps, NULL);
     gst_caps_unref (caps);
 
-    bin = gst_bin_new ("thumbnailsinkbin");
-    gst_bin_add_many (GST_BIN (bin), queue_fakesink, videoconvert, motioncells, videorate, capsfilter, jpegenc, multifilesink, NULL);
-    if (!gst_element_link_many (queue_fakesink, videoconvert, motioncells, videorate, capsfilter, jpegenc, multifilesink, NULL))
-        g_critical ("Failed to link thumbnailsink elements!");
+    /* Passthrough for the planar YUV the decoder produces, only converts
+     * formats MatiMotion doesn't read directly */
+    videoconvert = gst_element_factory_make ("videoconvert", NULL);
+    g_return_val_if_fail (GST_IS_ELEMENT (videoconvert), FALSE);
+
+    motion = mati_motion_new (MOTION_NAME);
+    g_return_val_if_fail (GST_IS_ELEMENT (motion), FALSE);
+    self->motion = motion;
 
-    video_sink_pad = gst_ghost_pad_new ("videosink", gst_element_get_static_pad (queue_fakesink, "sink"));
+    fakesink = gst_element_factory_make ("fakesink", NULL);
+    g_return_val_if_fail (GST_IS_ELEMENT (fakesink), FALSE);
+    g_object_set (G_OBJECT (fakesink),
+                  "sync", FALSE,
+                  "async", FALSE,
+                  NULL);
+
+    bin = gst_bin_new ("analysisbin");
+    gst_bin_add_many (GST_BIN (bin), queue_analysis, videorate, videoscale, capsfilter, videoconvert, motion, fakesink, NULL);
+    if (!gst_element_link_many (queue_analysis, videorate, videoscale, capsfilter, videoconvert, motion, fakesink, NULL))
+        g_critical ("Failed to link analysis elements!");
+
+    video_sink_pad = gst_ghost_pad_new ("videosink", gst_element_get_static_pad (queue_analysis, "sink"));
     if (!gst_element_add_pad (bin, video_sink_pad))
-        g_critical ("Failed to set videosink pad in fakesink bin!");
+        g_critical ("Failed to set videosink pad in analysis bin!");
 
     return bin;
 }
 
+/* Stamps the first buffer through the pad, the field comes as user data */
+static GstPadProbeReturn
+startup_buffer_probe_cb (GstPad          *pad,
+                         GstPadProbeInfo *info,
+                         gpointer         user_data)
+{
+    startup_time_stamp (user_data);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+static GstPadProbeReturn
+startup_keyframe_probe_cb (GstPad          *pad,
+                           GstPadProbeInfo *info,
+                           gpointer         user_data)
+{
+    if (GST_BUFFER_FLAG_IS_SET (GST_PAD_PROBE_INFO_BUFFER (info), GST_BUFFER_FLAG_DELTA_UNIT))
+        return GST_PAD_PROBE_OK;
+
+    startup_time_stamp (user_data);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+static void
+on_sdp_handler (GstElement   *rtspsrc,
+                gpointer      sdp,
+                MatiDetector *self)
+{
+    startup_time_stamp (&self->sdp_time);
+}
+
+static gchar *
+mati_detector_get_caps_cache_file (MatiDetector *self)
+{
+    return g_strconcat (CACHE_DIR, self->source_id, ".caps", NULL);
+}
+
+/* Remembers the input caps for the next fast start, only written when
+ * they changed */
+static void
+mati_detector_cache_caps (MatiDetector *self,
+                          GstCaps      *caps)
+{
+    g_autofree gchar *caps_string = gst_caps_to_string (caps);
+    g_autofree gchar *cache_file = NULL;
+    g_autoptr (GError) error = NULL;
+
+    if (g_strcmp0 (caps_string, self->cached_caps) == 0)
+        return;
+
+    cache_file = mati_detector_get_caps_cache_file (self);
+    if (g_mkdir_with_parents (CACHE_DIR, 0755) != 0
+        || !g_file_set_contents_full (cache_file, caps_string, -1, G_FILE_SET_CONTENTS_CONSISTENT, 0644, &error))
+    {
+        g_warning ("couldn't cache caps of %s: %s", self->source_id, error != NULL ? error->message : g_strerror (errno));
+        return;
+    }
+
+    g_free (self->cached_caps);
+    self->cached_caps = g_steal_pointer (&caps_string);
+}
+
+/* Runs on the detector thread, only the newest caps matter when several
+ * arrived in between */
+static gboolean
+mati_detector_handle_input_caps (gpointer user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    g_autoptr (GstCaps) caps = NULL;
+
+    g_mutex_lock (&self->caps_lock);
+    caps = g_steal_pointer (&self->input_caps);
+    g_mutex_unlock (&self->caps_lock);
+    if (caps == NULL || gst_caps_is_empty (caps))
+        return G_SOURCE_REMOVE;
+
+    mati_detector_cache_caps (self, caps);
+    if (self->live_mode == MATI_LIVE_PASSTHROUGH)
+        mati_detector_set_input_profile (self, gst_structure_get_string (gst_caps_get_structure (caps, 0), "profile"));
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Stays installed, the caps of every camera (re)connect are handed on to
+ * the detector thread for the cache and the live view */
+static GstPadProbeReturn
+input_caps_probe_cb (GstPad          *pad,
+                     GstPadProbeInfo *info,
+                     gpointer         user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+    GstCaps *caps;
+
+    if (GST_EVENT_TYPE (event) != GST_EVENT_CAPS)
+        return GST_PAD_PROBE_OK;
+
+    gst_event_parse_caps (event, &caps);
+    g_mutex_lock (&self->caps_lock);
+    gst_caps_replace (&self->input_caps, caps);
+    g_mutex_unlock (&self->caps_lock);
+    mati_detector_idle_add (self, mati_detector_handle_input_caps);
+
+    return GST_PAD_PROBE_OK;
+}
+
+static gboolean
+source_eos_cb (gpointer user_data)
+{
+    mati_detector_schedule_reconnect (MATI_DETECTOR (user_data), "end of stream");
+    return G_SOURCE_REMOVE;
+}
+
+/* A live camera only ends when it is lost. Its EOS must not reach the
+ * tee, it would finalize recordings and stop every branch. */
+static GstPadProbeReturn
+source_eos_probe_cb (GstPad          *pad,
+                     GstPadProbeInfo *info,
+                     gpointer         user_data)
+{
+    if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) != GST_EVENT_EOS)
+        return GST_PAD_PROBE_OK;
+
+    mati_detector_idle_add (MATI_DETECTOR (user_data), source_eos_cb);
+    return GST_PAD_PROBE_DROP;
+}
+
 static GstElement*
 build_common_pipeline (MatiDetector *self,
                        gchar        *uri)
@@ -764,6 +2385,12 @@ build_common_pipeline (MatiDetector *self,
                   "media", "video",
                   NULL);
     gst_element_set_name (videosource, RTSPSRC_NAME);
+    if (self->rtsp_transport != NULL)
+        gst_util_set_object_arg (G_OBJECT (videosource), "protocols",
+                                 g_str_equal (self->rtsp_transport, "tcp") ? "tcp" : "udp+udp-mcast");
+    if (self->fast_start)
+        g_object_set (videosource, "latency", self->steady_latency ? STEADY_LATENCY : FAST_START_LATENCY, NULL);
+    g_signal_connect (videosource, "on-sdp", G_CALLBACK (on_sdp_handler), self);
     g_signal_connect (videosource, "pad-added", G_CALLBACK (pad_added_handler), self);
 
     self->queue_connect = gst_element_factory_make ("queue", NULL);
@@ -771,9 +2398,18 @@ build_common_pipeline (MatiDetector *self,
 
     h264_depay = gst_element_factory_make ("rtph264depay", NULL);
     g_return_val_if_fail (GST_IS_ELEMENT (h264_depay), FALSE);
+    if (startup_time_get (&self->first_buffer_time) == 0)
+    {
+        g_autoptr (GstPad) depay_src_pad = gst_element_get_static_pad (h264_depay, "src");
+
+        gst_pad_add_probe (depay_src_pad, GST_PAD_PROBE_TYPE_BUFFER, startup_buffer_probe_cb, &self->first_buffer_time, NULL);
+    }
 
     h264_parse = gst_element_factory_make ("h264parse", NULL);
     g_return_val_if_fail (GST_IS_ELEMENT (h264_parse), FALSE);
+    /* SPS/PPS in front of every keyframe, recordings and passthrough live
+     * view can then start on any of them */
+    g_object_set (h264_parse, "config-interval", -1, NULL);
 
     bin = gst_bin_new ("commonbin");
     gst_bin_add_many (GST_BIN (bin), videosource, self->queue_connect,
@@ -784,6 +2420,9 @@ build_common_pipeline (MatiDetector *self,
                                 NULL))
         g_critical ("Couldn't link all common pipeline elements!");
 
+    g_autoptr (GstPad) parse_src_pad = gst_element_get_static_pad (h264_parse, "src");
+    gst_pad_add_probe (parse_src_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, source_eos_probe_cb, self, NULL);
+
     video_src_pad = gst_ghost_pad_new ("videosrc", gst_element_get_static_pad (h264_parse, "src"));
     if (!gst_element_add_pad (bin, video_src_pad))
         g_critical ("Failed to set videosrc pad in common pipeline bin!");
@@ -791,168 +2430,562 @@ build_common_pipeline (MatiDetector *self,
     return bin;
 }
 
+static void
+stop_common_bin_async (GstElement *bin,
+                       gpointer    user_data)
+{
+    gst_element_set_state (bin, GST_STATE_NULL);
+}
+
+/* Swaps the source for a new one, everything behind the tee keeps its
+ * state: pre-roll, recordings, live view and their sessions. Stopping an
+ * rtspsrc whose camera is gone can take seconds, the old bin is shut down
+ * off the detector thread once it is out of the pipeline. */
+static gboolean
+mati_detector_reconnect (gpointer user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    g_autoptr (GstPad) tee_sink_pad = gst_element_get_static_pad (self->tee, "sink");
+    g_autoptr (GstPad) src_pad = gst_element_get_static_pad (self->common_bin, "videosrc");
+    g_autoptr (GstElement) old_bin = gst_object_ref (self->common_bin);
+    g_autoptr (GstElement) old_source = gst_bin_get_by_name (GST_BIN (old_bin), RTSPSRC_NAME);
+
+    self->reconnect_timeout = 0;
+    self->reconnect_attempts++;
+    g_message ("reconnecting camera %s, attempt %u", self->source_id, self->reconnect_attempts);
+
+    /* Late pads or SDP of the old source must not reach the new one */
+    if (old_source != NULL)
+        g_signal_handlers_disconnect_by_data (old_source, self);
+    gst_pad_unlink (src_pad, tee_sink_pad);
+    gst_bin_remove (GST_BIN (self->pipeline), old_bin);
+    gst_element_call_async (old_bin, stop_common_bin_async, NULL, NULL);
+
+    self->common_bin = build_common_pipeline (self, self->uri);
+    gst_bin_add (GST_BIN (self->pipeline), self->common_bin);
+    if (!gst_element_link (self->common_bin, self->tee))
+        g_critical ("Couldn't link new source of %s!", self->source_id);
+    gst_element_sync_state_with_parent (self->common_bin);
+
+    self->watchdog_start_time = g_get_monotonic_time ();
+    return G_SOURCE_REMOVE;
+}
+
+/* Runs on the detector thread. Only one attempt is ever pending, the
+ * delay doubles until frames arrive again. */
+static void
+mati_detector_schedule_reconnect (MatiDetector *self,
+                                  const char   *reason)
+{
+    if (self->reconnect_timeout != 0 || self->common_bin == NULL)
+        return;
+
+    if (!self->reconnecting)
+    {
+        self->reconnecting = TRUE;
+        self->reconnect_began = g_get_monotonic_time ();
+    }
+
+    g_warning ("camera %s lost (%s), reconnecting in %u s", self->source_id, reason, self->reconnect_delay);
+    self->reconnect_timeout = mati_detector_timeout_add_seconds (self, self->reconnect_delay, mati_detector_reconnect);
+    self->reconnect_delay = MIN (self->reconnect_delay * 2, RECONNECT_MAX_DELAY);
+}
+
 gboolean
 mati_detector_build (MatiDetector *self,
                      gchar        *uri)
 {
     g_return_val_if_fail (MATI_IS_DETECTOR (self), FALSE);
 
-    GstElement *common_pipeline;
-    GstElement *thumbnail_sink_bin, *streamer_bin;
-    GstElement *recording_buffer;
-    GstElement *recording_fakesink_queue;
-    GstElement *recording_fakesink;
+    GstElement *analysis_bin;
+    GstElement *recording_queue;
+    GstElement *thumbnailer_queue;
     GstElement *decoder;
     GstElement *decoder_queue;
 
-    common_pipeline = build_common_pipeline (self, uri);
-    streamer_bin = build_streamer (self);
+    g_free (self->uri);
+    self->uri = g_strdup (uri);
+    if (self->fast_start)
+    {
+        g_autofree gchar *cache_file = mati_detector_get_caps_cache_file (self);
+
+        g_clear_pointer (&self->cached_caps, g_free);
+        g_file_get_contents (cache_file, &self->cached_caps, NULL, NULL);
+    }
+    self->common_bin = build_common_pipeline (self, uri);
     self->tee = gst_element_factory_make ("tee", NULL);
     g_return_val_if_fail (GST_IS_ELEMENT (self->tee), FALSE);
     self->recording_tee = gst_element_factory_make ("tee", NULL);
     g_return_val_if_fail (GST_IS_ELEMENT (self->recording_tee), FALSE);
-    /* Add a buffer that is at least RECORDING_BUFFER long.
-     * This makes sure that the recording pipeline is running RECORDING_BUFFER
-     * behind so we can "record in the past". */
-    recording_buffer = gst_element_factory_make ("queue", NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (recording_buffer), FALSE);
-    gst_element_set_name (recording_buffer, RECORDING_BUFFER_NAME);
-    g_object_set (recording_buffer,
-                  "max-size-time", RECORDING_BUFFER * 2,
-                  "max-size-bytes", 0,
-                  "max-size-buffers", 0,
-                  NULL);
-    GstPad *recording_buffer_src_pad = gst_element_get_static_pad (recording_buffer, "src");
-    gst_pad_set_offset (recording_buffer_src_pad, RECORDING_BUFFER);
-    gst_object_unref (recording_buffer_src_pad);
-    recording_fakesink_queue = gst_element_factory_make ("queue", NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (recording_fakesink_queue), FALSE);
-    recording_fakesink = gst_element_factory_make ("fakesink", NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (recording_fakesink), FALSE);
-    g_object_set (G_OBJECT (recording_fakesink),
-                  "sync", TRUE,
+    /* Recordings only ever start on a keyframe, the tee may run without
+     * any recording attached. */
+    g_object_set (self->recording_tee, "allow-not-linked", TRUE, NULL);
+    /* Keeps the last GOPs in memory so we can "record in the past", the
+     * pre-roll is flushed into the muxer as soon as a recording starts. */
+    self->preroll = mati_preroll_new (PREROLL_NAME);
+    g_object_set (self->preroll,
+                  "preroll-time", self->preroll_time,
+                  "max-bytes", self->preroll_bytes,
                   NULL);
-    thumbnail_sink_bin = build_thumbnailsink (self);
+    /* Nothing gets lost while the writer catches up, only a writer stuck
+     * for longer than the budget lasts costs frames */
+    recording_queue = mati_detector_add_branch (self, "recording", MATI_BRANCH_LOSSLESS, 0, RECORDING_QUEUE_BYTES);
+    /* A slow disk drops a thumbnail instead of holding up the camera */
+    thumbnailer_queue = mati_detector_add_branch (self, "thumbnailer", MATI_BRANCH_LEAKY, SINGLE_QUEUE_BUFFERS, 0);
+    self->thumbnailer = build_thumbnailer (self);
+    analysis_bin = build_analysis (self);
     
     self->decoder_tee = gst_element_factory_make ("tee", NULL);
     g_return_val_if_fail (GST_IS_ELEMENT (self->decoder_tee), FALSE);
     decoder = build_decoder (self);
-    decoder_queue = gst_element_factory_make ("queue", NULL);
-    g_return_val_if_fail (GST_IS_ELEMENT (decoder_queue), FALSE);
-
-    gst_bin_add_many (GST_BIN (self->pipeline), common_pipeline, self->tee, decoder_queue, decoder, self->decoder_tee,
-                      streamer_bin, thumbnail_sink_bin, recording_buffer, self->recording_tee,
-                      recording_fakesink_queue, recording_fakesink, NULL);
+    decoder_queue = mati_detector_add_branch (self, "decoder", MATI_BRANCH_KEYFRAME, DECODER_QUEUE_BUFFERS, 0);
+    self->decode_gate = mati_decode_gate_new (self->decode_idle_mode, self->decode_gate_threshold);
+
+    g_autoptr (GstPad) tee_sink_pad = gst_element_get_static_pad (self->tee, "sink");
+    mati_stats_add_probe (self->input_stats, tee_sink_pad);
+    gst_pad_add_probe (tee_sink_pad, GST_PAD_PROBE_TYPE_BUFFER, startup_keyframe_probe_cb, &self->first_keyframe_time, NULL);
+    gst_pad_add_probe (tee_sink_pad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, input_caps_probe_cb, self, NULL);
+    g_autoptr (GstPad) decoder_src_pad = gst_element_get_static_pad (decoder, "src");
+    gst_pad_add_probe (decoder_src_pad, GST_PAD_PROBE_TYPE_BUFFER, startup_buffer_probe_cb, &self->first_frame_time, NULL);
+
+    gst_bin_add_many (GST_BIN (self->pipeline), self->common_bin, self->tee, decoder_queue, decoder, self->decoder_tee,
+                      thumbnailer_queue, self->thumbnailer, analysis_bin, recording_queue, self->preroll, self->recording_tee,
+                      NULL);
 
-    if (!gst_element_link_many (common_pipeline, self->tee, decoder_queue, decoder, NULL))
+    if (!gst_element_link_many (self->common_bin, self->tee, decoder_queue, decoder, NULL))
     {
         g_critical ("Couldn't link common pipeline to decoder!");
         return FALSE;
     }
 
-    if (!gst_element_link_many (decoder, self->decoder_tee, thumbnail_sink_bin, NULL))
+    /* On the tee side of the decoder queue, what the gate holds back never
+     * counts against the branch */
+    g_autoptr (GstPad) decoder_queue_sink_pad = gst_element_get_static_pad (decoder_queue, "sink");
+    g_autoptr (GstPad) decoder_tee_pad = gst_pad_get_peer (decoder_queue_sink_pad);
+    mati_decode_gate_add_probe (self->decode_gate, decoder_tee_pad);
+
+    if (!gst_element_link (decoder, self->decoder_tee))
     {
-        g_critical ("Couldn't link common pipeline to fakesinkbin!");
+        g_critical ("Couldn't link decoder to its tee!");
         return FALSE;
     }
 
-    if (!gst_element_link (self->decoder_tee, streamer_bin))
+    if (!gst_element_link_many (self->tee, thumbnailer_queue, self->thumbnailer, NULL))
     {
-        g_critical ("Couldn't link decoder pipeline to streamer bin!");
+        g_critical ("Couldn't link common pipeline to thumbnailer!");
+        return FALSE;
+    }
+
+    /* Deltas and keyframes in between thumbnails are dropped before they
+     * count against the branch */
+    g_autoptr (GstPad) thumbnailer_queue_sink_pad = gst_element_get_static_pad (thumbnailer_queue, "sink");
+    g_autoptr (GstPad) thumbnailer_tee_pad = gst_pad_get_peer (thumbnailer_queue_sink_pad);
+    mati_thumbnailer_add_probe (MATI_THUMBNAILER (self->thumbnailer), thumbnailer_tee_pad);
+
+    if (self->http_server != NULL)
+    {
+        /* Fragments are shared by every client, a gap has to end on a
+         * keyframe or all of them get a broken GOP */
+        GstElement *http_queue = mati_detector_add_branch (self, "httpstream", MATI_BRANCH_KEYFRAME, 0, ENCODED_QUEUE_BYTES);
+
+        self->http_stream = mati_http_stream_new ("httpstream");
+        gst_bin_add_many (GST_BIN (self->pipeline), http_queue, self->http_stream, NULL);
+
+        if (!gst_element_link_many (self->tee, http_queue, self->http_stream, NULL))
+        {
+            g_critical ("Couldn't link common pipeline to http stream!");
+            return FALSE;
+        }
+        mati_http_server_add_stream (self->http_server, self->source_id, MATI_HTTP_STREAM (self->http_stream));
+    }
+
+    if (!gst_element_link (self->decoder_tee, analysis_bin))
+    {
+        g_critical ("Couldn't link decoder pipeline to analysis bin!");
         return FALSE;
     }
 
-    if (!gst_element_link_many (self->tee, recording_buffer, self->recording_tee, recording_fakesink_queue, recording_fakesink, NULL))
+    if (self->frame_ring_rate > 0)
+    {
+        /* Raw frames are large, hold one and drop the rest rather than
+         * slowing down the decoder */
+        GstElement *frame_ring_queue = mati_detector_add_branch (self, "framering", MATI_BRANCH_LEAKY, SINGLE_QUEUE_BUFFERS, 0);
+
+        self->frame_ring = mati_frame_ring_new ("framering");
+        g_object_set (self->frame_ring,
+                      "width", self->frame_ring_width,
+                      "max-rate", self->frame_ring_rate,
+                      NULL);
+        if (self->frame_ring_format != NULL)
+            g_object_set (self->frame_ring, "format", self->frame_ring_format, NULL);
+        gst_bin_add_many (GST_BIN (self->pipeline), frame_ring_queue, self->frame_ring, NULL);
+
+        if (!gst_element_link_many (self->decoder_tee, frame_ring_queue, self->frame_ring, NULL))
+        {
+            g_critical ("Couldn't link decoder pipeline to frame ring!");
+            return FALSE;
+        }
+    }
+
+    if (self->live_mode == MATI_LIVE_PASSTHROUGH)
+    {
+        g_autoptr (GstCaps) cached_caps = self->cached_caps != NULL ? gst_caps_from_string (self->cached_caps) : NULL;
+
+        /* Whether the camera stream can go out as is depends on its
+         * profile, a fast start trusts the one of the last run and has the
+         * streamer ready before the camera answers. The caps probe sets it
+         * up otherwise, and rebuilds it if the guess was wrong. */
+        if (cached_caps != NULL && !gst_caps_is_empty (cached_caps))
+        {
+            self->caps_from_cache = TRUE;
+            self->input_profile = g_strdup (gst_structure_get_string (gst_caps_get_structure (cached_caps, 0), "profile"));
+            mati_detector_idle_add (self, mati_detector_setup_passthrough);
+        }
+    }
+    else
+    {
+        self->streamer_source = self->decoder_tee;
+        self->streamer_bin = build_streamer (self, self->live_mode == MATI_LIVE_SHARED);
+        gst_bin_add (GST_BIN (self->pipeline), self->streamer_bin);
+
+        /* Linked from the start so webrtcsink learns the caps before the
+         * first consumer, detached again when nobody connects */
+        mati_detector_attach_streamer (self);
+        if (self->streamer_tee_pad == NULL)
+            return FALSE;
+        mati_detector_idle_add (self, mati_detector_update_streamer);
+    }
+
+    if (!gst_element_link_many (self->tee, recording_queue, self->preroll, self->recording_tee, NULL))
     {
-        g_critical ("Couldn't link common pipeline to recording buffer!");
+        g_critical ("Couldn't link common pipeline to pre-roll!");
         return FALSE;
     }
 
+    self->build_time = g_get_monotonic_time ();
     return TRUE;
 }
 
-JsonNode *
-mati_detector_get_diagnostics (MatiDetector *self)
+static void
+add_startup_time (JsonObject *object,
+                  const char *name,
+                  gint64      time,
+                  gint64      start)
+{
+    if (time != 0)
+        json_object_set_double_member (object, name, (time - start) / 1000.0);
+}
+
+/* Only called on the detector thread, which owns most of what is read */
+static JsonNode *
+mati_detector_build_diagnostics (MatiDetector *self)
 {
     JsonNode *json_node = json_node_alloc ();
     JsonObject *diagnostics_object = json_object_new ();
     JsonObject *input_object = json_object_new ();
     JsonObject *webrtc_object = json_object_new ();
     JsonObject *decoder_object = json_object_new ();
+    JsonObject *branches_object = json_object_new ();
+    JsonArray *threads_array = json_array_new ();
     g_autoptr (GstElement) rtspsrc = gst_bin_get_by_name (GST_BIN (self->pipeline), RTSPSRC_NAME);
     g_autoptr (GstElement) webrtcsink = gst_bin_get_by_name (GST_BIN (self->pipeline), WEBRTCSINK_NAME);
 
-    if (!GST_IS_BIN (rtspsrc) || !GST_IS_BIN (webrtcsink))
+    MatiStatsSnapshot input_stats, decoder_stats;
+    MatiDecodeGateStats gate_stats;
+
+    /* Gone for a moment while reconnecting */
+    if (rtspsrc != NULL)
     {
-        g_critical ("Couldn't get rtspsrc or webrtcsink elements!");
-        return json_node_init_object (json_node, diagnostics_object);
+        guint64 connectionspeed;
+        guint latency;
+        int buffersize;
+        g_autofree char *uri = NULL;
+
+        g_object_get (rtspsrc,
+                      "udp-buffer-size", &buffersize,
+                      "connection-speed", &connectionspeed,
+                      "location", &uri,
+                      "latency", &latency, NULL);
+        json_object_set_int_member (input_object, "udp-buffer-size", buffersize);
+        json_object_set_int_member (input_object, "connection-speed", connectionspeed);
+        json_object_set_string_member (input_object, "uri", uri);
+        json_object_set_int_member (input_object, "latency", latency);
     }
-
-    gint64 bufferduration, connectionspeed, latency;
-    int buffersize;
-    g_autofree char *uri;
-
-    g_object_get (rtspsrc,
-                  "udp-buffer-size", &buffersize,
-                  "connection-speed", &connectionspeed,
-                  "location", &uri, 
-                  "latency", &latency, NULL);
-    json_object_set_int_member (input_object, "udp-buffer-size", buffersize);
-    json_object_set_int_member (input_object, "connection-speed", connectionspeed);
-    json_object_set_string_member (input_object, "uri", uri);
-    json_object_set_int_member (input_object, "latency", latency);
+    json_object_set_boolean_member (input_object, "reconnecting", self->reconnecting);
+    json_object_set_int_member (input_object, "reconnects", self->reconnects);
+    json_object_set_int_member (input_object, "reconnect-attempts", self->reconnect_attempts);
+    json_object_set_int_member (input_object, "reconnect-delay", self->reconnect_delay);
+    json_object_set_double_member (input_object, "last-reconnect-time", self->last_reconnect_time);
+    mati_stats_snapshot (self->input_stats, &input_stats);
+    json_object_set_double_member (input_object, "framerate", input_stats.framerate);
+    json_object_set_double_member (input_object, "jitter", input_stats.jitter);
+    json_object_set_double_member (input_object, "bitrate", input_stats.bitrate);
+    json_object_set_int_member (input_object, "frames", input_stats.frames);
+    json_object_set_int_member (input_object, "bytes", input_stats.bytes);
 
     json_object_set_boolean_member (diagnostics_object, "is-in-motion", self->is_in_motion);
+
+    /* Milliseconds since the process started, missing until reached */
+    JsonObject *startup_object = json_object_new ();
+    json_object_set_boolean_member (startup_object, "fast-start", self->fast_start);
+    json_object_set_string_member (startup_object, "transport", self->rtsp_transport ? self->rtsp_transport : "auto");
+    json_object_set_boolean_member (startup_object, "cached-caps", self->caps_from_cache);
+    json_object_set_boolean_member (startup_object, "steady-latency", !self->fast_start || self->steady_latency);
+    add_startup_time (startup_object, "built", self->build_time, self->process_start);
+    add_startup_time (startup_object, "rtsp-described", startup_time_get (&self->sdp_time), self->process_start);
+    add_startup_time (startup_object, "rtsp-connected", self->connected_time, self->process_start);
+    add_startup_time (startup_object, "first-buffer", startup_time_get (&self->first_buffer_time), self->process_start);
+    add_startup_time (startup_object, "first-keyframe", startup_time_get (&self->first_keyframe_time), self->process_start);
+    add_startup_time (startup_object, "first-frame", startup_time_get (&self->first_frame_time), self->process_start);
+    json_object_set_object_member (diagnostics_object, "startup", startup_object);
     json_object_set_object_member (diagnostics_object, "input", input_object);
 
-    GStrv *webrtc_sessions;
-    guint min_bitrate, max_bitrate;
-    char *stun_server;
-    GstValueArray *turn_servers;
-    // JsonArray *turn_server_array = json_array_new ();
-    GstCaps *video_caps;
-    g_signal_emit_by_name (webrtcsink, "get-sessions", &webrtc_sessions);
-    g_object_get (webrtcsink,
-                  "min-bitrate", &min_bitrate,
-                  "max-bitrate", &max_bitrate,
-                  "stun-server", &stun_server,
-                  "turn-servers", &turn_servers,
-                  "video-caps", &video_caps, NULL);
-    json_object_set_int_member (webrtc_object, "min-bitrate", min_bitrate);
-    json_object_set_int_member (webrtc_object, "max-bitrate", max_bitrate);
-    json_object_set_string_member (webrtc_object, "stun-server", stun_server);
-    // for (int i = 0; i < gst_value_array_get_size (turn_servers); i++)
-    // {
-    //     json_array_add_string_element (turn_server_array, g_value_get_string (gst_value_array_get_value (turn_servers, i)));
-    // }
-    // json_object_set_array_member (webrtcsink, "turn-servers", turn_server_array);
-    json_object_set_string_member (webrtc_object, "video-caps", gst_caps_to_string (video_caps));
-    json_object_set_int_member (webrtc_object, "consumers", g_strv_length (webrtc_sessions));
-    json_object_set_string_member (webrtc_object, "peer-id", self->peer_id);
-    json_object_set_object_member (diagnostics_object, "webrtc", webrtc_object);
-
-    json_object_set_double_member (decoder_object, "framerate", self->framerate);
-    json_object_set_int_member (decoder_object, "last-frame-buffer", self->last_frame_buffer);
+    /* Passthrough only builds the streamer once the input caps are known */
+    if (webrtcsink != NULL)
+    {
+        g_auto (GStrv) webrtc_sessions = NULL;
+        guint min_bitrate, max_bitrate;
+        g_autofree char *stun_server = NULL;
+        g_autoptr (GstCaps) video_caps = NULL;
+        g_autofree char *video_caps_string = NULL;
+
+        g_signal_emit_by_name (webrtcsink, "get-sessions", &webrtc_sessions);
+        g_object_get (webrtcsink,
+                      "min-bitrate", &min_bitrate,
+                      "max-bitrate", &max_bitrate,
+                      "stun-server", &stun_server,
+                      "video-caps", &video_caps, NULL);
+        video_caps_string = video_caps != NULL ? gst_caps_to_string (video_caps) : g_strdup ("");
+        json_object_set_int_member (webrtc_object, "min-bitrate", min_bitrate);
+        json_object_set_int_member (webrtc_object, "max-bitrate", max_bitrate);
+        json_object_set_string_member (webrtc_object, "stun-server", stun_server);
+        json_object_set_string_member (webrtc_object, "video-caps", video_caps_string);
+        json_object_set_int_member (webrtc_object, "consumers", g_strv_length (webrtc_sessions));
+        json_object_set_boolean_member (webrtc_object, "attached", self->streamer_tee_pad != NULL);
+        json_object_set_int_member (webrtc_object, "attaches", self->streamer_attaches);
+        json_object_set_string_member (webrtc_object, "encoder-mode", mati_live_mode_to_string (self->live_mode));
+        if (self->live_encoder != NULL)
+        {
+            guint keyframe_requests, keyframes_forced;
+
+            mati_live_encoder_get_stats (MATI_LIVE_ENCODER (self->live_encoder), &keyframe_requests, &keyframes_forced);
+            json_object_set_int_member (webrtc_object, "encoders", self->streamer_tee_pad != NULL ? 1 : 0);
+            json_object_set_int_member (webrtc_object, "keyframe-requests", keyframe_requests);
+            json_object_set_int_member (webrtc_object, "keyframes-forced", keyframes_forced);
+        }
+        else
+        {
+            json_object_set_int_member (webrtc_object, "encoders",
+                                        self->streamer_source == self->tee ? 0 : g_strv_length (webrtc_sessions));
+        }
+        json_object_set_boolean_member (webrtc_object, "passthrough", self->streamer_source == self->tee);
+        if (self->input_profile != NULL)
+            json_object_set_string_member (webrtc_object, "input-profile", self->input_profile);
+        json_object_set_string_member (webrtc_object, "peer-id", self->peer_id);
+        json_object_set_object_member (diagnostics_object, "webrtc", webrtc_object);
+    }
+    else
+    {
+        json_object_unref (webrtc_object);
+    }
+
+    mati_stats_snapshot (self->decoder_stats, &decoder_stats);
+    json_object_set_double_member (decoder_object, "framerate", decoder_stats.framerate);
+    json_object_set_double_member (decoder_object, "jitter", decoder_stats.jitter);
+    json_object_set_int_member (decoder_object, "frames", decoder_stats.frames);
+    json_object_set_int_member (decoder_object, "last-frame-buffer", decoder_stats.last_frame_time);
+    json_object_set_boolean_member (decoder_object, "frame-timeout", self->frame_timeout_reached);
+    mati_decode_gate_get_stats (self->decode_gate, &gate_stats);
+    json_object_set_boolean_member (decoder_object, "gate-open", gate_stats.open);
+    json_object_set_double_member (decoder_object, "gate-activity", gate_stats.activity);
+    json_object_set_int_member (decoder_object, "gate-passed", gate_stats.passed);
+    json_object_set_int_member (decoder_object, "gate-dropped", gate_stats.dropped);
+    json_object_set_string_member (decoder_object, "idle-mode", mati_decode_idle_mode_to_string (self->decode_idle_mode));
+    json_object_set_int_member (decoder_object, "switches-to-full", gate_stats.switches_to_full);
+    json_object_set_int_member (decoder_object, "switches-to-idle", gate_stats.switches_to_idle);
     json_object_set_object_member (diagnostics_object, "decoder", decoder_object);
 
-    if (self->is_in_motion)
+    for (guint i = 0; i < self->branches->len; i++)
+    {
+        MatiBranch *branch = g_ptr_array_index (self->branches, i);
+        JsonObject *branch_object = json_object_new ();
+        MatiBranchStats branch_stats;
+
+        mati_branch_get_stats (branch, &branch_stats);
+        json_object_set_string_member (branch_object, "policy", mati_branch_policy_to_string (branch_stats.policy));
+        json_object_set_int_member (branch_object, "passed", branch_stats.passed);
+        json_object_set_int_member (branch_object, "dropped", branch_stats.dropped);
+        json_object_set_int_member (branch_object, "dropped-bytes", branch_stats.dropped_bytes);
+        json_object_set_int_member (branch_object, "overruns", branch_stats.overruns);
+        json_object_set_int_member (branch_object, "level-buffers", branch_stats.level_buffers);
+        json_object_set_int_member (branch_object, "level-bytes", branch_stats.level_bytes);
+        json_object_set_int_member (branch_object, "high-water-buffers", branch_stats.high_water_buffers);
+        json_object_set_int_member (branch_object, "high-water-bytes", branch_stats.high_water_bytes);
+        json_object_set_object_member (branches_object, mati_branch_get_name (branch), branch_object);
+    }
+    json_object_set_object_member (diagnostics_object, "branches", branches_object);
+
+    g_autoptr (GArray) threads = mati_thread_policy_get_threads (self->thread_policy);
+    for (guint i = 0; i < threads->len; i++)
+    {
+        MatiThreadInfo *thread = &g_array_index (threads, MatiThreadInfo, i);
+        JsonObject *thread_object = json_object_new ();
+
+        json_object_set_string_member (thread_object, "name", thread->name);
+        json_object_set_string_member (thread_object, "class", mati_thread_class_to_string (thread->thread_class));
+        json_object_set_int_member (thread_object, "tid", thread->tid);
+        json_object_set_int_member (thread_object, "nice", thread->nice);
+        json_object_set_int_member (thread_object, "cpu-time", thread->cpu_time);
+        json_array_add_object_element (threads_array, thread_object);
+    }
+    json_object_set_array_member (diagnostics_object, "threads", threads_array);
+
+    if (self->thumbnailer != NULL)
+    {
+        JsonObject *thumbnail_object = json_object_new ();
+        guint published;
+        gsize size;
+
+        mati_thumbnailer_get_stats (MATI_THUMBNAILER (self->thumbnailer), &published, &size);
+        json_object_set_int_member (thumbnail_object, "width", self->thumbnail_width);
+        json_object_set_int_member (thumbnail_object, "published", published);
+        json_object_set_int_member (thumbnail_object, "size", size);
+        json_object_set_object_member (diagnostics_object, "thumbnail", thumbnail_object);
+    }
+
+    if (self->frame_ring != NULL)
+    {
+        JsonObject *frame_ring_object = json_object_new ();
+        guint64 frames;
+        guint rings;
+
+        mati_frame_ring_get_stats (MATI_FRAME_RING (self->frame_ring), &frames, &rings);
+        json_object_set_int_member (frame_ring_object, "frames", frames);
+        json_object_set_int_member (frame_ring_object, "rings", rings);
+        json_object_set_object_member (diagnostics_object, "frame-ring", frame_ring_object);
+    }
+
+    guint64 preroll_bytes;
+    GstClockTime preroll_duration;
+    guint preroll_keyframes;
+    JsonObject *recording_object = json_object_new ();
+
+    mati_preroll_get_stats (MATI_PREROLL (self->preroll), &preroll_bytes, &preroll_duration, &preroll_keyframes);
+    json_object_set_int_member (recording_object, "preroll-bytes", preroll_bytes);
+    json_object_set_int_member (recording_object, "preroll-duration", preroll_duration / GST_MSECOND);
+    json_object_set_int_member (recording_object, "preroll-keyframes", preroll_keyframes);
+    json_object_set_int_member (recording_object, "preroll-time", self->preroll_time / GST_MSECOND);
+    json_object_set_int_member (recording_object, "preroll-max-bytes", self->preroll_bytes);
+    json_object_set_int_member (recording_object, "postroll-time", self->postroll_time / GST_MSECOND);
+    json_object_set_string_member (recording_object, "state", mati_recording_state_to_string (self->recording_state));
+    json_object_set_int_member (recording_object, "finalizing", g_list_length (self->finalizing_bins));
+    json_object_set_int_member (recording_object, "finalized", self->recordings_finalized);
+    json_object_set_string_member (recording_object, "format", mati_recording_format_to_string (self->format));
+    json_object_set_int_member (recording_object, "segment-time", self->segment_time / GST_MSECOND);
+    json_object_set_int_member (recording_object, "segment-bytes", self->segment_bytes);
+    json_object_set_int_member (recording_object, "ram-used", mati_writer_get_ram_used ());
+    json_object_set_object_member (diagnostics_object, "recording", recording_object);
+
+    if (self->file_sink_bin != NULL)
     {
         JsonObject *filesink_object = json_object_new ();
-        g_autoptr (GstElement) filesink = gst_bin_get_by_name (self->file_sink_bin, FILESINK_NAME);
-        int filesink_buffersize;
-        g_autofree *filelocation;
-        gboolean dropframes;
-        JsonObject* json_object = json_object_new ();
+        g_autoptr (GstElement) writer = NULL;
 
-        g_object_get (filesink,
-                      "buffer-size", &filesink_buffersize,
-                      "location", &filelocation, NULL);
+        g_mutex_lock (&self->recording_lock);
+        json_object_set_string_member (filesink_object, "file-location", self->recording_location);
+        json_object_set_int_member (filesink_object, "segments", self->recording_segments);
+        if (self->writer != NULL)
+            writer = gst_object_ref (self->writer);
+        g_mutex_unlock (&self->recording_lock);
 
-        json_object_set_int_member (filesink_object, "filesink-buffer-size", filesink_buffersize);
-        json_object_set_string_member (filesink_object, "file-location", filelocation);
+        if (writer != NULL)
+        {
+            MatiWriterStats writer_stats;
+
+            mati_writer_get_stats (MATI_WRITER (writer), &writer_stats);
+            json_object_set_int_member (filesink_object, "bytes-written", writer_stats.bytes_written);
+            json_object_set_int_member (filesink_object, "queued-bytes", writer_stats.queued_bytes);
+            json_object_set_int_member (filesink_object, "max-queued-bytes", writer_stats.max_queued_bytes);
+            json_object_set_int_member (filesink_object, "writes", writer_stats.writes);
+            json_object_set_int_member (filesink_object, "stalls", writer_stats.stalls);
+            json_object_set_double_member (filesink_object, "write-latency", writer_stats.write_latency);
+            json_object_set_double_member (filesink_object, "max-write-latency", writer_stats.max_write_latency);
+            json_object_set_int_member (filesink_object, "ram-staged", writer_stats.ram_staged);
+            json_object_set_boolean_member (filesink_object, "ram-fallback", writer_stats.ram_fallback);
+        }
 
         json_object_set_object_member (diagnostics_object, "active-file-bin", filesink_object);
     }
 
+    if (self->retention != NULL)
+    {
+        JsonObject *retention_object = json_object_new ();
+        MatiRetentionStats retention_stats;
+
+        mati_retention_get_stats (self->retention, self->source_id, &retention_stats);
+        json_object_set_int_member (retention_object, "files", retention_stats.files);
+        json_object_set_int_member (retention_object, "bytes", retention_stats.bytes);
+        json_object_set_int_member (retention_object, "total-files", retention_stats.total_files);
+        json_object_set_int_member (retention_object, "total-bytes", retention_stats.total_bytes);
+        json_object_set_int_member (retention_object, "prune-runs", retention_stats.prune_runs);
+        json_object_set_int_member (retention_object, "pruned-files", retention_stats.pruned_files);
+        json_object_set_int_member (retention_object, "pruned-bytes", retention_stats.pruned_bytes);
+        json_object_set_int_member (retention_object, "prune-errors", retention_stats.prune_errors);
+        json_object_set_double_member (retention_object, "last-prune-time", retention_stats.last_prune_time);
+        json_object_set_double_member (retention_object, "scan-time", retention_stats.scan_time);
+        json_object_set_object_member (diagnostics_object, "retention", retention_object);
+    }
+
+    if (self->http_stream != NULL)
+    {
+        JsonObject *http_object = json_object_new ();
+        MatiHttpServerStats http_stats;
+        guint64 fragments, bytes;
+
+        mati_http_stream_get_stats (MATI_HTTP_STREAM (self->http_stream), &fragments, &bytes);
+        mati_http_server_get_stats (self->http_server, &http_stats);
+        json_object_set_int_member (http_object, "fragments", fragments);
+        json_object_set_int_member (http_object, "fragment-bytes", bytes);
+        json_object_set_int_member (http_object, "clients", http_stats.clients);
+        json_object_set_int_member (http_object, "requests", http_stats.requests);
+        json_object_set_int_member (http_object, "clients-dropped", http_stats.clients_dropped);
+        json_object_set_int_member (http_object, "fragments-skipped", http_stats.fragments_skipped);
+        json_object_set_int_member (http_object, "bytes-sent", http_stats.bytes_sent);
+        json_object_set_object_member (diagnostics_object, "http", http_object);
+    }
+
     return json_node_init_object (json_node, diagnostics_object);
 }
+
+/* Publishes a new snapshot as JSON for GetDiagnostics and as the Stats
+ * property, whose changes go out in one PropertiesChanged per interval */
+static gboolean
+mati_detector_refresh_diagnostics (gpointer user_data)
+{
+    MatiDetector *self = MATI_DETECTOR (user_data);
+    g_autoptr (JsonNode) diagnostics = mati_detector_build_diagnostics (self);
+    g_autoptr (GVariant) stats = g_variant_ref_sink (json_gvariant_serialize (diagnostics));
+    gchar *json = json_to_string (diagnostics, FALSE);
+
+    g_mutex_lock (&self->diagnostics_lock);
+    g_free (self->diagnostics);
+    self->diagnostics = json;
+    g_mutex_unlock (&self->diagnostics_lock);
+
+    mati_communicator_set_stats (self->communicator, stats);
+    return G_SOURCE_CONTINUE;
+}
+
+/* The last snapshot as JSON, never touches the pipeline */
+gchar *
+mati_detector_get_diagnostics (MatiDetector *self)
+{
+    gchar *diagnostics;
+
+    g_return_val_if_fail (MATI_IS_DETECTOR (self), NULL);
+
+    g_mutex_lock (&self->diagnostics_lock);
+    diagnostics = g_strdup (self->diagnostics);
+    g_mutex_unlock (&self->diagnostics_lock);
+    return diagnostics;
+}
@@ -6,6 +6,11 @@
 #include <gst/gst.h>
 
 #include "mati-communicator.h"
+#include "mati-decode-gate.h"
+#include "mati-http-server.h"
+#include "mati-live-encoder.h"
+#include "mati-recording.h"
+#include "mati-retention.h"
 
 G_BEGIN_DECLS
 
@@ -20,8 +25,64 @@ void mati_detector_start (MatiDetector *self);
 
 GstStateChangeReturn mati_detector_stop (MatiDetector *self);
 
+void mati_detector_set_recording_options (MatiDetector *self,
+                                          guint64       preroll_time,
+                                          guint64       preroll_bytes,
+                                          guint64       postroll_time);
+
+void mati_detector_set_segment_options (MatiDetector        *self,
+                                        MatiRecordingFormat  format,
+                                        guint64              segment_time,
+                                        guint64              segment_bytes);
+
+void mati_detector_set_writer_options (MatiDetector *self,
+                                       gboolean      direct_io,
+                                       gboolean      sync_writes,
+                                       gboolean      ram_staging);
+
+void mati_detector_set_retention (MatiDetector  *self,
+                                  MatiRetention *retention);
+
+void mati_detector_set_export_options (MatiDetector *self,
+                                       const gchar  *export_dir);
+
+void mati_detector_set_http_server (MatiDetector   *self,
+                                    MatiHttpServer *http_server);
+
+void mati_detector_set_analysis_options (MatiDetector *self,
+                                         gint          analysis_width,
+                                         gint          analysis_fps);
+
+void mati_detector_set_thumbnail_options (MatiDetector *self,
+                                          guint         thumbnail_width);
+
+void mati_detector_set_frame_ring_options (MatiDetector *self,
+                                           guint         width,
+                                           gint          max_rate,
+                                           const gchar  *format);
+
+void mati_detector_set_startup_options (MatiDetector *self,
+                                        gint64        process_start,
+                                        gboolean      fast_start,
+                                        const gchar  *rtsp_transport);
+
+void mati_detector_set_live_options (MatiDetector  *self,
+                                     MatiLiveMode   live_mode,
+                                     gchar        **passthrough_profiles);
+
+void mati_detector_set_decoder_options (MatiDetector       *self,
+                                        MatiDecodeIdleMode  idle_mode,
+                                        gdouble             decode_gate_threshold);
+
+void mati_detector_set_thread_options (MatiDetector  *self,
+                                       guint          decoder_threads,
+                                       gchar        **thread_rules);
+
+void mati_detector_set_diagnostics_options (MatiDetector *self,
+                                            guint         stats_interval);
+
 gboolean mati_detector_build (MatiDetector *self, gchar *uri);
 
-JsonNode* mati_detector_get_diagnostics (MatiDetector *self);
+gchar *mati_detector_get_diagnostics (MatiDetector *self);
 
 G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,717 @@
+#include "mati-export.h"
+
+#include "mati-index.h"
+#include "mati-thread-policy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#define EXPORT_NICE 10
+#define PREROLL_TIMEOUT (10 * GST_SECOND)
+#define PROGRESS_INTERVAL (500 * G_TIME_SPAN_MILLISECOND)
+#define MAX_GAP G_USEC_PER_SEC // longer gaps between recordings are cut out
+#define GAP_KEPT (G_USEC_PER_SEC / 25)
+#define OUTPUT_QUEUE_BYTES (8 * 1024 * 1024)
+#define OUTPUT_POLL (100 * GST_MSECOND)
+#define OUTPUT_STALL_TIMEOUT (30 * G_TIME_SPAN_SECOND) // without the output taking anything
+#define PARSED_CAPS "video/x-h264,stream-format=byte-stream,alignment=au"
+
+typedef struct
+{
+    gchar *location;        // NULL for the pre-roll
+    gint64 start;           // wall-clock of PTS 0
+    gint64 seek_time;
+    GstBufferList *buffers; // pre-roll only
+    GstCaps *caps;
+} MatiExportSource;
+
+/* Copies a time range into one file without decoding. The range is read
+ * from the recordings overlapping it, each seeked to the keyframe at or
+ * before the start, followed by the pre-roll for what isn't on disk yet.
+ * Every source goes through its own reader pipeline into one muxer, with
+ * timestamps rebased to the clip and gaps between recordings cut out.
+ *
+ * Everything runs on a worker thread with a lower priority. The streaming
+ * threads of its pipelines come from a task pool and inherit nothing, a
+ * thread policy of the export runs them on dedicated threads niced the
+ * same way, so an export competes with nothing the live pipelines do.
+ * Progress and the result are reported on the main context of whoever
+ * started it. All times are wall-clock in microseconds. */
+struct _MatiExport
+{
+    guint id;
+    gint64 from;
+    gint64 to;
+    gchar *location;
+    GPtrArray *sources;
+
+    MatiExportProgressFunc progress;
+    MatiExportFinishedFunc finished;
+    gpointer user_data;
+    GDestroyNotify user_data_free;
+    GMainContext *context;
+
+    /* Worker thread only */
+    MatiThreadPolicy *thread_policy;
+    GstElement *output;
+    GstElement *appsrc;
+    GstBus *output_bus;
+    gint output_fd;
+    gboolean output_created; // only a file this export created is removed on failure
+    GstCaps *output_caps;
+    gboolean started;
+    gint64 origin;      // first exported buffer
+    gint64 last_time;   // last exported buffer
+    gint64 skipped;     // gaps cut out so far
+    gint64 last_progress;
+    gchar *error;
+};
+
+typedef struct
+{
+    MatiExport *export;
+    gdouble progress;
+    gboolean finished;
+} MatiExportUpdate;
+
+static void
+mati_export_source_free (MatiExportSource *source)
+{
+    g_free (source->location);
+    g_clear_pointer (&source->buffers, gst_buffer_list_unref);
+    gst_clear_caps (&source->caps);
+    g_free (source);
+}
+
+static void
+mati_export_free (MatiExport *self)
+{
+    if (self->user_data_free != NULL)
+        self->user_data_free (self->user_data);
+    g_ptr_array_unref (self->sources);
+    g_main_context_unref (self->context);
+    gst_clear_caps (&self->output_caps);
+    g_free (self->location);
+    g_free (self->error);
+    g_free (self);
+}
+
+static gboolean
+mati_export_dispatch (gpointer user_data)
+{
+    MatiExportUpdate *update = user_data;
+    MatiExport *self = update->export;
+
+    if (update->finished)
+    {
+        if (self->finished != NULL)
+            self->finished (self->id, self->error == NULL, self->error != NULL ? self->error : self->location, self->user_data);
+        mati_export_free (self);
+    }
+    else if (self->progress != NULL)
+    {
+        self->progress (self->id, update->progress, self->user_data);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Updates are dispatched in order, the last one frees the export */
+static void
+mati_export_post (MatiExport *self,
+                  gdouble     progress,
+                  gboolean    finished)
+{
+    MatiExportUpdate *update = g_new0 (MatiExportUpdate, 1);
+
+    update->export = self;
+    update->progress = progress;
+    update->finished = finished;
+    g_main_context_invoke_full (self->context, G_PRIORITY_DEFAULT, mati_export_dispatch, update, g_free);
+}
+
+static void
+mati_export_fail (MatiExport *self,
+                  const char *format,
+                  ...)
+{
+    va_list args;
+
+    if (self->error != NULL)
+        return;
+
+    va_start (args, format);
+    self->error = g_strdup_vprintf (format, args);
+    va_end (args);
+}
+
+/* Never raises the priority, that needs privileges */
+static gint
+mati_export_get_nice (void)
+{
+    gint nice = 0;
+
+#ifdef __linux__
+    errno = 0;
+    nice = getpriority (PRIO_PROCESS, syscall (SYS_gettid));
+    if (errno != 0)
+        nice = 0;
+#endif
+    return MIN (MAX (nice, EXPORT_NICE), 19);
+}
+
+static void
+mati_export_lower_priority (gint nice)
+{
+#ifdef __linux__
+    if (setpriority (PRIO_PROCESS, syscall (SYS_gettid), nice) != 0)
+        g_debug ("couldn't lower export priority: %s", g_strerror (errno));
+#endif
+}
+
+/* Has to be created before the worker lowers its own priority, the policy
+ * takes the current one as the default and only moves tasks of a class
+ * niced differently off the shared task pool */
+static void
+mati_export_create_thread_policy (MatiExport *self,
+                                  gint        nice)
+{
+    g_autofree gchar *id = g_strdup_printf ("%u", self->id);
+    g_autofree gchar *rule = g_strdup_printf ("io=:%d", nice);
+    g_autoptr (GError) error = NULL;
+
+    self->thread_policy = mati_thread_policy_new (id);
+    mati_thread_policy_add_branch (self->thread_policy, "export", MATI_THREAD_IO, "exp");
+    if (!mati_thread_policy_set_rule (self->thread_policy, rule, &error))
+        g_warning ("couldn't lower export priority: %s", error->message);
+}
+
+static GstElement *
+mati_export_new_pipeline (MatiExport *self,
+                          const char *name)
+{
+    GstElement *pipeline = gst_pipeline_new (name);
+    g_autoptr (GstBus) bus = gst_element_get_bus (pipeline);
+
+    mati_thread_policy_attach (self->thread_policy, bus);
+    return pipeline;
+}
+
+/* Never replaces anything, neither an existing file nor what a symlink
+ * points to */
+static gboolean
+mati_export_create_output (MatiExport *self)
+{
+    g_autofree gchar *directory = g_path_get_dirname (self->location);
+
+    if (g_mkdir_with_parents (directory, 0755) != 0)
+    {
+        mati_export_fail (self, "Couldn't create %s: %s", directory, g_strerror (errno));
+        return FALSE;
+    }
+
+    self->output_fd = open (self->location, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (self->output_fd < 0)
+    {
+        mati_export_fail (self, "Couldn't create %s: %s", self->location, g_strerror (errno));
+        return FALSE;
+    }
+    self->output_created = TRUE;
+    return TRUE;
+}
+
+static gboolean
+mati_export_build_output (MatiExport *self)
+{
+    GstElement *parse, *mux, *sink;
+
+    self->output = mati_export_new_pipeline (self, "export-output");
+    self->appsrc = gst_element_factory_make ("appsrc", NULL);
+    parse = gst_element_factory_make ("h264parse", NULL);
+    mux = gst_element_factory_make (g_str_has_suffix (self->location, ".mp4") ? "mp4mux" : "matroskamux", NULL);
+    sink = gst_element_factory_make ("fdsink", NULL);
+    if (self->appsrc == NULL || parse == NULL || mux == NULL || sink == NULL)
+    {
+        mati_export_fail (self, "Missing elements to export a clip");
+        return FALSE;
+    }
+
+    if (!mati_export_create_output (self))
+        return FALSE;
+
+    /* Never blocks, mati_export_wait_output keeps the queue bounded and
+     * notices when the output fails */
+    g_object_set (self->appsrc,
+                  "format", GST_FORMAT_TIME,
+                  "block", FALSE,
+                  "max-bytes", (guint64) OUTPUT_QUEUE_BYTES,
+                  NULL);
+    g_object_set (sink, "fd", self->output_fd, NULL);
+    self->output_bus = gst_element_get_bus (self->output);
+
+    gst_bin_add_many (GST_BIN (self->output), self->appsrc, parse, mux, sink, NULL);
+    if (!gst_element_link_many (self->appsrc, parse, mux, sink, NULL))
+    {
+        mati_export_fail (self, "Couldn't link the export pipeline");
+        return FALSE;
+    }
+
+    if (gst_element_set_state (self->output, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+    {
+        mati_export_fail (self, "Couldn't open %s", self->location);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+on_parsebin_pad_added (GstElement *parsebin,
+                       GstPad     *pad,
+                       GstElement *parse)
+{
+    g_autoptr (GstPad) sink_pad = gst_element_get_static_pad (parse, "sink");
+
+    /* Recordings only hold video, the first stream is the one */
+    if (!gst_pad_is_linked (sink_pad) && GST_PAD_LINK_FAILED (gst_pad_link (pad, sink_pad)))
+        GST_WARNING_OBJECT (parsebin, "couldn't link %s", GST_PAD_NAME (pad));
+}
+
+static GstElement *
+mati_export_build_reader (MatiExport        *self,
+                          MatiExportSource  *source,
+                          GstElement       **appsink)
+{
+    GstElement *pipeline = mati_export_new_pipeline (self, "export-reader");
+    GstElement *parse = gst_element_factory_make ("h264parse", NULL);
+    GstElement *filter = gst_element_factory_make ("capsfilter", NULL);
+    g_autoptr (GstCaps) caps = gst_caps_from_string (PARSED_CAPS);
+
+    *appsink = gst_element_factory_make ("appsink", NULL);
+    g_return_val_if_fail (parse != NULL && filter != NULL && *appsink != NULL, NULL);
+
+    /* Parameter sets in band so the output can switch between sources */
+    g_object_set (parse, "config-interval", -1, NULL);
+    g_object_set (filter, "caps", caps, NULL);
+    g_object_set (*appsink, "sync", FALSE, "max-buffers", 64, NULL);
+    gst_bin_add_many (GST_BIN (pipeline), parse, filter, *appsink, NULL);
+    gst_element_link_many (parse, filter, *appsink, NULL);
+
+    if (source->location != NULL)
+    {
+        GstElement *filesrc = gst_element_factory_make ("filesrc", NULL);
+        GstElement *parsebin = gst_element_factory_make ("parsebin", NULL);
+
+        g_return_val_if_fail (filesrc != NULL && parsebin != NULL, NULL);
+        g_object_set (filesrc, "location", source->location, NULL);
+        g_signal_connect (parsebin, "pad-added", G_CALLBACK (on_parsebin_pad_added), parse);
+        gst_bin_add_many (GST_BIN (pipeline), filesrc, parsebin, NULL);
+        gst_element_link (filesrc, parsebin);
+    }
+    else
+    {
+        GstElement *appsrc = gst_element_factory_make ("appsrc", NULL);
+
+        g_return_val_if_fail (appsrc != NULL, NULL);
+        g_object_set (appsrc, "format", GST_FORMAT_TIME, "caps", source->caps, "max-bytes", (guint64) 0, NULL);
+        gst_bin_add (GST_BIN (pipeline), appsrc);
+        gst_element_link (appsrc, parse);
+        gst_app_src_push_buffer_list (GST_APP_SRC (appsrc), gst_buffer_list_ref (source->buffers));
+        gst_app_src_end_of_stream (GST_APP_SRC (appsrc));
+    }
+
+    return pipeline;
+}
+
+/* The pre-roll overlaps the recordings, it starts at the keyframe after
+ * what was exported already or at the last one before the range */
+static void
+mati_export_trim_preroll (MatiExport       *self,
+                          MatiExportSource *source)
+{
+    guint length = gst_buffer_list_length (source->buffers);
+    guint first = length;
+
+    for (guint i = 0; i < length; i++)
+    {
+        GstBuffer *buffer = gst_buffer_list_get (source->buffers, i);
+        gint64 time = source->start + GST_BUFFER_PTS (buffer) / GST_USECOND;
+
+        if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT) || !GST_BUFFER_PTS_IS_VALID (buffer))
+            continue;
+
+        if (self->started)
+        {
+            if (time > self->last_time)
+            {
+                first = i;
+                break;
+            }
+        }
+        else
+        {
+            if (first == length || time <= self->from)
+                first = i;
+            if (time > self->from)
+                break;
+        }
+    }
+
+    if (first > 0)
+        gst_buffer_list_remove (source->buffers, 0, first);
+}
+
+static gboolean
+mati_export_check_output (MatiExport   *self,
+                          GstClockTime  timeout)
+{
+    g_autoptr (GstMessage) message = gst_bus_timed_pop_filtered (self->output_bus, timeout, GST_MESSAGE_ERROR);
+    g_autoptr (GError) error = NULL;
+
+    if (message == NULL)
+        return TRUE;
+
+    gst_message_parse_error (message, &error, NULL);
+    mati_export_fail (self, "Couldn't write %s: %s", self->location, error->message);
+    return FALSE;
+}
+
+/* Waits until the output took enough of what was pushed. Fails on an
+ * error of the output pipeline or when it stops taking anything. */
+static gboolean
+mati_export_wait_output (MatiExport *self)
+{
+    guint64 level = gst_app_src_get_current_level_bytes (GST_APP_SRC (self->appsrc));
+    gint64 last_change = g_get_monotonic_time ();
+
+    while (level > OUTPUT_QUEUE_BYTES)
+    {
+        guint64 new_level;
+
+        if (!mati_export_check_output (self, OUTPUT_POLL))
+            return FALSE;
+
+        new_level = gst_app_src_get_current_level_bytes (GST_APP_SRC (self->appsrc));
+        if (new_level < level)
+            last_change = g_get_monotonic_time ();
+        else if (g_get_monotonic_time () - last_change > OUTPUT_STALL_TIMEOUT)
+        {
+            mati_export_fail (self, "Writing %s stalled", self->location);
+            return FALSE;
+        }
+        level = new_level;
+    }
+    return mati_export_check_output (self, 0);
+}
+
+/* Returns FALSE once the end of the range is reached */
+static gboolean
+mati_export_push (MatiExport       *self,
+                  MatiExportSource *source,
+                  GstSample        *sample,
+                  gboolean         *source_started)
+{
+    GstBuffer *buffer = gst_sample_get_buffer (sample);
+    GstCaps *caps = gst_sample_get_caps (sample);
+    GstClockTime pts = GST_BUFFER_PTS (buffer);
+    gboolean keyframe = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    GstClockTimeDiff shift;
+    GstBuffer *output;
+    gint64 time, now;
+
+    if (!GST_CLOCK_TIME_IS_VALID (pts))
+        return TRUE;
+
+    time = source->start + pts / GST_USECOND;
+    if (time > self->to)
+        return FALSE;
+
+    /* Every source starts at a keyframe after what was exported */
+    if (!*source_started)
+    {
+        if (!keyframe || (self->started && time <= self->last_time))
+            return TRUE;
+        *source_started = TRUE;
+
+        if (!self->started)
+        {
+            self->started = TRUE;
+            self->origin = time;
+            self->last_time = time;
+        }
+        else if (time - self->last_time > MAX_GAP)
+        {
+            self->skipped += time - self->last_time - GAP_KEPT;
+        }
+    }
+
+    if (caps != NULL && (self->output_caps == NULL || !gst_caps_is_equal (caps, self->output_caps)))
+    {
+        gst_caps_replace (&self->output_caps, caps);
+        gst_app_src_set_caps (GST_APP_SRC (self->appsrc), caps);
+    }
+
+    output = gst_buffer_copy (buffer);
+    shift = (GstClockTimeDiff) (time - self->origin - self->skipped) * GST_USECOND - (GstClockTimeDiff) pts;
+    GST_BUFFER_PTS (output) = pts + shift;
+    if (GST_BUFFER_DTS_IS_VALID (buffer))
+        GST_BUFFER_DTS (output) = (GstClockTimeDiff) GST_BUFFER_DTS (buffer) + shift > 0 ? GST_BUFFER_DTS (buffer) + shift : 0;
+
+    if (gst_app_src_push_buffer (GST_APP_SRC (self->appsrc), output) != GST_FLOW_OK)
+    {
+        mati_export_fail (self, "Couldn't write %s", self->location);
+        return FALSE;
+    }
+    if (!mati_export_wait_output (self))
+        return FALSE;
+    self->last_time = MAX (self->last_time, time);
+
+    now = g_get_monotonic_time ();
+    if (now - self->last_progress > PROGRESS_INTERVAL)
+    {
+        self->last_progress = now;
+        mati_export_post (self, CLAMP ((gdouble) (time - self->from) / (self->to - self->from), 0, 1), FALSE);
+    }
+    return TRUE;
+}
+
+/* Returns FALSE when nothing after this source is needed */
+static gboolean
+mati_export_read_source (MatiExport       *self,
+                         MatiExportSource *source)
+{
+    g_autoptr (GstElement) reader = NULL;
+    g_autoptr (GstBus) bus = NULL;
+    g_autoptr (GstMessage) error_message = NULL;
+    GstElement *appsink;
+    GstSample *sample;
+    gboolean source_started = FALSE, more = TRUE;
+
+    if (source->location == NULL)
+        mati_export_trim_preroll (self, source);
+
+    reader = mati_export_build_reader (self, source, &appsink);
+    if (reader == NULL)
+    {
+        mati_export_fail (self, "Missing elements to read recordings");
+        return FALSE;
+    }
+    bus = gst_element_get_bus (reader);
+
+    if (gst_element_set_state (reader, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE
+        || gst_element_get_state (reader, NULL, NULL, PREROLL_TIMEOUT) == GST_STATE_CHANGE_FAILURE)
+    {
+        g_warning ("skipping unreadable %s", source->location != NULL ? source->location : "pre-roll");
+        gst_element_set_state (reader, GST_STATE_NULL);
+        return TRUE;
+    }
+
+    if (source->location != NULL && source->seek_time > source->start
+        && !gst_element_seek_simple (reader, GST_FORMAT_TIME,
+                                     GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_SNAP_BEFORE,
+                                     (source->seek_time - source->start) * GST_USECOND))
+        g_warning ("couldn't seek in %s, reading it from the start", source->location);
+
+    gst_element_set_state (reader, GST_STATE_PLAYING);
+    while (more && (sample = gst_app_sink_pull_sample (GST_APP_SINK (appsink))) != NULL)
+    {
+        more = mati_export_push (self, source, sample, &source_started);
+        gst_sample_unref (sample);
+    }
+
+    error_message = gst_bus_pop_filtered (bus, GST_MESSAGE_ERROR);
+    if (error_message != NULL)
+    {
+        g_autoptr (GError) error = NULL;
+
+        gst_message_parse_error (error_message, &error, NULL);
+        g_warning ("reading %s stopped early: %s", source->location != NULL ? source->location : "pre-roll",
+                   error->message);
+    }
+
+    gst_element_set_state (reader, GST_STATE_NULL);
+    return more && self->error == NULL;
+}
+
+static void
+mati_export_finish_output (MatiExport *self)
+{
+    if (self->started && self->error == NULL)
+    {
+        g_autoptr (GstMessage) message = NULL;
+
+        gst_app_src_end_of_stream (GST_APP_SRC (self->appsrc));
+        message = gst_bus_timed_pop_filtered (self->output_bus, OUTPUT_STALL_TIMEOUT * GST_USECOND,
+                                              GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+        if (message == NULL)
+        {
+            mati_export_fail (self, "Writing %s stalled", self->location);
+        }
+        else if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR)
+        {
+            g_autoptr (GError) error = NULL;
+
+            gst_message_parse_error (message, &error, NULL);
+            mati_export_fail (self, "Couldn't write %s: %s", self->location, error->message);
+        }
+    }
+    else if (!self->started)
+    {
+        mati_export_fail (self, "Nothing recorded in the requested range");
+    }
+
+    if (self->output != NULL)
+    {
+        gst_element_set_state (self->output, GST_STATE_NULL);
+        gst_clear_object (&self->output);
+    }
+    gst_clear_object (&self->output_bus);
+    if (self->output_fd >= 0)
+    {
+        close (self->output_fd);
+        self->output_fd = -1;
+    }
+    if (self->error != NULL && self->output_created)
+        g_unlink (self->location);
+}
+
+/* Looks up where each recording starts and the keyframe to seek to, and
+ * drops the ones without index or after the range. Recordings are oldest
+ * first, the first one after the range ends the lookups. */
+static void
+mati_export_resolve_recordings (MatiExport *self)
+{
+    gboolean after_range = FALSE;
+    guint i = 0;
+
+    while (i < self->sources->len)
+    {
+        MatiExportSource *source = g_ptr_array_index (self->sources, i);
+        MatiIndexLookup lookup;
+
+        if (source->location == NULL)
+        {
+            i++;
+            continue;
+        }
+
+        if (!after_range && mati_index_lookup (source->location, self->from, &lookup))
+        {
+            source->start = lookup.start;
+            source->seek_time = lookup.seek_time;
+            g_array_unref (lookup.motion);
+            after_range = source->start > self->to;
+            if (!after_range)
+            {
+                i++;
+                continue;
+            }
+        }
+        g_ptr_array_remove_index (self->sources, i);
+    }
+}
+
+static gpointer
+mati_export_thread_func (gpointer user_data)
+{
+    MatiExport *self = user_data;
+    gint64 start_time = g_get_monotonic_time ();
+    gint nice = mati_export_get_nice ();
+
+    mati_export_create_thread_policy (self, nice);
+    mati_export_lower_priority (nice);
+    mati_export_resolve_recordings (self);
+
+    if (mati_export_build_output (self))
+    {
+        for (guint i = 0; i < self->sources->len; i++)
+        {
+            if (!mati_export_read_source (self, g_ptr_array_index (self->sources, i)))
+                break;
+        }
+    }
+    mati_export_finish_output (self);
+
+    if (self->error == NULL)
+        g_message ("exported %.1f s to %s in %.1f s", (self->last_time - self->origin - self->skipped) / (gdouble) G_USEC_PER_SEC,
+                   self->location, (g_get_monotonic_time () - start_time) / (gdouble) G_USEC_PER_SEC);
+    else
+        g_warning ("export to %s failed: %s", self->location, self->error);
+
+    /* Every pipeline is gone, nothing posts to the policy anymore */
+    g_clear_pointer (&self->thread_policy, mati_thread_policy_free);
+    mati_export_post (self, 1, TRUE);
+    return NULL;
+}
+
+MatiExport *
+mati_export_new (guint       id,
+                 gint64      from,
+                 gint64      to,
+                 const char *location)
+{
+    MatiExport *self = g_new0 (MatiExport, 1);
+
+    self->id = id;
+    self->from = from;
+    self->to = to;
+    self->location = g_strdup (location);
+    self->output_fd = -1;
+    self->sources = g_ptr_array_new_with_free_func ((GDestroyNotify) mati_export_source_free);
+
+    return self;
+}
+
+/* Recordings have to be added oldest first, their indexes are read on
+ * the worker thread */
+void
+mati_export_add_recording (MatiExport *self,
+                           const char *location)
+{
+    MatiExportSource *source = g_new0 (MatiExportSource, 1);
+
+    source->location = g_strdup (location);
+    g_ptr_array_add (self->sources, source);
+}
+
+/* Takes buffers and caps, start is the wall-clock time of PTS 0 */
+void
+mati_export_add_preroll (MatiExport    *self,
+                         GstBufferList *buffers,
+                         GstCaps       *caps,
+                         gint64         start)
+{
+    MatiExportSource *source = g_new0 (MatiExportSource, 1);
+
+    source->buffers = buffers;
+    source->caps = caps;
+    source->start = start;
+    g_ptr_array_add (self->sources, source);
+}
+
+/* Hands the export over to a worker thread, the callbacks run on the
+ * thread-default main context of the caller and the export is freed after
+ * finished */
+void
+mati_export_run (MatiExport             *self,
+                 MatiExportProgressFunc  progress,
+                 MatiExportFinishedFunc  finished,
+                 gpointer                user_data,
+                 GDestroyNotify          user_data_free)
+{
+    self->progress = progress;
+    self->finished = finished;
+    self->user_data = user_data;
+    self->user_data_free = user_data_free;
+    self->context = g_main_context_ref_thread_default ();
+
+    g_thread_unref (g_thread_new ("export", mati_export_thread_func, self));
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <glib.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define MATI_EXPORT_DIR "/var/lib/mati/exports/"
+
+typedef struct _MatiExport MatiExport;
+
+typedef void (*MatiExportProgressFunc) (guint    id,
+                                        gdouble  progress,
+                                        gpointer user_data);
+
+typedef void (*MatiExportFinishedFunc) (guint       id,
+                                        gboolean    success,
+                                        const char *message,
+                                        gpointer    user_data);
+
+MatiExport *mati_export_new (guint       id,
+                             gint64      from,
+                             gint64      to,
+                             const char *location);
+
+void mati_export_add_recording (MatiExport *self,
+                                const char *location);
+
+void mati_export_add_preroll (MatiExport    *self,
+                              GstBufferList *buffers,
+                              GstCaps       *caps,
+                              gint64         start);
+
+void mati_export_run (MatiExport             *self,
+                      MatiExportProgressFunc  progress,
+                      MatiExportFinishedFunc  finished,
+                      gpointer                user_data,
+                      GDestroyNotify          user_data_free);
+
+G_END_DECLS
\ No newline at end of file
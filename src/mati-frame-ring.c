@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+
+#include "mati-frame-ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <gio/gio.h>
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define DEFAULT_WIDTH 0
+#define DEFAULT_MAX_RATE 5
+#define DEFAULT_FORMAT "I420"
+#define DEFAULT_SLOTS 4
+#define PAGE_ALIGN(size) (((size) + 4095) & ~((guint64) 4095))
+
+GST_DEBUG_CATEGORY_STATIC (mati_frame_ring_debug);
+#define GST_CAT_DEFAULT mati_frame_ring_debug
+
+G_STATIC_ASSERT (sizeof (MatiFrameRingHeader) <= MATI_FRAME_RING_HEADER_SIZE);
+G_STATIC_ASSERT (sizeof (MatiFrameRingSlot) <= MATI_FRAME_RING_SLOT_HEADER_SIZE);
+
+/* Decoded frames for other processes on this machine. Frames are decimated
+ * to max-rate and scaled to width behind the leaky branch queue of the
+ * detector, then copied once into a ring of slots in a memfd that
+ * consumers map read-only and read in place. See MatiFrameRingHeader for
+ * the protocol.
+ *
+ * The branch sees what the decode gate lets through, so without motion
+ * the rate drops to what the idle mode decodes. */
+struct _MatiFrameRing
+{
+    GstBin parent_instance;
+
+    GstElement *videorate;
+    GstElement *capsfilter;
+
+    /* Only touched by the streaming thread */
+    GstCaps *caps;
+    GstVideoInfo info;
+    guint8 *map;
+    gsize map_size;
+
+    /* Protected by the object lock */
+    gint fd;
+    guint width;
+    gint max_rate;
+    gchar *format;
+    guint n_slots;
+    guint64 frames;
+    guint rings;
+};
+
+G_DEFINE_TYPE (MatiFrameRing, mati_frame_ring, GST_TYPE_BIN);
+
+enum
+{
+    PROP_0,
+    PROP_WIDTH,
+    PROP_MAX_RATE,
+    PROP_FORMAT,
+    PROP_SLOTS,
+};
+
+/* Tells readers of the current ring to look for a new one and drops it */
+static void
+mati_frame_ring_close (MatiFrameRing *self)
+{
+    gint fd;
+
+    if (self->map != NULL)
+    {
+        MatiFrameRingHeader *header = (MatiFrameRingHeader *) self->map;
+
+        __atomic_store_n (&header->closed, 1, __ATOMIC_RELEASE);
+        munmap (self->map, self->map_size);
+        self->map = NULL;
+    }
+
+    GST_OBJECT_LOCK (self);
+    fd = self->fd;
+    self->fd = -1;
+    GST_OBJECT_UNLOCK (self);
+
+    if (fd >= 0)
+        close (fd);
+}
+
+static gboolean
+mati_frame_ring_open (MatiFrameRing *self,
+                      GstCaps       *caps)
+{
+    MatiFrameRingHeader *header;
+    guint64 slot_stride;
+    guint n_slots;
+    gint fd;
+
+    mati_frame_ring_close (self);
+    gst_caps_replace (&self->caps, caps);
+
+    if (!gst_video_info_from_caps (&self->info, caps))
+    {
+        GST_WARNING_OBJECT (self, "unusable caps %" GST_PTR_FORMAT, caps);
+        return FALSE;
+    }
+
+    GST_OBJECT_LOCK (self);
+    n_slots = self->n_slots;
+    GST_OBJECT_UNLOCK (self);
+
+    slot_stride = PAGE_ALIGN (MATI_FRAME_RING_SLOT_HEADER_SIZE + GST_VIDEO_INFO_SIZE (&self->info));
+    self->map_size = MATI_FRAME_RING_HEADER_SIZE + n_slots * slot_stride;
+
+    fd = memfd_create ("mati-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0 || ftruncate (fd, self->map_size) < 0)
+    {
+        GST_WARNING_OBJECT (self, "couldn't create frame ring: %s", g_strerror (errno));
+        if (fd >= 0)
+            close (fd);
+        return FALSE;
+    }
+
+    self->map = mmap (NULL, self->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (self->map == MAP_FAILED)
+    {
+        GST_WARNING_OBJECT (self, "couldn't map frame ring: %s", g_strerror (errno));
+        self->map = NULL;
+        close (fd);
+        return FALSE;
+    }
+
+    /* Only the mapping above stays writable, no fd of the ring, reopened
+     * or not, can be mapped for writing or written to anymore. Consumers
+     * may also rely on the size never changing under their mapping. */
+    if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0)
+    {
+        GST_WARNING_OBJECT (self, "couldn't seal frame ring: %s", g_strerror (errno));
+        munmap (self->map, self->map_size);
+        self->map = NULL;
+        close (fd);
+        return FALSE;
+    }
+
+    header = (MatiFrameRingHeader *) self->map;
+    memcpy (header->magic, MATI_FRAME_RING_MAGIC, sizeof (header->magic));
+    header->version = 1;
+    header->n_slots = n_slots;
+    header->width = GST_VIDEO_INFO_WIDTH (&self->info);
+    header->height = GST_VIDEO_INFO_HEIGHT (&self->info);
+    header->n_planes = GST_VIDEO_INFO_N_PLANES (&self->info);
+    g_strlcpy (header->format, gst_video_format_to_string (GST_VIDEO_INFO_FORMAT (&self->info)), sizeof (header->format));
+    for (guint i = 0; i < header->n_planes; i++)
+    {
+        header->stride[i] = GST_VIDEO_INFO_PLANE_STRIDE (&self->info, i);
+        header->offset[i] = GST_VIDEO_INFO_PLANE_OFFSET (&self->info, i);
+    }
+    header->frame_size = GST_VIDEO_INFO_SIZE (&self->info);
+    header->slot_stride = slot_stride;
+    header->data_offset = MATI_FRAME_RING_HEADER_SIZE;
+    header->framerate_n = GST_VIDEO_INFO_FPS_N (&self->info);
+    header->framerate_d = GST_VIDEO_INFO_FPS_D (&self->info);
+
+    GST_OBJECT_LOCK (self);
+    self->fd = fd;
+    self->rings++;
+    GST_OBJECT_UNLOCK (self);
+
+    GST_INFO_OBJECT (self, "frame ring of %u x %" G_GUINT64_FORMAT " bytes for %" GST_PTR_FORMAT,
+                     n_slots, slot_stride, caps);
+    return TRUE;
+}
+
+static void
+mati_frame_ring_write (MatiFrameRing *self,
+                       GstBuffer     *buffer,
+                       GstClockTime   pts)
+{
+    MatiFrameRingHeader *header = (MatiFrameRingHeader *) self->map;
+    guint64 n = header->write_count; // only ever written here
+    guint8 *slot_data = self->map + header->data_offset + (n % header->n_slots) * header->slot_stride;
+    MatiFrameRingSlot *slot = (MatiFrameRingSlot *) slot_data;
+    g_autoptr (GstBuffer) wrapped = NULL;
+    GstVideoFrame src, dst;
+
+    wrapped = gst_buffer_new_wrapped_full (0, slot_data + MATI_FRAME_RING_SLOT_HEADER_SIZE, header->frame_size,
+                                           0, header->frame_size, NULL, NULL);
+    if (!gst_video_frame_map (&src, &self->info, buffer, GST_MAP_READ))
+        return;
+    if (!gst_video_frame_map (&dst, &self->info, wrapped, GST_MAP_WRITE))
+    {
+        gst_video_frame_unmap (&src);
+        return;
+    }
+
+    __atomic_store_n (&slot->sequence, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    gst_video_frame_copy (&dst, &src);
+    slot->pts = pts;
+    slot->capture_time = g_get_real_time ();
+    slot->frame_number = n;
+    __atomic_store_n (&slot->sequence, 2 * n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n (&header->write_count, n + 1, __ATOMIC_RELEASE);
+
+    gst_video_frame_unmap (&dst);
+    gst_video_frame_unmap (&src);
+
+    GST_OBJECT_LOCK (self);
+    self->frames++;
+    GST_OBJECT_UNLOCK (self);
+}
+
+static GstFlowReturn
+on_new_sample (GstAppSink *appsink,
+               gpointer    user_data)
+{
+    MatiFrameRing *self = MATI_FRAME_RING (user_data);
+    g_autoptr (GstSample) sample = gst_app_sink_pull_sample (appsink);
+    GstCaps *caps;
+    GstBuffer *buffer;
+    const GstSegment *segment;
+
+    if (sample == NULL)
+        return GST_FLOW_EOS;
+
+    caps = gst_sample_get_caps (sample);
+    buffer = gst_sample_get_buffer (sample);
+    if (caps == NULL || buffer == NULL)
+        return GST_FLOW_OK;
+
+    if ((self->caps == NULL || !gst_caps_is_equal (caps, self->caps)) && !mati_frame_ring_open (self, caps))
+        return GST_FLOW_OK;
+    if (self->map == NULL)
+        return GST_FLOW_OK;
+
+    segment = gst_sample_get_segment (sample);
+    mati_frame_ring_write (self, buffer,
+                           segment != NULL ? gst_segment_to_running_time (segment, GST_FORMAT_TIME, GST_BUFFER_PTS (buffer))
+                                           : GST_BUFFER_PTS (buffer));
+    return GST_FLOW_OK;
+}
+
+static void
+mati_frame_ring_update_caps (MatiFrameRing *self)
+{
+    g_autoptr (GstCaps) caps = NULL;
+
+    GST_OBJECT_LOCK (self);
+    caps = gst_caps_new_simple ("video/x-raw",
+                                "format", G_TYPE_STRING, self->format,
+                                "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+                                NULL);
+    /* 0 keeps the decoded size */
+    if (self->width > 0)
+        gst_caps_set_simple (caps, "width", G_TYPE_INT, (gint) self->width, NULL);
+    GST_OBJECT_UNLOCK (self);
+
+    if (self->capsfilter != NULL)
+        g_object_set (self->capsfilter, "caps", caps, NULL);
+}
+
+static void
+mati_frame_ring_set_property (GObject      *object,
+                              guint         prop_id,
+                              const GValue *value,
+                              GParamSpec   *pspec)
+{
+    MatiFrameRing *self = MATI_FRAME_RING (object);
+
+    switch (prop_id)
+    {
+        case PROP_WIDTH:
+            GST_OBJECT_LOCK (self);
+            self->width = g_value_get_uint (value);
+            GST_OBJECT_UNLOCK (self);
+            mati_frame_ring_update_caps (self);
+            break;
+        case PROP_MAX_RATE:
+            GST_OBJECT_LOCK (self);
+            self->max_rate = g_value_get_int (value);
+            GST_OBJECT_UNLOCK (self);
+            if (self->videorate != NULL)
+                g_object_set (self->videorate, "max-rate", self->max_rate, NULL);
+            break;
+        case PROP_FORMAT:
+            GST_OBJECT_LOCK (self);
+            g_free (self->format);
+            self->format = g_value_dup_string (value);
+            GST_OBJECT_UNLOCK (self);
+            mati_frame_ring_update_caps (self);
+            break;
+        case PROP_SLOTS:
+            /* Applies to the next ring */
+            GST_OBJECT_LOCK (self);
+            self->n_slots = g_value_get_uint (value);
+            GST_OBJECT_UNLOCK (self);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+}
+
+static void
+mati_frame_ring_get_property (GObject    *object,
+                              guint       prop_id,
+                              GValue     *value,
+                              GParamSpec *pspec)
+{
+    MatiFrameRing *self = MATI_FRAME_RING (object);
+
+    GST_OBJECT_LOCK (self);
+    switch (prop_id)
+    {
+        case PROP_WIDTH:
+            g_value_set_uint (value, self->width);
+            break;
+        case PROP_MAX_RATE:
+            g_value_set_int (value, self->max_rate);
+            break;
+        case PROP_FORMAT:
+            g_value_set_string (value, self->format);
+            break;
+        case PROP_SLOTS:
+            g_value_set_uint (value, self->n_slots);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+static void
+mati_frame_ring_finalize (GObject *object)
+{
+    MatiFrameRing *self = MATI_FRAME_RING (object);
+
+    mati_frame_ring_close (self);
+    gst_caps_replace (&self->caps, NULL);
+    g_free (self->format);
+
+    G_OBJECT_CLASS (mati_frame_ring_parent_class)->finalize (object);
+}
+
+static void
+mati_frame_ring_init (MatiFrameRing *self)
+{
+    GstElement *videoscale, *videoconvert, *appsink;
+    GstAppSinkCallbacks callbacks = { .new_sample = on_new_sample };
+    g_autoptr (GstPad) sink_pad = NULL;
+
+    self->caps = NULL;
+    gst_video_info_init (&self->info);
+    self->map = NULL;
+    self->map_size = 0;
+    self->fd = -1;
+    self->width = DEFAULT_WIDTH;
+    self->max_rate = DEFAULT_MAX_RATE;
+    self->format = g_strdup (DEFAULT_FORMAT);
+    self->n_slots = DEFAULT_SLOTS;
+    self->frames = 0;
+    self->rings = 0;
+
+    self->videorate = gst_element_factory_make ("videorate", NULL);
+    videoscale = gst_element_factory_make ("videoscale", NULL);
+    videoconvert = gst_element_factory_make ("videoconvert", NULL);
+    self->capsfilter = gst_element_factory_make ("capsfilter", NULL);
+    appsink = gst_element_factory_make ("appsink", NULL);
+    if (self->videorate == NULL || videoscale == NULL || videoconvert == NULL
+        || self->capsfilter == NULL || appsink == NULL)
+    {
+        g_critical ("Couldn't create frame ring elements!");
+        return;
+    }
+
+    g_object_set (self->videorate,
+                  "max-rate", self->max_rate,
+                  "drop-only", TRUE,
+                  "skip-to-first", TRUE,
+                  NULL);
+    mati_frame_ring_update_caps (self);
+    g_object_set (appsink,
+                  "sync", FALSE,
+                  "async", FALSE,
+                  "max-buffers", 1,
+                  "drop", TRUE,
+                  NULL);
+    gst_app_sink_set_callbacks (GST_APP_SINK (appsink), &callbacks, self, NULL);
+
+    gst_bin_add_many (GST_BIN (self), self->videorate, videoscale, videoconvert, self->capsfilter, appsink, NULL);
+    if (!gst_element_link_many (self->videorate, videoscale, videoconvert, self->capsfilter, appsink, NULL))
+        g_critical ("Failed to link frame ring elements!");
+
+    sink_pad = gst_element_get_static_pad (self->videorate, "sink");
+    gst_element_add_pad (GST_ELEMENT (self), gst_ghost_pad_new ("sink", sink_pad));
+}
+
+static void
+mati_frame_ring_class_init (MatiFrameRingClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+    object_class->set_property = mati_frame_ring_set_property;
+    object_class->get_property = mati_frame_ring_get_property;
+    object_class->finalize = mati_frame_ring_finalize;
+
+    g_object_class_install_property (object_class, PROP_WIDTH,
+        g_param_spec_uint ("width", "Width", "Width of the frames, the height follows the aspect ratio, 0 keeps the decoded size",
+                           0, 8192, DEFAULT_WIDTH,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_MAX_RATE,
+        g_param_spec_int ("max-rate", "Maximum rate", "Frames per second written to the ring at most",
+                          1, G_MAXINT, DEFAULT_MAX_RATE,
+                          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_FORMAT,
+        g_param_spec_string ("format", "Format", "Raw video format of the frames",
+                             DEFAULT_FORMAT,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_SLOTS,
+        g_param_spec_uint ("slots", "Slots", "Frames the ring holds",
+                           2, 64, DEFAULT_SLOTS,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    gst_element_class_set_static_metadata (element_class,
+                                           "Mati frame ring", "Sink/Video",
+                                           "Decoded frames in shared memory for local consumers",
+                                           "Froura");
+
+    GST_DEBUG_CATEGORY_INIT (mati_frame_ring_debug, "matiframering", 0, "Mati frame ring");
+}
+
+/* A read-only fd of the current ring, owned by the caller. The ring is
+ * sealed against writes, so a consumer can't write into it even after
+ * reopening the fd for writing. */
+gint
+mati_frame_ring_get_fd (MatiFrameRing  *self,
+                        GError        **error)
+{
+    g_autofree gchar *path = NULL;
+    gint fd;
+
+    GST_OBJECT_LOCK (self);
+    if (self->fd < 0)
+    {
+        GST_OBJECT_UNLOCK (self);
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No frames yet");
+        return -1;
+    }
+    path = g_strdup_printf ("/proc/self/fd/%d", self->fd);
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    GST_OBJECT_UNLOCK (self);
+
+    if (fd < 0)
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "Couldn't reopen frame ring: %s", g_strerror (errno));
+    return fd;
+}
+
+void
+mati_frame_ring_get_stats (MatiFrameRing *self,
+                           guint64       *frames,
+                           guint         *rings)
+{
+    GST_OBJECT_LOCK (self);
+    *frames = self->frames;
+    *rings = self->rings;
+    GST_OBJECT_UNLOCK (self);
+}
+
+GstElement *
+mati_frame_ring_new (const char *name)
+{
+    return g_object_new (MATI_TYPE_FRAME_RING, "name", name, NULL);
+}
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define MATI_FRAME_RING_MAGIC "MATIRNG1"
+#define MATI_FRAME_RING_HEADER_SIZE 4096
+#define MATI_FRAME_RING_SLOT_HEADER_SIZE 64
+
+/* Layout of the shared memory, for consumers in other processes. The
+ * header sits at offset 0, slot i at data_offset + i * slot_stride with
+ * its frame MATI_FRAME_RING_SLOT_HEADER_SIZE bytes further. Every integer
+ * is in host byte order.
+ *
+ * Frame n goes to slot n % n_slots. Its sequence is odd while it is being
+ * written and 2 * n + 2 once it is complete, after which write_count
+ * becomes n + 1. A reader takes the slot of write_count - 1, checks the
+ * sequence is even, reads the frame in place and checks the sequence is
+ * still the same, otherwise the writer lapped it and the frame is torn.
+ * The writer never waits for readers.
+ *
+ * A caps change starts a new ring and sets closed in the old one,
+ * consumers then ask for the fd again. */
+typedef struct
+{
+    gchar magic[8];
+    guint32 version;
+    guint32 closed;
+    guint32 n_slots;
+    guint32 width;
+    guint32 height;
+    guint32 n_planes;
+    gchar format[16];     // GstVideoFormat name, e.g. "I420"
+    guint32 stride[4];
+    guint64 offset[4];
+    guint64 frame_size;
+    guint64 slot_stride;
+    guint64 data_offset;
+    gint32 framerate_n;
+    gint32 framerate_d;
+    guint64 write_count;  // frames published, updated last
+} MatiFrameRingHeader;
+
+typedef struct
+{
+    guint64 sequence;
+    guint64 pts;           // running time of the pipeline, in nanoseconds
+    gint64 capture_time;   // wall-clock, in microseconds since the epoch
+    guint64 frame_number;
+} MatiFrameRingSlot;
+
+#define MATI_TYPE_FRAME_RING (mati_frame_ring_get_type ())
+G_DECLARE_FINAL_TYPE (MatiFrameRing, mati_frame_ring, MATI, FRAME_RING, GstBin)
+
+GstElement *mati_frame_ring_new (const char *name);
+
+gint mati_frame_ring_get_fd (MatiFrameRing  *self,
+                             GError        **error);
+
+void mati_frame_ring_get_stats (MatiFrameRing *self,
+                                guint64       *frames,
+                                guint         *rings);
+
+G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,649 @@
+#include "mati-http-server.h"
+
+#include <string.h>
+
+#define REQUEST_SIZE 4096
+#define CLIENT_TIMEOUT 10    // seconds a write may stall before the client is dropped
+#define PLAYLIST_WAIT 10     // seconds a blocking playlist reload waits at most
+
+typedef struct _MatiHttpClient MatiHttpClient;
+
+typedef struct
+{
+    MatiHttpServer *server;
+    gchar *id;
+    MatiHttpStream *stream;
+    GList *waiting;  // MatiHttpClient, server thread only
+} MatiHttpCamera;
+
+struct _MatiHttpClient
+{
+    MatiHttpServer *server;
+    GSocketConnection *connection;
+    GCancellable *cancellable;
+    gchar request[REQUEST_SIZE];
+    gsize request_len;
+
+    MatiHttpCamera *camera;
+    GBytes *header;
+    GBytes *body;
+    GOutputVector vectors[2];
+
+    /* live.mp4 */
+    gboolean live;
+    gboolean synced;  // sent a fragment starting on a keyframe
+    guint generation;
+    guint64 next_sequence;
+
+    /* Blocking playlist reload */
+    guint64 wanted_sequence;
+    GSource *wait_source;
+};
+
+/* Serves every camera of the process over plain HTTP, without transcoding:
+ *
+ *   /<id>/live.mp4    one endless fragmented MP4, starting at the latest keyframe
+ *   /<id>/live.m3u8   HLS playlist of the fragments from a keyframe on, reloads block with _HLS_msn
+ *   /<id>/init.mp4    init segment of the playlist
+ *   /<id>/<n>.m4s     fragment n
+ *
+ * All I/O is asynchronous on the server thread and every client shares the
+ * fragments of MatiHttpStream, so the tee never waits for a client. A live
+ * client that falls out of the window skips ahead to the latest fragment,
+ * one that stalls a write for CLIENT_TIMEOUT is dropped. Every response
+ * closes the connection. There is no authentication, so the port is only
+ * bound to loopback unless another address is given. */
+struct _MatiHttpServer
+{
+    gchar *address;
+    guint16 port;
+
+    GMainContext *context;
+    GMainLoop *loop;
+    GThread *thread;
+    GSocketService *service;
+
+    /* Only touched on the server thread, or after it stopped */
+    GList *clients;
+
+    /* Under lock */
+    GMutex lock;
+    GHashTable *cameras; // id -> MatiHttpCamera
+    MatiHttpServerStats stats;
+};
+
+static void mati_http_client_live_next (MatiHttpClient *client);
+
+static void
+mati_http_client_free (MatiHttpClient *client)
+{
+    MatiHttpServer *server = client->server;
+
+    if (client->wait_source != NULL)
+    {
+        g_source_destroy (client->wait_source);
+        g_source_unref (client->wait_source);
+    }
+    if (client->camera != NULL)
+        client->camera->waiting = g_list_remove (client->camera->waiting, client);
+    server->clients = g_list_remove (server->clients, client);
+
+    g_cancellable_cancel (client->cancellable);
+    g_io_stream_close (G_IO_STREAM (client->connection), NULL, NULL);
+    g_object_unref (client->connection);
+    g_object_unref (client->cancellable);
+    g_clear_pointer (&client->header, g_bytes_unref);
+    g_clear_pointer (&client->body, g_bytes_unref);
+    g_free (client);
+
+    g_mutex_lock (&server->lock);
+    server->stats.clients--;
+    g_mutex_unlock (&server->lock);
+}
+
+static void
+mati_http_client_drop (MatiHttpClient *client,
+                       GError         *error)
+{
+    g_mutex_lock (&client->server->lock);
+    client->server->stats.clients_dropped++;
+    g_mutex_unlock (&client->server->lock);
+
+    g_debug ("dropping http client: %s", error->message);
+    mati_http_client_free (client);
+}
+
+static void
+mati_http_client_written (GObject      *source,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+    MatiHttpClient *client = user_data;
+    g_autoptr (GError) error = NULL;
+    gsize written = 0;
+
+    if (!g_output_stream_writev_all_finish (G_OUTPUT_STREAM (source), result, &written, &error))
+    {
+        /* Cancelled means the client is already gone */
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            mati_http_client_drop (client, error);
+        return;
+    }
+
+    g_mutex_lock (&client->server->lock);
+    client->server->stats.bytes_sent += written;
+    g_mutex_unlock (&client->server->lock);
+
+    g_clear_pointer (&client->header, g_bytes_unref);
+    g_clear_pointer (&client->body, g_bytes_unref);
+
+    if (client->live)
+        mati_http_client_live_next (client);
+    else
+        mati_http_client_free (client);
+}
+
+/* Takes ownership of header and body, either may be NULL */
+static void
+mati_http_client_write (MatiHttpClient *client,
+                        GBytes         *header,
+                        GBytes         *body)
+{
+    guint n_vectors = 0;
+
+    client->header = header;
+    client->body = body;
+    if (header != NULL)
+    {
+        client->vectors[n_vectors].buffer = g_bytes_get_data (header, &client->vectors[n_vectors].size);
+        n_vectors++;
+    }
+    if (body != NULL)
+    {
+        client->vectors[n_vectors].buffer = g_bytes_get_data (body, &client->vectors[n_vectors].size);
+        n_vectors++;
+    }
+
+    g_output_stream_writev_all_async (g_io_stream_get_output_stream (G_IO_STREAM (client->connection)),
+                                      client->vectors, n_vectors, G_PRIORITY_DEFAULT, client->cancellable,
+                                      mati_http_client_written, client);
+}
+
+static GBytes *
+mati_http_header (const char *status,
+                  const char *content_type,
+                  gssize      content_length)
+{
+    GString *header = g_string_new (NULL);
+
+    g_string_append_printf (header, "HTTP/1.1 %s\r\n", status);
+    if (content_type != NULL)
+        g_string_append_printf (header, "Content-Type: %s\r\n", content_type);
+    if (content_length >= 0)
+        g_string_append_printf (header, "Content-Length: %" G_GSSIZE_FORMAT "\r\n", content_length);
+    g_string_append (header,
+                     "Cache-Control: no-cache\r\n"
+                     "Connection: close\r\n"
+                     "\r\n");
+
+    return g_string_free_to_bytes (header);
+}
+
+/* Takes ownership of body */
+static void
+mati_http_client_respond (MatiHttpClient *client,
+                          const char     *status,
+                          const char     *content_type,
+                          GBytes         *body)
+{
+    if (body == NULL)
+        body = g_bytes_new_static (status, strlen (status));
+
+    mati_http_client_write (client, mati_http_header (status, content_type, g_bytes_get_size (body)), body);
+}
+
+static GBytes *
+mati_http_camera_build_playlist (MatiHttpCamera *camera)
+{
+    GString *playlist = g_string_new (NULL);
+    GString *segments = g_string_new (NULL);
+    GstClockTime max_duration = GST_SECOND;
+    guint64 first, next;
+
+    mati_http_stream_get_window (camera->stream, &first, &next, NULL, NULL);
+    for (guint64 sequence = first; sequence < next; sequence++)
+    {
+        GstClockTime duration = 0;
+        g_autoptr (GBytes) fragment = mati_http_stream_get_fragment (camera->stream, sequence, &duration);
+
+        if (fragment == NULL)
+            continue;
+        max_duration = MAX (max_duration, duration);
+        g_string_append_printf (segments, "#EXTINF:%.3f,\n%" G_GUINT64_FORMAT ".m4s\n",
+                                (gdouble) duration / GST_SECOND, sequence);
+    }
+
+    g_string_append_printf (playlist,
+                            "#EXTM3U\n"
+                            "#EXT-X-VERSION:7\n"
+                            "#EXT-X-TARGETDURATION:%u\n"
+                            "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES\n"
+                            "#EXT-X-MEDIA-SEQUENCE:%" G_GUINT64_FORMAT "\n"
+                            "#EXT-X-MAP:URI=\"init.mp4\"\n",
+                            (guint) ((max_duration + GST_SECOND - 1) / GST_SECOND), first);
+    g_string_append_len (playlist, segments->str, segments->len);
+    g_string_free (segments, TRUE);
+
+    return g_string_free_to_bytes (playlist);
+}
+
+static void
+mati_http_client_respond_playlist (MatiHttpClient *client)
+{
+    mati_http_client_respond (client, "200 OK", "application/vnd.apple.mpegurl",
+                              mati_http_camera_build_playlist (client->camera));
+}
+
+static gboolean
+playlist_wait_timeout_cb (gpointer user_data)
+{
+    MatiHttpClient *client = user_data;
+
+    client->camera->waiting = g_list_remove (client->camera->waiting, client);
+    g_clear_pointer (&client->wait_source, g_source_unref);
+    mati_http_client_respond_playlist (client);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Sends the next fragment, or waits for the stream to produce it. Fragments
+ * are cut by duration, so a new client and one that fell out of the window
+ * start over at the latest fragment that starts on a keyframe. */
+static void
+mati_http_client_live_next (MatiHttpClient *client)
+{
+    MatiHttpStream *stream = client->camera->stream;
+    guint64 first, next, keyframe;
+    guint generation;
+    GBytes *fragment;
+
+    mati_http_stream_get_window (stream, &first, &next, &keyframe, &generation);
+    if (generation != client->generation)
+    {
+        /* The fragments no longer match the init segment we sent */
+        mati_http_client_free (client);
+        return;
+    }
+
+    if (!client->synced || (client->next_sequence < first && next > first))
+    {
+        if (keyframe == next)
+        {
+            client->camera->waiting = g_list_prepend (client->camera->waiting, client);
+            return;
+        }
+        if (client->synced)
+        {
+            g_mutex_lock (&client->server->lock);
+            client->server->stats.fragments_skipped += keyframe - client->next_sequence;
+            g_mutex_unlock (&client->server->lock);
+        }
+        client->next_sequence = keyframe;
+        client->synced = TRUE;
+    }
+
+    fragment = client->next_sequence < next ? mati_http_stream_get_fragment (stream, client->next_sequence, NULL) : NULL;
+    if (fragment == NULL)
+    {
+        client->camera->waiting = g_list_prepend (client->camera->waiting, client);
+        return;
+    }
+
+    client->next_sequence++;
+    mati_http_client_write (client, NULL, fragment);
+}
+
+static void
+mati_http_client_start_live (MatiHttpClient *client)
+{
+    GBytes *init = mati_http_stream_get_init (client->camera->stream, &client->generation);
+
+    if (init == NULL)
+    {
+        mati_http_client_respond (client, "503 Service Unavailable", "text/plain", NULL);
+        return;
+    }
+
+    /* The first fragment is picked once the init segment is out */
+    client->live = TRUE;
+
+    mati_http_client_write (client, mati_http_header ("200 OK", "video/mp4", -1), init);
+}
+
+static void
+mati_http_client_handle_request (MatiHttpClient *client)
+{
+    g_auto (GStrv) request_line = NULL;
+    g_auto (GStrv) target = NULL;
+    g_auto (GStrv) components = NULL;
+    g_autofree gchar *camera_id = NULL;
+    const char *name;
+    gchar *line_end;
+
+    g_mutex_lock (&client->server->lock);
+    client->server->stats.requests++;
+    g_mutex_unlock (&client->server->lock);
+
+    line_end = strstr (client->request, "\r\n");
+    *line_end = '\0';
+    request_line = g_strsplit (client->request, " ", 3);
+    if (g_strv_length (request_line) != 3 || !g_str_has_prefix (request_line[2], "HTTP/1."))
+    {
+        mati_http_client_respond (client, "400 Bad Request", "text/plain", NULL);
+        return;
+    }
+    if (!g_str_equal (request_line[0], "GET"))
+    {
+        mati_http_client_respond (client, "405 Method Not Allowed", "text/plain", NULL);
+        return;
+    }
+
+    target = g_strsplit (request_line[1], "?", 2);
+    components = g_strsplit (target[0], "/", 0);
+    if (g_strv_length (components) != 3 || *components[0] != '\0')
+    {
+        mati_http_client_respond (client, "404 Not Found", "text/plain", NULL);
+        return;
+    }
+
+    camera_id = g_uri_unescape_string (components[1], NULL);
+    g_mutex_lock (&client->server->lock);
+    client->camera = camera_id != NULL ? g_hash_table_lookup (client->server->cameras, camera_id) : NULL;
+    g_mutex_unlock (&client->server->lock);
+    if (client->camera == NULL)
+    {
+        mati_http_client_respond (client, "404 Not Found", "text/plain", NULL);
+        return;
+    }
+
+    name = components[2];
+    if (g_str_equal (name, "live.mp4"))
+    {
+        mati_http_client_start_live (client);
+    }
+    else if (g_str_equal (name, "live.m3u8"))
+    {
+        const char *msn = target[1] != NULL ? strstr (target[1], "_HLS_msn=") : NULL;
+        guint64 first, next;
+
+        mati_http_stream_get_window (client->camera->stream, &first, &next, NULL, NULL);
+        if (msn != NULL)
+            client->wanted_sequence = g_ascii_strtoull (msn + strlen ("_HLS_msn="), NULL, 10);
+
+        if (msn != NULL && client->wanted_sequence >= next)
+        {
+            client->camera->waiting = g_list_prepend (client->camera->waiting, client);
+            client->wait_source = g_timeout_source_new_seconds (PLAYLIST_WAIT);
+            g_source_set_callback (client->wait_source, playlist_wait_timeout_cb, client, NULL);
+            g_source_attach (client->wait_source, client->server->context);
+        }
+        else
+        {
+            mati_http_client_respond_playlist (client);
+        }
+    }
+    else if (g_str_equal (name, "init.mp4"))
+    {
+        GBytes *init = mati_http_stream_get_init (client->camera->stream, NULL);
+
+        if (init != NULL)
+            mati_http_client_respond (client, "200 OK", "video/mp4", init);
+        else
+            mati_http_client_respond (client, "503 Service Unavailable", "text/plain", NULL);
+    }
+    else if (g_str_has_suffix (name, ".m4s"))
+    {
+        gchar *end = NULL;
+        guint64 sequence = g_ascii_strtoull (name, &end, 10);
+        GBytes *fragment = end != name && g_str_equal (end, ".m4s")
+                           ? mati_http_stream_get_fragment (client->camera->stream, sequence, NULL) : NULL;
+
+        if (fragment != NULL)
+            mati_http_client_respond (client, "200 OK", "video/iso.segment", fragment);
+        else
+            mati_http_client_respond (client, "404 Not Found", "text/plain", NULL);
+    }
+    else
+    {
+        mati_http_client_respond (client, "404 Not Found", "text/plain", NULL);
+    }
+}
+
+static void
+mati_http_client_read (MatiHttpClient *client);
+
+static void
+mati_http_client_request_read (GObject      *source,
+                               GAsyncResult *result,
+                               gpointer      user_data)
+{
+    MatiHttpClient *client = user_data;
+    g_autoptr (GError) error = NULL;
+    gssize n_read = g_input_stream_read_finish (G_INPUT_STREAM (source), result, &error);
+
+    if (n_read <= 0)
+    {
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            mati_http_client_free (client);
+        return;
+    }
+
+    client->request_len += n_read;
+    client->request[client->request_len] = '\0';
+
+    if (strstr (client->request, "\r\n\r\n") != NULL)
+        mati_http_client_handle_request (client);
+    else if (client->request_len >= REQUEST_SIZE - 1)
+        mati_http_client_respond (client, "431 Request Header Fields Too Large", "text/plain", NULL);
+    else
+        mati_http_client_read (client);
+}
+
+static void
+mati_http_client_read (MatiHttpClient *client)
+{
+    g_input_stream_read_async (g_io_stream_get_input_stream (G_IO_STREAM (client->connection)),
+                               client->request + client->request_len, REQUEST_SIZE - 1 - client->request_len,
+                               G_PRIORITY_DEFAULT, client->cancellable,
+                               mati_http_client_request_read, client);
+}
+
+static gboolean
+on_incoming (GSocketService    *service,
+             GSocketConnection *connection,
+             GObject           *source_object,
+             gpointer           user_data)
+{
+    MatiHttpServer *self = user_data;
+    MatiHttpClient *client = g_new0 (MatiHttpClient, 1);
+
+    client->server = self;
+    client->connection = g_object_ref (connection);
+    client->cancellable = g_cancellable_new ();
+    g_socket_set_timeout (g_socket_connection_get_socket (connection), CLIENT_TIMEOUT);
+    self->clients = g_list_prepend (self->clients, client);
+
+    g_mutex_lock (&self->lock);
+    self->stats.clients++;
+    g_mutex_unlock (&self->lock);
+
+    mati_http_client_read (client);
+    return TRUE;
+}
+
+/* Runs on the server thread, wakes everyone waiting for a fragment */
+static gboolean
+mati_http_camera_resume (gpointer user_data)
+{
+    MatiHttpCamera *camera = user_data;
+    GList *waiting = camera->waiting;
+    guint64 first, next;
+
+    camera->waiting = NULL;
+    mati_http_stream_get_window (camera->stream, &first, &next, NULL, NULL);
+
+    for (GList *l = waiting; l != NULL; l = l->next)
+    {
+        MatiHttpClient *client = l->data;
+
+        if (client->live)
+        {
+            mati_http_client_live_next (client);
+        }
+        else if (client->wanted_sequence < next)
+        {
+            g_source_destroy (client->wait_source);
+            g_clear_pointer (&client->wait_source, g_source_unref);
+            mati_http_client_respond_playlist (client);
+        }
+        else
+        {
+            camera->waiting = g_list_prepend (camera->waiting, client);
+        }
+    }
+    g_list_free (waiting);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Called from the streaming thread of the camera */
+static void
+mati_http_camera_notify (gpointer user_data)
+{
+    MatiHttpCamera *camera = user_data;
+
+    g_main_context_invoke (camera->server->context, mati_http_camera_resume, camera);
+}
+
+static void
+mati_http_camera_free (MatiHttpCamera *camera)
+{
+    mati_http_stream_set_notify (camera->stream, NULL, NULL);
+    gst_object_unref (camera->stream);
+    g_list_free (camera->waiting);
+    g_free (camera->id);
+    g_free (camera);
+}
+
+static gpointer
+mati_http_server_thread_func (gpointer user_data)
+{
+    MatiHttpServer *self = user_data;
+
+    g_main_context_push_thread_default (self->context);
+    g_main_loop_run (self->loop);
+    g_main_context_pop_thread_default (self->context);
+
+    return NULL;
+}
+
+MatiHttpServer *
+mati_http_server_new (const char *address,
+                      guint16     port)
+{
+    MatiHttpServer *self = g_new0 (MatiHttpServer, 1);
+
+    self->address = g_strdup (address);
+    self->port = port;
+    self->context = g_main_context_new ();
+    self->loop = g_main_loop_new (self->context, FALSE);
+    g_mutex_init (&self->lock);
+    self->cameras = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) mati_http_camera_free);
+
+    return self;
+}
+
+void
+mati_http_server_free (MatiHttpServer *self)
+{
+    if (self->thread != NULL)
+    {
+        g_main_loop_quit (self->loop);
+        g_thread_join (self->thread);
+    }
+    if (self->service != NULL)
+    {
+        g_socket_service_stop (self->service);
+        g_socket_listener_close (G_SOCKET_LISTENER (self->service));
+        g_object_unref (self->service);
+    }
+
+    /* Nothing runs any more, whatever is still pending is dropped */
+    while (self->clients != NULL)
+        mati_http_client_free (self->clients->data);
+
+    g_hash_table_unref (self->cameras);
+    g_mutex_clear (&self->lock);
+    g_main_loop_unref (self->loop);
+    g_main_context_unref (self->context);
+    g_free (self->address);
+    g_free (self);
+}
+
+void
+mati_http_server_add_stream (MatiHttpServer *self,
+                             const char     *camera_id,
+                             MatiHttpStream *stream)
+{
+    MatiHttpCamera *camera = g_new0 (MatiHttpCamera, 1);
+
+    camera->server = self;
+    camera->id = g_strdup (camera_id);
+    camera->stream = gst_object_ref (stream);
+    mati_http_stream_set_notify (stream, mati_http_camera_notify, camera);
+
+    g_mutex_lock (&self->lock);
+    g_hash_table_replace (self->cameras, camera->id, camera);
+    g_mutex_unlock (&self->lock);
+}
+
+gboolean
+mati_http_server_start (MatiHttpServer  *self,
+                        GError         **error)
+{
+    g_autoptr (GSocketAddress) address = g_inet_socket_address_new_from_string (self->address, self->port);
+    gboolean ret;
+
+    if (address == NULL)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid http address %s", self->address);
+        return FALSE;
+    }
+
+    /* Accepts get dispatched on the context that is the default while
+     * the port is added */
+    g_main_context_push_thread_default (self->context);
+    self->service = g_socket_service_new ();
+    g_signal_connect (self->service, "incoming", G_CALLBACK (on_incoming), self);
+    ret = g_socket_listener_add_address (G_SOCKET_LISTENER (self->service), address, G_SOCKET_TYPE_STREAM,
+                                         G_SOCKET_PROTOCOL_TCP, NULL, NULL, error);
+    if (ret)
+        g_socket_service_start (self->service);
+    g_main_context_pop_thread_default (self->context);
+
+    if (!ret)
+        return FALSE;
+
+    self->thread = g_thread_new ("http", mati_http_server_thread_func, self);
+    g_message ("serving live streams on http %s port %u", self->address, self->port);
+    return TRUE;
+}
+
+void
+mati_http_server_get_stats (MatiHttpServer      *self,
+                            MatiHttpServerStats *stats)
+{
+    g_mutex_lock (&self->lock);
+    *stats = self->stats;
+    g_mutex_unlock (&self->lock);
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <gio/gio.h>
+
+#include "mati-http-stream.h"
+
+G_BEGIN_DECLS
+
+typedef struct _MatiHttpServer MatiHttpServer;
+
+typedef struct
+{
+    guint clients;            // connected right now
+    guint64 requests;
+    guint64 clients_dropped;  // timed out or failed while streaming
+    guint64 fragments_skipped;
+    guint64 bytes_sent;
+} MatiHttpServerStats;
+
+MatiHttpServer *mati_http_server_new (const char *address,
+                                      guint16     port);
+
+void mati_http_server_free (MatiHttpServer *self);
+
+void mati_http_server_add_stream (MatiHttpServer *self,
+                                  const char     *camera_id,
+                                  MatiHttpStream *stream);
+
+gboolean mati_http_server_start (MatiHttpServer  *self,
+                                 GError         **error);
+
+void mati_http_server_get_stats (MatiHttpServer      *self,
+                                 MatiHttpServerStats *stats);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MatiHttpServer, mati_http_server_free)
+
+G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,629 @@
+#include "mati-http-stream.h"
+
+#include <gst/app/gstappsink.h>
+
+#define DEFAULT_FRAGMENT_DURATION 1000 // ms
+#define DEFAULT_WINDOW 6
+#define SAMPLE_IS_NON_SYNC (1 << 16) // sample_is_non_sync_sample of the ISO BMFF sample flags
+
+GST_DEBUG_CATEGORY_STATIC (mati_http_stream_debug);
+#define GST_CAT_DEFAULT mati_http_stream_debug
+
+typedef struct
+{
+    guint64 sequence;
+    GBytes *data;          // moof and mdat
+    GstClockTime duration;
+    gboolean keyframe;     // first sample is a sync sample
+} MatiHttpFragment;
+
+/* The camera stream as fragmented MP4 for the HTTP server, without
+ * transcoding. Its output is split into boxes: ftyp and moov make up the
+ * init segment, every moof with its mdat becomes one fragment. The last
+ * window fragments are kept as immutable GBytes that every client shares.
+ *
+ * mp4mux cuts fragments by duration, not on keyframes, so the sample flags
+ * in the moof tell whether a fragment can start a client. The window is
+ * trimmed a GOP at a time and always starts on a keyframe, with long GOPs
+ * it holds more than window fragments.
+ *
+ * The branch queue of the detector in front drops up to the next keyframe
+ * once full, so nothing here ever holds up the tee and fragments never
+ * lose part of a GOP. When the muxer starts over, with a new ftyp, the
+ * generation changes and clients have to fetch the init segment again. */
+struct _MatiHttpStream
+{
+    GstBin parent_instance;
+
+    GstElement *mux;
+
+    /* Only touched by the streaming thread */
+    GByteArray *pending;  // output not yet split into boxes
+    GByteArray *header;
+    GByteArray *fragment;
+    GstClockTime fragment_start;
+    GstClockTime fragment_end;
+    gint64 fragment_wall_start;
+    gboolean fragment_keyframe;
+    guint32 default_sample_flags;  // from the trex of the moov
+
+    /* Protected by the object lock */
+    GBytes *init;
+    GQueue fragments;      // MatiHttpFragment, oldest first
+    guint64 next_sequence;
+    guint generation;
+    guint window;
+    guint64 fragments_published;
+    guint64 bytes_published;
+    MatiHttpStreamFunc notify;
+    gpointer notify_data;
+};
+
+G_DEFINE_TYPE (MatiHttpStream, mati_http_stream, GST_TYPE_BIN);
+
+enum
+{
+    PROP_0,
+    PROP_FRAGMENT_DURATION,
+    PROP_WINDOW,
+};
+
+static void
+mati_http_fragment_free (MatiHttpFragment *fragment)
+{
+    g_bytes_unref (fragment->data);
+    g_free (fragment);
+}
+
+static void
+mati_http_stream_notify (MatiHttpStream *self)
+{
+    MatiHttpStreamFunc notify;
+    gpointer notify_data;
+
+    GST_OBJECT_LOCK (self);
+    notify = self->notify;
+    notify_data = self->notify_data;
+    GST_OBJECT_UNLOCK (self);
+
+    if (notify != NULL)
+        notify (notify_data);
+}
+
+/* Drops the oldest GOP as long as window fragments remain, or leading
+ * fragments without a keyframe once there is one */
+static void
+mati_http_stream_trim_window (MatiHttpStream *self)
+{
+    for (;;)
+    {
+        MatiHttpFragment *head = g_queue_peek_head (&self->fragments);
+        GList *l = self->fragments.head;
+        guint n_gop = 0;
+
+        if (head == NULL)
+            break;
+        if (head->keyframe)
+        {
+            l = l->next;
+            n_gop++;
+        }
+        for (; l != NULL && !((MatiHttpFragment *) l->data)->keyframe; l = l->next)
+            n_gop++;
+
+        /* The head GOP is the newest one */
+        if (l == NULL)
+            break;
+        if (head->keyframe && g_queue_get_length (&self->fragments) - n_gop < self->window)
+            break;
+
+        while (n_gop-- > 0)
+            mati_http_fragment_free (g_queue_pop_head (&self->fragments));
+    }
+}
+
+static void
+mati_http_stream_publish_fragment (MatiHttpStream *self)
+{
+    MatiHttpFragment *fragment = g_new0 (MatiHttpFragment, 1);
+    guint len = self->fragment->len;
+
+    if (GST_CLOCK_TIME_IS_VALID (self->fragment_start) && self->fragment_end > self->fragment_start)
+        fragment->duration = self->fragment_end - self->fragment_start;
+    else
+        fragment->duration = (g_get_monotonic_time () - self->fragment_wall_start) * GST_USECOND;
+    fragment->data = g_byte_array_free_to_bytes (self->fragment);
+    fragment->keyframe = self->fragment_keyframe;
+    self->fragment = NULL;
+    self->fragment_start = GST_CLOCK_TIME_NONE;
+    self->fragment_end = GST_CLOCK_TIME_NONE;
+    self->fragment_wall_start = g_get_monotonic_time ();
+
+    GST_OBJECT_LOCK (self);
+    fragment->sequence = self->next_sequence++;
+    g_queue_push_tail (&self->fragments, fragment);
+    mati_http_stream_trim_window (self);
+    self->fragments_published++;
+    self->bytes_published += len;
+    GST_OBJECT_UNLOCK (self);
+
+    GST_LOG_OBJECT (self, "fragment %" G_GUINT64_FORMAT " of %u bytes, %" GST_TIME_FORMAT "%s",
+                    fragment->sequence, len, GST_TIME_ARGS (fragment->duration),
+                    fragment->keyframe ? ", keyframe" : "");
+    mati_http_stream_notify (self);
+}
+
+/* Payload of the first child of type among the boxes in data */
+static const guint8 *
+mati_http_find_box (const guint8 *data,
+                    gsize         size,
+                    guint32       type,
+                    gsize        *payload_size)
+{
+    while (size >= 8)
+    {
+        guint32 box_size = GST_READ_UINT32_BE (data);
+
+        if (box_size < 8 || box_size > size)
+            break;
+        if (GST_READ_UINT32_LE (data + 4) == type)
+        {
+            *payload_size = box_size - 8;
+            return data + 8;
+        }
+        data += box_size;
+        size -= box_size;
+    }
+
+    return NULL;
+}
+
+/* Default sample flags of the track, from moov/mvex/trex */
+static guint32
+mati_http_read_trex_flags (const guint8 *moov,
+                           gsize         size)
+{
+    const guint8 *mvex, *trex = NULL;
+    gsize mvex_size, trex_size;
+
+    mvex = mati_http_find_box (moov + 8, size - 8, GST_MAKE_FOURCC ('m', 'v', 'e', 'x'), &mvex_size);
+    if (mvex != NULL)
+        trex = mati_http_find_box (mvex, mvex_size, GST_MAKE_FOURCC ('t', 'r', 'e', 'x'), &trex_size);
+    if (trex == NULL || trex_size < 24)
+        return 0;
+
+    return GST_READ_UINT32_BE (trex + 20);
+}
+
+/* Whether the first sample of the moof is a sync sample, its flags come from
+ * the trun, the tfhd or the trex defaults in that order */
+static gboolean
+mati_http_stream_starts_on_keyframe (MatiHttpStream *self,
+                                     const guint8   *moof,
+                                     gsize           size)
+{
+    const guint8 *traf, *tfhd = NULL, *trun = NULL;
+    gsize traf_size, tfhd_size = 0, trun_size = 0, offset;
+    guint32 sample_flags = self->default_sample_flags;
+    guint32 flags;
+
+    traf = mati_http_find_box (moof + 8, size - 8, GST_MAKE_FOURCC ('t', 'r', 'a', 'f'), &traf_size);
+    if (traf != NULL)
+    {
+        tfhd = mati_http_find_box (traf, traf_size, GST_MAKE_FOURCC ('t', 'f', 'h', 'd'), &tfhd_size);
+        trun = mati_http_find_box (traf, traf_size, GST_MAKE_FOURCC ('t', 'r', 'u', 'n'), &trun_size);
+    }
+    if (tfhd == NULL || trun == NULL || tfhd_size < 8 || trun_size < 8 || GST_READ_UINT32_BE (trun + 4) == 0)
+        return FALSE;
+
+    /* Version and flags, track_ID, then only the fields the flags ask for */
+    flags = GST_READ_UINT32_BE (tfhd) & 0xffffff;
+    offset = 8;
+    if (flags & 0x000001)
+        offset += 8; // base_data_offset
+    if (flags & 0x000002)
+        offset += 4; // sample_description_index
+    if (flags & 0x000008)
+        offset += 4; // default_sample_duration
+    if (flags & 0x000010)
+        offset += 4; // default_sample_size
+    if (flags & 0x000020)
+    {
+        if (tfhd_size < offset + 4)
+            return FALSE;
+        sample_flags = GST_READ_UINT32_BE (tfhd + offset);
+    }
+
+    /* Version and flags, sample_count, then the optional fields and the samples */
+    flags = GST_READ_UINT32_BE (trun) & 0xffffff;
+    offset = 8;
+    if (flags & 0x000001)
+        offset += 4; // data_offset
+    if (flags & 0x000004)
+    {
+        if (trun_size < offset + 4)
+            return FALSE;
+        sample_flags = GST_READ_UINT32_BE (trun + offset);
+    }
+    else if (flags & 0x000400)
+    {
+        if (flags & 0x000100)
+            offset += 4; // sample_duration
+        if (flags & 0x000200)
+            offset += 4; // sample_size
+        if (trun_size < offset + 4)
+            return FALSE;
+        sample_flags = GST_READ_UINT32_BE (trun + offset);
+    }
+
+    return (sample_flags & SAMPLE_IS_NON_SYNC) == 0;
+}
+
+static void
+mati_http_stream_handle_box (MatiHttpStream *self,
+                             const guint8   *data,
+                             gsize           size)
+{
+    guint32 type = GST_READ_UINT32_LE (data + 4);
+
+    switch (type)
+    {
+        case GST_MAKE_FOURCC ('f', 't', 'y', 'p'):
+            /* The muxer started over, nothing before is of use any more */
+            GST_OBJECT_LOCK (self);
+            g_clear_pointer (&self->init, g_bytes_unref);
+            g_queue_clear_full (&self->fragments, (GDestroyNotify) mati_http_fragment_free);
+            self->generation++;
+            GST_OBJECT_UNLOCK (self);
+            g_clear_pointer (&self->fragment, g_byte_array_unref);
+            g_byte_array_set_size (self->header, 0);
+            g_byte_array_append (self->header, data, size);
+            break;
+        case GST_MAKE_FOURCC ('m', 'o', 'o', 'v'):
+            self->default_sample_flags = mati_http_read_trex_flags (data, size);
+            g_byte_array_append (self->header, data, size);
+            GST_OBJECT_LOCK (self);
+            g_clear_pointer (&self->init, g_bytes_unref);
+            self->init = g_bytes_new (self->header->data, self->header->len);
+            GST_OBJECT_UNLOCK (self);
+            break;
+        case GST_MAKE_FOURCC ('m', 'o', 'o', 'f'):
+            g_clear_pointer (&self->fragment, g_byte_array_unref);
+            self->fragment = g_byte_array_sized_new (size);
+            g_byte_array_append (self->fragment, data, size);
+            self->fragment_keyframe = mati_http_stream_starts_on_keyframe (self, data, size);
+            break;
+        case GST_MAKE_FOURCC ('m', 'd', 'a', 't'):
+            if (self->fragment == NULL)
+                break;
+            g_byte_array_append (self->fragment, data, size);
+            mati_http_stream_publish_fragment (self);
+            break;
+        default:
+            /* mfra and friends only matter to files */
+            break;
+    }
+}
+
+static void
+mati_http_stream_split_boxes (MatiHttpStream *self)
+{
+    while (self->pending->len >= 8)
+    {
+        guint64 size = GST_READ_UINT32_BE (self->pending->data);
+
+        if (size == 1)
+        {
+            if (self->pending->len < 16)
+                break;
+            size = GST_READ_UINT64_BE (self->pending->data + 8);
+        }
+        if (size < 8)
+        {
+            GST_WARNING_OBJECT (self, "invalid box size %" G_GUINT64_FORMAT ", resyncing", size);
+            g_byte_array_set_size (self->pending, 0);
+            break;
+        }
+        if (self->pending->len < size)
+            break;
+
+        mati_http_stream_handle_box (self, self->pending->data, size);
+        g_byte_array_remove_range (self->pending, 0, size);
+    }
+}
+
+static GstFlowReturn
+on_new_sample (GstAppSink *appsink,
+               gpointer    user_data)
+{
+    MatiHttpStream *self = MATI_HTTP_STREAM (user_data);
+    g_autoptr (GstSample) sample = gst_app_sink_pull_sample (appsink);
+    GstBuffer *buffer;
+    GstClockTime pts;
+    GstMapInfo map;
+
+    if (sample == NULL)
+        return GST_FLOW_EOS;
+
+    buffer = gst_sample_get_buffer (sample);
+    if (buffer == NULL || !gst_buffer_map (buffer, &map, GST_MAP_READ))
+        return GST_FLOW_OK;
+
+    /* Samples come after the moof of their fragment */
+    pts = GST_BUFFER_PTS (buffer);
+    if (GST_CLOCK_TIME_IS_VALID (pts) && self->fragment != NULL)
+    {
+        if (!GST_CLOCK_TIME_IS_VALID (self->fragment_start) || pts < self->fragment_start)
+            self->fragment_start = pts;
+        if (GST_BUFFER_DURATION_IS_VALID (buffer))
+            pts += GST_BUFFER_DURATION (buffer);
+        if (!GST_CLOCK_TIME_IS_VALID (self->fragment_end) || pts > self->fragment_end)
+            self->fragment_end = pts;
+    }
+
+    g_byte_array_append (self->pending, map.data, map.size);
+    gst_buffer_unmap (buffer, &map);
+    mati_http_stream_split_boxes (self);
+
+    return GST_FLOW_OK;
+}
+
+static void
+mati_http_stream_set_property (GObject      *object,
+                               guint         prop_id,
+                               const GValue *value,
+                               GParamSpec   *pspec)
+{
+    MatiHttpStream *self = MATI_HTTP_STREAM (object);
+
+    switch (prop_id)
+    {
+        case PROP_FRAGMENT_DURATION:
+            g_object_set (self->mux, "fragment-duration", g_value_get_uint (value), NULL);
+            break;
+        case PROP_WINDOW:
+            GST_OBJECT_LOCK (self);
+            self->window = g_value_get_uint (value);
+            GST_OBJECT_UNLOCK (self);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+}
+
+static void
+mati_http_stream_get_property (GObject    *object,
+                               guint       prop_id,
+                               GValue     *value,
+                               GParamSpec *pspec)
+{
+    MatiHttpStream *self = MATI_HTTP_STREAM (object);
+
+    switch (prop_id)
+    {
+        case PROP_FRAGMENT_DURATION:
+        {
+            guint fragment_duration;
+
+            g_object_get (self->mux, "fragment-duration", &fragment_duration, NULL);
+            g_value_set_uint (value, fragment_duration);
+            break;
+        }
+        case PROP_WINDOW:
+            GST_OBJECT_LOCK (self);
+            g_value_set_uint (value, self->window);
+            GST_OBJECT_UNLOCK (self);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+}
+
+static void
+mati_http_stream_finalize (GObject *object)
+{
+    MatiHttpStream *self = MATI_HTTP_STREAM (object);
+
+    g_byte_array_unref (self->pending);
+    g_byte_array_unref (self->header);
+    g_clear_pointer (&self->fragment, g_byte_array_unref);
+    g_clear_pointer (&self->init, g_bytes_unref);
+    g_queue_clear_full (&self->fragments, (GDestroyNotify) mati_http_fragment_free);
+
+    G_OBJECT_CLASS (mati_http_stream_parent_class)->finalize (object);
+}
+
+static void
+mati_http_stream_init (MatiHttpStream *self)
+{
+    GstElement *parse, *capsfilter, *appsink;
+    GstAppSinkCallbacks callbacks = { .new_sample = on_new_sample };
+    g_autoptr (GstCaps) caps = NULL;
+    g_autoptr (GstPad) sink_pad = NULL;
+
+    self->pending = g_byte_array_new ();
+    self->header = g_byte_array_new ();
+    self->fragment = NULL;
+    self->fragment_start = GST_CLOCK_TIME_NONE;
+    self->fragment_end = GST_CLOCK_TIME_NONE;
+    self->fragment_wall_start = g_get_monotonic_time ();
+    self->fragment_keyframe = FALSE;
+    self->default_sample_flags = 0;
+    self->init = NULL;
+    g_queue_init (&self->fragments);
+    self->next_sequence = 0;
+    self->generation = 0;
+    self->window = DEFAULT_WINDOW;
+    self->fragments_published = 0;
+    self->bytes_published = 0;
+    self->notify = NULL;
+    self->notify_data = NULL;
+
+    parse = gst_element_factory_make ("h264parse", NULL);
+    capsfilter = gst_element_factory_make ("capsfilter", NULL);
+    self->mux = gst_element_factory_make ("mp4mux", NULL);
+    appsink = gst_element_factory_make ("appsink", NULL);
+    if (parse == NULL || capsfilter == NULL || self->mux == NULL || appsink == NULL)
+    {
+        g_critical ("Couldn't create http stream elements!");
+        return;
+    }
+
+    caps = gst_caps_new_simple ("video/x-h264",
+                                "stream-format", G_TYPE_STRING, "avc",
+                                "alignment", G_TYPE_STRING, "au",
+                                NULL);
+    g_object_set (capsfilter, "caps", caps, NULL);
+    g_object_set (self->mux,
+                  "fragment-duration", DEFAULT_FRAGMENT_DURATION,
+                  "streamable", TRUE,
+                  NULL);
+    g_object_set (appsink,
+                  "sync", FALSE,
+                  "async", FALSE,
+                  NULL);
+    gst_app_sink_set_callbacks (GST_APP_SINK (appsink), &callbacks, self, NULL);
+
+    gst_bin_add_many (GST_BIN (self), parse, capsfilter, self->mux, appsink, NULL);
+    if (!gst_element_link_many (parse, capsfilter, self->mux, appsink, NULL))
+        g_critical ("Failed to link http stream elements!");
+
+    sink_pad = gst_element_get_static_pad (parse, "sink");
+    gst_element_add_pad (GST_ELEMENT (self), gst_ghost_pad_new ("sink", sink_pad));
+}
+
+static void
+mati_http_stream_class_init (MatiHttpStreamClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+    object_class->set_property = mati_http_stream_set_property;
+    object_class->get_property = mati_http_stream_get_property;
+    object_class->finalize = mati_http_stream_finalize;
+
+    g_object_class_install_property (object_class, PROP_FRAGMENT_DURATION,
+        g_param_spec_uint ("fragment-duration", "Fragment duration", "Target fragment length in milliseconds, fragments don't wait for keyframes",
+                           1, G_MAXUINT, DEFAULT_FRAGMENT_DURATION,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_WINDOW,
+        g_param_spec_uint ("window", "Window", "Fragments kept for clients, at least from the previous keyframe on",
+                           2, 64, DEFAULT_WINDOW,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    gst_element_class_set_static_metadata (element_class,
+                                           "Mati HTTP stream", "Sink/Video",
+                                           "Fragmented MP4 of an H.264 stream for HTTP clients",
+                                           "Froura");
+
+    GST_DEBUG_CATEGORY_INIT (mati_http_stream_debug, "matihttpstream", 0, "Mati HTTP stream");
+}
+
+/* Called from the streaming thread after every new fragment */
+void
+mati_http_stream_set_notify (MatiHttpStream     *self,
+                             MatiHttpStreamFunc  func,
+                             gpointer            user_data)
+{
+    GST_OBJECT_LOCK (self);
+    self->notify = func;
+    self->notify_data = user_data;
+    GST_OBJECT_UNLOCK (self);
+}
+
+/* NULL until the muxer wrote its header */
+GBytes *
+mati_http_stream_get_init (MatiHttpStream *self,
+                           guint          *generation)
+{
+    GBytes *init = NULL;
+
+    GST_OBJECT_LOCK (self);
+    if (self->init != NULL)
+        init = g_bytes_ref (self->init);
+    if (generation != NULL)
+        *generation = self->generation;
+    GST_OBJECT_UNLOCK (self);
+
+    return init;
+}
+
+/* NULL if the fragment isn't there yet or fell out of the window */
+GBytes *
+mati_http_stream_get_fragment (MatiHttpStream *self,
+                               guint64         sequence,
+                               GstClockTime   *duration)
+{
+    GBytes *data = NULL;
+
+    GST_OBJECT_LOCK (self);
+    for (GList *l = self->fragments.head; l != NULL; l = l->next)
+    {
+        MatiHttpFragment *fragment = l->data;
+
+        if (fragment->sequence == sequence)
+        {
+            data = g_bytes_ref (fragment->data);
+            if (duration != NULL)
+                *duration = fragment->duration;
+            break;
+        }
+    }
+    GST_OBJECT_UNLOCK (self);
+
+    return data;
+}
+
+/* Fragments first up to next are available, first == next if none.
+ * keyframe is the newest of them that starts on a keyframe, next if none
+ * does. */
+void
+mati_http_stream_get_window (MatiHttpStream *self,
+                             guint64        *first,
+                             guint64        *next,
+                             guint64        *keyframe,
+                             guint          *generation)
+{
+    MatiHttpFragment *oldest;
+
+    GST_OBJECT_LOCK (self);
+    oldest = g_queue_peek_head (&self->fragments);
+    *next = self->next_sequence;
+    *first = oldest != NULL ? oldest->sequence : self->next_sequence;
+    if (keyframe != NULL)
+    {
+        *keyframe = self->next_sequence;
+        for (GList *l = self->fragments.tail; l != NULL; l = l->prev)
+        {
+            MatiHttpFragment *fragment = l->data;
+
+            if (fragment->keyframe)
+            {
+                *keyframe = fragment->sequence;
+                break;
+            }
+        }
+    }
+    if (generation != NULL)
+        *generation = self->generation;
+    GST_OBJECT_UNLOCK (self);
+}
+
+void
+mati_http_stream_get_stats (MatiHttpStream *self,
+                            guint64        *fragments,
+                            guint64        *bytes)
+{
+    GST_OBJECT_LOCK (self);
+    *fragments = self->fragments_published;
+    *bytes = self->bytes_published;
+    GST_OBJECT_UNLOCK (self);
+}
+
+GstElement *
+mati_http_stream_new (const char *name)
+{
+    return g_object_new (MATI_TYPE_HTTP_STREAM, "name", name, NULL);
+}
\ No newline at end of file
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef void (*MatiHttpStreamFunc) (gpointer user_data);
+
+#define MATI_TYPE_HTTP_STREAM (mati_http_stream_get_type ())
+G_DECLARE_FINAL_TYPE (MatiHttpStream, mati_http_stream, MATI, HTTP_STREAM, GstBin)
+
+GstElement *mati_http_stream_new (const char *name);
+
+void mati_http_stream_set_notify (MatiHttpStream     *self,
+                                  MatiHttpStreamFunc  func,
+                                  gpointer            user_data);
+
+GBytes *mati_http_stream_get_init (MatiHttpStream *self,
+                                   guint          *generation);
+
+GBytes *mati_http_stream_get_fragment (MatiHttpStream *self,
+                                       guint64         sequence,
+                                       GstClockTime   *duration);
+
+void mati_http_stream_get_window (MatiHttpStream *self,
+                                  guint64        *first,
+                                  guint64        *next,
+                                  guint64        *keyframe,
+                                  guint          *generation);
+
+void mati_http_stream_get_stats (MatiHttpStream *self,
+                                 guint64        *fragments,
+                                 guint64        *bytes);
+
+G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,243 @@
+#include "mati-index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC "MATIIDX1"
+#define TRAILER_MAGIC "MATIEND1"
+#define MAGIC_SIZE 8
+#define FLUSH_ENTRIES 256
+
+/* Sidecar index of a recording, written while muxing. After an 8 byte
+ * magic come 16 byte keyframe entries, wall-clock time and byte offset,
+ * in the order they were written. Closing the index appends the motion
+ * intervals, 16 bytes each, and a trailer with both counts. An index
+ * without trailer, of a recording still written or cut short by a crash,
+ * is read as keyframes only. Everything is little endian.
+ *
+ * Lookups map the file and binary search the keyframes, nothing is
+ * parsed up front. */
+
+typedef struct
+{
+    gint64 time;
+    guint64 offset;
+} MatiIndexEntry;
+
+typedef struct
+{
+    guint64 n_keyframes;
+    guint64 n_motion;
+    gchar magic[MAGIC_SIZE];
+} MatiIndexTrailer;
+
+struct _MatiIndexWriter
+{
+    gchar *location;
+    gint fd;
+    GArray *pending; // MatiIndexEntry, little endian
+    guint64 n_keyframes;
+    gint64 last_time;
+};
+
+static gboolean
+write_all (gint          fd,
+           gconstpointer data,
+           gsize         length)
+{
+    const guint8 *bytes = data;
+
+    while (length > 0)
+    {
+        gssize ret = write (fd, bytes, length);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return FALSE;
+        bytes += ret;
+        length -= ret;
+    }
+    return TRUE;
+}
+
+MatiIndexWriter *
+mati_index_writer_new (const char  *location,
+                       GError     **error)
+{
+    MatiIndexWriter *self;
+    g_autofree gchar *index_location = g_strconcat (location, MATI_INDEX_SUFFIX, NULL);
+    gint fd = open (index_location, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0 || !write_all (fd, INDEX_MAGIC, MAGIC_SIZE))
+    {
+        gint saved_errno = errno;
+
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                     "Couldn't create %s: %s", index_location, g_strerror (saved_errno));
+        if (fd >= 0)
+            close (fd);
+        return NULL;
+    }
+
+    self = g_new0 (MatiIndexWriter, 1);
+    self->location = g_steal_pointer (&index_location);
+    self->fd = fd;
+    self->pending = g_array_sized_new (FALSE, FALSE, sizeof (MatiIndexEntry), FLUSH_ENTRIES);
+
+    return self;
+}
+
+void
+mati_index_writer_add_keyframe (MatiIndexWriter *self,
+                                gint64           time,
+                                guint64          offset)
+{
+    MatiIndexEntry entry;
+
+    /* Keeps the keyframes sorted for the binary search */
+    time = MAX (time, self->last_time);
+    self->last_time = time;
+
+    entry.time = GINT64_TO_LE (time);
+    entry.offset = GUINT64_TO_LE (offset);
+    g_array_append_val (self->pending, entry);
+    self->n_keyframes++;
+
+    if (self->pending->len >= FLUSH_ENTRIES)
+        mati_index_writer_flush (self);
+}
+
+gboolean
+mati_index_writer_flush (MatiIndexWriter *self)
+{
+    gboolean ret;
+
+    if (self->pending->len == 0)
+        return TRUE;
+
+    ret = write_all (self->fd, self->pending->data, self->pending->len * sizeof (MatiIndexEntry));
+    g_array_set_size (self->pending, 0);
+    if (!ret)
+        g_warning ("couldn't write %s: %s", self->location, g_strerror (errno));
+
+    return ret;
+}
+
+/* Writes the motion intervals and the trailer, and frees the writer */
+gboolean
+mati_index_writer_close (MatiIndexWriter *self,
+                         GArray          *motion)
+{
+    MatiIndexTrailer trailer;
+    gboolean ret = mati_index_writer_flush (self);
+
+    for (guint i = 0; ret && motion != NULL && i < motion->len; i++)
+    {
+        MatiIndexInterval interval = g_array_index (motion, MatiIndexInterval, i);
+
+        interval.start = GINT64_TO_LE (interval.start);
+        interval.end = GINT64_TO_LE (interval.end);
+        ret = write_all (self->fd, &interval, sizeof (interval));
+    }
+
+    trailer.n_keyframes = GUINT64_TO_LE (self->n_keyframes);
+    trailer.n_motion = GUINT64_TO_LE (motion != NULL ? motion->len : 0);
+    memcpy (trailer.magic, TRAILER_MAGIC, MAGIC_SIZE);
+    ret = ret && write_all (self->fd, &trailer, sizeof (trailer));
+    if (!ret)
+        g_warning ("couldn't finish %s: %s", self->location, g_strerror (errno));
+
+    close (self->fd);
+    g_array_unref (self->pending);
+    g_free (self->location);
+    g_free (self);
+
+    return ret;
+}
+
+static gint64
+entry_time (const MatiIndexEntry *entries,
+            guint64               i)
+{
+    return GINT64_FROM_LE (entries[i].time);
+}
+
+/* Fills lookup for the recording at location, seeking to time */
+gboolean
+mati_index_lookup (const char      *location,
+                   gint64           time,
+                   MatiIndexLookup *lookup)
+{
+    g_autofree gchar *index_location = g_strconcat (location, MATI_INDEX_SUFFIX, NULL);
+    g_autoptr (GMappedFile) file = g_mapped_file_new (index_location, FALSE, NULL);
+    const gchar *data;
+    const MatiIndexEntry *entries;
+    const MatiIndexInterval *motion = NULL;
+    guint64 size, n_keyframes, n_motion = 0, low, high;
+
+    memset (lookup, 0, sizeof (MatiIndexLookup));
+    if (file == NULL)
+        return FALSE;
+
+    data = g_mapped_file_get_contents (file);
+    size = g_mapped_file_get_length (file);
+    if (size < MAGIC_SIZE || memcmp (data, INDEX_MAGIC, MAGIC_SIZE) != 0)
+        return FALSE;
+
+    entries = (const MatiIndexEntry *) (data + MAGIC_SIZE);
+    n_keyframes = (size - MAGIC_SIZE) / sizeof (MatiIndexEntry);
+
+    if (size >= MAGIC_SIZE + sizeof (MatiIndexTrailer))
+    {
+        MatiIndexTrailer trailer;
+
+        memcpy (&trailer, data + size - sizeof (MatiIndexTrailer), sizeof (trailer));
+        if (memcmp (trailer.magic, TRAILER_MAGIC, MAGIC_SIZE) == 0)
+        {
+            guint64 capacity = (size - MAGIC_SIZE - sizeof (trailer)) / sizeof (MatiIndexEntry);
+
+            /* Counts come from disk, bounded first so the size check
+             * below can't overflow */
+            n_keyframes = GUINT64_FROM_LE (trailer.n_keyframes);
+            n_motion = GUINT64_FROM_LE (trailer.n_motion);
+            if (n_keyframes > capacity || n_motion > capacity - n_keyframes
+                || MAGIC_SIZE + (n_keyframes + n_motion) * sizeof (MatiIndexEntry) + sizeof (trailer) != size)
+                return FALSE;
+            motion = (const MatiIndexInterval *) (entries + n_keyframes);
+        }
+    }
+    if (n_keyframes == 0)
+        return FALSE;
+
+    /* Last keyframe at or before time */
+    low = 0;
+    high = n_keyframes;
+    while (high - low > 1)
+    {
+        guint64 middle = low + (high - low) / 2;
+
+        if (entry_time (entries, middle) <= time)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    lookup->start = entry_time (entries, 0);
+    lookup->end = entry_time (entries, n_keyframes - 1);
+    lookup->seek_time = entry_time (entries, low);
+    lookup->seek_offset = GUINT64_FROM_LE (entries[low].offset);
+    lookup->motion = g_array_sized_new (FALSE, FALSE, sizeof (MatiIndexInterval), n_motion);
+    for (guint64 i = 0; i < n_motion; i++)
+    {
+        MatiIndexInterval interval;
+
+        interval.start = GINT64_FROM_LE (motion[i].start);
+        interval.end = GINT64_FROM_LE (motion[i].end);
+        g_array_append_val (lookup->motion, interval);
+    }
+
+    return TRUE;
+}
\ No newline at end of file
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Appended to the location of a recording */
+#define MATI_INDEX_SUFFIX ".idx"
+
+typedef struct _MatiIndexWriter MatiIndexWriter;
+
+/* Wall-clock times in microseconds since the epoch */
+typedef struct
+{
+    gint64 start;
+    gint64 end;
+} MatiIndexInterval;
+
+typedef struct
+{
+    gint64 start;          // first keyframe
+    gint64 end;            // last keyframe
+    gint64 seek_time;      // last keyframe at or before the requested time
+    guint64 seek_offset;   // byte offset of that keyframe in the recording
+    GArray *motion;        // MatiIndexInterval, owned by the caller
+} MatiIndexLookup;
+
+MatiIndexWriter *mati_index_writer_new (const char  *location,
+                                        GError     **error);
+
+void mati_index_writer_add_keyframe (MatiIndexWriter *self,
+                                     gint64           time,
+                                     guint64          offset);
+
+gboolean mati_index_writer_flush (MatiIndexWriter *self);
+
+gboolean mati_index_writer_close (MatiIndexWriter *self,
+                                  GArray          *motion);
+
+gboolean mati_index_lookup (const char      *location,
+                            gint64           time,
+                            MatiIndexLookup *lookup);
+
+G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,252 @@
+#include "mati-live-encoder.h"
+
+#include <gst/video/video.h>
+
+#define DEFAULT_BITRATE 512
+#define DEFAULT_KEY_INT_MAX 30
+#define DEFAULT_KEYFRAME_INTERVAL GST_SECOND
+
+GST_DEBUG_CATEGORY_STATIC (mati_live_encoder_debug);
+#define GST_CAT_DEFAULT mati_live_encoder_debug
+
+/* Encodes the decoded stream once for every live view consumer. New peers
+ * each ask for a keyframe, the requests are coalesced so a burst of peers
+ * joining forces at most one keyframe per keyframe-interval. */
+struct _MatiLiveEncoder
+{
+    GstBin parent_instance;
+
+    GstElement *encoder;
+
+    /* Protected by the object lock */
+    guint bitrate;
+    guint64 keyframe_interval;
+    GstClockTime last_forced;
+    guint keyframe_requests;
+    guint keyframes_forced;
+};
+
+G_DEFINE_TYPE (MatiLiveEncoder, mati_live_encoder, GST_TYPE_BIN);
+
+enum
+{
+    PROP_0,
+    PROP_BITRATE,
+    PROP_KEYFRAME_INTERVAL,
+};
+
+static GstPadProbeReturn
+keyframe_request_probe_cb (GstPad          *pad,
+                           GstPadProbeInfo *info,
+                           gpointer         user_data)
+{
+    MatiLiveEncoder *self = MATI_LIVE_ENCODER (user_data);
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+    GstClockTime now = gst_util_get_timestamp ();
+    gboolean forward;
+
+    if (!gst_video_event_is_force_key_unit (event))
+        return GST_PAD_PROBE_OK;
+
+    GST_OBJECT_LOCK (self);
+    self->keyframe_requests++;
+    forward = !GST_CLOCK_TIME_IS_VALID (self->last_forced) || now >= self->last_forced + self->keyframe_interval;
+    if (forward)
+    {
+        self->last_forced = now;
+        self->keyframes_forced++;
+    }
+    GST_OBJECT_UNLOCK (self);
+
+    if (!forward)
+    {
+        GST_DEBUG_OBJECT (self, "coalescing keyframe request");
+        return GST_PAD_PROBE_DROP;
+    }
+
+    GST_INFO_OBJECT (self, "forcing keyframe");
+    return GST_PAD_PROBE_OK;
+}
+
+static void
+mati_live_encoder_set_property (GObject      *object,
+                                guint         prop_id,
+                                const GValue *value,
+                                GParamSpec   *pspec)
+{
+    MatiLiveEncoder *self = MATI_LIVE_ENCODER (object);
+
+    switch (prop_id)
+    {
+        case PROP_BITRATE:
+            GST_OBJECT_LOCK (self);
+            self->bitrate = g_value_get_uint (value);
+            GST_OBJECT_UNLOCK (self);
+            if (self->encoder != NULL)
+                g_object_set (self->encoder, "bitrate", self->bitrate, NULL);
+            break;
+        case PROP_KEYFRAME_INTERVAL:
+            GST_OBJECT_LOCK (self);
+            self->keyframe_interval = g_value_get_uint64 (value);
+            GST_OBJECT_UNLOCK (self);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+}
+
+static void
+mati_live_encoder_get_property (GObject    *object,
+                                guint       prop_id,
+                                GValue     *value,
+                                GParamSpec *pspec)
+{
+    MatiLiveEncoder *self = MATI_LIVE_ENCODER (object);
+
+    GST_OBJECT_LOCK (self);
+    switch (prop_id)
+    {
+        case PROP_BITRATE:
+            g_value_set_uint (value, self->bitrate);
+            break;
+        case PROP_KEYFRAME_INTERVAL:
+            g_value_set_uint64 (value, self->keyframe_interval);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+static void
+mati_live_encoder_init (MatiLiveEncoder *self)
+{
+    GstElement *videoconvert, *capsfilter, *parser;
+    g_autoptr (GstCaps) caps = NULL;
+    g_autoptr (GstPad) encoder_src_pad = NULL;
+    g_autoptr (GstPad) sink_pad = NULL;
+    g_autoptr (GstPad) src_pad = NULL;
+
+    self->bitrate = DEFAULT_BITRATE;
+    self->keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+    self->last_forced = GST_CLOCK_TIME_NONE;
+    self->keyframe_requests = 0;
+    self->keyframes_forced = 0;
+
+    videoconvert = gst_element_factory_make ("videoconvert", NULL);
+    self->encoder = gst_element_factory_make ("x264enc", NULL);
+    capsfilter = gst_element_factory_make ("capsfilter", NULL);
+    parser = gst_element_factory_make ("h264parse", NULL);
+    if (videoconvert == NULL || self->encoder == NULL || capsfilter == NULL || parser == NULL)
+    {
+        g_critical ("Couldn't create live encoder elements!");
+        return;
+    }
+
+    /* Same settings webrtcsink gets per session in encoder_setup() */
+    g_object_set (self->encoder,
+                  "tune", 4, // zero-latency
+                  "speed-preset", 1, // ultrafast
+                  "bitrate", self->bitrate,
+                  "key-int-max", DEFAULT_KEY_INT_MAX,
+                  "cabac", FALSE,
+                  NULL);
+
+    /* Every browser can decode constrained baseline */
+    caps = gst_caps_new_simple ("video/x-h264",
+                                "profile", G_TYPE_STRING, "constrained-baseline",
+                                NULL);
+    g_object_set (capsfilter, "caps", caps, NULL);
+
+    /* Peers joining mid-GOP need SPS/PPS with the next keyframe */
+    g_object_set (parser, "config-interval", -1, NULL);
+
+    gst_bin_add_many (GST_BIN (self), videoconvert, self->encoder, capsfilter, parser, NULL);
+    if (!gst_element_link_many (videoconvert, self->encoder, capsfilter, parser, NULL))
+        g_critical ("Failed to link live encoder elements!");
+
+    encoder_src_pad = gst_element_get_static_pad (self->encoder, "src");
+    gst_pad_add_probe (encoder_src_pad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, keyframe_request_probe_cb, self, NULL);
+
+    sink_pad = gst_element_get_static_pad (videoconvert, "sink");
+    gst_element_add_pad (GST_ELEMENT (self), gst_ghost_pad_new ("sink", sink_pad));
+    src_pad = gst_element_get_static_pad (parser, "src");
+    gst_element_add_pad (GST_ELEMENT (self), gst_ghost_pad_new ("src", src_pad));
+}
+
+static void
+mati_live_encoder_class_init (MatiLiveEncoderClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+    object_class->set_property = mati_live_encoder_set_property;
+    object_class->get_property = mati_live_encoder_get_property;
+
+    g_object_class_install_property (object_class, PROP_BITRATE,
+        g_param_spec_uint ("bitrate", "Bitrate", "Bitrate of the shared encoder in kbit/s",
+                           1, 100 * 1024, DEFAULT_BITRATE,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_KEYFRAME_INTERVAL,
+        g_param_spec_uint64 ("keyframe-interval", "Keyframe interval",
+                             "Minimum time between keyframes forced by consumers, in nanoseconds",
+                             0, G_MAXUINT64, DEFAULT_KEYFRAME_INTERVAL,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    gst_element_class_set_static_metadata (element_class,
+                                           "Mati live encoder", "Codec/Encoder/Video",
+                                           "Single H.264 encoder shared by every live view consumer",
+                                           "Froura");
+
+    GST_DEBUG_CATEGORY_INIT (mati_live_encoder_debug, "matiliveencoder", 0, "Mati shared live encoder");
+}
+
+void
+mati_live_encoder_get_stats (MatiLiveEncoder *self,
+                             guint           *keyframe_requests,
+                             guint           *keyframes_forced)
+{
+    GST_OBJECT_LOCK (self);
+    *keyframe_requests = self->keyframe_requests;
+    *keyframes_forced = self->keyframes_forced;
+    GST_OBJECT_UNLOCK (self);
+}
+
+const char *
+mati_live_mode_to_string (MatiLiveMode live_mode)
+{
+    switch (live_mode)
+    {
+        case MATI_LIVE_PER_CONSUMER:
+            return "per-consumer";
+        case MATI_LIVE_SHARED:
+            return "shared";
+        case MATI_LIVE_PASSTHROUGH:
+            return "passthrough";
+        default:
+            return "unknown";
+    }
+}
+
+gboolean
+mati_live_mode_from_string (const char   *string,
+                            MatiLiveMode *live_mode)
+{
+    for (MatiLiveMode mode = MATI_LIVE_PER_CONSUMER; mode <= MATI_LIVE_PASSTHROUGH; mode++)
+    {
+        if (g_strcmp0 (string, mati_live_mode_to_string (mode)) == 0)
+        {
+            *live_mode = mode;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+GstElement *
+mati_live_encoder_new (const char *name)
+{
+    return g_object_new (MATI_TYPE_LIVE_ENCODER, "name", name, NULL);
+}
\ No newline at end of file
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+    MATI_LIVE_PER_CONSUMER,   // webrtcsink runs an encoder per session
+    MATI_LIVE_SHARED,         // one encoder feeds every session
+    MATI_LIVE_PASSTHROUGH,    // send the camera stream as is when browsers can play it
+} MatiLiveMode;
+
+#define MATI_TYPE_LIVE_ENCODER (mati_live_encoder_get_type ())
+G_DECLARE_FINAL_TYPE (MatiLiveEncoder, mati_live_encoder, MATI, LIVE_ENCODER, GstBin)
+
+GstElement *mati_live_encoder_new (const char *name);
+
+void mati_live_encoder_get_stats (MatiLiveEncoder *self,
+                                  guint           *keyframe_requests,
+                                  guint           *keyframes_forced);
+
+const char *mati_live_mode_to_string (MatiLiveMode live_mode);
+
+gboolean mati_live_mode_from_string (const char   *string,
+                                     MatiLiveMode *live_mode);
+
+G_END_DECLS
\ No newline at end of file
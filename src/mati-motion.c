@@ -0,0 +1,444 @@
+#include "mati-motion.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATI_MOTION_X86 1
+#endif
+
+#define DEFAULT_GRID_COLS 16
+#define DEFAULT_GRID_ROWS 12
+#define DEFAULT_THRESHOLD 12
+#define DEFAULT_MIN_TILES 2
+#define DEFAULT_GAP 5
+#define MAX_GRID 64
+/* More changed tiles than this is a lighting change, not motion */
+#define LIGHTING_CHANGE_RATIO 0.8
+
+GST_DEBUG_CATEGORY_STATIC (mati_motion_debug);
+#define GST_CAT_DEFAULT mati_motion_debug
+
+/* Motion detection straight on the luma plane. Every frame is compared
+ * against a running background with block differencing per tile, updating
+ * the background in the same pass. The element never modifies the frames
+ * and posts the same "motion" element messages as motioncells. */
+struct _MatiMotion
+{
+    GstVideoFilter parent_instance;
+
+    guint grid_cols;
+    guint grid_rows;
+    guint threshold;
+    guint min_tiles;
+    guint gap;
+
+    guint8 *background;
+    gint width;
+    gint height;
+    guint64 *tile_sad;
+
+    gboolean in_motion;
+    GstClockTime last_motion;
+};
+
+G_DEFINE_TYPE (MatiMotion, mati_motion, GST_TYPE_VIDEO_FILTER);
+
+enum
+{
+    PROP_0,
+    PROP_GRID_COLS,
+    PROP_GRID_ROWS,
+    PROP_THRESHOLD,
+    PROP_MIN_TILES,
+    PROP_GAP,
+};
+
+#define MOTION_CAPS GST_VIDEO_CAPS_MAKE ("{ I420, YV12, NV12, NV21, Y42B, Y444, GRAY8 }")
+
+/* Returns the sum of absolute differences between cur and bg and moves bg
+ * a quarter of the way towards cur. */
+typedef guint64 (*SadUpdateFunc) (const guint8 *cur, guint8 *bg, gsize n);
+
+static SadUpdateFunc sad_update;
+
+static guint64
+sad_update_scalar (const guint8 *cur,
+                   guint8       *bg,
+                   gsize         n)
+{
+    guint64 sad = 0;
+
+    for (gsize i = 0; i < n; i++)
+    {
+        guint8 half = (bg[i] + cur[i] + 1) >> 1;
+
+        sad += ABS ((gint) cur[i] - (gint) bg[i]);
+        bg[i] = (bg[i] + half + 1) >> 1;
+    }
+    return sad;
+}
+
+#ifdef MATI_MOTION_X86
+__attribute__ ((target ("sse2")))
+static guint64
+sad_update_sse2 (const guint8 *cur,
+                 guint8       *bg,
+                 gsize         n)
+{
+    __m128i acc = _mm_setzero_si128 ();
+    gsize i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i c = _mm_loadu_si128 ((const __m128i *) (cur + i));
+        __m128i b = _mm_loadu_si128 ((const __m128i *) (bg + i));
+
+        acc = _mm_add_epi64 (acc, _mm_sad_epu8 (c, b));
+        _mm_storeu_si128 ((__m128i *) (bg + i), _mm_avg_epu8 (b, _mm_avg_epu8 (b, c)));
+    }
+
+    return (guint32) _mm_cvtsi128_si32 (acc)
+           + (guint32) _mm_cvtsi128_si32 (_mm_srli_si128 (acc, 8))
+           + sad_update_scalar (cur + i, bg + i, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static guint64
+sad_update_avx2 (const guint8 *cur,
+                 guint8       *bg,
+                 gsize         n)
+{
+    __m256i acc = _mm256_setzero_si256 ();
+    __m128i sum;
+    gsize i = 0;
+
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i c = _mm256_loadu_si256 ((const __m256i *) (cur + i));
+        __m256i b = _mm256_loadu_si256 ((const __m256i *) (bg + i));
+
+        acc = _mm256_add_epi64 (acc, _mm256_sad_epu8 (c, b));
+        _mm256_storeu_si256 ((__m256i *) (bg + i), _mm256_avg_epu8 (b, _mm256_avg_epu8 (b, c)));
+    }
+
+    sum = _mm_add_epi64 (_mm256_castsi256_si128 (acc), _mm256_extracti128_si256 (acc, 1));
+    return (guint32) _mm_cvtsi128_si32 (sum)
+           + (guint32) _mm_cvtsi128_si32 (_mm_srli_si128 (sum, 8))
+           + sad_update_sse2 (cur + i, bg + i, n - i);
+}
+#endif
+
+static void
+mati_motion_post (MatiMotion   *self,
+                  const char   *field,
+                  GstClockTime  timestamp,
+                  guint         changed_tiles)
+{
+    GstStructure *structure = gst_structure_new ("motion",
+                                                  field, G_TYPE_UINT64, timestamp,
+                                                  "changed_tiles", G_TYPE_UINT, changed_tiles,
+                                                  NULL);
+
+    gst_element_post_message (GST_ELEMENT (self), gst_message_new_element (GST_OBJECT (self), structure));
+}
+
+static void
+mati_motion_reset (MatiMotion *self)
+{
+    g_clear_pointer (&self->background, g_free);
+    g_clear_pointer (&self->tile_sad, g_free);
+    self->width = 0;
+    self->height = 0;
+}
+
+static gboolean
+mati_motion_set_info (GstVideoFilter *filter,
+                      GstCaps        *incaps,
+                      GstVideoInfo   *in_info,
+                      GstCaps        *outcaps,
+                      GstVideoInfo   *out_info)
+{
+    MatiMotion *self = MATI_MOTION (filter);
+
+    GST_OBJECT_LOCK (self);
+    mati_motion_reset (self);
+    self->width = GST_VIDEO_INFO_WIDTH (in_info);
+    self->height = GST_VIDEO_INFO_HEIGHT (in_info);
+    GST_OBJECT_UNLOCK (self);
+
+    return TRUE;
+}
+
+static GstFlowReturn
+mati_motion_transform_frame_ip (GstVideoFilter *filter,
+                                GstVideoFrame  *frame)
+{
+    MatiMotion *self = MATI_MOTION (filter);
+    const guint8 *luma = GST_VIDEO_FRAME_PLANE_DATA (frame, 0);
+    gint stride = GST_VIDEO_FRAME_PLANE_STRIDE (frame, 0);
+    GstClockTime timestamp = GST_BUFFER_PTS (frame->buffer);
+    guint cols, rows, threshold, min_tiles, changed_tiles = 0;
+    GstClockTime gap;
+    gboolean initialized;
+
+    GST_OBJECT_LOCK (self);
+    cols = MIN ((guint) self->width, self->grid_cols);
+    rows = MIN ((guint) self->height, self->grid_rows);
+    threshold = self->threshold;
+    min_tiles = self->min_tiles;
+    gap = self->gap * GST_SECOND;
+    initialized = self->background != NULL;
+    if (!initialized)
+    {
+        self->background = g_malloc ((gsize) self->width * self->height);
+        self->tile_sad = g_new0 (guint64, MAX_GRID * MAX_GRID);
+    }
+    GST_OBJECT_UNLOCK (self);
+
+    if (!GST_CLOCK_TIME_IS_VALID (timestamp))
+        timestamp = g_get_monotonic_time () * GST_USECOND;
+
+    if (!initialized)
+    {
+        for (gint y = 0; y < self->height; y++)
+            memcpy (self->background + (gsize) y * self->width, luma + (gsize) y * stride, self->width);
+        return GST_FLOW_OK;
+    }
+
+    memset (self->tile_sad, 0, sizeof (guint64) * cols * rows);
+
+    for (gint y = 0; y < self->height; y++)
+    {
+        const guint8 *cur = luma + (gsize) y * stride;
+        guint8 *bg = self->background + (gsize) y * self->width;
+        guint64 *tile_row = self->tile_sad + (gsize) (y * rows / self->height) * cols;
+
+        for (guint col = 0; col < cols; col++)
+        {
+            gint start = col * self->width / cols;
+            gint end = (col + 1) * self->width / cols;
+
+            tile_row[col] += sad_update (cur + start, bg + start, end - start);
+        }
+    }
+
+    for (guint row = 0; row < rows; row++)
+    {
+        gint tile_height = (row + 1) * self->height / rows - row * self->height / rows;
+
+        for (guint col = 0; col < cols; col++)
+        {
+            gint tile_width = (col + 1) * self->width / cols - col * self->width / cols;
+            guint64 pixels = MAX ((guint64) tile_width * tile_height, 1);
+
+            if (self->tile_sad[row * cols + col] > threshold * pixels)
+                changed_tiles++;
+        }
+    }
+
+    if (changed_tiles > LIGHTING_CHANGE_RATIO * cols * rows)
+    {
+        GST_DEBUG_OBJECT (self, "%u of %u tiles changed, treating it as a lighting change", changed_tiles, cols * rows);
+        return GST_FLOW_OK;
+    }
+
+    if (changed_tiles >= min_tiles)
+    {
+        self->last_motion = timestamp;
+        if (!self->in_motion)
+        {
+            self->in_motion = TRUE;
+            mati_motion_post (self, "motion_begin", timestamp, changed_tiles);
+        }
+    }
+    else if (self->in_motion && timestamp >= self->last_motion + gap)
+    {
+        self->in_motion = FALSE;
+        mati_motion_post (self, "motion_finished", timestamp, changed_tiles);
+    }
+
+    return GST_FLOW_OK;
+}
+
+static gboolean
+mati_motion_stop (GstBaseTransform *trans)
+{
+    MatiMotion *self = MATI_MOTION (trans);
+
+    GST_OBJECT_LOCK (self);
+    mati_motion_reset (self);
+    self->in_motion = FALSE;
+    GST_OBJECT_UNLOCK (self);
+
+    return TRUE;
+}
+
+static void
+mati_motion_set_property (GObject      *object,
+                          guint         prop_id,
+                          const GValue *value,
+                          GParamSpec   *pspec)
+{
+    MatiMotion *self = MATI_MOTION (object);
+
+    GST_OBJECT_LOCK (self);
+    switch (prop_id)
+    {
+        case PROP_GRID_COLS:
+            self->grid_cols = g_value_get_uint (value);
+            break;
+        case PROP_GRID_ROWS:
+            self->grid_rows = g_value_get_uint (value);
+            break;
+        case PROP_THRESHOLD:
+            self->threshold = g_value_get_uint (value);
+            break;
+        case PROP_MIN_TILES:
+            self->min_tiles = g_value_get_uint (value);
+            break;
+        case PROP_GAP:
+            self->gap = g_value_get_uint (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+static void
+mati_motion_get_property (GObject    *object,
+                          guint       prop_id,
+                          GValue     *value,
+                          GParamSpec *pspec)
+{
+    MatiMotion *self = MATI_MOTION (object);
+
+    GST_OBJECT_LOCK (self);
+    switch (prop_id)
+    {
+        case PROP_GRID_COLS:
+            g_value_set_uint (value, self->grid_cols);
+            break;
+        case PROP_GRID_ROWS:
+            g_value_set_uint (value, self->grid_rows);
+            break;
+        case PROP_THRESHOLD:
+            g_value_set_uint (value, self->threshold);
+            break;
+        case PROP_MIN_TILES:
+            g_value_set_uint (value, self->min_tiles);
+            break;
+        case PROP_GAP:
+            g_value_set_uint (value, self->gap);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+static void
+mati_motion_finalize (GObject *object)
+{
+    MatiMotion *self = MATI_MOTION (object);
+
+    mati_motion_reset (self);
+
+    G_OBJECT_CLASS (mati_motion_parent_class)->finalize (object);
+}
+
+static void
+mati_motion_init (MatiMotion *self)
+{
+    self->grid_cols = DEFAULT_GRID_COLS;
+    self->grid_rows = DEFAULT_GRID_ROWS;
+    self->threshold = DEFAULT_THRESHOLD;
+    self->min_tiles = DEFAULT_MIN_TILES;
+    self->gap = DEFAULT_GAP;
+    self->background = NULL;
+    self->tile_sad = NULL;
+    self->width = 0;
+    self->height = 0;
+    self->in_motion = FALSE;
+    self->last_motion = 0;
+
+    /* Frames are only read, never written */
+    gst_base_transform_set_passthrough (GST_BASE_TRANSFORM (self), TRUE);
+}
+
+static void
+mati_motion_class_init (MatiMotionClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+    GstBaseTransformClass *transform_class = GST_BASE_TRANSFORM_CLASS (klass);
+    GstVideoFilterClass *filter_class = GST_VIDEO_FILTER_CLASS (klass);
+    g_autoptr (GstCaps) caps = gst_caps_from_string (MOTION_CAPS);
+
+    object_class->set_property = mati_motion_set_property;
+    object_class->get_property = mati_motion_get_property;
+    object_class->finalize = mati_motion_finalize;
+
+    transform_class->stop = mati_motion_stop;
+    transform_class->transform_ip_on_passthrough = TRUE;
+    filter_class->set_info = mati_motion_set_info;
+    filter_class->transform_frame_ip = mati_motion_transform_frame_ip;
+
+    g_object_class_install_property (object_class, PROP_GRID_COLS,
+        g_param_spec_uint ("grid-cols", "Grid columns", "Number of tile columns",
+                           1, MAX_GRID, DEFAULT_GRID_COLS,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_GRID_ROWS,
+        g_param_spec_uint ("grid-rows", "Grid rows", "Number of tile rows",
+                           1, MAX_GRID, DEFAULT_GRID_ROWS,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_THRESHOLD,
+        g_param_spec_uint ("threshold", "Threshold",
+                           "Mean luma difference against the background for a tile to count as changed",
+                           1, 255, DEFAULT_THRESHOLD,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_MIN_TILES,
+        g_param_spec_uint ("min-tiles", "Minimum tiles", "Changed tiles needed to start motion",
+                           1, MAX_GRID * MAX_GRID, DEFAULT_MIN_TILES,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_GAP,
+        g_param_spec_uint ("gap", "Gap", "Seconds without motion before motion is finished",
+                           1, 3600, DEFAULT_GAP,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    gst_element_class_add_pad_template (element_class, gst_pad_template_new ("sink", GST_PAD_SINK, GST_PAD_ALWAYS, caps));
+    gst_element_class_add_pad_template (element_class, gst_pad_template_new ("src", GST_PAD_SRC, GST_PAD_ALWAYS, caps));
+    gst_element_class_set_static_metadata (element_class,
+                                           "Mati motion", "Filter/Analyzer/Video",
+                                           "Tile based motion detection on the luma plane",
+                                           "Froura");
+
+    GST_DEBUG_CATEGORY_INIT (mati_motion_debug, "matimotion", 0, "Mati motion detection");
+
+    const char *implementation = "scalar";
+
+    sad_update = sad_update_scalar;
+#ifdef MATI_MOTION_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2"))
+    {
+        sad_update = sad_update_avx2;
+        implementation = "AVX2";
+    }
+    else if (__builtin_cpu_supports ("sse2"))
+    {
+        sad_update = sad_update_sse2;
+        implementation = "SSE2";
+    }
+#endif
+    GST_INFO ("using %s block differencing", implementation);
+}
+
+GstElement *
+mati_motion_new (const char *name)
+{
+    return g_object_new (MATI_TYPE_MOTION, "name", name, NULL);
+}
\ No newline at end of file
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <gst/video/gstvideofilter.h>
+
+G_BEGIN_DECLS
+
+#define MATI_TYPE_MOTION (mati_motion_get_type ())
+G_DECLARE_FINAL_TYPE (MatiMotion, mati_motion, MATI, MOTION, GstVideoFilter)
+
+GstElement *mati_motion_new (const char *name);
+
+G_END_DECLS
\ No newline at end of file
@@ -2,6 +2,10 @@
 
 #include <gst/gst.h>
 
+#include "mati-decode-gate.h"
+#include "mati-live-encoder.h"
+#include "mati-recording.h"
+
 G_BEGIN_DECLS
 
 #define MATI_TYPE_OPTIONS (mati_options_get_type ())
@@ -11,8 +15,45 @@ MatiOptions *mati_options_new ();
 
 gboolean mati_options_read (MatiOptions *self, int *argc, char **argv[], GError **error);
 
-gchar *mati_options_get_uri (MatiOptions *self);
-gchar *mati_options_get_id (MatiOptions *self);
+guint mati_options_get_n_cameras (MatiOptions *self);
+gchar *mati_options_get_camera_id (MatiOptions *self, guint index);
+gchar *mati_options_get_camera_uri (MatiOptions *self, guint index);
+gboolean mati_options_is_single_camera (MatiOptions *self);
+
+gchar *mati_options_get_bus_name (MatiOptions *self);
 gchar *mati_options_get_turnserver (MatiOptions *self);
 
+guint64 mati_options_get_preroll_time (MatiOptions *self);
+guint64 mati_options_get_preroll_bytes (MatiOptions *self);
+guint64 mati_options_get_postroll_time (MatiOptions *self);
+MatiRecordingFormat mati_options_get_recording_format (MatiOptions *self);
+guint64 mati_options_get_segment_time (MatiOptions *self);
+guint64 mati_options_get_segment_bytes (MatiOptions *self);
+gboolean mati_options_get_direct_io (MatiOptions *self);
+gboolean mati_options_get_sync_writes (MatiOptions *self);
+guint64 mati_options_get_ram_budget (MatiOptions *self);
+guint64 mati_options_get_quota_bytes (MatiOptions *self);
+guint64 mati_options_get_camera_quota_bytes (MatiOptions *self);
+gint64 mati_options_get_max_age (MatiOptions *self);
+
+gchar *mati_options_get_export_dir (MatiOptions *self);
+gint mati_options_get_analysis_width (MatiOptions *self);
+gint mati_options_get_analysis_fps (MatiOptions *self);
+gint mati_options_get_thumbnail_width (MatiOptions *self);
+guint16 mati_options_get_http_port (MatiOptions *self);
+gchar *mati_options_get_http_address (MatiOptions *self);
+gboolean mati_options_get_fast_start (MatiOptions *self);
+gchar *mati_options_get_rtsp_transport (MatiOptions *self);
+gint mati_options_get_frame_ring_width (MatiOptions *self);
+gint mati_options_get_frame_ring_fps (MatiOptions *self);
+gchar *mati_options_get_frame_ring_format (MatiOptions *self);
+
+MatiLiveMode mati_options_get_live_mode (MatiOptions *self);
+gchar **mati_options_get_passthrough_profiles (MatiOptions *self);
+MatiDecodeIdleMode mati_options_get_decode_idle_mode (MatiOptions *self);
+gdouble mati_options_get_decode_gate_threshold (MatiOptions *self);
+guint mati_options_get_decoder_threads (MatiOptions *self);
+gchar **mati_options_get_thread_rules (MatiOptions *self);
+guint mati_options_get_stats_interval (MatiOptions *self);
+
 G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,340 @@
+#include "mati-preroll.h"
+
+#define DEFAULT_PREROLL_TIME ((guint64)10 * GST_SECOND)
+#define DEFAULT_MAX_BYTES ((guint64)64 * 1024 * 1024)
+
+GST_DEBUG_CATEGORY_STATIC (mati_preroll_debug);
+#define GST_CAT_DEFAULT mati_preroll_debug
+
+/* Keeps the last GOPs of the encoded stream in memory so a recording can
+ * start in the past. While no recording is running nothing is pushed
+ * downstream. On start the ring is flushed from its oldest keyframe, which
+ * trimming keeps at the newest keyframe that is at least preroll-time old,
+ * after which buffers pass straight through. */
+struct _MatiPreroll
+{
+    GstElement parent_instance;
+
+    GstPad *sinkpad;
+    GstPad *srcpad;
+
+    /* Protected by the object lock */
+    GQueue buffers;
+    GQueue keyframes; // links into buffers that hold a keyframe
+    guint64 bytes;
+    guint64 preroll_time;
+    guint64 max_bytes;
+    gboolean recording;
+    gboolean flush_pending;
+};
+
+G_DEFINE_TYPE (MatiPreroll, mati_preroll, GST_TYPE_ELEMENT);
+
+enum
+{
+    PROP_0,
+    PROP_PREROLL_TIME,
+    PROP_MAX_BYTES,
+};
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("video/x-h264"));
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("video/x-h264"));
+
+static gboolean
+is_keyframe (GstBuffer *buffer)
+{
+    return !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+}
+
+static void
+mati_preroll_pop_head (MatiPreroll *self)
+{
+    GstBuffer *buffer;
+
+    if (g_queue_peek_head (&self->keyframes) == g_queue_peek_head_link (&self->buffers))
+        g_queue_pop_head (&self->keyframes);
+
+    buffer = g_queue_pop_head (&self->buffers);
+    self->bytes -= gst_buffer_get_size (buffer);
+    gst_buffer_unref (buffer);
+}
+
+static void
+mati_preroll_clear (MatiPreroll *self)
+{
+    while (!g_queue_is_empty (&self->buffers))
+        mati_preroll_pop_head (self);
+}
+
+/* Drops whole GOPs from the head, called with the object lock held */
+static void
+mati_preroll_trim (MatiPreroll *self)
+{
+    GstClockTime newest = GST_BUFFER_DTS_OR_PTS ((GstBuffer *) g_queue_peek_tail (&self->buffers));
+
+    while (self->keyframes.length > 1)
+    {
+        GList *next_gop = g_queue_peek_nth (&self->keyframes, 1);
+        GstClockTime next_gop_start = GST_BUFFER_DTS_OR_PTS ((GstBuffer *) next_gop->data);
+        gboolean old_enough = GST_CLOCK_TIME_IS_VALID (newest) && GST_CLOCK_TIME_IS_VALID (next_gop_start)
+                              && next_gop_start + self->preroll_time <= newest;
+
+        if (!old_enough && self->bytes <= self->max_bytes)
+            break;
+
+        while (g_queue_peek_head_link (&self->buffers) != next_gop)
+            mati_preroll_pop_head (self);
+    }
+
+    /* A single GOP that doesn't fit is useless without its keyframe */
+    if (self->bytes > self->max_bytes)
+    {
+        GST_WARNING_OBJECT (self, "GOP exceeds %" G_GUINT64_FORMAT " bytes, dropping pre-roll", self->max_bytes);
+        mati_preroll_clear (self);
+    }
+}
+
+static GstFlowReturn
+mati_preroll_chain (GstPad    *pad,
+                    GstObject *parent,
+                    GstBuffer *buffer)
+{
+    MatiPreroll *self = MATI_PREROLL (parent);
+    GstBufferList *flush = NULL;
+    gboolean push = FALSE;
+    GstFlowReturn ret = GST_FLOW_OK;
+
+    GST_OBJECT_LOCK (self);
+
+    /* The ring always starts at a keyframe */
+    if (!g_queue_is_empty (&self->buffers) || is_keyframe (buffer))
+    {
+        g_queue_push_tail (&self->buffers, gst_buffer_ref (buffer));
+        if (is_keyframe (buffer))
+            g_queue_push_tail (&self->keyframes, g_queue_peek_tail_link (&self->buffers));
+        self->bytes += gst_buffer_get_size (buffer);
+        mati_preroll_trim (self);
+    }
+
+    if (self->flush_pending && !g_queue_is_empty (&self->buffers))
+    {
+        /* The current buffer is the tail of the ring, so it is part of the flush */
+        flush = gst_buffer_list_new_sized (self->buffers.length);
+        for (GList *l = self->buffers.head; l != NULL; l = l->next)
+            gst_buffer_list_add (flush, gst_buffer_ref (l->data));
+        self->flush_pending = FALSE;
+        GST_INFO_OBJECT (self, "flushing %u buffers of pre-roll", gst_buffer_list_length (flush));
+    }
+    else if (self->recording && !self->flush_pending)
+    {
+        push = TRUE;
+    }
+
+    GST_OBJECT_UNLOCK (self);
+
+    if (flush != NULL)
+    {
+        gst_buffer_unref (buffer);
+        ret = gst_pad_push_list (self->srcpad, flush);
+    }
+    else if (push)
+    {
+        ret = gst_pad_push (self->srcpad, buffer);
+    }
+    else
+    {
+        gst_buffer_unref (buffer);
+    }
+
+    /* Nothing is recording when the tee has no branches left */
+    if (ret == GST_FLOW_NOT_LINKED)
+        ret = GST_FLOW_OK;
+
+    return ret;
+}
+
+static void
+mati_preroll_set_property (GObject      *object,
+                           guint         prop_id,
+                           const GValue *value,
+                           GParamSpec   *pspec)
+{
+    MatiPreroll *self = MATI_PREROLL (object);
+
+    GST_OBJECT_LOCK (self);
+    switch (prop_id)
+    {
+        case PROP_PREROLL_TIME:
+            self->preroll_time = g_value_get_uint64 (value);
+            break;
+        case PROP_MAX_BYTES:
+            self->max_bytes = g_value_get_uint64 (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+static void
+mati_preroll_get_property (GObject    *object,
+                           guint       prop_id,
+                           GValue     *value,
+                           GParamSpec *pspec)
+{
+    MatiPreroll *self = MATI_PREROLL (object);
+
+    GST_OBJECT_LOCK (self);
+    switch (prop_id)
+    {
+        case PROP_PREROLL_TIME:
+            g_value_set_uint64 (value, self->preroll_time);
+            break;
+        case PROP_MAX_BYTES:
+            g_value_set_uint64 (value, self->max_bytes);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+static void
+mati_preroll_finalize (GObject *object)
+{
+    MatiPreroll *self = MATI_PREROLL (object);
+
+    mati_preroll_clear (self);
+
+    G_OBJECT_CLASS (mati_preroll_parent_class)->finalize (object);
+}
+
+static void
+mati_preroll_init (MatiPreroll *self)
+{
+    self->sinkpad = gst_pad_new_from_static_template (&sink_template, "sink");
+    gst_pad_set_chain_function (self->sinkpad, mati_preroll_chain);
+    GST_PAD_SET_PROXY_CAPS (self->sinkpad);
+    gst_element_add_pad (GST_ELEMENT (self), self->sinkpad);
+
+    self->srcpad = gst_pad_new_from_static_template (&src_template, "src");
+    GST_PAD_SET_PROXY_CAPS (self->srcpad);
+    gst_element_add_pad (GST_ELEMENT (self), self->srcpad);
+
+    g_queue_init (&self->buffers);
+    g_queue_init (&self->keyframes);
+    self->bytes = 0;
+    self->preroll_time = DEFAULT_PREROLL_TIME;
+    self->max_bytes = DEFAULT_MAX_BYTES;
+    self->recording = FALSE;
+    self->flush_pending = FALSE;
+}
+
+static void
+mati_preroll_class_init (MatiPrerollClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+    object_class->set_property = mati_preroll_set_property;
+    object_class->get_property = mati_preroll_get_property;
+    object_class->finalize = mati_preroll_finalize;
+
+    g_object_class_install_property (object_class, PROP_PREROLL_TIME,
+        g_param_spec_uint64 ("preroll-time", "Pre-roll time",
+                             "Minimum amount of stream kept before a recording starts, in nanoseconds",
+                             0, G_MAXUINT64, DEFAULT_PREROLL_TIME,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_MAX_BYTES,
+        g_param_spec_uint64 ("max-bytes", "Maximum bytes",
+                             "Byte budget of the pre-roll ring",
+                             0, G_MAXUINT64, DEFAULT_MAX_BYTES,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    gst_element_class_add_static_pad_template (element_class, &sink_template);
+    gst_element_class_add_static_pad_template (element_class, &src_template);
+    gst_element_class_set_static_metadata (element_class,
+                                           "Mati pre-roll", "Filter/Video",
+                                           "Keyframe indexed ring buffer of encoded video",
+                                           "Froura");
+
+    GST_DEBUG_CATEGORY_INIT (mati_preroll_debug, "matipreroll", 0, "Mati pre-roll ring buffer");
+}
+
+/* Flushes the pre-roll on the next buffer and passes the stream through
+ * until mati_preroll_stop(). */
+void
+mati_preroll_start (MatiPreroll *self)
+{
+    GST_OBJECT_LOCK (self);
+    if (!self->recording)
+    {
+        self->recording = TRUE;
+        self->flush_pending = TRUE;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+void
+mati_preroll_stop (MatiPreroll *self)
+{
+    GST_OBJECT_LOCK (self);
+    self->recording = FALSE;
+    self->flush_pending = FALSE;
+    GST_OBJECT_UNLOCK (self);
+}
+
+void
+mati_preroll_get_stats (MatiPreroll  *self,
+                        guint64      *bytes,
+                        GstClockTime *duration,
+                        guint        *keyframes)
+{
+    GST_OBJECT_LOCK (self);
+    *bytes = self->bytes;
+    *keyframes = self->keyframes.length;
+    *duration = 0;
+    if (self->buffers.length > 1)
+    {
+        GstClockTime first = GST_BUFFER_DTS_OR_PTS ((GstBuffer *) g_queue_peek_head (&self->buffers));
+        GstClockTime last = GST_BUFFER_DTS_OR_PTS ((GstBuffer *) g_queue_peek_tail (&self->buffers));
+
+        if (GST_CLOCK_TIME_IS_VALID (first) && GST_CLOCK_TIME_IS_VALID (last) && last > first)
+            *duration = last - first;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+GstElement *
+mati_preroll_new (const char *name)
+{
+    return g_object_new (MATI_TYPE_PREROLL, "name", name, NULL);
+}
+
+/* Copies the ring, starting at a keyframe, for readers outside of the
+ * pipeline. The buffers are shared, not duplicated. */
+GstBufferList *
+mati_preroll_snapshot (MatiPreroll  *self,
+                       GstCaps     **caps)
+{
+    GstBufferList *buffers;
+
+    *caps = gst_pad_get_current_caps (self->sinkpad);
+
+    GST_OBJECT_LOCK (self);
+    buffers = gst_buffer_list_new_sized (self->buffers.length);
+    for (GList *l = self->buffers.head; l != NULL; l = l->next)
+        gst_buffer_list_add (buffers, gst_buffer_ref (l->data));
+    GST_OBJECT_UNLOCK (self);
+
+    return buffers;
+}
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define MATI_TYPE_PREROLL (mati_preroll_get_type ())
+G_DECLARE_FINAL_TYPE (MatiPreroll, mati_preroll, MATI, PREROLL, GstElement)
+
+GstElement *mati_preroll_new (const char *name);
+
+void mati_preroll_start (MatiPreroll *self);
+
+void mati_preroll_stop (MatiPreroll *self);
+
+void mati_preroll_get_stats (MatiPreroll  *self,
+                             guint64      *bytes,
+                             GstClockTime *duration,
+                             guint        *keyframes);
+
+GstBufferList *mati_preroll_snapshot (MatiPreroll  *self,
+                                      GstCaps     **caps);
+
+G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,56 @@
+#include "mati-recording.h"
+
+const char *
+mati_recording_state_to_string (MatiRecordingState state)
+{
+    switch (state)
+    {
+        case MATI_RECORDING_IDLE:
+            return "idle";
+        case MATI_RECORDING_STARTING:
+            return "starting";
+        case MATI_RECORDING_RECORDING:
+            return "recording";
+        case MATI_RECORDING_DRAINING:
+            return "draining";
+        case MATI_RECORDING_FINALIZED:
+            return "finalized";
+        default:
+            return "unknown";
+    }
+}
+
+const char *
+mati_recording_format_to_string (MatiRecordingFormat format)
+{
+    switch (format)
+    {
+        case MATI_RECORDING_MATROSKA:
+            return "matroska";
+        case MATI_RECORDING_FMP4:
+            return "fmp4";
+        default:
+            return "unknown";
+    }
+}
+
+gboolean
+mati_recording_format_from_string (const char          *string,
+                                   MatiRecordingFormat *format)
+{
+    for (MatiRecordingFormat f = MATI_RECORDING_MATROSKA; f <= MATI_RECORDING_FMP4; f++)
+    {
+        if (g_strcmp0 (string, mati_recording_format_to_string (f)) == 0)
+        {
+            *format = f;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+const char *
+mati_recording_format_get_extension (MatiRecordingFormat format)
+{
+    return format == MATI_RECORDING_FMP4 ? "mp4" : "mkv";
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Recordings of a camera go to a directory named after its id */
+#define MATI_RECORDING_DIR "/etc/videos/"
+
+typedef enum
+{
+    MATI_RECORDING_MATROSKA,   // one matroska file per motion event
+    MATI_RECORDING_FMP4,       // fragmented MP4, playable up to the last fragment
+} MatiRecordingFormat;
+
+/* Lifecycle of the recording bin of a detector. A bin leaves the detector
+ * when draining ends and finalizes on its own, so a new recording can start
+ * while earlier ones are still being finalized. */
+typedef enum
+{
+    MATI_RECORDING_IDLE,       // nothing recording, the pre-roll keeps filling
+    MATI_RECORDING_STARTING,   // bin linked, waiting for the pre-roll flush
+    MATI_RECORDING_RECORDING,  // data reaches the bin
+    MATI_RECORDING_DRAINING,   // motion stopped, recording the post-roll
+    MATI_RECORDING_FINALIZED,  // EOS reached the file, the bin is removed
+} MatiRecordingState;
+
+const char *mati_recording_state_to_string (MatiRecordingState state);
+
+const char *mati_recording_format_to_string (MatiRecordingFormat format);
+
+gboolean mati_recording_format_from_string (const char          *string,
+                                            MatiRecordingFormat *format);
+
+const char *mati_recording_format_get_extension (MatiRecordingFormat format);
+
+G_END_DECLS
\ No newline at end of file
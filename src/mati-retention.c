@@ -0,0 +1,530 @@
+#include "mati-retention.h"
+#include "mati-index.h"
+
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#endif
+
+#define PRUNE_INTERVAL (60 * G_TIME_SPAN_MINUTE) // age limit without new recordings
+#define GROWING_TIME 60 // seconds a closed file may still be finalized
+
+typedef struct
+{
+    GQueue files;     // oldest first
+    guint64 bytes;
+} MatiRetentionCamera;
+
+typedef struct
+{
+    gchar *location;
+    MatiRetentionCamera *camera;
+    guint64 size;     // with the sidecar index
+    gint64 mtime;     // seconds since the epoch
+    gboolean growing; // still written, never pruned
+} MatiRetentionFile;
+
+/* Keeps the recordings directory within its quotas. The index of every
+ * recording is built once by scanning the directory on the retention
+ * thread and afterwards only updated by the detectors as they open new
+ * files, so pruning never walks the directory again. Pruning runs on the
+ * same thread at idle CPU and I/O priority, asked for whenever a recording
+ * starts and once an hour for the age limit. Files still being written are
+ * never removed. */
+struct _MatiRetention
+{
+    gchar *directory;
+    guint64 max_bytes;
+    guint64 camera_max_bytes;
+    gint64 max_age; // seconds
+
+    GThread *thread;
+    GMutex lock;
+    GCond cond;
+    gboolean running;
+    gboolean prune_requested;
+
+    /* Under lock */
+    GHashTable *cameras; // camera id -> MatiRetentionCamera
+    GHashTable *files;   // location -> MatiRetentionFile, owned by its camera
+    guint total_files;
+    guint64 total_bytes;
+    guint prune_runs;
+    guint pruned_files;
+    guint64 pruned_bytes;
+    guint prune_errors;
+    gdouble last_prune_time;
+    gdouble scan_time;
+};
+
+static void
+mati_retention_file_free (MatiRetentionFile *file)
+{
+    g_free (file->location);
+    g_free (file);
+}
+
+static void
+mati_retention_camera_free (MatiRetentionCamera *camera)
+{
+    g_queue_clear_full (&camera->files, (GDestroyNotify) mati_retention_file_free);
+    g_free (camera);
+}
+
+static gint
+compare_mtime (gconstpointer a,
+               gconstpointer b,
+               gpointer      user_data)
+{
+    const MatiRetentionFile *file_a = a, *file_b = b;
+
+    return (file_a->mtime > file_b->mtime) - (file_a->mtime < file_b->mtime);
+}
+
+/* Sidecar indexes end in .mkv.idx or .mp4.idx, they belong to their
+ * recording and are never counted on their own */
+static gboolean
+is_recording (const char *name)
+{
+    return g_str_has_suffix (name, ".mkv") || g_str_has_suffix (name, ".mp4");
+}
+
+/* Size of a recording together with its sidecar index, both count toward
+ * the quotas and go away together */
+static gboolean
+stat_recording (const char *location,
+                guint64    *size,
+                gint64     *mtime)
+{
+    g_autofree gchar *index_location = g_strconcat (location, MATI_INDEX_SUFFIX, NULL);
+    GStatBuf st;
+
+    if (g_stat (location, &st) != 0 || !S_ISREG (st.st_mode))
+        return FALSE;
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+
+    if (g_stat (index_location, &st) == 0 && S_ISREG (st.st_mode))
+        *size += st.st_size;
+    return TRUE;
+}
+
+/* Called with the lock held */
+static MatiRetentionFile *
+mati_retention_insert (MatiRetention *self,
+                       const char    *camera_id,
+                       const char    *location,
+                       guint64        size,
+                       gint64         mtime,
+                       gboolean       growing)
+{
+    MatiRetentionCamera *camera;
+    MatiRetentionFile *file;
+
+    if (g_hash_table_contains (self->files, location))
+        return NULL;
+
+    camera = g_hash_table_lookup (self->cameras, camera_id);
+    if (camera == NULL)
+    {
+        camera = g_new0 (MatiRetentionCamera, 1);
+        g_queue_init (&camera->files);
+        g_hash_table_insert (self->cameras, g_strdup (camera_id), camera);
+    }
+
+    file = g_new0 (MatiRetentionFile, 1);
+    file->location = g_strdup (location);
+    file->camera = camera;
+    file->size = size;
+    file->mtime = mtime;
+    file->growing = growing;
+
+    g_queue_push_tail (&camera->files, file);
+    g_hash_table_insert (self->files, file->location, file);
+    camera->bytes += size;
+    self->total_bytes += size;
+    self->total_files++;
+
+    return file;
+}
+
+/* Called with the lock held, the file is handed over to the caller */
+static MatiRetentionFile *
+mati_retention_pop_oldest (MatiRetention       *self,
+                           MatiRetentionCamera *camera)
+{
+    MatiRetentionFile *file = g_queue_pop_head (&camera->files);
+
+    g_hash_table_remove (self->files, file->location);
+    camera->bytes -= MIN (camera->bytes, file->size);
+    self->total_bytes -= MIN (self->total_bytes, file->size);
+    self->total_files--;
+
+    return file;
+}
+
+static gboolean
+can_prune (MatiRetentionCamera *camera)
+{
+    MatiRetentionFile *oldest = g_queue_peek_head (&camera->files);
+
+    /* The newest file is the one a recording may be writing to */
+    return oldest != NULL && !oldest->growing && camera->files.length > 1;
+}
+
+static void
+mati_retention_lower_priority (void)
+{
+#ifdef __linux__
+    pid_t tid = syscall (SYS_gettid);
+
+    if (setpriority (PRIO_PROCESS, tid, 19) != 0)
+        g_debug ("couldn't lower retention CPU priority: %s", g_strerror (errno));
+    if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+        g_debug ("couldn't lower retention I/O priority: %s", g_strerror (errno));
+#endif
+}
+
+static void
+mati_retention_scan (MatiRetention *self)
+{
+    gint64 start_time = g_get_monotonic_time ();
+    g_autoptr (GDir) root = NULL;
+    g_autoptr (GError) error = NULL;
+    const char *camera_id;
+
+    root = g_dir_open (self->directory, 0, &error);
+    if (root == NULL)
+    {
+        g_message ("no recordings to index: %s", error->message);
+        return;
+    }
+
+    while ((camera_id = g_dir_read_name (root)) != NULL)
+    {
+        g_autofree char *camera_path = g_build_filename (self->directory, camera_id, NULL);
+        g_autoptr (GDir) dir = g_dir_open (camera_path, 0, NULL);
+        g_autoptr (GPtrArray) found = NULL;
+        MatiRetentionCamera *camera;
+        const char *name;
+
+        if (dir == NULL)
+            continue;
+
+        /* stat() every file without holding the lock */
+        found = g_ptr_array_new_with_free_func ((GDestroyNotify) mati_retention_file_free);
+        while ((name = g_dir_read_name (dir)) != NULL)
+        {
+            MatiRetentionFile *file;
+
+            if (!is_recording (name))
+                continue;
+
+            file = g_new0 (MatiRetentionFile, 1);
+            file->location = g_build_filename (camera_path, name, NULL);
+            if (!stat_recording (file->location, &file->size, &file->mtime))
+            {
+                mati_retention_file_free (file);
+                continue;
+            }
+            g_ptr_array_add (found, file);
+        }
+
+        g_mutex_lock (&self->lock);
+        for (guint i = 0; i < found->len; i++)
+        {
+            MatiRetentionFile *file = g_ptr_array_index (found, i);
+
+            mati_retention_insert (self, camera_id, file->location, file->size, file->mtime, FALSE);
+        }
+        camera = g_hash_table_lookup (self->cameras, camera_id);
+        if (camera != NULL)
+            g_queue_sort (&camera->files, compare_mtime, NULL);
+        g_mutex_unlock (&self->lock);
+    }
+
+    g_mutex_lock (&self->lock);
+    self->scan_time = (g_get_monotonic_time () - start_time) / (gdouble) G_TIME_SPAN_MILLISECOND;
+    g_message ("indexed %u recordings, %" G_GUINT64_FORMAT " bytes in %.0f ms",
+               self->total_files, self->total_bytes, self->scan_time);
+    g_mutex_unlock (&self->lock);
+}
+
+/* Sizes of files still being written are only known by asking the disk */
+static void
+mati_retention_refresh_growing (MatiRetention *self)
+{
+    g_autoptr (GPtrArray) locations = g_ptr_array_new_with_free_func (g_free);
+    gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+    GHashTableIter iter;
+    MatiRetentionFile *file;
+
+    g_mutex_lock (&self->lock);
+    g_hash_table_iter_init (&iter, self->files);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &file))
+    {
+        if (file->growing)
+            g_ptr_array_add (locations, g_strdup (file->location));
+    }
+    g_mutex_unlock (&self->lock);
+
+    for (guint i = 0; i < locations->len; i++)
+    {
+        const char *location = g_ptr_array_index (locations, i);
+        guint64 size;
+        gint64 mtime;
+
+        /* Not there yet while staged in memory */
+        if (!stat_recording (location, &size, &mtime))
+            continue;
+
+        g_mutex_lock (&self->lock);
+        file = g_hash_table_lookup (self->files, location);
+        if (file != NULL)
+        {
+            file->camera->bytes += size - file->size;
+            self->total_bytes += size - file->size;
+            file->size = size;
+            file->mtime = mtime;
+            file->growing = g_queue_peek_tail (&file->camera->files) == file || now - file->mtime < GROWING_TIME;
+        }
+        g_mutex_unlock (&self->lock);
+    }
+}
+
+static void
+mati_retention_run_prune (MatiRetention *self)
+{
+    gint64 start_time = g_get_monotonic_time ();
+    gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+    g_autoptr (GPtrArray) victims = g_ptr_array_new_with_free_func ((GDestroyNotify) mati_retention_file_free);
+    guint64 bytes = 0;
+    guint errors = 0;
+    GHashTableIter iter;
+    MatiRetentionCamera *camera;
+
+    mati_retention_refresh_growing (self);
+
+    g_mutex_lock (&self->lock);
+    g_hash_table_iter_init (&iter, self->cameras);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &camera))
+    {
+        while (can_prune (camera))
+        {
+            MatiRetentionFile *oldest = g_queue_peek_head (&camera->files);
+
+            if (!(self->camera_max_bytes > 0 && camera->bytes > self->camera_max_bytes)
+                && !(self->max_age > 0 && now - oldest->mtime > self->max_age))
+                break;
+            g_ptr_array_add (victims, mati_retention_pop_oldest (self, camera));
+        }
+    }
+
+    while (self->max_bytes > 0 && self->total_bytes > self->max_bytes)
+    {
+        MatiRetentionCamera *oldest_camera = NULL;
+        MatiRetentionFile *oldest = NULL;
+
+        g_hash_table_iter_init (&iter, self->cameras);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &camera))
+        {
+            MatiRetentionFile *head = g_queue_peek_head (&camera->files);
+
+            if (can_prune (camera) && (oldest == NULL || head->mtime < oldest->mtime))
+            {
+                oldest = head;
+                oldest_camera = camera;
+            }
+        }
+        if (oldest_camera == NULL)
+            break;
+        g_ptr_array_add (victims, mati_retention_pop_oldest (self, oldest_camera));
+    }
+    g_mutex_unlock (&self->lock);
+
+    for (guint i = 0; i < victims->len; i++)
+    {
+        MatiRetentionFile *file = g_ptr_array_index (victims, i);
+        g_autofree gchar *index_location = g_strconcat (file->location, MATI_INDEX_SUFFIX, NULL);
+
+        if (g_unlink (file->location) != 0 && errno != ENOENT)
+        {
+            g_warning ("couldn't remove recording %s: %s", file->location, g_strerror (errno));
+            errors++;
+            continue;
+        }
+        if (g_unlink (index_location) != 0 && errno != ENOENT)
+            g_warning ("couldn't remove index %s: %s", index_location, g_strerror (errno));
+        bytes += file->size;
+    }
+
+    g_mutex_lock (&self->lock);
+    self->prune_runs++;
+    self->pruned_files += victims->len - errors;
+    self->pruned_bytes += bytes;
+    self->prune_errors += errors;
+    self->last_prune_time = (g_get_monotonic_time () - start_time) / (gdouble) G_TIME_SPAN_MILLISECOND;
+    g_mutex_unlock (&self->lock);
+
+    if (victims->len > 0)
+        g_message ("pruned %u recordings, %" G_GUINT64_FORMAT " bytes", victims->len - errors, bytes);
+}
+
+static gpointer
+mati_retention_thread_func (gpointer user_data)
+{
+    MatiRetention *self = user_data;
+
+    mati_retention_lower_priority ();
+    mati_retention_scan (self);
+
+    g_mutex_lock (&self->lock);
+    while (self->running)
+    {
+        gint64 deadline = g_get_monotonic_time () + PRUNE_INTERVAL;
+
+        while (self->running && !self->prune_requested)
+        {
+            if (!g_cond_wait_until (&self->cond, &self->lock, deadline))
+                break;
+        }
+        if (!self->running)
+            break;
+        self->prune_requested = FALSE;
+
+        g_mutex_unlock (&self->lock);
+        mati_retention_run_prune (self);
+        g_mutex_lock (&self->lock);
+    }
+    g_mutex_unlock (&self->lock);
+
+    return NULL;
+}
+
+/* Limits of 0 are disabled, max_age is in seconds */
+MatiRetention *
+mati_retention_new (const char *directory,
+                    guint64     max_bytes,
+                    guint64     camera_max_bytes,
+                    gint64      max_age)
+{
+    MatiRetention *self = g_new0 (MatiRetention, 1);
+
+    self->directory = g_strdup (directory);
+    self->max_bytes = max_bytes;
+    self->camera_max_bytes = camera_max_bytes;
+    self->max_age = max_age;
+    g_mutex_init (&self->lock);
+    g_cond_init (&self->cond);
+    self->cameras = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) mati_retention_camera_free);
+    self->files = g_hash_table_new (g_str_hash, g_str_equal);
+
+    return self;
+}
+
+void
+mati_retention_free (MatiRetention *self)
+{
+    g_mutex_lock (&self->lock);
+    self->running = FALSE;
+    g_cond_broadcast (&self->cond);
+    g_mutex_unlock (&self->lock);
+
+    if (self->thread != NULL)
+        g_thread_join (self->thread);
+
+    g_hash_table_destroy (self->files);
+    g_hash_table_destroy (self->cameras);
+    g_mutex_clear (&self->lock);
+    g_cond_clear (&self->cond);
+    g_free (self->directory);
+    g_free (self);
+}
+
+/* Indexes the directory and prunes it once */
+void
+mati_retention_start (MatiRetention *self)
+{
+    g_return_if_fail (self->thread == NULL);
+
+    self->running = TRUE;
+    self->prune_requested = TRUE;
+    self->thread = g_thread_new ("retention", mati_retention_thread_func, self);
+}
+
+/* A recording opened a new file, it counts once it has been written */
+void
+mati_retention_add_file (MatiRetention *self,
+                         const char    *camera_id,
+                         const char    *location)
+{
+    g_mutex_lock (&self->lock);
+    mati_retention_insert (self, camera_id, location, 0, g_get_real_time () / G_USEC_PER_SEC, TRUE);
+    g_mutex_unlock (&self->lock);
+}
+
+/* Never blocks, the pruning happens on the retention thread */
+void
+mati_retention_prune (MatiRetention *self)
+{
+    g_mutex_lock (&self->lock);
+    self->prune_requested = TRUE;
+    g_cond_signal (&self->cond);
+    g_mutex_unlock (&self->lock);
+}
+
+/* Recordings of a camera written to at or after since, in seconds since
+ * the epoch, oldest first */
+GPtrArray *
+mati_retention_list_files (MatiRetention *self,
+                           const char    *camera_id,
+                           gint64         since)
+{
+    GPtrArray *locations = g_ptr_array_new_with_free_func (g_free);
+    MatiRetentionCamera *camera;
+
+    g_mutex_lock (&self->lock);
+    camera = g_hash_table_lookup (self->cameras, camera_id);
+    for (GList *l = camera != NULL ? camera->files.tail : NULL; l != NULL; l = l->prev)
+    {
+        MatiRetentionFile *file = l->data;
+
+        if (file->mtime < since && !file->growing)
+            break;
+        g_ptr_array_insert (locations, 0, g_strdup (file->location));
+    }
+    g_mutex_unlock (&self->lock);
+
+    return locations;
+}
+
+void
+mati_retention_get_stats (MatiRetention      *self,
+                          const char         *camera_id,
+                          MatiRetentionStats *stats)
+{
+    MatiRetentionCamera *camera;
+
+    g_mutex_lock (&self->lock);
+    camera = g_hash_table_lookup (self->cameras, camera_id);
+    stats->files = camera != NULL ? camera->files.length : 0;
+    stats->bytes = camera != NULL ? camera->bytes : 0;
+    stats->total_files = self->total_files;
+    stats->total_bytes = self->total_bytes;
+    stats->prune_runs = self->prune_runs;
+    stats->pruned_files = self->pruned_files;
+    stats->pruned_bytes = self->pruned_bytes;
+    stats->prune_errors = self->prune_errors;
+    stats->last_prune_time = self->last_prune_time;
+    stats->scan_time = self->scan_time;
+    g_mutex_unlock (&self->lock);
+}
\ No newline at end of file
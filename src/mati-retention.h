@@ -0,0 +1,48 @@
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _MatiRetention MatiRetention;
+
+typedef struct
+{
+    guint files;            // recordings of the camera in the index
+    guint64 bytes;
+    guint total_files;      // recordings of every camera
+    guint64 total_bytes;
+    guint prune_runs;
+    guint pruned_files;
+    guint64 pruned_bytes;
+    guint prune_errors;
+    gdouble last_prune_time; // ms
+    gdouble scan_time;       // ms, 0 while the startup scan runs
+} MatiRetentionStats;
+
+MatiRetention *mati_retention_new (const char *directory,
+                                   guint64     max_bytes,
+                                   guint64     camera_max_bytes,
+                                   gint64      max_age);
+
+void mati_retention_free (MatiRetention *self);
+
+void mati_retention_start (MatiRetention *self);
+
+void mati_retention_add_file (MatiRetention *self,
+                              const char    *camera_id,
+                              const char    *location);
+
+void mati_retention_prune (MatiRetention *self);
+
+GPtrArray *mati_retention_list_files (MatiRetention *self,
+                                     const char    *camera_id,
+                                     gint64         since);
+
+void mati_retention_get_stats (MatiRetention      *self,
+                               const char         *camera_id,
+                               MatiRetentionStats *stats);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MatiRetention, mati_retention_free)
+
+G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,141 @@
+#include "mati-stats.h"
+
+#include <string.h>
+
+#define STATS_WINDOW 64
+#define SNAPSHOT_RETRIES 16
+
+/* Per-frame statistics, written by a single streaming thread and read from
+ * anywhere. The writer never takes a lock: it bumps the sequence counter to
+ * an odd value, updates the window and bumps it back to even. Readers copy
+ * the window and retry when the sequence changed underneath them. */
+struct _MatiStats
+{
+    gint sequence;
+
+    guint head;
+    guint count;
+    GstClockTime timestamps[STATS_WINDOW];
+    guint32 sizes[STATS_WINDOW];
+
+    guint64 frames;
+    guint64 bytes;
+    gint64 last_frame_time;
+};
+
+MatiStats *
+mati_stats_new (void)
+{
+    return g_new0 (MatiStats, 1);
+}
+
+void
+mati_stats_free (MatiStats *self)
+{
+    g_free (self);
+}
+
+void
+mati_stats_push (MatiStats    *self,
+                 GstClockTime  timestamp,
+                 gsize         size)
+{
+    gint64 now = g_get_monotonic_time ();
+
+    /* Fall back to the arrival time for buffers without a timestamp */
+    if (!GST_CLOCK_TIME_IS_VALID (timestamp))
+        timestamp = now * GST_USECOND;
+
+    g_atomic_int_inc (&self->sequence);
+
+    self->timestamps[self->head] = timestamp;
+    self->sizes[self->head] = MIN (size, G_MAXUINT32);
+    self->head = (self->head + 1) % STATS_WINDOW;
+    if (self->count < STATS_WINDOW)
+        self->count++;
+    self->frames++;
+    self->bytes += size;
+    self->last_frame_time = now;
+
+    g_atomic_int_inc (&self->sequence);
+}
+
+void
+mati_stats_snapshot (MatiStats         *self,
+                     MatiStatsSnapshot *snapshot)
+{
+    GstClockTime timestamps[STATS_WINDOW];
+    guint32 sizes[STATS_WINDOW];
+    guint head = 0, count = 0;
+    GstClockTime first, last, span;
+    guint64 window_bytes = 0;
+    gdouble mean_interval, deviation = 0;
+    gint sequence;
+
+    memset (snapshot, 0, sizeof (MatiStatsSnapshot));
+
+    for (guint retry = 0; retry < SNAPSHOT_RETRIES; retry++)
+    {
+        sequence = g_atomic_int_get (&self->sequence);
+        if (sequence & 1)
+            continue;
+
+        head = self->head;
+        count = self->count;
+        memcpy (timestamps, self->timestamps, sizeof (timestamps));
+        memcpy (sizes, self->sizes, sizeof (sizes));
+        snapshot->frames = self->frames;
+        snapshot->bytes = self->bytes;
+        snapshot->last_frame_time = self->last_frame_time;
+
+        if (g_atomic_int_get (&self->sequence) == sequence)
+            break;
+        count = 0;
+    }
+
+    if (count < 2)
+        return;
+
+    /* The oldest entry sits at head once the window has wrapped */
+    first = timestamps[(head + STATS_WINDOW - count) % STATS_WINDOW];
+    last = timestamps[(head + STATS_WINDOW - 1) % STATS_WINDOW];
+    if (last <= first)
+        return;
+    span = last - first;
+
+    for (guint i = 1; i < count; i++)
+        window_bytes += sizes[(head + STATS_WINDOW - i) % STATS_WINDOW];
+
+    mean_interval = (gdouble) span / (count - 1);
+    for (guint i = 1; i < count; i++)
+    {
+        GstClockTime current = timestamps[(head + STATS_WINDOW - i) % STATS_WINDOW];
+        GstClockTime previous = timestamps[(head + STATS_WINDOW - i - 1) % STATS_WINDOW];
+
+        deviation += ABS ((gdouble) GST_CLOCK_DIFF (previous, current) - mean_interval);
+    }
+
+    snapshot->framerate = (gdouble) (count - 1) * GST_SECOND / span;
+    snapshot->bitrate = (gdouble) window_bytes * 8 * GST_SECOND / span;
+    snapshot->jitter = deviation / (count - 1) / GST_MSECOND;
+}
+
+static GstPadProbeReturn
+stats_probe_cb (GstPad          *pad,
+                GstPadProbeInfo *info,
+                gpointer         user_data)
+{
+    MatiStats *self = user_data;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+    mati_stats_push (self, GST_BUFFER_DTS_OR_PTS (buffer), gst_buffer_get_size (buffer));
+
+    return GST_PAD_PROBE_OK;
+}
+
+gulong
+mati_stats_add_probe (MatiStats *self,
+                      GstPad    *pad)
+{
+    return gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, stats_probe_cb, self, NULL);
+}
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <glib.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _MatiStats MatiStats;
+
+typedef struct
+{
+    guint64 frames;
+    guint64 bytes;
+    gdouble framerate;        // frames per second over the window
+    gdouble jitter;           // mean deviation of the frame interval, in ms
+    gdouble bitrate;          // bits per second over the window
+    gint64 last_frame_time;   // monotonic time of the last frame, 0 if none yet
+} MatiStatsSnapshot;
+
+MatiStats *mati_stats_new (void);
+
+void mati_stats_free (MatiStats *self);
+
+void mati_stats_push (MatiStats    *self,
+                      GstClockTime  timestamp,
+                      gsize         size);
+
+void mati_stats_snapshot (MatiStats         *self,
+                          MatiStatsSnapshot *snapshot);
+
+gulong mati_stats_add_probe (MatiStats *self,
+                             GstPad    *pad);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MatiStats, mati_stats_free)
+
+G_END_DECLS
\ No newline at end of file
@@ -0,0 +1,523 @@
+#define _GNU_SOURCE
+
+#include "mati-thread-policy.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define THREAD_NAME_LENGTH 15 // what the kernel keeps, without the terminator
+#define OUTPUT_NICE 5          // added to the process nice value for encode and io
+
+/* What a thread of one class gets every time it starts running a task */
+typedef struct
+{
+    gboolean set_affinity;  // FALSE runs on the CPUs of the process
+    cpu_set_t cpus;
+    gint nice;
+} MatiThreadRule;
+
+/* Runs every task on a thread of its own that ends with the task. Lowering
+ * a nice value again needs privileges, so a niced thread must not go back
+ * to the task pool every other element shares. */
+typedef struct
+{
+    GstTaskPool parent_instance;
+} MatiDedicatedPool;
+
+typedef struct
+{
+    GstTaskPoolClass parent_class;
+} MatiDedicatedPoolClass;
+
+typedef struct
+{
+    GstTaskPoolFunction func;
+    gpointer user_data;
+} MatiDedicatedTask;
+
+static GType mati_dedicated_pool_get_type (void);
+G_DEFINE_TYPE (MatiDedicatedPool, mati_dedicated_pool, GST_TYPE_TASK_POOL);
+
+/* Elements whose streaming threads belong to a class, matched against the
+ * name of the element owning the task and all of its parents */
+typedef struct
+{
+    gchar *element_name;
+    MatiThreadClass thread_class;
+    gchar *label;
+} MatiThreadBranch;
+
+/* Applies names, CPU affinity and nice values to the streaming threads of
+ * one pipeline. GStreamer posts a stream-status message from every
+ * streaming thread right after it starts and right before it stops
+ * running a task, the sync handler receives both on that same thread, so
+ * the thread can change itself without knowing how it was created.
+ *
+ * Every class, other included, has an explicit affinity and nice value
+ * that is applied when a task starts, so a reused task pool thread never
+ * keeps what its previous task had. Tasks of a class with a nice value
+ * other than the process one get a dedicated thread instead, it would
+ * have no way back. Threads created by a streaming thread, like the ones
+ * libav decodes on, inherit its affinity and nice value. */
+struct _MatiThreadPolicy
+{
+    gchar *camera_id;
+    MatiThreadRule rules[MATI_THREAD_IO + 1];
+    GPtrArray *branches;
+    GstTaskPool *dedicated_pool;
+
+    cpu_set_t default_cpus;
+    gint default_nice;
+    gint warned; // classes whose settings failed, bit per class
+
+    GMutex lock;
+    GHashTable *threads; // tid -> MatiThreadInfo
+};
+
+static gpointer
+mati_dedicated_task_func (gpointer user_data)
+{
+    MatiDedicatedTask *task = user_data;
+
+    task->func (task->user_data);
+    g_free (task);
+    return NULL;
+}
+
+static void
+mati_dedicated_pool_prepare (GstTaskPool  *pool,
+                             GError      **error)
+{
+    /* No shared threads to set up */
+}
+
+static void
+mati_dedicated_pool_cleanup (GstTaskPool *pool)
+{
+}
+
+static gpointer
+mati_dedicated_pool_push (GstTaskPool          *pool,
+                          GstTaskPoolFunction   func,
+                          gpointer              user_data,
+                          GError              **error)
+{
+    MatiDedicatedTask *task = g_new0 (MatiDedicatedTask, 1);
+    GThread *thread;
+
+    task->func = func;
+    task->user_data = user_data;
+    thread = g_thread_try_new ("mati-task", mati_dedicated_task_func, task, error);
+    if (thread == NULL)
+        g_free (task);
+    return thread;
+}
+
+static void
+mati_dedicated_pool_join (GstTaskPool *pool,
+                          gpointer     id)
+{
+    g_thread_join (id);
+}
+
+static void
+mati_dedicated_pool_init (MatiDedicatedPool *self)
+{
+}
+
+static void
+mati_dedicated_pool_class_init (MatiDedicatedPoolClass *klass)
+{
+    GstTaskPoolClass *pool_class = GST_TASK_POOL_CLASS (klass);
+
+    pool_class->prepare = mati_dedicated_pool_prepare;
+    pool_class->cleanup = mati_dedicated_pool_cleanup;
+    pool_class->push = mati_dedicated_pool_push;
+    pool_class->join = mati_dedicated_pool_join;
+}
+
+static void
+mati_thread_branch_free (MatiThreadBranch *branch)
+{
+    g_free (branch->element_name);
+    g_free (branch->label);
+    g_free (branch);
+}
+
+static void
+mati_thread_info_free (MatiThreadInfo *info)
+{
+    g_free (info->name);
+    g_free (info);
+}
+
+static void
+mati_thread_info_clear (MatiThreadInfo *info)
+{
+    g_clear_pointer (&info->name, g_free);
+}
+
+MatiThreadPolicy *
+mati_thread_policy_new (const char *camera_id)
+{
+    MatiThreadPolicy *self = g_new0 (MatiThreadPolicy, 1);
+
+    self->camera_id = g_strdup (camera_id);
+    self->branches = g_ptr_array_new_with_free_func ((GDestroyNotify) mati_thread_branch_free);
+    self->threads = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify) mati_thread_info_free);
+    self->dedicated_pool = g_object_new (mati_dedicated_pool_get_type (), NULL);
+    gst_object_ref_sink (self->dedicated_pool);
+    g_mutex_init (&self->lock);
+
+    if (sched_getaffinity (0, sizeof (cpu_set_t), &self->default_cpus) != 0)
+        CPU_ZERO (&self->default_cpus);
+    errno = 0;
+    self->default_nice = getpriority (PRIO_PROCESS, 0);
+    if (errno != 0)
+        self->default_nice = 0;
+
+    for (guint i = 0; i < G_N_ELEMENTS (self->rules); i++)
+        self->rules[i].nice = self->default_nice;
+    /* Outputs give way to decoding and motion detection unless configured
+     * otherwise, raising priorities needs privileges we usually lack */
+    self->rules[MATI_THREAD_ENCODE].nice = MIN (self->default_nice + OUTPUT_NICE, 19);
+    self->rules[MATI_THREAD_IO].nice = MIN (self->default_nice + OUTPUT_NICE, 19);
+
+    return self;
+}
+
+void
+mati_thread_policy_free (MatiThreadPolicy *self)
+{
+    g_clear_pointer (&self->branches, g_ptr_array_unref);
+    g_clear_pointer (&self->threads, g_hash_table_unref);
+    gst_clear_object (&self->dedicated_pool);
+    g_mutex_clear (&self->lock);
+    g_free (self->camera_id);
+    g_free (self);
+}
+
+static gboolean
+parse_cpu_list (const char  *string,
+                cpu_set_t   *cpus,
+                GError     **error)
+{
+    g_auto (GStrv) ranges = g_strsplit (string, ",", -1);
+
+    CPU_ZERO (cpus);
+    for (guint i = 0; ranges[i] != NULL; i++)
+    {
+        g_auto (GStrv) bounds = g_strsplit (ranges[i], "-", 2);
+        guint64 first, last;
+
+        if (!g_ascii_string_to_unsigned (bounds[0], 10, 0, CPU_SETSIZE - 1, &first, error))
+            return FALSE;
+        last = first;
+        if (bounds[1] != NULL && !g_ascii_string_to_unsigned (bounds[1], 10, first, CPU_SETSIZE - 1, &last, error))
+            return FALSE;
+
+        for (guint64 cpu = first; cpu <= last; cpu++)
+            CPU_SET (cpu, cpus);
+    }
+
+    if (CPU_COUNT (cpus) == 0)
+    {
+        g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Empty CPU list");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* A rule looks like class=cpus[:nice], e.g. decode=2-3 or encode=0,1:10.
+ * An empty CPU list runs on the CPUs of the process, a missing nice value
+ * keeps the one of the class. */
+gboolean
+mati_thread_policy_set_rule (MatiThreadPolicy  *self,
+                             const char        *rule,
+                             GError           **error)
+{
+    g_auto (GStrv) class_setting = g_strsplit (rule, "=", 2);
+    g_auto (GStrv) setting = NULL;
+    MatiThreadClass thread_class;
+    MatiThreadRule parsed = { .set_affinity = FALSE };
+
+    if (class_setting[0] == NULL || class_setting[1] == NULL
+        || !mati_thread_class_from_string (class_setting[0], &thread_class) || thread_class == MATI_THREAD_OTHER)
+    {
+        g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE, "Invalid thread rule %s", rule);
+        return FALSE;
+    }
+
+    parsed.nice = self->rules[thread_class].nice;
+    setting = g_strsplit (class_setting[1], ":", 2);
+    if (setting[0] != NULL && *setting[0] != '\0')
+    {
+        if (!parse_cpu_list (setting[0], &parsed.cpus, error))
+            return FALSE;
+        parsed.set_affinity = TRUE;
+    }
+    if (setting[0] != NULL && setting[1] != NULL)
+    {
+        gint64 nice;
+
+        if (!g_ascii_string_to_signed (setting[1], 10, -20, 19, &nice, error))
+            return FALSE;
+        parsed.nice = nice;
+    }
+
+    self->rules[thread_class] = parsed;
+    return TRUE;
+}
+
+void
+mati_thread_policy_add_branch (MatiThreadPolicy *self,
+                               const char       *element_name,
+                               MatiThreadClass   thread_class,
+                               const char       *label)
+{
+    MatiThreadBranch *branch = g_new0 (MatiThreadBranch, 1);
+
+    branch->element_name = g_strdup (element_name);
+    branch->thread_class = thread_class;
+    branch->label = g_strdup (label);
+    g_ptr_array_add (self->branches, branch);
+}
+
+static MatiThreadBranch *
+mati_thread_policy_find_branch (MatiThreadPolicy *self,
+                                GstElement       *owner)
+{
+    GstObject *object = gst_object_ref (GST_OBJECT (owner));
+
+    while (object != NULL)
+    {
+        g_autofree gchar *name = gst_object_get_name (object);
+        GstObject *parent;
+
+        for (guint i = 0; i < self->branches->len; i++)
+        {
+            MatiThreadBranch *branch = g_ptr_array_index (self->branches, i);
+
+            if (g_str_has_prefix (name, branch->element_name))
+            {
+                gst_object_unref (object);
+                return branch;
+            }
+        }
+
+        parent = gst_object_get_parent (object);
+        gst_object_unref (object);
+        object = parent;
+    }
+    return NULL;
+}
+
+static void
+mati_thread_policy_warn (MatiThreadPolicy *self,
+                         MatiThreadClass   thread_class,
+                         const char       *what)
+{
+    gint bit = 1 << thread_class;
+
+    if ((g_atomic_int_or (&self->warned, bit) & bit) == 0)
+        g_warning ("Couldn't set the %s of %s threads: %s", what, mati_thread_class_to_string (thread_class),
+                   g_strerror (errno));
+}
+
+static MatiThreadClass
+mati_thread_policy_classify (MatiThreadPolicy  *self,
+                             GstElement        *owner,
+                             MatiThreadBranch **branch)
+{
+    *branch = mati_thread_policy_find_branch (self, owner);
+    return *branch != NULL ? (*branch)->thread_class : MATI_THREAD_OTHER;
+}
+
+/* Posted by the thread starting the task, before it runs */
+static void
+mati_thread_policy_create (MatiThreadPolicy *self,
+                           GstElement       *owner,
+                           GstMessage       *message)
+{
+    const GValue *value = gst_message_get_stream_status_object (message);
+    MatiThreadBranch *branch;
+    MatiThreadClass thread_class = mati_thread_policy_classify (self, owner, &branch);
+
+    if (self->rules[thread_class].nice == self->default_nice || value == NULL || !G_VALUE_HOLDS (value, GST_TYPE_TASK))
+        return;
+
+    gst_task_set_pool (GST_TASK (g_value_get_object (value)), self->dedicated_pool);
+}
+
+static void
+mati_thread_policy_enter (MatiThreadPolicy *self,
+                          GstElement       *owner)
+{
+    MatiThreadBranch *branch;
+    MatiThreadClass thread_class = mati_thread_policy_classify (self, owner, &branch);
+    MatiThreadRule *rule = &self->rules[thread_class];
+    const cpu_set_t *cpus = rule->set_affinity ? &rule->cpus : &self->default_cpus;
+    MatiThreadInfo *info = g_new0 (MatiThreadInfo, 1);
+    gchar thread_name[THREAD_NAME_LENGTH + 1];
+    gint tid = gettid ();
+
+    info->name = g_strdup_printf ("%s-%s", branch != NULL ? branch->label : "gst", self->camera_id);
+    info->thread_class = thread_class;
+    info->tid = tid;
+
+    g_strlcpy (thread_name, info->name, sizeof (thread_name));
+    pthread_setname_np (pthread_self (), thread_name);
+
+    /* Explicit every time, the thread may have run another class before */
+    if (CPU_COUNT (cpus) > 0 && sched_setaffinity (0, sizeof (cpu_set_t), cpus) != 0)
+        mati_thread_policy_warn (self, thread_class, "CPU affinity");
+    if (setpriority (PRIO_PROCESS, tid, rule->nice) != 0)
+        mati_thread_policy_warn (self, thread_class, "nice value");
+
+    errno = 0;
+    info->nice = getpriority (PRIO_PROCESS, tid);
+    GST_DEBUG ("thread %d runs %s as %s", tid, GST_ELEMENT_NAME (owner), info->name);
+
+    g_mutex_lock (&self->lock);
+    g_hash_table_replace (self->threads, GINT_TO_POINTER (tid), info);
+    g_mutex_unlock (&self->lock);
+}
+
+/* Nothing to restore, the next task sets its own values and a niced
+ * thread ends with its task */
+static void
+mati_thread_policy_leave (MatiThreadPolicy *self)
+{
+    g_mutex_lock (&self->lock);
+    g_hash_table_remove (self->threads, GINT_TO_POINTER (gettid ()));
+    g_mutex_unlock (&self->lock);
+}
+
+static GstBusSyncReply
+thread_policy_sync_handler (GstBus     *bus,
+                            GstMessage *message,
+                            gpointer    user_data)
+{
+    MatiThreadPolicy *self = user_data;
+    GstStreamStatusType type;
+    GstElement *owner;
+
+    if (GST_MESSAGE_TYPE (message) != GST_MESSAGE_STREAM_STATUS)
+        return GST_BUS_PASS;
+
+    gst_message_parse_stream_status (message, &type, &owner);
+    if (type == GST_STREAM_STATUS_TYPE_CREATE)
+        mati_thread_policy_create (self, owner, message);
+    else if (type == GST_STREAM_STATUS_TYPE_ENTER)
+        mati_thread_policy_enter (self, owner);
+    else if (type == GST_STREAM_STATUS_TYPE_LEAVE)
+        mati_thread_policy_leave (self);
+
+    /* Nobody else is interested, keeps them off the detector thread */
+    return GST_BUS_DROP;
+}
+
+/* The policy has to outlive the bus */
+void
+mati_thread_policy_attach (MatiThreadPolicy *self,
+                           GstBus           *bus)
+{
+    gst_bus_set_sync_handler (bus, thread_policy_sync_handler, self, NULL);
+}
+
+/* In ms, -1 when the thread is gone */
+static gint64
+read_cpu_time (gint tid)
+{
+    g_autofree gchar *path = g_strdup_printf ("/proc/self/task/%d/stat", tid);
+    g_autofree gchar *contents = NULL;
+    g_auto (GStrv) fields = NULL;
+    const gchar *end;
+
+    if (!g_file_get_contents (path, &contents, NULL, NULL))
+        return -1;
+
+    /* The name in parentheses may contain spaces, fields are counted
+     * from the state following it */
+    end = strrchr (contents, ')');
+    if (end == NULL)
+        return -1;
+    fields = g_strsplit (end + 2, " ", 14);
+    if (g_strv_length (fields) < 14)
+        return -1;
+
+    return (g_ascii_strtoll (fields[11], NULL, 10) + g_ascii_strtoll (fields[12], NULL, 10)) * 1000
+           / sysconf (_SC_CLK_TCK);
+}
+
+/* Every thread currently running a task of this pipeline */
+GArray *
+mati_thread_policy_get_threads (MatiThreadPolicy *self)
+{
+    GArray *threads = g_array_new (FALSE, FALSE, sizeof (MatiThreadInfo));
+    GHashTableIter iter;
+    MatiThreadInfo *info;
+
+    g_array_set_clear_func (threads, (GDestroyNotify) mati_thread_info_clear);
+
+    g_mutex_lock (&self->lock);
+    g_hash_table_iter_init (&iter, self->threads);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &info))
+    {
+        MatiThreadInfo copy = *info;
+
+        copy.name = g_strdup (info->name);
+        g_array_append_val (threads, copy);
+    }
+    g_mutex_unlock (&self->lock);
+
+    for (guint i = 0; i < threads->len; i++)
+    {
+        MatiThreadInfo *thread = &g_array_index (threads, MatiThreadInfo, i);
+
+        thread->cpu_time = read_cpu_time (thread->tid);
+    }
+    return threads;
+}
+
+const char *
+mati_thread_class_to_string (MatiThreadClass thread_class)
+{
+    switch (thread_class)
+    {
+        case MATI_THREAD_OTHER:
+            return "other";
+        case MATI_THREAD_INPUT:
+            return "input";
+        case MATI_THREAD_DECODE:
+            return "decode";
+        case MATI_THREAD_ANALYSIS:
+            return "analysis";
+        case MATI_THREAD_ENCODE:
+            return "encode";
+        case MATI_THREAD_IO:
+            return "io";
+        default:
+            return "unknown";
+    }
+}
+
+gboolean
+mati_thread_class_from_string (const char      *string,
+                               MatiThreadClass *thread_class)
+{
+    for (MatiThreadClass candidate = MATI_THREAD_OTHER; candidate <= MATI_THREAD_IO; candidate++)
+    {
+        if (g_strcmp0 (string, mati_thread_class_to_string (candidate)) == 0)
+        {
+            *thread_class = candidate;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
\ No newline at end of file
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <glib.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+    MATI_THREAD_OTHER,      // CPUs and nice value of the process
+    MATI_THREAD_INPUT,      // network source, depayloading and parsing
+    MATI_THREAD_DECODE,
+    MATI_THREAD_ANALYSIS,
+    MATI_THREAD_ENCODE,     // live view, thumbnails and other outputs
+    MATI_THREAD_IO,         // recordings
+} MatiThreadClass;
+
+typedef struct _MatiThreadPolicy MatiThreadPolicy;
+
+typedef struct
+{
+    gchar *name;
+    MatiThreadClass thread_class;
+    gint tid;
+    gint nice;
+    gint64 cpu_time;    // user and system time in ms
+} MatiThreadInfo;
+
+MatiThreadPolicy *mati_thread_policy_new (const char *camera_id);
+
+void mati_thread_policy_free (MatiThreadPolicy *self);
+
+gboolean mati_thread_policy_set_rule (MatiThreadPolicy  *self,
+                                      const char        *rule,
+                                      GError           **error);
+
+void mati_thread_policy_add_branch (MatiThreadPolicy *self,
+                                    const char       *element_name,
+                                    MatiThreadClass   thread_class,
+                                    const char       *label);
+
+void mati_thread_policy_attach (MatiThreadPolicy *self,
+                                GstBus           *bus);
+
+GArray *mati_thread_policy_get_threads (MatiThreadPolicy *self);
+
+const char *mati_thread_class_to_string (MatiThreadClass thread_class);
+
+gboolean mati_thread_class_from_string (const char      *string,
+                                        MatiThreadClass *thread_class);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MatiThreadPolicy, mati_thread_policy_free)
+
+G_END_DECLS
\ No newline at end of file
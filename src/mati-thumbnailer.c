@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+
+#include "mati-thumbnailer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <gio/gio.h>
+#include <gst/app/gstappsink.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define DEFAULT_WIDTH 320
+#define DEFAULT_INTERVAL (10 * GST_SECOND)
+
+GST_DEBUG_CATEGORY_STATIC (mati_thumbnailer_debug);
+#define GST_CAT_DEFAULT mati_thumbnailer_debug
+
+/* Thumbnails straight from the encoded stream. Only one keyframe per
+ * interval gets past the probe mati_thumbnailer_add_probe() puts on the
+ * pad feeding the thumbnailer, into a decoder of its own, and is scaled
+ * down to width before it is encoded, so the cost doesn't depend on the
+ * camera resolution or on what the analysis decoder does. The newest JPEG
+ * is kept in memory for mati_thumbnailer_get_fd() and, with location set,
+ * published on disk through a temporary file and a rename so readers never
+ * see half of one. */
+struct _MatiThumbnailer
+{
+    GstBin parent_instance;
+
+    GstElement *capsfilter;
+
+    /* Protected by the object lock */
+    gchar *location;
+    guint width;
+    guint64 interval;
+    GstClockTime last_keyframe;
+    GBytes *latest;
+    guint published;
+};
+
+G_DEFINE_TYPE (MatiThumbnailer, mati_thumbnailer, GST_TYPE_BIN);
+
+enum
+{
+    PROP_0,
+    PROP_LOCATION,
+    PROP_WIDTH,
+    PROP_INTERVAL,
+};
+
+static GstPadProbeReturn
+keyframe_probe_cb (GstPad          *pad,
+                   GstPadProbeInfo *info,
+                   gpointer         user_data)
+{
+    MatiThumbnailer *self = MATI_THUMBNAILER (user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    GstClockTime timestamp = GST_BUFFER_DTS_OR_PTS (buffer);
+    gboolean pass;
+
+    if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+        return GST_PAD_PROBE_DROP;
+
+    if (!GST_CLOCK_TIME_IS_VALID (timestamp))
+        timestamp = gst_util_get_timestamp ();
+
+    GST_OBJECT_LOCK (self);
+    pass = !GST_CLOCK_TIME_IS_VALID (self->last_keyframe) || timestamp < self->last_keyframe
+           || timestamp >= self->last_keyframe + self->interval;
+    if (pass)
+        self->last_keyframe = timestamp;
+    GST_OBJECT_UNLOCK (self);
+
+    return pass ? GST_PAD_PROBE_OK : GST_PAD_PROBE_DROP;
+}
+
+static GstFlowReturn
+on_new_sample (GstAppSink *appsink,
+               gpointer    user_data)
+{
+    MatiThumbnailer *self = MATI_THUMBNAILER (user_data);
+    g_autoptr (GstSample) sample = gst_app_sink_pull_sample (appsink);
+    g_autoptr (GBytes) jpeg = NULL;
+    g_autoptr (GError) error = NULL;
+    g_autofree gchar *location = NULL;
+    GstMapInfo map;
+
+    if (sample == NULL)
+        return GST_FLOW_EOS;
+
+    if (!gst_buffer_map (gst_sample_get_buffer (sample), &map, GST_MAP_READ))
+        return GST_FLOW_OK;
+    jpeg = g_bytes_new (map.data, map.size);
+    gst_buffer_unmap (gst_sample_get_buffer (sample), &map);
+
+    GST_OBJECT_LOCK (self);
+    g_clear_pointer (&self->latest, g_bytes_unref);
+    self->latest = g_bytes_ref (jpeg);
+    self->published++;
+    location = g_strdup (self->location);
+    GST_OBJECT_UNLOCK (self);
+
+    if (location != NULL
+        && !g_file_set_contents_full (location, g_bytes_get_data (jpeg, NULL), g_bytes_get_size (jpeg),
+                                      G_FILE_SET_CONTENTS_CONSISTENT, 0644, &error))
+        GST_WARNING_OBJECT (self, "couldn't publish thumbnail: %s", error->message);
+
+    return GST_FLOW_OK;
+}
+
+static void
+mati_thumbnailer_update_caps (MatiThumbnailer *self)
+{
+    g_autoptr (GstCaps) caps = NULL;
+
+    GST_OBJECT_LOCK (self);
+    /* Only the width is fixed, videoscale keeps the aspect ratio */
+    caps = gst_caps_new_simple ("video/x-raw",
+                                "format", G_TYPE_STRING, "I420",
+                                "width", G_TYPE_INT, (gint) self->width,
+                                "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+                                NULL);
+    GST_OBJECT_UNLOCK (self);
+
+    if (self->capsfilter != NULL)
+        g_object_set (self->capsfilter, "caps", caps, NULL);
+}
+
+static void
+mati_thumbnailer_set_property (GObject      *object,
+                               guint         prop_id,
+                               const GValue *value,
+                               GParamSpec   *pspec)
+{
+    MatiThumbnailer *self = MATI_THUMBNAILER (object);
+
+    switch (prop_id)
+    {
+        case PROP_LOCATION:
+            GST_OBJECT_LOCK (self);
+            g_free (self->location);
+            self->location = g_value_dup_string (value);
+            GST_OBJECT_UNLOCK (self);
+            break;
+        case PROP_WIDTH:
+            GST_OBJECT_LOCK (self);
+            self->width = g_value_get_uint (value);
+            GST_OBJECT_UNLOCK (self);
+            mati_thumbnailer_update_caps (self);
+            break;
+        case PROP_INTERVAL:
+            GST_OBJECT_LOCK (self);
+            self->interval = g_value_get_uint64 (value);
+            GST_OBJECT_UNLOCK (self);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+}
+
+static void
+mati_thumbnailer_get_property (GObject    *object,
+                               guint       prop_id,
+                               GValue     *value,
+                               GParamSpec *pspec)
+{
+    MatiThumbnailer *self = MATI_THUMBNAILER (object);
+
+    GST_OBJECT_LOCK (self);
+    switch (prop_id)
+    {
+        case PROP_LOCATION:
+            g_value_set_string (value, self->location);
+            break;
+        case PROP_WIDTH:
+            g_value_set_uint (value, self->width);
+            break;
+        case PROP_INTERVAL:
+            g_value_set_uint64 (value, self->interval);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+static void
+mati_thumbnailer_finalize (GObject *object)
+{
+    MatiThumbnailer *self = MATI_THUMBNAILER (object);
+
+    g_clear_pointer (&self->latest, g_bytes_unref);
+    g_free (self->location);
+
+    G_OBJECT_CLASS (mati_thumbnailer_parent_class)->finalize (object);
+}
+
+static void
+mati_thumbnailer_init (MatiThumbnailer *self)
+{
+    GstElement *decoder, *videoscale, *videoconvert, *jpegenc, *appsink;
+    GstAppSinkCallbacks callbacks = { .new_sample = on_new_sample };
+    g_autoptr (GstPad) sink_pad = NULL;
+
+    self->location = NULL;
+    self->width = DEFAULT_WIDTH;
+    self->interval = DEFAULT_INTERVAL;
+    self->last_keyframe = GST_CLOCK_TIME_NONE;
+    self->latest = NULL;
+    self->published = 0;
+
+    decoder = gst_element_factory_make ("avdec_h264", NULL);
+    videoscale = gst_element_factory_make ("videoscale", NULL);
+    videoconvert = gst_element_factory_make ("videoconvert", NULL);
+    self->capsfilter = gst_element_factory_make ("capsfilter", NULL);
+    jpegenc = gst_element_factory_make ("jpegenc", NULL);
+    appsink = gst_element_factory_make ("appsink", NULL);
+    if (decoder == NULL || videoscale == NULL || videoconvert == NULL
+        || self->capsfilter == NULL || jpegenc == NULL || appsink == NULL)
+    {
+        g_critical ("Couldn't create thumbnailer elements!");
+        return;
+    }
+
+    /* Frame threads would hold back one thumbnail per thread */
+    g_object_set (decoder, "max-threads", 1, NULL);
+    mati_thumbnailer_update_caps (self);
+    g_object_set (appsink,
+                  "sync", FALSE,
+                  "async", FALSE,
+                  "max-buffers", 1,
+                  "drop", TRUE,
+                  NULL);
+    gst_app_sink_set_callbacks (GST_APP_SINK (appsink), &callbacks, self, NULL);
+
+    gst_bin_add_many (GST_BIN (self), decoder, videoscale, videoconvert, self->capsfilter, jpegenc, appsink, NULL);
+    if (!gst_element_link_many (decoder, videoscale, videoconvert, self->capsfilter, jpegenc, appsink, NULL))
+        g_critical ("Failed to link thumbnailer elements!");
+
+    sink_pad = gst_element_get_static_pad (decoder, "sink");
+    gst_element_add_pad (GST_ELEMENT (self), gst_ghost_pad_new ("sink", sink_pad));
+}
+
+static void
+mati_thumbnailer_class_init (MatiThumbnailerClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+    object_class->set_property = mati_thumbnailer_set_property;
+    object_class->get_property = mati_thumbnailer_get_property;
+    object_class->finalize = mati_thumbnailer_finalize;
+
+    g_object_class_install_property (object_class, PROP_LOCATION,
+        g_param_spec_string ("location", "Location", "File the latest thumbnail is published to, NULL keeps it in memory",
+                             NULL,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_WIDTH,
+        g_param_spec_uint ("width", "Width", "Width of the thumbnails, the height follows the aspect ratio",
+                           16, 8192, DEFAULT_WIDTH,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_INTERVAL,
+        g_param_spec_uint64 ("interval", "Interval", "Minimum time between thumbnails, in nanoseconds",
+                             0, G_MAXUINT64, DEFAULT_INTERVAL,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+    gst_element_class_set_static_metadata (element_class,
+                                           "Mati thumbnailer", "Codec/Encoder/Image",
+                                           "JPEG thumbnails from the keyframes of an H.264 stream",
+                                           "Froura");
+
+    GST_DEBUG_CATEGORY_INIT (mati_thumbnailer_debug, "matithumbnailer", 0, "Mati thumbnailer");
+}
+
+/* Goes on the tee side of the queue in front of the thumbnailer, so only
+ * the keyframes it decodes count against that queue */
+gulong
+mati_thumbnailer_add_probe (MatiThumbnailer *self,
+                            GstPad          *pad)
+{
+    return gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, keyframe_probe_cb, self, NULL);
+}
+
+/* A sealed memfd holding the latest thumbnail, owned by the caller */
+gint
+mati_thumbnailer_get_fd (MatiThumbnailer  *self,
+                         GError          **error)
+{
+    g_autoptr (GBytes) jpeg = NULL;
+    const guint8 *data;
+    gsize size, written = 0;
+    gint fd;
+
+    GST_OBJECT_LOCK (self);
+    if (self->latest != NULL)
+        jpeg = g_bytes_ref (self->latest);
+    GST_OBJECT_UNLOCK (self);
+
+    if (jpeg == NULL)
+    {
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No thumbnail yet");
+        return -1;
+    }
+
+    fd = memfd_create ("thumbnail.jpg", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "Couldn't create memfd: %s", g_strerror (errno));
+        return -1;
+    }
+
+    data = g_bytes_get_data (jpeg, &size);
+    while (written < size)
+    {
+        gssize ret = write (fd, data + written, size - written);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+        {
+            g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "Couldn't write memfd: %s", g_strerror (errno));
+            close (fd);
+            return -1;
+        }
+        written += ret;
+    }
+
+    lseek (fd, 0, SEEK_SET);
+    fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    return fd;
+}
+
+void
+mati_thumbnailer_get_stats (MatiThumbnailer *self,
+                            guint           *published,
+                            gsize           *size)
+{
+    GST_OBJECT_LOCK (self);
+    *published = self->published;
+    *size = self->latest != NULL ? g_bytes_get_size (self->latest) : 0;
+    GST_OBJECT_UNLOCK (self);
+}
+
+GstElement *
+mati_thumbnailer_new (const char *name)
+{
+    return g_object_new (MATI_TYPE_THUMBNAILER, "name", name, NULL);
+}
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define MATI_TYPE_THUMBNAILER (mati_thumbnailer_get_type ())
+G_DECLARE_FINAL_TYPE (MatiThumbnailer, mati_thumbnailer, MATI, THUMBNAILER, GstBin)
+
+GstElement *mati_thumbnailer_new (const char *name);
+
+gulong mati_thumbnailer_add_probe (MatiThumbnailer *self,
+                                   GstPad          *pad);
+
+gint mati_thumbnailer_get_fd (MatiThumbnailer  *self,
+                              GError          **error);
+
+void mati_thumbnailer_get_stats (MatiThumbnailer *self,
+                                 guint           *published,
+                                 gsize           *size);
+
+G_END_DECLS
\ No newline at end of file
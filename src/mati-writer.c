@@ -0,0 +1,1017 @@
+#define _GNU_SOURCE
+#include "mati-writer.h"
+#include "mati-index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define DEFAULT_BLOCK_SIZE (1024 * 1024)
+#define DEFAULT_MAX_QUEUE_BYTES ((guint64)64 * 1024 * 1024)
+#define DEFAULT_PREALLOCATE ((guint64)64 * 1024 * 1024)
+#define DIRECT_ALIGNMENT 4096
+
+GST_DEBUG_CATEGORY_STATIC (mati_writer_debug);
+#define GST_CAT_DEFAULT mati_writer_debug
+
+typedef enum
+{
+    ITEM_BUFFER,
+    ITEM_SEEK,   // the muxer goes back to rewrite a header
+    ITEM_FLUSH,  // write out the partial block, sent before EOS
+} MatiWriterItemType;
+
+typedef struct
+{
+    MatiWriterItemType type;
+    GstBuffer *buffer;
+    guint64 offset;
+} MatiWriterItem;
+
+/* File sink that never writes on the streaming thread. Buffers are handed
+ * to an I/O thread through a queue bounded by max-queue-bytes, which
+ * gathers them into block-size writes. The file is preallocated ahead of
+ * the data, can be opened with O_DIRECT and have writeback started after
+ * every block with sync_file_range().
+ *
+ * With ram-staging the file is first written to a memfd and copied to its
+ * location in one sequential pass on EOS or stop, which is what
+ * flash storage handles best. All writers share one RAM budget, a writer
+ * that doesn't fit anymore commits what it has and writes directly from
+ * then on.
+ *
+ * With index a sidecar next to the file gets the byte offset of every
+ * keyframe the muxer marks, and on stop the motion intervals. Keyframe
+ * times are wall-clock, start-time is when the first buffer was captured
+ * and defaults to when it arrived. */
+struct _MatiWriter
+{
+    GstBaseSink parent_instance;
+
+    /* Properties, protected by the object lock */
+    gchar *location;
+    guint block_size;
+    guint64 max_queue_bytes;
+    guint64 preallocate;
+    gboolean direct;
+    gboolean sync;
+    gboolean ram_staging;
+    gboolean index;
+    gint64 start_time;
+
+    GThread *thread;
+    gint fd;
+
+    /* Protected by lock */
+    GMutex lock;
+    GCond cond;
+    GQueue items;
+    gboolean running;
+    gboolean flushing;
+    gboolean busy;
+    gint write_error;
+    MatiWriterStats stats;
+    gint64 total_write_time;
+    GArray *motion; // MatiIndexInterval
+    gboolean motion_open;
+
+    /* Streaming thread only */
+    guint64 position;
+
+    /* I/O thread only */
+    guint8 *staging;
+    gsize staged;
+    guint64 staging_offset;
+    guint64 file_end;
+    guint64 allocated_end;
+    gboolean direct_active;
+    gboolean memfd_active;
+    guint64 ram_reserved;   // taken from the budget, may run ahead of file_end
+    MatiIndexWriter *index_writer;
+    GstClockTime first_pts;
+    gint64 index_base;
+};
+
+/* Shared by every writer in the process */
+static GMutex ram_lock;
+static guint64 ram_budget = 0;
+static guint64 ram_used = 0;
+
+G_DEFINE_TYPE (MatiWriter, mati_writer, GST_TYPE_BASE_SINK);
+
+enum
+{
+    PROP_0,
+    PROP_LOCATION,
+    PROP_BLOCK_SIZE,
+    PROP_MAX_QUEUE_BYTES,
+    PROP_PREALLOCATE,
+    PROP_DIRECT,
+    PROP_SYNC,
+    PROP_RAM_STAGING,
+    PROP_INDEX,
+    PROP_START_TIME,
+};
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+static void
+mati_writer_item_free (MatiWriterItem *item)
+{
+    if (item->buffer != NULL)
+        gst_buffer_unref (item->buffer);
+    g_free (item);
+}
+
+/* O_DIRECT only takes aligned offsets and lengths, anything else goes
+ * through the page cache from then on */
+static void
+mati_writer_disable_direct (MatiWriter *self)
+{
+    if (!self->direct_active)
+        return;
+
+    fcntl (self->fd, F_SETFL, fcntl (self->fd, F_GETFL) & ~O_DIRECT);
+    self->direct_active = FALSE;
+}
+
+static void
+mati_writer_preallocate (MatiWriter *self,
+                         guint64     end)
+{
+#ifdef __linux__
+    if (self->preallocate == 0 || self->memfd_active || end <= self->allocated_end)
+        return;
+
+    if (fallocate (self->fd, FALLOC_FL_KEEP_SIZE, self->allocated_end, end - self->allocated_end + self->preallocate) == 0)
+    {
+        self->allocated_end = end + self->preallocate;
+    }
+    else
+    {
+        GST_INFO_OBJECT (self, "not preallocating: %s", g_strerror (errno));
+        self->preallocate = 0;
+    }
+#endif
+}
+
+static gint
+mati_writer_open_location (MatiWriter *self)
+{
+    gint flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    gint fd = -1;
+
+    self->direct_active = FALSE;
+    if (self->direct)
+    {
+        fd = open (self->location, flags | O_DIRECT, 0644);
+        self->direct_active = fd >= 0;
+    }
+    /* tmpfs and some other filesystems refuse O_DIRECT */
+    if (!self->direct_active)
+        fd = open (self->location, flags, 0644);
+
+    return fd;
+}
+
+static gboolean
+mati_writer_pwrite_all (MatiWriter   *self,
+                        const guint8 *data,
+                        gsize         length,
+                        guint64       offset)
+{
+    gsize written = 0;
+
+    while (written < length)
+    {
+        gssize ret = pwrite (self->fd, data + written, length - written, offset + written);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return FALSE;
+        written += ret;
+    }
+    return TRUE;
+}
+
+/* Takes RAM for growing the memfd up to end from the shared budget. What
+ * a failed write reserved stays reserved, a retry doesn't take it again. */
+static gboolean
+mati_writer_reserve_ram (MatiWriter *self,
+                         guint64     end)
+{
+    guint64 needed = end > self->ram_reserved ? end - self->ram_reserved : 0;
+    gboolean reserved;
+
+    g_mutex_lock (&ram_lock);
+    reserved = ram_used + needed <= ram_budget;
+    if (reserved)
+        ram_used += needed;
+    g_mutex_unlock (&ram_lock);
+
+    if (reserved)
+        self->ram_reserved += needed;
+    return reserved;
+}
+
+static void
+mati_writer_release_ram (MatiWriter *self)
+{
+    g_mutex_lock (&ram_lock);
+    ram_used -= MIN (ram_used, self->ram_reserved);
+    g_mutex_unlock (&ram_lock);
+    self->ram_reserved = 0;
+}
+
+/* Copies the memfd to the real location in one sequential pass and writes
+ * there from then on */
+static gboolean
+mati_writer_commit_ram (MatiWriter *self)
+{
+    gint64 start_time = g_get_monotonic_time ();
+    gint memfd = self->fd;
+    guint8 *buffer = NULL;
+    guint64 offset = 0;
+    gboolean ret = TRUE;
+
+    self->fd = mati_writer_open_location (self);
+    if (self->fd < 0 || posix_memalign ((void **) &buffer, DIRECT_ALIGNMENT, self->block_size) != 0)
+    {
+        if (self->fd >= 0)
+            close (self->fd);
+        self->fd = memfd;
+        return FALSE;
+    }
+    self->memfd_active = FALSE;
+    self->allocated_end = 0;
+    mati_writer_preallocate (self, self->file_end);
+
+    while (ret && offset < self->file_end)
+    {
+        gssize length = pread (memfd, buffer, MIN (self->block_size, self->file_end - offset), offset);
+
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length <= 0)
+        {
+            ret = FALSE;
+            break;
+        }
+        if (length % DIRECT_ALIGNMENT != 0)
+            mati_writer_disable_direct (self);
+        ret = mati_writer_pwrite_all (self, buffer, length, offset);
+        offset += length;
+    }
+
+    close (memfd);
+    free (buffer);
+    mati_writer_release_ram (self);
+
+    GST_INFO_OBJECT (self, "committed %" G_GUINT64_FORMAT " bytes to %s in %" G_GINT64_FORMAT " ms",
+                     offset, self->location, (g_get_monotonic_time () - start_time) / G_TIME_SPAN_MILLISECOND);
+    return ret;
+}
+
+static gboolean
+mati_writer_write_staging (MatiWriter *self)
+{
+    gint64 start_time = g_get_monotonic_time ();
+    gint64 write_time;
+    gsize written = self->staged;
+
+    if (self->staged == 0)
+        return TRUE;
+
+    if (self->memfd_active && !mati_writer_reserve_ram (self, self->staging_offset + self->staged))
+    {
+        GST_INFO_OBJECT (self, "RAM budget used up, writing %s directly", self->location);
+        if (!mati_writer_commit_ram (self))
+            return FALSE;
+        g_mutex_lock (&self->lock);
+        self->stats.ram_fallback = TRUE;
+        g_mutex_unlock (&self->lock);
+    }
+
+    if (self->staged % DIRECT_ALIGNMENT != 0 || self->staging_offset % DIRECT_ALIGNMENT != 0)
+        mati_writer_disable_direct (self);
+    mati_writer_preallocate (self, self->staging_offset + self->staged);
+
+    if (!mati_writer_pwrite_all (self, self->staging, self->staged, self->staging_offset))
+        return FALSE;
+
+#ifdef __linux__
+    if (self->sync)
+        sync_file_range (self->fd, self->staging_offset, self->staged, SYNC_FILE_RANGE_WRITE);
+#endif
+
+    self->staging_offset += self->staged;
+    self->file_end = MAX (self->file_end, self->staging_offset);
+
+    write_time = g_get_monotonic_time () - start_time;
+    g_mutex_lock (&self->lock);
+    self->stats.bytes_written += written;
+    self->stats.ram_staged = self->memfd_active ? self->file_end : 0;
+    self->stats.writes++;
+    self->total_write_time += write_time;
+    self->stats.write_latency = (gdouble) self->total_write_time / self->stats.writes / G_TIME_SPAN_MILLISECOND;
+    self->stats.max_write_latency = MAX (self->stats.max_write_latency, (gdouble) write_time / G_TIME_SPAN_MILLISECOND);
+    g_mutex_unlock (&self->lock);
+
+    /* The index never gets far ahead of the data it points to */
+    if (self->index_writer != NULL)
+        mati_index_writer_flush (self->index_writer);
+
+    self->staged = 0;
+    return TRUE;
+}
+
+static void
+mati_writer_index_buffer (MatiWriter *self,
+                          GstBuffer  *buffer)
+{
+    GstClockTime pts = GST_BUFFER_PTS (buffer);
+
+    if (self->index_writer == NULL || !GST_CLOCK_TIME_IS_VALID (pts))
+        return;
+
+    if (!GST_CLOCK_TIME_IS_VALID (self->first_pts))
+    {
+        self->first_pts = pts;
+        if (self->index_base == 0)
+            self->index_base = g_get_real_time ();
+    }
+
+    if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT)
+        || GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_HEADER))
+        return;
+
+    mati_index_writer_add_keyframe (self->index_writer,
+                                    self->index_base + GST_CLOCK_DIFF (self->first_pts, pts) / GST_USECOND,
+                                    self->staging_offset + self->staged);
+}
+
+static gboolean
+mati_writer_append (MatiWriter *self,
+                    GstBuffer  *buffer)
+{
+    GstMapInfo map;
+    gsize consumed = 0;
+    gboolean ret = TRUE;
+
+    if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
+        return FALSE;
+
+    while (ret && consumed < map.size)
+    {
+        gsize length = MIN (map.size - consumed, self->block_size - self->staged);
+
+        memcpy (self->staging + self->staged, map.data + consumed, length);
+        self->staged += length;
+        consumed += length;
+
+        if (self->staged == self->block_size)
+            ret = mati_writer_write_staging (self);
+    }
+
+    gst_buffer_unmap (buffer, &map);
+    return ret;
+}
+
+static gboolean
+mati_writer_process (MatiWriter     *self,
+                     MatiWriterItem *item)
+{
+    switch (item->type)
+    {
+        case ITEM_BUFFER:
+        {
+            mati_writer_index_buffer (self, item->buffer);
+            return mati_writer_append (self, item->buffer);
+        }
+        case ITEM_SEEK:
+        {
+            if (!mati_writer_write_staging (self))
+                return FALSE;
+            self->staging_offset = item->offset;
+            return TRUE;
+        }
+        case ITEM_FLUSH:
+            return mati_writer_write_staging (self);
+        default:
+            return TRUE;
+    }
+}
+
+static gpointer
+mati_writer_thread_func (gpointer user_data)
+{
+    MatiWriter *self = MATI_WRITER (user_data);
+    gboolean failed = FALSE;
+
+    g_mutex_lock (&self->lock);
+    while (TRUE)
+    {
+        MatiWriterItem *item;
+
+        while (g_queue_is_empty (&self->items) && self->running)
+            g_cond_wait (&self->cond, &self->lock);
+        if (g_queue_is_empty (&self->items))
+            break;
+
+        item = g_queue_pop_head (&self->items);
+        self->busy = TRUE;
+        g_mutex_unlock (&self->lock);
+
+        /* After an error the data is only consumed, render() reports it */
+        if (!failed && !mati_writer_process (self, item))
+        {
+            gint error = errno;
+
+            failed = TRUE;
+            g_mutex_lock (&self->lock);
+            self->write_error = error != 0 ? error : EIO;
+            g_mutex_unlock (&self->lock);
+        }
+
+        g_mutex_lock (&self->lock);
+        if (item->buffer != NULL)
+            self->stats.queued_bytes -= gst_buffer_get_size (item->buffer);
+        self->busy = FALSE;
+        g_cond_broadcast (&self->cond);
+        g_mutex_unlock (&self->lock);
+
+        mati_writer_item_free (item);
+        g_mutex_lock (&self->lock);
+    }
+    g_mutex_unlock (&self->lock);
+
+    if (!failed)
+        mati_writer_write_staging (self);
+
+    return NULL;
+}
+
+static void
+mati_writer_push_item (MatiWriter         *self,
+                       MatiWriterItemType  type,
+                       GstBuffer          *buffer,
+                       guint64             offset)
+{
+    MatiWriterItem *item = g_new0 (MatiWriterItem, 1);
+
+    item->type = type;
+    item->buffer = buffer;
+    item->offset = offset;
+
+    g_mutex_lock (&self->lock);
+    g_queue_push_tail (&self->items, item);
+    g_cond_broadcast (&self->cond);
+    g_mutex_unlock (&self->lock);
+}
+
+/* Waits until everything handed over so far is written */
+static void
+mati_writer_drain (MatiWriter *self)
+{
+    mati_writer_push_item (self, ITEM_FLUSH, NULL, 0);
+
+    g_mutex_lock (&self->lock);
+    while ((!g_queue_is_empty (&self->items) || self->busy) && !self->flushing)
+        g_cond_wait (&self->cond, &self->lock);
+    g_mutex_unlock (&self->lock);
+}
+
+/* Moves what is staged in RAM to the location, from the streaming thread
+ * once the writer thread is idle or gone */
+static void
+mati_writer_finish_ram (MatiWriter *self)
+{
+    if (!self->memfd_active)
+        return;
+
+    if (!mati_writer_commit_ram (self))
+    {
+        GST_ELEMENT_ERROR (self, RESOURCE, WRITE, ("Error while writing to file \"%s\".", self->location),
+                           GST_ERROR_SYSTEM);
+        if (self->memfd_active)
+            mati_writer_release_ram (self);
+    }
+    self->memfd_active = FALSE;
+
+    g_mutex_lock (&self->lock);
+    self->stats.ram_staged = 0;
+    g_mutex_unlock (&self->lock);
+}
+
+static gboolean
+mati_writer_start (GstBaseSink *sink)
+{
+    MatiWriter *self = MATI_WRITER (sink);
+    gboolean ram_available;
+
+    if (self->location == NULL)
+    {
+        GST_ELEMENT_ERROR (self, RESOURCE, NOT_FOUND, ("No file name specified for writing."), (NULL));
+        return FALSE;
+    }
+
+    g_mutex_lock (&ram_lock);
+    ram_available = ram_used < ram_budget;
+    g_mutex_unlock (&ram_lock);
+
+    self->memfd_active = FALSE;
+    self->direct_active = FALSE;
+#ifdef __linux__
+    if (self->ram_staging && ram_available)
+    {
+        g_autofree gchar *name = g_path_get_basename (self->location);
+
+        self->fd = memfd_create (name, MFD_CLOEXEC);
+        self->memfd_active = self->fd >= 0;
+    }
+#endif
+    if (!self->memfd_active)
+        self->fd = mati_writer_open_location (self);
+    if (self->fd < 0)
+    {
+        GST_ELEMENT_ERROR (self, RESOURCE, OPEN_WRITE, ("Could not open file \"%s\" for writing.", self->location),
+                           GST_ERROR_SYSTEM);
+        return FALSE;
+    }
+
+    self->block_size = GST_ROUND_UP_N (MAX (self->block_size, DIRECT_ALIGNMENT), DIRECT_ALIGNMENT);
+    if (posix_memalign ((void **) &self->staging, DIRECT_ALIGNMENT, self->block_size) != 0)
+    {
+        close (self->fd);
+        self->fd = -1;
+        return FALSE;
+    }
+    self->staged = 0;
+    self->staging_offset = 0;
+    self->file_end = 0;
+    self->ram_reserved = 0;
+    self->allocated_end = 0;
+    self->position = 0;
+
+    self->first_pts = GST_CLOCK_TIME_NONE;
+    self->index_base = self->start_time;
+    if (self->index)
+    {
+        g_autoptr (GError) error = NULL;
+
+        self->index_writer = mati_index_writer_new (self->location, &error);
+        if (self->index_writer == NULL)
+            GST_WARNING_OBJECT (self, "recording without index: %s", error->message);
+    }
+
+    self->running = TRUE;
+    self->flushing = FALSE;
+    self->write_error = 0;
+    memset (&self->stats, 0, sizeof (self->stats));
+    self->total_write_time = 0;
+    g_array_set_size (self->motion, 0);
+    self->motion_open = FALSE;
+    self->thread = g_thread_new ("mati-writer", mati_writer_thread_func, self);
+
+    GST_INFO_OBJECT (self, "writing to %s%s", self->location,
+                     self->memfd_active ? " through RAM" : self->direct_active ? " with O_DIRECT" : "");
+    return TRUE;
+}
+
+static gboolean
+mati_writer_stop (GstBaseSink *sink)
+{
+    MatiWriter *self = MATI_WRITER (sink);
+
+    g_mutex_lock (&self->lock);
+    self->running = FALSE;
+    g_cond_broadcast (&self->cond);
+    g_mutex_unlock (&self->lock);
+
+    if (self->thread != NULL)
+        g_thread_join (self->thread);
+    self->thread = NULL;
+
+    /* Only left over when no EOS came */
+    mati_writer_finish_ram (self);
+
+    g_mutex_lock (&self->lock);
+    if (self->motion_open)
+        g_array_index (self->motion, MatiIndexInterval, self->motion->len - 1).end = g_get_real_time ();
+    self->motion_open = FALSE;
+    if (self->index_writer != NULL)
+        mati_index_writer_close (g_steal_pointer (&self->index_writer), self->motion);
+    g_mutex_unlock (&self->lock);
+
+    if (self->fd >= 0)
+    {
+        /* Gives back what was preallocated past the data */
+        if (self->allocated_end > self->file_end && ftruncate (self->fd, self->file_end) != 0)
+            GST_WARNING_OBJECT (self, "couldn't trim %s: %s", self->location, g_strerror (errno));
+        if (self->sync)
+            fdatasync (self->fd);
+        close (self->fd);
+        self->fd = -1;
+    }
+
+    g_clear_pointer (&self->staging, free);
+    return TRUE;
+}
+
+static GstFlowReturn
+mati_writer_render (GstBaseSink *sink,
+                    GstBuffer   *buffer)
+{
+    MatiWriter *self = MATI_WRITER (sink);
+    gsize size = gst_buffer_get_size (buffer);
+    gint write_error;
+
+    g_mutex_lock (&self->lock);
+    if (self->write_error == 0 && self->stats.queued_bytes > 0 && self->stats.queued_bytes + size > self->max_queue_bytes)
+    {
+        self->stats.stalls++;
+        GST_DEBUG_OBJECT (self, "queue full, waiting for the disk");
+        while (self->stats.queued_bytes > 0 && self->stats.queued_bytes + size > self->max_queue_bytes
+               && !self->flushing && self->write_error == 0)
+            g_cond_wait (&self->cond, &self->lock);
+    }
+    write_error = self->write_error;
+    if (self->flushing)
+    {
+        g_mutex_unlock (&self->lock);
+        return GST_FLOW_FLUSHING;
+    }
+    if (write_error == 0)
+    {
+        self->stats.queued_bytes += size;
+        self->stats.max_queued_bytes = MAX (self->stats.max_queued_bytes, self->stats.queued_bytes);
+    }
+    g_mutex_unlock (&self->lock);
+
+    if (write_error != 0)
+    {
+        GST_ELEMENT_ERROR (self, RESOURCE, WRITE, ("Error while writing to file \"%s\".", self->location),
+                           ("%s", g_strerror (write_error)));
+        return GST_FLOW_ERROR;
+    }
+
+    mati_writer_push_item (self, ITEM_BUFFER, gst_buffer_ref (buffer), 0);
+    self->position += size;
+    return GST_FLOW_OK;
+}
+
+static gboolean
+mati_writer_event (GstBaseSink *sink,
+                   GstEvent    *event)
+{
+    MatiWriter *self = MATI_WRITER (sink);
+
+    switch (GST_EVENT_TYPE (event))
+    {
+        case GST_EVENT_SEGMENT:
+        {
+            const GstSegment *segment;
+
+            gst_event_parse_segment (event, &segment);
+            if (segment->format == GST_FORMAT_BYTES && segment->start != self->position)
+            {
+                mati_writer_push_item (self, ITEM_SEEK, NULL, segment->start);
+                self->position = segment->start;
+            }
+            break;
+        }
+        case GST_EVENT_EOS:
+            /* The file is complete by the time EOS gets posted, also when
+             * it was staged in RAM */
+            mati_writer_drain (self);
+            mati_writer_finish_ram (self);
+            break;
+        default:
+            break;
+    }
+
+    return GST_BASE_SINK_CLASS (mati_writer_parent_class)->event (sink, event);
+}
+
+static gboolean
+mati_writer_query (GstBaseSink *sink,
+                   GstQuery    *query)
+{
+    MatiWriter *self = MATI_WRITER (sink);
+
+    switch (GST_QUERY_TYPE (query))
+    {
+        case GST_QUERY_SEEKING:
+        {
+            GstFormat format;
+
+            /* Muxers rewrite their headers when the sink can seek */
+            gst_query_parse_seeking (query, &format, NULL, NULL, NULL);
+            gst_query_set_seeking (query, format, format == GST_FORMAT_BYTES || format == GST_FORMAT_DEFAULT, 0, -1);
+            return TRUE;
+        }
+        case GST_QUERY_POSITION:
+        {
+            GstFormat format;
+
+            gst_query_parse_position (query, &format, NULL);
+            if (format != GST_FORMAT_BYTES && format != GST_FORMAT_DEFAULT)
+                break;
+            gst_query_set_position (query, GST_FORMAT_BYTES, self->position);
+            return TRUE;
+        }
+        default:
+            break;
+    }
+
+    return GST_BASE_SINK_CLASS (mati_writer_parent_class)->query (sink, query);
+}
+
+static gboolean
+mati_writer_unlock (GstBaseSink *sink)
+{
+    MatiWriter *self = MATI_WRITER (sink);
+
+    g_mutex_lock (&self->lock);
+    self->flushing = TRUE;
+    g_cond_broadcast (&self->cond);
+    g_mutex_unlock (&self->lock);
+    return TRUE;
+}
+
+static gboolean
+mati_writer_unlock_stop (GstBaseSink *sink)
+{
+    MatiWriter *self = MATI_WRITER (sink);
+
+    g_mutex_lock (&self->lock);
+    self->flushing = FALSE;
+    g_mutex_unlock (&self->lock);
+    return TRUE;
+}
+
+static void
+mati_writer_set_property (GObject      *object,
+                          guint         prop_id,
+                          const GValue *value,
+                          GParamSpec   *pspec)
+{
+    MatiWriter *self = MATI_WRITER (object);
+
+    GST_OBJECT_LOCK (self);
+    switch (prop_id)
+    {
+        case PROP_LOCATION:
+            g_free (self->location);
+            self->location = g_value_dup_string (value);
+            break;
+        case PROP_BLOCK_SIZE:
+            self->block_size = g_value_get_uint (value);
+            break;
+        case PROP_MAX_QUEUE_BYTES:
+            self->max_queue_bytes = g_value_get_uint64 (value);
+            break;
+        case PROP_PREALLOCATE:
+            self->preallocate = g_value_get_uint64 (value);
+            break;
+        case PROP_DIRECT:
+            self->direct = g_value_get_boolean (value);
+            break;
+        case PROP_SYNC:
+            self->sync = g_value_get_boolean (value);
+            break;
+        case PROP_RAM_STAGING:
+            self->ram_staging = g_value_get_boolean (value);
+            break;
+        case PROP_INDEX:
+            self->index = g_value_get_boolean (value);
+            break;
+        case PROP_START_TIME:
+            self->start_time = g_value_get_int64 (value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+static void
+mati_writer_get_property (GObject    *object,
+                          guint       prop_id,
+                          GValue     *value,
+                          GParamSpec *pspec)
+{
+    MatiWriter *self = MATI_WRITER (object);
+
+    GST_OBJECT_LOCK (self);
+    switch (prop_id)
+    {
+        case PROP_LOCATION:
+            g_value_set_string (value, self->location);
+            break;
+        case PROP_BLOCK_SIZE:
+            g_value_set_uint (value, self->block_size);
+            break;
+        case PROP_MAX_QUEUE_BYTES:
+            g_value_set_uint64 (value, self->max_queue_bytes);
+            break;
+        case PROP_PREALLOCATE:
+            g_value_set_uint64 (value, self->preallocate);
+            break;
+        case PROP_DIRECT:
+            g_value_set_boolean (value, self->direct);
+            break;
+        case PROP_SYNC:
+            g_value_set_boolean (value, self->sync);
+            break;
+        case PROP_RAM_STAGING:
+            g_value_set_boolean (value, self->ram_staging);
+            break;
+        case PROP_INDEX:
+            g_value_set_boolean (value, self->index);
+            break;
+        case PROP_START_TIME:
+            g_value_set_int64 (value, self->start_time);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+            break;
+    }
+    GST_OBJECT_UNLOCK (self);
+}
+
+static void
+mati_writer_finalize (GObject *object)
+{
+    MatiWriter *self = MATI_WRITER (object);
+
+    g_queue_clear_full (&self->items, (GDestroyNotify) mati_writer_item_free);
+    g_mutex_clear (&self->lock);
+    g_cond_clear (&self->cond);
+    g_array_unref (self->motion);
+    g_free (self->location);
+
+    G_OBJECT_CLASS (mati_writer_parent_class)->finalize (object);
+}
+
+static void
+mati_writer_init (MatiWriter *self)
+{
+    self->location = NULL;
+    self->block_size = DEFAULT_BLOCK_SIZE;
+    self->max_queue_bytes = DEFAULT_MAX_QUEUE_BYTES;
+    self->preallocate = DEFAULT_PREALLOCATE;
+    self->direct = FALSE;
+    self->sync = FALSE;
+    self->ram_staging = FALSE;
+    self->memfd_active = FALSE;
+    self->ram_reserved = 0;
+    self->index = FALSE;
+    self->start_time = 0;
+    self->index_writer = NULL;
+    self->motion = g_array_new (FALSE, FALSE, sizeof (MatiIndexInterval));
+    self->motion_open = FALSE;
+    self->thread = NULL;
+    self->fd = -1;
+    self->staging = NULL;
+    g_mutex_init (&self->lock);
+    g_cond_init (&self->cond);
+    g_queue_init (&self->items);
+
+    gst_base_sink_set_sync (GST_BASE_SINK (self), FALSE);
+}
+
+static void
+mati_writer_class_init (MatiWriterClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+    GstBaseSinkClass *base_sink_class = GST_BASE_SINK_CLASS (klass);
+
+    object_class->set_property = mati_writer_set_property;
+    object_class->get_property = mati_writer_get_property;
+    object_class->finalize = mati_writer_finalize;
+
+    base_sink_class->start = mati_writer_start;
+    base_sink_class->stop = mati_writer_stop;
+    base_sink_class->render = mati_writer_render;
+    base_sink_class->event = mati_writer_event;
+    base_sink_class->query = mati_writer_query;
+    base_sink_class->unlock = mati_writer_unlock;
+    base_sink_class->unlock_stop = mati_writer_unlock_stop;
+
+    g_object_class_install_property (object_class, PROP_LOCATION,
+        g_param_spec_string ("location", "File Location", "Location of the file to write",
+                             NULL,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property (object_class, PROP_BLOCK_SIZE,
+        g_param_spec_uint ("block-size", "Block size", "Size of a single write, rounded up to 4096",
+                           DIRECT_ALIGNMENT, 64 * 1024 * 1024, DEFAULT_BLOCK_SIZE,
+                           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property (object_class, PROP_MAX_QUEUE_BYTES,
+        g_param_spec_uint64 ("max-queue-bytes", "Maximum queue bytes",
+                             "Data waiting for the I/O thread before the streaming thread waits",
+                             0, G_MAXUINT64, DEFAULT_MAX_QUEUE_BYTES,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property (object_class, PROP_PREALLOCATE,
+        g_param_spec_uint64 ("preallocate", "Preallocate",
+                             "Bytes allocated ahead of the data with fallocate, 0 disables it",
+                             0, G_MAXUINT64, DEFAULT_PREALLOCATE,
+                             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property (object_class, PROP_DIRECT,
+        g_param_spec_boolean ("direct", "Direct I/O", "Write with O_DIRECT, bypassing the page cache",
+                              FALSE,
+                              G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property (object_class, PROP_SYNC,
+        g_param_spec_boolean ("sync", "Sync", "Start writeback after every block with sync_file_range",
+                              FALSE,
+                              G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property (object_class, PROP_RAM_STAGING,
+        g_param_spec_boolean ("ram-staging", "RAM staging",
+                              "Write to memory first and commit the file in one pass on EOS or stop",
+                              FALSE,
+                              G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property (object_class, PROP_INDEX,
+        g_param_spec_boolean ("index", "Index", "Write a sidecar index of keyframes and motion",
+                              FALSE,
+                              G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property (object_class, PROP_START_TIME,
+        g_param_spec_int64 ("start-time", "Start time",
+                            "Wall-clock time of the first buffer in microseconds, 0 uses its arrival",
+                            0, G_MAXINT64, 0,
+                            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
+
+    gst_element_class_add_static_pad_template (element_class, &sink_template);
+    gst_element_class_set_static_metadata (element_class,
+                                           "Mati writer", "Sink/File",
+                                           "Writes recordings from a dedicated I/O thread",
+                                           "Froura");
+
+    GST_DEBUG_CATEGORY_INIT (mati_writer_debug, "matiwriter", 0, "Mati recording writer");
+}
+
+void
+mati_writer_get_stats (MatiWriter      *self,
+                       MatiWriterStats *stats)
+{
+    g_mutex_lock (&self->lock);
+    *stats = self->stats;
+    g_mutex_unlock (&self->lock);
+}
+
+/* Motion as seen by the detector, ends up in the index */
+void
+mati_writer_mark_motion (MatiWriter *self,
+                         gboolean    in_motion,
+                         gint64      time)
+{
+    g_mutex_lock (&self->lock);
+    if (in_motion && !self->motion_open)
+    {
+        MatiIndexInterval interval = { time, time };
+
+        g_array_append_val (self->motion, interval);
+        self->motion_open = TRUE;
+    }
+    else if (!in_motion && self->motion_open)
+    {
+        g_array_index (self->motion, MatiIndexInterval, self->motion->len - 1).end = time;
+        self->motion_open = FALSE;
+    }
+    g_mutex_unlock (&self->lock);
+}
+
+/* Budget of all writers together, 0 disables RAM staging */
+void
+mati_writer_set_ram_budget (guint64 bytes)
+{
+    g_mutex_lock (&ram_lock);
+    ram_budget = bytes;
+    g_mutex_unlock (&ram_lock);
+}
+
+guint64
+mati_writer_get_ram_used (void)
+{
+    guint64 used;
+
+    g_mutex_lock (&ram_lock);
+    used = ram_used;
+    g_mutex_unlock (&ram_lock);
+
+    return used;
+}
+
+GstElement *
+mati_writer_new (const char *name)
+{
+    return g_object_new (MATI_TYPE_WRITER, "name", name, NULL);
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <gst/gst.h>
+#include <gst/base/gstbasesink.h>
+
+G_BEGIN_DECLS
+
+typedef struct
+{
+    guint64 bytes_written;
+    guint64 queued_bytes;      // handed over but not written yet
+    guint64 max_queued_bytes;
+    guint writes;
+    guint stalls;              // times the streaming thread had to wait for the disk
+    gdouble write_latency;     // average of one block write in ms
+    gdouble max_write_latency; // ms
+    guint64 ram_staged;        // bytes of this file still only in memory
+    gboolean ram_fallback;     // RAM budget ran out, writing directly
+} MatiWriterStats;
+
+#define MATI_TYPE_WRITER (mati_writer_get_type ())
+G_DECLARE_FINAL_TYPE (MatiWriter, mati_writer, MATI, WRITER, GstBaseSink)
+
+GstElement *mati_writer_new (const char *name);
+
+void mati_writer_get_stats (MatiWriter      *self,
+                            MatiWriterStats *stats);
+
+void mati_writer_mark_motion (MatiWriter *self,
+                              gboolean    in_motion,
+                              gint64      time);
+
+void mati_writer_set_ram_budget (guint64 bytes);
+
+guint64 mati_writer_get_ram_used (void);
+
+G_END_DECLS
\ No newline at end of file